@@ -13,6 +13,8 @@ extern "C" {
 #include <curl/curl.h>
 }
 
+#include "session-cache.h"
+
 static size_t on_curl_write(char *ptr, size_t size, size_t nmemb,
                             void *userdata) {
   // APIのレスポンスボディをstdoutに出力
@@ -29,6 +31,9 @@ void print_help() {
           "  -o, --offset=0            items offset, [0, )\n"
           "  -l, --limit=20            items limit, [0, 100]\n"
           "  -i, --item-id=ITEMID      filter devices by attached option plan\n"
+          "  -S, --session-cache=FILE  reuse TLS sessions and resolved "
+          "addresses across runs,\n"
+          "                            defaults to $SAFIE_SESSION_CACHE\n"
           "  -h, --help                print this help\n");
 }
 
@@ -38,6 +43,7 @@ int main(int argc, char *argv[]) {
    */
   const char *api_key = getenv("SAFIE_API_KEY");
   int offset = 0, limit = 20, item_id = -1;
+  const char *session_cache_path = getenv("SAFIE_SESSION_CACHE");
 
   int opt;
   static struct option long_options[] = {
@@ -45,10 +51,11 @@ int main(int argc, char *argv[]) {
       {"offset", required_argument, NULL, 'o'},
       {"limit", required_argument, NULL, 'l'},
       {"item-id", required_argument, NULL, 'i'},
+      {"session-cache", required_argument, NULL, 'S'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
   };
-  while ((opt = getopt_long(argc, argv, "k:o:l:i:h", long_options, NULL)) !=
+  while ((opt = getopt_long(argc, argv, "k:o:l:i:S:h", long_options, NULL)) !=
          -1) {
     switch (opt) {
     case 'k':
@@ -81,6 +88,9 @@ int main(int argc, char *argv[]) {
         exit(2);
       }
       break;
+    case 'S':
+      session_cache_path = optarg;
+      break;
     case 'h':
       print_help();
       exit(0);
@@ -137,8 +147,32 @@ int main(int argc, char *argv[]) {
   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_curl_write);
 
+  // 前回の実行で保存したTLSセッションと接続先アドレスを使う
+  session_cache *cache = NULL;
+  if (session_cache_path != NULL && session_cache_path[0] != '\0') {
+    cache = session_cache_load(session_cache_path);
+    if (cache == NULL || session_cache_apply(cache, curl) != 0) {
+      fprintf(stderr, "error: failed to load session cache\n");
+      session_cache_free(cache);
+      curl_easy_cleanup(curl);
+      curl_slist_free_all(headers);
+      exit(1);
+    }
+  }
+
   CURLcode ret = curl_easy_perform(curl);
+  if (ret == CURLE_COULDNT_CONNECT && cache != NULL) {
+    // キャッシュした接続先に接続できないときは名前解決からやり直す
+    session_cache_forget(cache, curl);
+    session_cache_apply(cache, curl);
+    ret = curl_easy_perform(curl);
+  }
   fprintf(stdout, "\n");
+  if (cache != NULL) {
+    session_cache_update(cache, curl);
+    session_cache_save(cache, curl);
+    session_cache_free(cache);
+  }
   if (ret != CURLE_OK) {
     fprintf(stderr, "error: curl failed: %d: %s\n", ret,
             curl_easy_strerror(ret));
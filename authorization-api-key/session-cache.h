@@ -0,0 +1,58 @@
+/*
+ * session-cache
+ * プロセスをまたいでTLSセッションと名前解決の結果を再利用するためのキャッシュ
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+extern "C" {
+#include <curl/curl.h>
+}
+
+// 名前解決の結果を再利用する期間 [sec]
+#define SESSION_CACHE_DNS_TTL 300
+// 保存するエントリ数の上限
+#define SESSION_CACHE_MAX_ENTRIES 16
+
+typedef struct session_cache session_cache;
+
+/// @brief セッションキャッシュをファイルから読み込みます
+/// ファイルが存在しないときは空のキャッシュを返し, 期限切れのエントリは読み捨てる
+/// @param path [IN] キャッシュファイルのパス
+/// @return キャッシュ, 失敗したときNULL
+session_cache *session_cache_load(const char *path);
+
+/// @brief キャッシュの内容をeasyハンドルに設定します
+/// 名前解決の結果を `CURLOPT_RESOLVE` に設定し, TLSセッションをハンドル
+/// (または共有オブジェクト) のセッションキャッシュに登録する
+/// @param cache [IN/OUT] キャッシュ
+/// @param curl [IN] 要求前のeasyハンドル
+/// @return 終了コード, `0` のとき正常終了
+int session_cache_apply(session_cache *cache, CURL *curl);
+
+/// @brief 完了した要求の接続先アドレスをキャッシュに記録します
+/// @param cache [IN/OUT] キャッシュ
+/// @param curl [IN] 要求を終えたeasyハンドル
+void session_cache_update(session_cache *cache, CURL *curl);
+
+/// @brief キャッシュから設定した接続先アドレスを破棄します
+/// 接続先が変わり接続できなかったときに, 名前解決からやり直すために使う
+/// @param cache [IN/OUT] キャッシュ
+/// @param curl [IN] 接続に失敗したeasyハンドル
+void session_cache_forget(session_cache *cache, CURL *curl);
+
+/// @brief キャッシュをファイルに保存します
+/// TLSセッションを含むため所有者のみ読み書きできるファイルとして書き込む
+/// @param cache [IN/OUT] キャッシュ
+/// @param curl [IN] TLSセッションを書き出すeasyハンドル (共有オブジェクトの
+/// セッションキャッシュを使うハンドル), NULLのとき読み込んだセッションを保存する
+/// @return 終了コード, `0` のとき正常終了
+int session_cache_save(session_cache *cache, CURL *curl);
+
+/// @brief キャッシュを解放します
+/// @param cache [IN] キャッシュ, NULLのとき何もしない
+void session_cache_free(session_cache *cache);
+
+#endif
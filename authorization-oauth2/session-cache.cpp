@@ -0,0 +1,445 @@
+/*
+ * session-cache
+ * プロセスをまたいでTLSセッションと名前解決の結果を再利用するためのキャッシュ
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "session-cache.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// 名前解決の結果
+typedef struct {
+  char host[256];
+  long port;
+  char address[64];
+  long long expires; // 有効期限 (UNIX時間)
+  int forgotten;     // 接続できなかったため破棄したとき `1`
+} resolve_entry;
+
+// TLSセッション (`curl_easy_ssls_export` の出力)
+typedef struct {
+  char *key; // セッションキー, ハッシュ化されているときNULL
+  unsigned char *shmac;
+  size_t shmac_len;
+  unsigned char *sdata;
+  size_t sdata_len;
+  long long expires; // 有効期限 (UNIX時間), 不明のとき `0`
+} tls_entry;
+
+struct session_cache {
+  char *path;
+  resolve_entry resolves[SESSION_CACHE_MAX_ENTRIES];
+  int nresolves;
+  tls_entry sessions[SESSION_CACHE_MAX_ENTRIES];
+  int nsessions;
+  struct curl_slist *resolve_list; // `CURLOPT_RESOLVE` に設定するリスト
+  int dirty;    // `resolve_list` を作り直す必要があるとき `1`
+  long long list_expires; // `resolve_list` で固定したアドレスの最も早い有効期限
+  int imported; // TLSセッションを登録済みのとき `1`
+};
+
+static const char BASE64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/// @brief バイト列をBase64で出力します, 空のときは `-` を出力する
+static void write_base64(FILE *fp, const unsigned char *data, size_t size) {
+  if (size == 0) {
+    fputc('-', fp);
+    return;
+  }
+  for (size_t i = 0; i < size; i += 3) {
+    unsigned long v = (unsigned long)data[i] << 16;
+    if (i + 1 < size) {
+      v |= (unsigned long)data[i + 1] << 8;
+    }
+    if (i + 2 < size) {
+      v |= data[i + 2];
+    }
+    fputc(BASE64[(v >> 18) & 0x3f], fp);
+    fputc(BASE64[(v >> 12) & 0x3f], fp);
+    fputc((i + 1 < size) ? BASE64[(v >> 6) & 0x3f] : '=', fp);
+    fputc((i + 2 < size) ? BASE64[v & 0x3f] : '=', fp);
+  }
+}
+
+/// @brief Base64の文字列をデコードします, `-` は空のバイト列とする
+/// @param text [IN] Base64の文字列
+/// @param data [OUT] デコードしたバイト列 (終端にNUL文字を付加), 呼び出し側で `free` すること
+/// @param size [OUT] バイト列の長さ
+/// @return 終了コード, `0` のとき正常終了
+static int read_base64(const char *text, unsigned char **data, size_t *size) {
+  *data = NULL;
+  *size = 0;
+  size_t len = strlen(text);
+  if (strcmp(text, "-") == 0) {
+    return 0;
+  }
+  if (len % 4 != 0) {
+    return 1;
+  }
+  unsigned char *out = (unsigned char *)malloc(len / 4 * 3 + 1);
+  if (out == NULL) {
+    return 1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += 4) {
+    unsigned long v = 0;
+    int pad = 0;
+    for (int k = 0; k < 4; k++) {
+      const char *p = strchr(BASE64, text[i + k]);
+      if (text[i + k] == '=' && i + 4 == len && k >= 2) {
+        pad++;
+        v <<= 6;
+      } else if (p != NULL && text[i + k] != '\0' && pad == 0) {
+        v = (v << 6) | (unsigned long)(p - BASE64);
+      } else {
+        free(out);
+        return 1;
+      }
+    }
+    out[n++] = (v >> 16) & 0xff;
+    if (pad < 2) {
+      out[n++] = (v >> 8) & 0xff;
+    }
+    if (pad < 1) {
+      out[n++] = v & 0xff;
+    }
+  }
+  out[n] = '\0';
+  *data = out;
+  *size = n;
+  return 0;
+}
+
+static void tls_entry_free(tls_entry *e) {
+  free(e->key);
+  free(e->shmac);
+  free(e->sdata);
+  memset(e, 0, sizeof(*e));
+}
+
+/// @brief 要求先のホスト名とポート番号を取得します
+/// @return 取得できたとき `0`, IPアドレスを直接指定した要求のときは `1`
+static int target_of(CURL *curl, char *host, size_t size, long *port) {
+  char *url = NULL;
+  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+  if (url == NULL) {
+    return 1;
+  }
+
+  int ret = 1;
+  char *h = NULL, *p = NULL;
+  unsigned char addr[16];
+  CURLU *u = curl_url();
+  if (u == NULL || curl_url_set(u, CURLUPART_URL, url, 0) != CURLUE_OK ||
+      curl_url_get(u, CURLUPART_HOST, &h, 0) != CURLUE_OK ||
+      curl_url_get(u, CURLUPART_PORT, &p, CURLU_DEFAULT_PORT) != CURLUE_OK) {
+    goto done;
+  }
+  if (h[0] == '[' || inet_pton(AF_INET, h, addr) == 1 ||
+      strlen(h) >= size) {
+    goto done;
+  }
+  strcpy(host, h);
+  *port = strtol(p, NULL, 10);
+  ret = 0;
+
+done:
+  curl_free(h);
+  curl_free(p);
+  curl_url_cleanup(u);
+  return ret;
+}
+
+session_cache *session_cache_load(const char *path) {
+  session_cache *cache = (session_cache *)calloc(1, sizeof(session_cache));
+  if (cache == NULL || (cache->path = strdup(path)) == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->dirty = 1;
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return cache;
+  }
+  long long now = time(NULL);
+  char *line = NULL;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, fp) > 0) {
+    // resolve HOST PORT ADDRESS EXPIRES
+    resolve_entry *r = &cache->resolves[cache->nresolves];
+    if (cache->nresolves < SESSION_CACHE_MAX_ENTRIES &&
+        sscanf(line, "resolve %255s %ld %63s %lld", r->host, &r->port,
+               r->address, &r->expires) == 4) {
+      if (now < r->expires) {
+        cache->nresolves++;
+      }
+      continue;
+    }
+
+    // tls EXPIRES KEY SHMAC SDATA (各フィールドはBase64)
+    // セッションデータの長さは決まっていないため, 行を空白で区切って読む
+    tls_entry *s = &cache->sessions[cache->nsessions];
+    const char *delim = " \t\r\n";
+    char *save = NULL;
+    char *tag = strtok_r(line, delim, &save);
+    char *expires = strtok_r(NULL, delim, &save);
+    char *key64 = strtok_r(NULL, delim, &save);
+    char *shmac64 = strtok_r(NULL, delim, &save);
+    char *sdata64 = strtok_r(NULL, delim, &save);
+    if (cache->nsessions < SESSION_CACHE_MAX_ENTRIES && tag != NULL &&
+        strcmp(tag, "tls") == 0 && sdata64 != NULL) {
+      char *end;
+      s->expires = strtoll(expires, &end, 10);
+      size_t key_len;
+      if (*end == '\0' && (s->expires == 0 || now < s->expires) &&
+          read_base64(key64, (unsigned char **)&s->key, &key_len) == 0 &&
+          read_base64(shmac64, &s->shmac, &s->shmac_len) == 0 &&
+          read_base64(sdata64, &s->sdata, &s->sdata_len) == 0 &&
+          s->sdata_len > 0) {
+        cache->nsessions++;
+      } else {
+        tls_entry_free(s);
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+  return cache;
+}
+
+int session_cache_apply(session_cache *cache, CURL *curl) {
+  long long now = time(NULL);
+  // 固定したアドレスの有効期限が過ぎたときも作り直し, 固定を外す
+  if (cache->dirty || now >= cache->list_expires) {
+    curl_slist_free_all(cache->resolve_list);
+    cache->resolve_list = NULL;
+    cache->list_expires = LLONG_MAX;
+    for (int i = 0; i < cache->nresolves; i++) {
+      resolve_entry *r = &cache->resolves[i];
+      char entry[512];
+      if (r->forgotten || r->expires <= now) {
+        // `CURLOPT_RESOLVE` のアドレスは期限切れにならないため,
+        // 共有のDNSキャッシュからも取り除く
+        snprintf(entry, sizeof(entry), "-%s:%ld", r->host, r->port);
+      } else if (strchr(r->address, ':') != NULL) {
+        snprintf(entry, sizeof(entry), "%s:%ld:[%s]", r->host, r->port,
+                 r->address);
+      } else {
+        snprintf(entry, sizeof(entry), "%s:%ld:%s", r->host, r->port,
+                 r->address);
+      }
+      if (!r->forgotten && r->expires > now &&
+          r->expires < cache->list_expires) {
+        cache->list_expires = r->expires;
+      }
+      struct curl_slist *list = curl_slist_append(cache->resolve_list, entry);
+      if (list == NULL) {
+        return 1;
+      }
+      cache->resolve_list = list;
+    }
+    cache->dirty = 0;
+  }
+  if (cache->resolve_list != NULL) {
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, cache->resolve_list);
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  // 登録に失敗したセッションは通常のハンドシェイクになるだけなので無視する
+  if (!cache->imported) {
+    for (int i = 0; i < cache->nsessions; i++) {
+      tls_entry *s = &cache->sessions[i];
+      curl_easy_ssls_import(curl, s->key, s->shmac, s->shmac_len, s->sdata,
+                            s->sdata_len);
+    }
+    cache->imported = 1;
+  }
+#endif
+  return 0;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+// `curl_easy_ssls_export` で収集中のTLSセッション
+typedef struct {
+  tls_entry sessions[SESSION_CACHE_MAX_ENTRIES];
+  int nsessions;
+} tls_export;
+
+static CURLcode on_ssls_export(CURL *handle, void *userptr,
+                               const char *session_key,
+                               const unsigned char *shmac, size_t shmac_len,
+                               const unsigned char *sdata, size_t sdata_len,
+                               curl_off_t valid_until, int ietf_tls_id,
+                               const char *alpn, size_t earlydata_max) {
+  tls_export *ex = (tls_export *)userptr;
+  if (ex->nsessions >= SESSION_CACHE_MAX_ENTRIES || sdata_len == 0) {
+    return CURLE_OK;
+  }
+  tls_entry *s = &ex->sessions[ex->nsessions];
+  s->key = (session_key != NULL) ? strdup(session_key) : NULL;
+  s->shmac = (unsigned char *)malloc(shmac_len + 1);
+  s->sdata = (unsigned char *)malloc(sdata_len);
+  if ((session_key != NULL && s->key == NULL) || s->shmac == NULL ||
+      s->sdata == NULL) {
+    tls_entry_free(s);
+    return CURLE_OUT_OF_MEMORY;
+  }
+  memcpy(s->shmac, shmac, shmac_len);
+  s->shmac_len = shmac_len;
+  memcpy(s->sdata, sdata, sdata_len);
+  s->sdata_len = sdata_len;
+  s->expires = valid_until;
+  ex->nsessions++;
+  return CURLE_OK;
+}
+#endif
+
+void session_cache_update(session_cache *cache, CURL *curl) {
+  long response_code = 0;
+  char *ip = NULL;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+#if LIBCURL_VERSION_NUM >= 0x080700
+  // プロキシ経由のときの接続先はプロキシのアドレス
+  long used_proxy = 0;
+  curl_easy_getinfo(curl, CURLINFO_USED_PROXY, &used_proxy);
+  if (used_proxy) {
+    ip = NULL;
+  }
+#endif
+
+  char host[256];
+  long port;
+  if (response_code > 0 && ip != NULL && ip[0] != '\0' &&
+      strlen(ip) < sizeof(cache->resolves[0].address) &&
+      target_of(curl, host, sizeof(host), &port) == 0) {
+    resolve_entry *r = NULL;
+    for (int i = 0; i < cache->nresolves; i++) {
+      if (strcmp(cache->resolves[i].host, host) == 0 &&
+          cache->resolves[i].port == port) {
+        r = &cache->resolves[i];
+      }
+    }
+    long long now = time(NULL);
+    // 上限に達したときは, 固定したアドレスを外せなくなるため他の接続先を上書きしない
+    if (r == NULL && cache->nresolves < SESSION_CACHE_MAX_ENTRIES) {
+      r = &cache->resolves[cache->nresolves++];
+      r->expires = 0;
+    }
+    if (r != NULL && (r->forgotten || r->expires <= now)) {
+      // 新しい結果のみ記録し, キャッシュから設定した結果の期限は延ばさない
+      // 期限切れのアドレスの固定を外し, 新しいアドレスに置き換える
+      cache->dirty = 1;
+      strcpy(r->host, host);
+      r->port = port;
+      strcpy(r->address, ip);
+      r->expires = now + SESSION_CACHE_DNS_TTL;
+      r->forgotten = 0;
+    }
+  }
+
+}
+
+void session_cache_forget(session_cache *cache, CURL *curl) {
+  char host[256];
+  long port;
+  if (target_of(curl, host, sizeof(host), &port) != 0) {
+    return;
+  }
+  for (int i = 0; i < cache->nresolves; i++) {
+    resolve_entry *r = &cache->resolves[i];
+    if (strcmp(r->host, host) == 0 && r->port == port && !r->forgotten) {
+      r->forgotten = 1;
+      cache->dirty = 1;
+    }
+  }
+}
+
+int session_cache_save(session_cache *cache, CURL *curl) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  // TLSセッションは要求ごとではなく, 保存時にまとめて書き出す
+  if (curl != NULL) {
+    tls_export ex;
+    memset(&ex, 0, sizeof(ex));
+    curl_easy_ssls_export(curl, on_ssls_export, &ex);
+    if (ex.nsessions > 0) {
+      for (int i = 0; i < cache->nsessions; i++) {
+        tls_entry_free(&cache->sessions[i]);
+      }
+      memcpy(cache->sessions, ex.sessions, sizeof(ex.sessions));
+      cache->nsessions = ex.nsessions;
+    }
+  }
+#else
+  (void)curl;
+#endif
+
+  // 同時に実行された他のプロセスと衝突しないよう一時ファイルから置き換える
+  char tmp[4096];
+  int n = snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cache->path, (int)getpid());
+  if (n >= sizeof(tmp)) {
+    fprintf(stderr, "error: session cache path too long\n");
+    return 1;
+  }
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  FILE *fp = (fd >= 0) ? fdopen(fd, "w") : NULL;
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to write session cache: %s\n",
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  fprintf(fp, "# session cache, do not share (contains TLS session data)\n");
+  for (int i = 0; i < cache->nresolves; i++) {
+    const resolve_entry *r = &cache->resolves[i];
+    if (!r->forgotten) {
+      fprintf(fp, "resolve %s %ld %s %lld\n", r->host, r->port, r->address,
+              r->expires);
+    }
+  }
+  for (int i = 0; i < cache->nsessions; i++) {
+    const tls_entry *s = &cache->sessions[i];
+    fprintf(fp, "tls %lld ", s->expires);
+    write_base64(fp, (const unsigned char *)s->key,
+                 (s->key != NULL) ? strlen(s->key) : 0);
+    fputc(' ', fp);
+    write_base64(fp, s->shmac, s->shmac_len);
+    fputc(' ', fp);
+    write_base64(fp, s->sdata, s->sdata_len);
+    fputc('\n', fp);
+  }
+
+  if (fclose(fp) != 0 || rename(tmp, cache->path) != 0) {
+    fprintf(stderr, "error: failed to write session cache: %s\n",
+            strerror(errno));
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+void session_cache_free(session_cache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+  for (int i = 0; i < cache->nsessions; i++) {
+    tls_entry_free(&cache->sessions[i]);
+  }
+  curl_slist_free_all(cache->resolve_list);
+  free(cache->path);
+  free(cache);
+}
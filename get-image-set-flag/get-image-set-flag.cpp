@@ -5,16 +5,21 @@
  * Copyright (c) 2023 Safie Inc.
  */
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 extern "C" {
 #include <cjson/cJSON.h>
 #include <curl/curl.h>
 }
 
+#include "http-metrics.h"
+#include "poll-schedule.h"
+
 /// @brief ポインタを返す `expr` を評価し値がNULLのときerrorラベルにjumpします
 /// @param expr ポインタを返す式
 #define CHECK_NULL(expr)                                                       \
@@ -26,20 +31,243 @@ extern "C" {
     }                                                                          \
   }
 
+// 可変長バッファの構造体
 typedef struct {
   char *data;
   size_t size;
   size_t capacity;
 } buffer;
 
-/// @brief Safie APIによりカメラ画像を取得する
+// 応答バッファのプールに保持するバッファ数の上限 (同時要求数の既定値の2倍)
+#define BUFFER_POOL_SIZE 64
+
+// Content-Lengthから受信前に確保する容量の上限 [byte]
+// 超える応答は受信に合わせて拡張し、不正な値で大きな領域を確保しない
+#define BUFFER_PRESIZE_MAX (4 * 1024 * 1024)
+
+// プールに返却するバッファの容量の上限 [byte]、超えるバッファは解放する
+#define BUFFER_POOL_MAX_CAPACITY (4 * 1024 * 1024)
+
+// 応答バッファの統計
+typedef struct {
+  unsigned long acquired;    // バッファの取得回数
+  unsigned long reused;      // プールのバッファを再利用した回数
+  unsigned long allocations; // メモリ確保 (malloc/realloc) の回数
+  unsigned long long copied; // バッファにコピーしたバイト数
+} buffer_stats;
+
+// 応答バッファのプール
+// 返却されたバッファを次の要求で再利用し、定常状態ではメモリ確保を行わない
+static struct {
+  buffer idle[BUFFER_POOL_SIZE]; // 再利用待ちのバッファ
+  int nidle;
+  buffer_stats stats;
+} buffer_pool;
+
+/// @brief プールから空のバッファを取得する
+/// プールが空のときは領域を持たないバッファを返し、領域は応答の受信時に確保する
+/// @param buf [OUT] バッファ
+void buffer_acquire(buffer *buf) {
+  buffer_pool.stats.acquired++;
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+  if (buffer_pool.nidle == 0) {
+    return;
+  }
+
+  // 最も大きいバッファを使い再確保の機会を減らす
+  int k = 0;
+  for (int i = 1; i < buffer_pool.nidle; i++) {
+    if (buffer_pool.idle[k].capacity < buffer_pool.idle[i].capacity) {
+      k = i;
+    }
+  }
+  *buf = buffer_pool.idle[k];
+  buffer_pool.idle[k] = buffer_pool.idle[--buffer_pool.nidle];
+  buf->size = 0;
+  buffer_pool.stats.reused++;
+}
+
+/// @brief バッファをプールに返却する
+/// @param buf [IN/OUT] バッファ、返却後は領域を持たない
+void buffer_release(buffer *buf) {
+  if (buf->data == NULL) {
+    return;
+  }
+  if (buffer_pool.nidle < BUFFER_POOL_SIZE &&
+      buf->capacity <= BUFFER_POOL_MAX_CAPACITY) {
+    buffer_pool.idle[buffer_pool.nidle++] = *buf;
+  } else {
+    free(buf->data);
+  }
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+}
+
+/// @brief バッファの容量を `capacity` 以上にする
+/// @param buf [IN/OUT] バッファ
+/// @param capacity [IN] 必要な容量 [byte]
+/// @return 終了コード、0以外のときエラー
+int buffer_reserve(buffer *buf, size_t capacity) {
+  if (capacity <= buf->capacity) {
+    return 0;
+  }
+  char *data = (char *)realloc(buf->data, capacity);
+  if (data == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  buffer_pool.stats.allocations++;
+  buf->data = data;
+  buf->capacity = capacity;
+  return 0;
+}
+
+/// @brief プール内のバッファを解放する
+void buffer_pool_cleanup() {
+  for (int i = 0; i < buffer_pool.nidle; i++) {
+    free(buffer_pool.idle[i].data);
+  }
+  buffer_pool.nidle = 0;
+}
+
+/// @brief 応答ヘッダのContent-Lengthから受信前にバッファの容量を確保する
+size_t on_curl_header_buffer(char *ptr, size_t size, size_t nmemb,
+                             void *userdata) {
+  size_t realsize = size * nmemb;
+  buffer *buf = (buffer *)userdata;
+  const char *name = "Content-Length:";
+  size_t len = strlen(name);
+  if (realsize > len && strncasecmp(ptr, name, len) == 0) {
+    unsigned long long length = strtoull(ptr + len, NULL, 10);
+    // 終端のNUL文字の分を加える
+    if (length > 0 && length <= BUFFER_PRESIZE_MAX &&
+        buffer_reserve(buf, buf->size + length + 1) != 0) {
+      return 0;
+    }
+  }
+  return realsize;
+}
+
+size_t on_curl_write_buffer(char *ptr, size_t size, size_t nmemb,
+                            void *userdata) {
+  size_t realsize = size * nmemb;
+  buffer *buf = (buffer *)userdata;
+  if (buf->capacity < buf->size + realsize + 1) {
+    // Content-Lengthが無い応答のときは倍々に拡張する
+    size_t newcapacity = buf->capacity * 2;
+    if (newcapacity < buf->size + realsize + 1) {
+      newcapacity = buf->size + realsize + 1;
+    }
+    if (buffer_reserve(buf, newcapacity) != 0) {
+      return 0;
+    }
+  }
+  memcpy(buf->data + buf->size, ptr, realsize);
+  buf->size += realsize;
+  buf->data[buf->size] = '\0';
+  buffer_pool.stats.copied += realsize;
+  return realsize;
+}
+
+// HTTPクライアント
+// プロセス内のすべてのAPI呼び出しでeasyハンドル, 接続, DNSキャッシュ, TLSセッションを再利用する
+#define HTTP_POOL_SIZE 64
+#define HTTP_DNS_CACHE_TIMEOUT 300L  // DNSキャッシュの有効期間 [sec]
+#define HTTP_KEEPALIVE_IDLE 30L      // keep-aliveを送り始めるまでのアイドル時間 [sec]
+#define HTTP_KEEPALIVE_INTERVAL 15L  // keep-aliveの送信間隔 [sec]
+#define HTTP_MAXAGE_CONN 300L        // 再利用する接続の最大アイドル時間 [sec]
+
+/// @brief HTTPクライアントを初期化する
+/// @return 終了コード、0以外のときエラー
+int http_client_init();
+
+/// @brief HTTPクライアントを解放する
+void http_client_cleanup();
+
+/// @brief HTTP要求に使用するeasyハンドルを取得する
+/// 返却済みのハンドルがあれば設定を初期化して再利用する
+/// @return easyハンドル、失敗したときNULL
+CURL *http_acquire();
+
+/// @brief easyハンドルを返却する
+/// @param curl [IN] `http_acquire` で取得したeasyハンドル、NULLのとき何もしない
+void http_release(CURL *curl);
+
+// 画像の取得間隔の既定値 [sec]
+#define DEFAULT_INTERVAL 5.0
+// 要求ごとの開始時刻のゆらぎの既定値 [sec]
+#define DEFAULT_JITTER 0.5
+// 同時に実行するHTTP要求数の既定値
+#define DEFAULT_CONCURRENCY 32
+
+// 実行中のHTTP要求
+typedef struct {
+  CURL *curl; // 実行中でないときNULL
+  struct curl_slist *headers;
+  char *body;
+  buffer buf; // 応答
+} transfer;
+
+// 監視する1台のカメラ
+typedef struct {
+  char device_id[64];
+  double interval; // 画像の取得間隔 [sec], 0のとき `--interval` の値
+  double due;      // 次の取得の予定時刻 (`monotonic_now`), ゆらぎを含まない
+  int dead_time;   // イベントを登録しない残りの取得回数
+  int event_pending; // 登録を待っているイベントがあるとき `1`
+  transfer image;  // 画像の取得
+  transfer event;  // イベントの登録
+  unsigned long images;  // 取得した画像の数
+  unsigned long skipped; // 前回の取得が終わらず, または遅れて見送った回数
+} camera;
+
+/// @brief 数値の引数を解析する
+/// @param s [IN] 文字列
+/// @param value [OUT] 値
+/// @return 終了コード、数値でないか余分な文字があるときエラー
+int parse_number(const char *s, double *value);
+
+/// @brief カメラを追加する
+/// @param cameras [IN/OUT] カメラの配列
+/// @param ncameras [IN/OUT] カメラ数
+/// @param device_id [IN] デバイスID
+/// @param interval [IN] 画像の取得間隔 [sec], 0のとき `--interval` の値
+/// @return 終了コード、0以外のときエラー
+int add_camera(camera **cameras, int *ncameras, const char *device_id,
+               double interval);
+
+/// @brief カメラの一覧をファイルから読み込む
+/// 1行に `DEVICEID [INTERVAL]`, 空行と `#` で始まる行は無視する
+/// @param path [IN] カメラ一覧のファイル, `-` のとき標準入力
+/// @param cameras [IN/OUT] カメラの配列
+/// @param ncameras [IN/OUT] カメラ数
+/// @return 終了コード、0以外のときエラー
+int load_cameras(const char *path, camera **cameras, int *ncameras);
+
+/// @brief HTTP要求を終え, easyハンドルをmultiハンドルから外して返却する
+/// @param multi [IN/OUT] multiハンドル
+/// @param t [IN/OUT] 要求, 応答のバッファは返却しない
+void finish_transfer(CURLM *multi, transfer *t);
+
+/// @brief Safie APIによるカメラ画像の取得を開始する
+/// @param multi [IN/OUT] 要求を追加するmultiハンドル
 /// @param api_key [IN] Safie APIのAPIキー
-/// @param device_id [IN] 対象カメラのデバイスID
-/// @param buf [IN/OUT] 取得された画像 (JPEG) を保存するバッファ
+/// @param c [IN/OUT] 対象カメラ, 取得された画像 (JPEG) は `c->image.buf` に保存される
 /// @param verbosity [IN] 値が0以上のとき詳細なログメッセージを出力する
 /// @return 終了コード、0以外のときエラー
-int get_device_image(const char *api_key, const char *device_id, buffer *buf,
-                     int verbosity);
+int start_device_image(CURLM *multi, const char *api_key, camera *c,
+                       int verbosity);
+
+/// @brief カメラ画像の取得を終え, 画像を分析する
+/// @param multi [IN/OUT] multiハンドル
+/// @param c [IN/OUT] 対象カメラ
+/// @param ret [IN] 要求の結果
+/// @param score [OUT] 報告すべき事象が存在するかのしきい値 [0, 1]
+/// @return 終了コード、0以外のとき取得または分析に失敗
+int finish_device_image(CURLM *multi, camera *c, CURLcode ret, double *score);
 
 /// @brief 画像の分析を行う (現在の実装はプレースホルダ)
 /// @param buf [IN] 取得された画像 (JPEG) のバッファ
@@ -47,14 +275,27 @@ int get_device_image(const char *api_key, const char *device_id, buffer *buf,
 /// @return 終了コード、0以外のときエラー
 int analyze(buffer *buf, double *score);
 
-/// @brief Safie APIによりイベント (SafieViewerのVODタイムライン上のピン) を登録
+/// @brief 分析結果からイベントを登録するか判定し, 不感時間を更新する
+/// @param c [IN/OUT] 対象カメラ
+/// @param score [IN] 分析結果
+/// @return イベントを登録するとき `1`
+int check_event(camera *c, double score);
+
+/// @brief Safie APIによるイベント (SafieViewerのVODタイムライン上のピン) の登録を開始する
+/// @param multi [IN/OUT] 要求を追加するmultiハンドル
 /// @param api_key [IN] Safie APIのAPIキー
-/// @param device_id [IN] 対象カメラのデバイスID
+/// @param c [IN/OUT] 対象カメラ
 /// @param definition_id [IN] イベント定義ID
 /// @param verbosity [IN] 値が0以上のとき詳細なログメッセージを出力する
 /// @return 終了コード、0以外のときエラー
-int post_event(const char *api_key, const char *device_id,
-               const char *definition_id, int verbosity);
+int start_event(CURLM *multi, const char *api_key, camera *c,
+                const char *definition_id, int verbosity);
+
+/// @brief イベントの登録を終える
+/// @param multi [IN/OUT] multiハンドル
+/// @param c [IN/OUT] 対象カメラ
+/// @param ret [IN] 要求の結果
+void finish_event(CURLM *multi, camera *c, CURLcode ret);
 
 void print_help() {
   fprintf(
@@ -64,8 +305,22 @@ void print_help() {
       "image analysis result\n"
       "\n"
       "  -k, --apikey=APIKEY       API key, required\n"
-      "  -d, --device-id=DEVICEID  device ID, required\n"
+      "  -d, --device-id=DEVICEID  device ID, can be repeated to monitor "
+      "several\n"
+      "                            cameras\n"
+      "  -l, --device-list=FILE    monitor every camera listed in FILE ('-' "
+      "for\n"
+      "                            stdin), one 'DEVICEID [INTERVAL]' per "
+      "line\n"
       "  -e, --definition-id=ID    event definition ID, required\n"
+      "  -i, --interval=5          seconds between images of each camera\n"
+      "  -j, --jitter=0.5          random delay [sec] added to each request, "
+      "at most\n"
+      "                            half the interval\n"
+      "  -c, --concurrency=32      maximum number of concurrent requests\n"
+      "  -M, --metrics-file=FILE   write per-phase HTTP latency metrics to FILE "
+      "in\n"
+      "                            Prometheus text format\n"
       "  -v, --verbose             enable verbose logging\n"
       "  -h, --help                print this help\n");
 }
@@ -75,31 +330,76 @@ int main(int argc, char *argv[]) {
    * オプション引数の処理
    */
   const char *api_key = getenv("SAFIE_API_KEY");
-  const char *device_id = NULL;
   const char *definition_id = NULL;
+  const char *metrics_file = NULL;
+  camera *cameras = NULL;
+  int ncameras = 0;
+  double interval = DEFAULT_INTERVAL;
+  double jitter = DEFAULT_JITTER;
+  int concurrency = DEFAULT_CONCURRENCY;
   int verbosity = 0;
 
   int opt;
   static struct option long_options[] = {
       {"apikey", required_argument, NULL, 'k'},
       {"device-id", required_argument, NULL, 'd'},
+      {"device-list", required_argument, NULL, 'l'},
       {"definition-id", required_argument, NULL, 'e'},
+      {"interval", required_argument, NULL, 'i'},
+      {"jitter", required_argument, NULL, 'j'},
+      {"concurrency", required_argument, NULL, 'c'},
+      {"metrics-file", required_argument, NULL, 'M'},
       {"verbose", no_argument, NULL, 'v'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
   };
-  while ((opt = getopt_long(argc, argv, "k:d:e:vh", long_options, NULL)) !=
-         -1) {
+  while ((opt = getopt_long(argc, argv, "k:d:l:e:i:j:c:M:vh", long_options,
+                            NULL)) != -1) {
     switch (opt) {
     case 'k':
       api_key = optarg;
       break;
     case 'd':
-      device_id = optarg;
+      if (add_camera(&cameras, &ncameras, optarg, 0.0) != 0) {
+        exit(2);
+      }
+      break;
+    case 'l':
+      if (load_cameras(optarg, &cameras, &ncameras) != 0) {
+        exit(2);
+      }
       break;
     case 'e':
       definition_id = optarg;
       break;
+    case 'i':
+      if (parse_number(optarg, &interval) != 0 || interval <= 0.0) {
+        fprintf(stderr, "error: invalid --interval\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'j':
+      if (parse_number(optarg, &jitter) != 0 || jitter < 0.0) {
+        fprintf(stderr, "error: invalid --jitter\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'c': {
+      double v;
+      if (parse_number(optarg, &v) != 0 || v < 1.0 || v > 65536.0 ||
+          v != (int)v) {
+        fprintf(stderr, "error: invalid --concurrency\n");
+        print_help();
+        exit(2);
+      }
+      concurrency = (int)v;
+      break;
+    }
+    case 'M':
+      metrics_file = optarg;
+      break;
     case 'v':
       verbosity++;
       break;
@@ -120,7 +420,7 @@ int main(int argc, char *argv[]) {
     print_help();
     exit(2);
   }
-  if (device_id == NULL) {
+  if (ncameras == 0) {
     fprintf(stderr, "error: missing device ID\n");
     print_help();
     exit(2);
@@ -130,94 +430,335 @@ int main(int argc, char *argv[]) {
     print_help();
     exit(2);
   }
+  for (int i = 0; i < ncameras; i++) {
+    if (cameras[i].interval <= 0.0) {
+      cameras[i].interval = interval;
+    }
+  }
 
   /*
    * メインループ
    */
-  int rc;
-  buffer buf = {NULL, 0, 16384};
-  CHECK_NULL(buf.data = (char *)malloc(16384));
+  CURLM *multi = NULL;
+  poll_schedule schedule = {NULL, 0, 0};
+  int active = 0; // 実行中の要求数
+  // 登録を待っているイベントのカメラの番号 (リングバッファ, 容量はカメラ数)
+  int *pending = NULL;
+  int pending_head = 0, pending_count = 0;
+  unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+  unsigned long reported_skipped = 0;
+  double now, last_metrics;
+
+  // すべての要求で同じ接続とTLSセッションを使い続ける
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  if (http_client_init() != 0 ||
+      poll_schedule_init(&schedule, ncameras) != 0) {
+    goto error;
+  }
+  CHECK_NULL(pending = (int *)malloc(ncameras * sizeof(int)));
+  CHECK_NULL(multi = curl_multi_init());
+  // 接続数を同時要求数までに抑え, 超えた要求は空いた接続を待たせる
+  curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)concurrency);
+
+  // 最初の取得をカメラごとに取得間隔の中で散らし, 一斉に要求しないようにする
+  now = monotonic_now();
+  for (int i = 0; i < ncameras; i++) {
+    camera *c = &cameras[i];
+    c->due = now + c->interval * rand_r(&seed) / RAND_MAX;
+    poll_schedule_push(&schedule, c->due, i);
+  }
+  last_metrics = now;
 
-  int dead_time;
-  dead_time = 0;
   while (1) {
-    // カメラ画像を取得
-    buf.size = 0;
-    rc = get_device_image(api_key, device_id, &buf, verbosity);
-    if (rc != 0) {
-      goto error;
+    // 登録を待っているイベントを画像取得より先に開始する
+    // イベントの登録も同時要求数に含め, 上限を超えないようにする
+    while (active < concurrency && pending_count > 0) {
+      camera *c = &cameras[pending[pending_head]];
+      pending_head = (pending_head + 1) % ncameras;
+      pending_count--;
+      c->event_pending = 0;
+      if (start_event(multi, api_key, c, definition_id, verbosity) != 0) {
+        goto error;
+      }
+      active++;
     }
 
-    // 画像解析処理を実施しスコアを計算
-    // (画像分類や検出の信頼度を想定)
-    double score = 0.0;
-    rc = analyze(&buf, &score);
-    if (rc != 0) {
-      goto error;
+    // 予定時刻を過ぎたカメラの画像取得を開始する
+    now = monotonic_now();
+    while (active < concurrency && poll_schedule_next(&schedule) <= now) {
+      int i = poll_schedule_pop(&schedule);
+      camera *c = &cameras[i];
+      // 次の予定は前回の予定から数え, 要求の所要時間で周期がずれないようにする
+      // 同時要求数の上限で遅れ, 次の予定も過ぎた回は見送る
+      c->due += c->interval;
+      while (c->due <= now) {
+        c->due += c->interval;
+        c->skipped++;
+      }
+      // ゆらぎは周期に累積させず, 取得間隔の半分までにする
+      double j = (jitter < c->interval / 2.0) ? jitter : c->interval / 2.0;
+      poll_schedule_push(&schedule, c->due + j * rand_r(&seed) / RAND_MAX, i);
+      if (c->image.curl != NULL) {
+        // 前回の取得が終わっていない
+        c->skipped++;
+        continue;
+      }
+      if (start_device_image(multi, api_key, c, verbosity) != 0) {
+        goto error;
+      }
+      active++;
     }
 
-    int found = (score > 0.95) ? 1 : 0;
-    if (found && dead_time <= 0) {
-      // スコアがしきい値を超えかつ過去15秒間で検出がないときイベント登録
-      fprintf(stderr, "event found, registering: score=%f\n", score);
-      rc = post_event(api_key, device_id, definition_id, verbosity);
-      if (rc != 0) {
-        goto error;
+    // 次の予定時刻まで, または要求の完了まで待つ
+    // 同時要求数が上限のときは要求の完了のみを待つ
+    int timeout_ms = 1000;
+    if (active < concurrency && pending_count > 0) {
+      timeout_ms = 0;
+    } else if (active < concurrency) {
+      double wait = poll_schedule_next(&schedule) - monotonic_now();
+      if (wait < 1.0) {
+        timeout_ms = (wait > 0.0) ? (int)ceil(wait * 1000.0) : 0;
+      }
+    }
+    curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+    int running;
+    curl_multi_perform(multi, &running);
+
+    // 完了した要求を処理する
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      CURL *curl = msg->easy_handle;
+      CURLcode ret = msg->data.result;
+      camera *c = NULL;
+      curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&c);
+      active--;
+      if (curl == c->image.curl) {
+        // 画像解析処理を実施しスコアを計算
+        // (画像分類や検出の信頼度を想定)
+        double score = 0.0;
+        if (finish_device_image(multi, c, ret, &score) != 0) {
+          continue;
+        }
+        if (check_event(c, score)) {
+          // 同時要求数に空きができてから登録する
+          c->event_pending = 1;
+          pending[(pending_head + pending_count) % ncameras] =
+              (int)(c - cameras);
+          pending_count++;
+        }
+      } else {
+        finish_event(multi, c, ret);
       }
-    } else if (found) {
-      // スコアがしきい値を超え過去15秒で検出があるとき検出を無視する
-      fprintf(stderr, "event found but ignored: score=%f\n", score);
-    } else {
-      // スコアがしきい値以下
-      fprintf(stderr, "event not found: score=%f\n", score);
     }
 
-    // 不感時間の更新
-    if (found) {
-      dead_time = 3;
-    } else {
-      dead_time--;
+    // 一定間隔でHTTPメトリクスを書き出す
+    if (monotonic_now() - last_metrics < HTTP_METRICS_INTERVAL) {
+      continue;
+    }
+    last_metrics = monotonic_now();
+    if (metrics_file != NULL) {
+      http_metrics_write(metrics_file);
+    }
+    unsigned long images = 0, skipped = 0;
+    for (int i = 0; i < ncameras; i++) {
+      images += cameras[i].images;
+      skipped += cameras[i].skipped;
     }
+    if (verbosity || skipped != reported_skipped) {
+      // 見送りが増えたときは同時要求数か取得間隔の見直しが必要
+      fprintf(stderr,
+              "%d cameras: %lu images, %lu skipped, %d requests in flight\n",
+              ncameras, images, skipped, active);
+      reported_skipped = skipped;
+    }
+    if (verbosity) {
+      fprintf(stderr,
+              "response buffers: %lu acquired (%lu reused), %lu allocations, "
+              "%llu bytes copied\n",
+              buffer_pool.stats.acquired, buffer_pool.stats.reused,
+              buffer_pool.stats.allocations, buffer_pool.stats.copied);
+    }
+  }
 
-    // 1tickごと5秒ウェイト
-    sleep(5);
+error:
+  // 失敗した要求の記録を残す
+  if (metrics_file != NULL) {
+    http_metrics_write(metrics_file);
+  }
+  // 共有オブジェクトを参照するハンドルを先にmultiハンドルから外す
+  for (int i = 0; i < ncameras; i++) {
+    finish_transfer(multi, &cameras[i].image);
+    finish_transfer(multi, &cameras[i].event);
+    buffer_release(&cameras[i].image.buf);
   }
+  curl_multi_cleanup(multi);
+  http_client_cleanup();
+  curl_global_cleanup();
+  buffer_pool_cleanup();
+  poll_schedule_free(&schedule);
+  free(pending);
+  free(cameras);
+  return 1;
+}
 
-  free(buf.data);
+// HTTPクライアントの状態
+static struct {
+  CURLSH *share;              // DNS, TLSセッション, 接続の共有
+  CURL *idle[HTTP_POOL_SIZE]; // 再利用待ちのeasyハンドル
+  int nidle;
+} http_client;
+
+int http_client_init() {
+  CHECK_NULL(http_client.share = curl_share_init());
+  curl_share_setopt(http_client.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(http_client.share, CURLSHOPT_SHARE,
+                    CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(http_client.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  http_client.nidle = 0;
   return 0;
 
 error:
-  free(buf.data);
   return 1;
 }
 
-size_t on_curl_write_buffer(char *ptr, size_t size, size_t nmemb,
-                            void *userdata) {
-  size_t realsize = size * nmemb;
-  buffer *buf = (buffer *)userdata;
-  if (buf->capacity < buf->size + realsize) {
-    size_t newcapacity = buf->capacity * 2;
-    CHECK_NULL(buf->data = (char *)realloc(buf->data, newcapacity));
-    buf->capacity = newcapacity;
+void http_client_cleanup() {
+  // 共有オブジェクトを参照するハンドルを先に解放する
+  for (int i = 0; i < http_client.nidle; i++) {
+    curl_easy_cleanup(http_client.idle[i]);
   }
-  memcpy(buf->data + buf->size, ptr, realsize);
-  buf->size += realsize;
-  return realsize;
+  http_client.nidle = 0;
+  curl_share_cleanup(http_client.share);
+  http_client.share = NULL;
+}
 
-error:
+CURL *http_acquire() {
+  CURL *curl;
+  if (http_client.nidle > 0) {
+    curl = http_client.idle[--http_client.nidle];
+    curl_easy_reset(curl);
+  } else {
+    curl = curl_easy_init();
+    if (curl == NULL) {
+      return NULL;
+    }
+  }
+  curl_easy_setopt(curl, CURLOPT_SHARE, http_client.share);
+  curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, HTTP_DNS_CACHE_TIMEOUT);
+  // 要求の合間に接続が切断されないようTCP keep-aliveを送る
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, HTTP_KEEPALIVE_IDLE);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, HTTP_KEEPALIVE_INTERVAL);
+  curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, HTTP_MAXAGE_CONN);
+  return curl;
+}
+
+void http_release(CURL *curl) {
+  if (curl == NULL) {
+    return;
+  }
+  if (http_client.nidle < HTTP_POOL_SIZE) {
+    http_client.idle[http_client.nidle++] = curl;
+  } else {
+    curl_easy_cleanup(curl);
+  }
+}
+
+int parse_number(const char *s, double *value) {
+  char *end;
+  errno = 0;
+  double v = strtod(s, &end);
+  if (end == s || *end != '\0' || errno != 0 || !isfinite(v)) {
+    return 1;
+  }
+  *value = v;
   return 0;
 }
 
-int get_device_image(const char *api_key, const char *device_id, buffer *buf,
-                     int verbosity) {
-  struct curl_slist *headers = NULL;
-  CURL *curl = NULL;
+int add_camera(camera **cameras, int *ncameras, const char *device_id,
+               double interval) {
+  camera *p = (camera *)realloc(*cameras, (*ncameras + 1) * sizeof(camera));
+  if (p == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  *cameras = p;
+  camera *c = &p[*ncameras];
+  memset(c, 0, sizeof(camera));
+  int n = snprintf(c->device_id, sizeof(c->device_id), "%s", device_id);
+  if (n >= sizeof(c->device_id)) {
+    fprintf(stderr, "error: device ID too long\n");
+    return 1;
+  }
+  c->interval = interval;
+  (*ncameras)++;
+  return 0;
+}
+
+int load_cameras(const char *path, camera **cameras, int *ncameras) {
+  FILE *fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  char line[512];
+  int lineno = 0;
+  int ret = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    char *saveptr = NULL;
+    char *device_id = strtok_r(line, " \t\r\n", &saveptr);
+    if (device_id == NULL || device_id[0] == '#') {
+      continue;
+    }
+    double interval = 0.0;
+    char *field = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (field != NULL &&
+        (parse_number(field, &interval) != 0 || interval <= 0.0)) {
+      fprintf(stderr, "error: %s:%d: invalid interval\n", path, lineno);
+      ret = 1;
+      break;
+    }
+    if (strtok_r(NULL, " \t\r\n", &saveptr) != NULL) {
+      fprintf(stderr, "error: %s:%d: too many fields\n", path, lineno);
+      ret = 1;
+      break;
+    }
+    if (add_camera(cameras, ncameras, device_id, interval) != 0) {
+      ret = 1;
+      break;
+    }
+  }
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  return ret;
+}
+
+void finish_transfer(CURLM *multi, transfer *t) {
+  if (t->curl != NULL) {
+    curl_multi_remove_handle(multi, t->curl);
+    http_release(t->curl);
+    t->curl = NULL;
+  }
+  curl_slist_free_all(t->headers);
+  t->headers = NULL;
+  cJSON_free(t->body);
+  t->body = NULL;
+}
+
+int start_device_image(CURLM *multi, const char *api_key, camera *c,
+                       int verbosity) {
+  transfer *t = &c->image;
 
   // リクエストURL
   char url[256];
   int n;
   n = snprintf(url, sizeof(url),
-               "https://openapi.safie.link/v2/devices/%s/image", device_id);
+               "https://openapi.safie.link/v2/devices/%s/image", c->device_id);
   if (n >= sizeof(url)) {
     fprintf(stderr, "error: url too long\n");
     goto error;
@@ -230,37 +771,55 @@ int get_device_image(const char *api_key, const char *device_id, buffer *buf,
     fprintf(stderr, "error: api-key too long\n");
     goto error;
   }
-  headers = curl_slist_append(headers, auth);
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-
-  // HTTP要求
-  curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_curl_write_buffer);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, buf);
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-  curl_easy_setopt(curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
-
-  CURLcode ret;
-  ret = curl_easy_perform(curl);
-  if (ret != CURLE_OK) {
+  t->headers = curl_slist_append(t->headers, auth);
+  t->headers = curl_slist_append(t->headers, "Content-Type: application/json");
+
+  // HTTP要求, 完了はmultiハンドルから通知される
+  // 返却された画像のバッファを再利用し, 毎回のメモリ確保を避ける
+  buffer_acquire(&t->buf);
+  CHECK_NULL(t->curl = http_acquire());
+  curl_easy_setopt(t->curl, CURLOPT_URL, url);
+  curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, on_curl_header_buffer);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, &t->buf);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, on_curl_write_buffer);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->buf);
+  curl_easy_setopt(t->curl, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(t->curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
+  curl_easy_setopt(t->curl, CURLOPT_PRIVATE, c);
+
+  CURLMcode ret;
+  ret = curl_multi_add_handle(multi, t->curl);
+  if (ret != CURLM_OK) {
     fprintf(stderr, "error: curl failed: %d: %s\n", ret,
-            curl_easy_strerror(ret));
+            curl_multi_strerror(ret));
     goto error;
   }
-
-  // 後処理
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
   return 0;
 
 error:
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
+  finish_transfer(multi, t);
+  buffer_release(&t->buf);
   return 1;
 }
 
+int finish_device_image(CURLM *multi, camera *c, CURLcode ret, double *score) {
+  transfer *t = &c->image;
+  int rc = 1;
+  http_metrics_record("GET /v2/devices/{device_id}/image", t->curl);
+  if (ret != CURLE_OK) {
+    // 1台のカメラの失敗で他のカメラの監視を止めず, 次の予定時刻に再び取得する
+    fprintf(stderr, "%s: error: curl failed: %d: %s\n", c->device_id, ret,
+            curl_easy_strerror(ret));
+  } else {
+    c->images++;
+    rc = analyze(&t->buf, score);
+  }
+  finish_transfer(multi, t);
+  buffer_release(&t->buf);
+  return rc;
+}
+
 int analyze(buffer *buf, double *score) {
   // サンプルでは60秒周期のサインカーブを出力
   *score = sin(time(NULL) / 60.0 * M_PI * 2.0);
@@ -281,17 +840,43 @@ size_t on_curl_debug(CURL *handle, curl_infotype type, char *data, size_t size,
   return 0;
 }
 
-int post_event(const char *api_key, const char *device_id,
-               const char *definition_id, int verbosity) {
-  struct curl_slist *headers = NULL;
+int check_event(camera *c, double score) {
+  int found = (score > 0.95) ? 1 : 0;
+  int post = 0;
+  if (found && c->dead_time <= 0 && c->event.curl == NULL &&
+      !c->event_pending) {
+    // スコアがしきい値を超えかつ過去3回の取得で検出がないときイベント登録
+    fprintf(stderr, "%s: event found, registering: score=%f\n", c->device_id,
+            score);
+    post = 1;
+  } else if (found) {
+    // スコアがしきい値を超え過去3回の取得で検出があるとき検出を無視する
+    fprintf(stderr, "%s: event found but ignored: score=%f\n", c->device_id,
+            score);
+  } else {
+    // スコアがしきい値以下
+    fprintf(stderr, "%s: event not found: score=%f\n", c->device_id, score);
+  }
+
+  // 不感時間の更新
+  if (found) {
+    c->dead_time = 3;
+  } else {
+    c->dead_time--;
+  }
+  return post;
+}
+
+int start_event(CURLM *multi, const char *api_key, camera *c,
+                const char *definition_id, int verbosity) {
+  transfer *t = &c->event;
   cJSON *req = NULL;
-  CURL *curl = NULL;
 
   // リクエストURL
   char url[256];
   int n;
   n = snprintf(url, sizeof(url),
-               "https://openapi.safie.link/v2/devices/%s/events", device_id);
+               "https://openapi.safie.link/v2/devices/%s/events", c->device_id);
   if (n >= sizeof(url)) {
     fprintf(stderr, "error: url too long\n");
     goto error;
@@ -304,39 +889,45 @@ int post_event(const char *api_key, const char *device_id,
     fprintf(stderr, "error: api-key too long\n");
     goto error;
   }
-  headers = curl_slist_append(headers, auth);
-  headers = curl_slist_append(headers, "Content-Type: application/json");
+  t->headers = curl_slist_append(t->headers, auth);
+  t->headers = curl_slist_append(t->headers, "Content-Type: application/json");
 
   // body
   CHECK_NULL(req = cJSON_CreateObject());
   CHECK_NULL(cJSON_AddStringToObject(req, "definition_id", definition_id));
 
-  // HTTP要求
-  curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, cJSON_PrintUnformatted(req));
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-  curl_easy_setopt(curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
-  curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
-
-  CURLcode ret;
-  ret = curl_easy_perform(curl);
-  if (ret != CURLE_OK) {
+  // HTTP要求, 完了はmultiハンドルから通知される
+  CHECK_NULL(t->curl = http_acquire());
+  curl_easy_setopt(t->curl, CURLOPT_URL, url);
+  curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+  CHECK_NULL(t->body = cJSON_PrintUnformatted(req));
+  curl_easy_setopt(t->curl, CURLOPT_POSTFIELDS, t->body);
+  curl_easy_setopt(t->curl, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(t->curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
+  curl_easy_setopt(t->curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
+  curl_easy_setopt(t->curl, CURLOPT_PRIVATE, c);
+
+  CURLMcode ret;
+  ret = curl_multi_add_handle(multi, t->curl);
+  if (ret != CURLM_OK) {
     fprintf(stderr, "error: curl failed: %d: %s\n", ret,
-            curl_easy_strerror(ret));
+            curl_multi_strerror(ret));
     goto error;
   }
-
-  // 後処理
-  curl_easy_cleanup(curl);
   cJSON_Delete(req);
-  curl_slist_free_all(headers);
   return 0;
 
 error:
-  curl_easy_cleanup(curl);
+  finish_transfer(multi, t);
   cJSON_Delete(req);
-  curl_slist_free_all(headers);
   return 1;
 }
+
+void finish_event(CURLM *multi, camera *c, CURLcode ret) {
+  http_metrics_record("POST /v2/devices/{device_id}/events", c->event.curl);
+  if (ret != CURLE_OK) {
+    fprintf(stderr, "%s: error: curl failed: %d: %s\n", c->device_id, ret,
+            curl_easy_strerror(ret));
+  }
+  finish_transfer(multi, &c->event);
+}
@@ -0,0 +1,84 @@
+/*
+ * poll-schedule
+ * 多数のカメラの画像取得の予定時刻を管理する
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "poll-schedule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int poll_schedule_init(poll_schedule *s, int capacity) {
+  s->entries = (poll_entry *)malloc(capacity * sizeof(poll_entry));
+  if (s->entries == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  s->count = 0;
+  s->capacity = capacity;
+  return 0;
+}
+
+void poll_schedule_free(poll_schedule *s) {
+  free(s->entries);
+  s->entries = NULL;
+  s->count = 0;
+  s->capacity = 0;
+}
+
+int poll_schedule_push(poll_schedule *s, double deadline, int id) {
+  if (s->count == s->capacity) {
+    return 1;
+  }
+  // 末尾に追加し, 親より早い間は親と入れ替える
+  int i = s->count++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (s->entries[parent].deadline <= deadline) {
+      break;
+    }
+    s->entries[i] = s->entries[parent];
+    i = parent;
+  }
+  s->entries[i].deadline = deadline;
+  s->entries[i].id = id;
+  return 0;
+}
+
+double poll_schedule_next(const poll_schedule *s) {
+  return s->entries[0].deadline;
+}
+
+int poll_schedule_pop(poll_schedule *s) {
+  int id = s->entries[0].id;
+  // 末尾の予定を先頭に移し, 子より遅い間は早い方の子と入れ替える
+  poll_entry last = s->entries[--s->count];
+  int i = 0;
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= s->count) {
+      break;
+    }
+    if (child + 1 < s->count &&
+        s->entries[child + 1].deadline < s->entries[child].deadline) {
+      child++;
+    }
+    if (last.deadline <= s->entries[child].deadline) {
+      break;
+    }
+    s->entries[i] = s->entries[child];
+    i = child;
+  }
+  if (s->count > 0) {
+    s->entries[i] = last;
+  }
+  return id;
+}
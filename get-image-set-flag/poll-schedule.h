@@ -0,0 +1,54 @@
+/*
+ * poll-schedule
+ * 多数のカメラの画像取得の予定時刻を管理する
+ * (予定時刻の早い順に取り出す二分ヒープ, 追加と取り出しはカメラ数の対数時間)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef POLL_SCHEDULE_H
+#define POLL_SCHEDULE_H
+
+// 予定
+typedef struct {
+  double deadline; // 予定時刻 (`monotonic_now`) [sec]
+  int id;          // カメラの番号
+} poll_entry;
+
+// 予定の一覧
+typedef struct {
+  poll_entry *entries; // 二分ヒープ, 先頭が最も早い予定
+  int count;
+  int capacity;
+} poll_schedule;
+
+/// @brief 単調増加時計の現在時刻 [sec] を返します
+double monotonic_now();
+
+/// @brief 予定の一覧を初期化します
+/// @param s [OUT] 予定の一覧
+/// @param capacity [IN] 予定の数の上限 (カメラ数)
+/// @return 終了コード, `0` のとき正常終了
+int poll_schedule_init(poll_schedule *s, int capacity);
+
+/// @brief 予定の一覧を解放します
+/// @param s [IN/OUT] 予定の一覧
+void poll_schedule_free(poll_schedule *s);
+
+/// @brief 予定を追加します
+/// @param s [IN/OUT] 予定の一覧
+/// @param deadline [IN] 予定時刻 (`monotonic_now`) [sec]
+/// @param id [IN] カメラの番号
+/// @return 終了コード, `0` のとき正常終了, 上限を超えるとき `1`
+int poll_schedule_push(poll_schedule *s, double deadline, int id);
+
+/// @brief 最も早い予定の時刻を返します
+/// @param s [IN] 予定の一覧, 空でないこと
+/// @return 予定時刻 (`monotonic_now`) [sec]
+double poll_schedule_next(const poll_schedule *s);
+
+/// @brief 最も早い予定を取り出します
+/// @param s [IN/OUT] 予定の一覧, 空でないこと
+/// @return カメラの番号
+int poll_schedule_pop(poll_schedule *s);
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ * checksum
+ * ダウンロード中のデータからSHA-256, CRC32Cを逐次計算する
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "checksum.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// x86-64ではビルド時の `-msse4.2` の有無によらず, 実行するCPUに合わせて
+// CRC32命令を使う
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#endif
+
+// 書き込み済みのデータを読み直すときのバッファサイズ
+#define CHECKSUM_READ_SIZE (1024 * 1024)
+
+int checksum_init(checksum *sum, int types) {
+  memset(sum, 0, sizeof(*sum));
+  if (types & CHECKSUM_SHA256) {
+    sum->sha256 = EVP_MD_CTX_new();
+    if (sum->sha256 == NULL ||
+        EVP_DigestInit_ex(sum->sha256, EVP_sha256(), NULL) != 1) {
+      fprintf(stderr, "error: failed to initialize SHA-256\n");
+      checksum_cleanup(sum);
+      return 1;
+    }
+  }
+  sum->crc32c_enabled = (types & CHECKSUM_CRC32C) ? 1 : 0;
+  return 0;
+}
+
+void checksum_cleanup(checksum *sum) {
+  EVP_MD_CTX_free(sum->sha256);
+  sum->sha256 = NULL;
+  sum->crc32c_enabled = 0;
+}
+
+int checksum_enabled(const checksum *sum) {
+  return sum->sha256 != NULL || sum->crc32c_enabled;
+}
+
+int checksum_update(checksum *sum, const void *data, size_t size) {
+  if (sum->sha256 != NULL && EVP_DigestUpdate(sum->sha256, data, size) != 1) {
+    fprintf(stderr, "error: failed to update SHA-256\n");
+    return 1;
+  }
+  if (sum->crc32c_enabled) {
+    sum->crc32c = crc32c_update(sum->crc32c, data, size);
+  }
+  sum->offset += size;
+  return 0;
+}
+
+int checksum_read(checksum *sum, int fd, off_t end) {
+  if (sum->offset >= end) {
+    return 0;
+  }
+  size_t size = end - sum->offset;
+  if (size > CHECKSUM_READ_SIZE) {
+    size = CHECKSUM_READ_SIZE;
+  }
+  char *buf = (char *)malloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  while (sum->offset < end) {
+    size_t n = end - sum->offset;
+    if (n > size) {
+      n = size;
+    }
+    ssize_t r = pread(fd, buf, n, sum->offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      fprintf(stderr, "error: failed to read file: %s\n",
+              (r < 0) ? strerror(errno) : "unexpected end of file");
+      free(buf);
+      return 1;
+    }
+    if (checksum_update(sum, buf, r) != 0) {
+      free(buf);
+      return 1;
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+int checksum_final(checksum *sum, char sha256[65], uint32_t *crc32c) {
+  sha256[0] = '\0';
+  if (sum->sha256 != NULL) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (EVP_DigestFinal_ex(sum->sha256, md, &len) != 1 || len != 32) {
+      fprintf(stderr, "error: failed to finalize SHA-256\n");
+      return 1;
+    }
+    for (unsigned int i = 0; i < len; i++) {
+      snprintf(sha256 + i * 2, 3, "%02x", md[i]);
+    }
+  }
+  *crc32c = sum->crc32c;
+  return 0;
+}
+
+/// @brief CRC32Cの計算表 (反転多項式 0x82f63b78)
+static const uint32_t *crc32c_table() {
+  static uint32_t table[256];
+  static int initialized = 0;
+  if (!initialized) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      }
+      table[i] = c;
+    }
+    initialized = 1;
+  }
+  return table;
+}
+
+#ifdef CRC32C_HARDWARE
+/// @brief SSE4.2のCRC32命令でCRC32Cを計算します
+/// SSE4.2に対応したCPUでのみ呼び出す
+/// @param crc [IN] 反転済みのCRC32C
+/// @return 反転済みのCRC32C
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size) {
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc = (uint32_t)_mm_crc32_u64(crc, v);
+  }
+  for (; size > 0; p++, size--) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  crc = ~crc;
+#ifdef CRC32C_HARDWARE
+  // SSE4.2のCRC32命令はCRC32Cを計算する
+  static int sse42 = -1;
+  if (sse42 < 0) {
+    sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  }
+  if (sse42) {
+    return ~crc32c_sse42(crc, p, size);
+  }
+#endif
+  const uint32_t *table = crc32c_table();
+  for (; size > 0; p++, size--) {
+    crc = table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/// @brief Base64の文字列をデコードします
+/// @return デコードしたバイト数, 不正な文字列のとき `-1`
+static int decode_base64(const char *text, size_t length, unsigned char *out,
+                         size_t size) {
+  static const char table[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned long v = 0;
+  int bits = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < length && text[i] != '='; i++) {
+    const char *p = strchr(table, text[i]);
+    if (p == NULL || text[i] == '\0') {
+      return -1;
+    }
+    v = (v << 6) | (unsigned long)(p - table);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (n >= size) {
+        return -1;
+      }
+      out[n++] = (v >> bits) & 0xff;
+    }
+  }
+  return (int)n;
+}
+
+/// @brief `name=value` の並び (`,` 区切り) から `name` の値を探します
+/// @return 値の先頭, 見つからないときNULL
+static const char *find_param(const char *first, const char *last,
+                              const char *name, size_t *length) {
+  size_t len = strlen(name);
+  const char *p = first;
+  while (p < last) {
+    while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    const char *end = p;
+    while (end < last && *end != ',') {
+      end++;
+    }
+    if ((size_t)(end - p) > len && strncasecmp(p, name, len) == 0 &&
+        p[len] == '=') {
+      *length = end - (p + len + 1);
+      return p + len + 1;
+    }
+    p = end;
+  }
+  return NULL;
+}
+
+/// @brief Base64のSHA-256を16進文字列にしてチェックサムに設定します
+static void set_sha256(const char *value, size_t length,
+                       checksum_expect *expect) {
+  // Repr-Digestの値は `:` で囲まれる
+  if (length >= 2 && value[0] == ':' && value[length - 1] == ':') {
+    value++;
+    length -= 2;
+  }
+  unsigned char md[32];
+  if (decode_base64(value, length, md, sizeof(md)) == 32) {
+    for (int i = 0; i < 32; i++) {
+      snprintf(expect->sha256 + i * 2, 3, "%02x", md[i]);
+    }
+  }
+}
+
+/// @brief Base64のCRC32C (ビッグエンディアン) をチェックサムに設定します
+static void set_crc32c(const char *value, size_t length,
+                       checksum_expect *expect) {
+  if (length >= 2 && value[0] == ':' && value[length - 1] == ':') {
+    value++;
+    length -= 2;
+  }
+  unsigned char b[4];
+  if (decode_base64(value, length, b, sizeof(b)) == 4) {
+    expect->crc32c = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+                     ((uint32_t)b[2] << 8) | b[3];
+    expect->has_crc32c = 1;
+  }
+}
+
+void checksum_parse_header(const char *line, size_t length,
+                           checksum_expect *expect) {
+  const char *colon = (const char *)memchr(line, ':', length);
+  if (colon == NULL) {
+    return;
+  }
+  size_t name_len = colon - line;
+  const char *first = colon + 1;
+  const char *last = line + length;
+  while (first < last && (*first == ' ' || *first == '\t')) {
+    first++;
+  }
+  while (first < last && isspace((unsigned char)last[-1])) {
+    last--;
+  }
+
+#define HEADER_IS(name)                                                        \
+  (name_len == strlen(name) && strncasecmp(line, name, name_len) == 0)
+  const char *value;
+  size_t len;
+  if (HEADER_IS("Digest") || HEADER_IS("Repr-Digest")) {
+    if ((value = find_param(first, last, "sha-256", &len)) != NULL) {
+      set_sha256(value, len, expect);
+    }
+    if ((value = find_param(first, last, "crc32c", &len)) != NULL) {
+      set_crc32c(value, len, expect);
+    }
+  } else if (HEADER_IS("x-goog-hash")) {
+    if ((value = find_param(first, last, "crc32c", &len)) != NULL) {
+      set_crc32c(value, len, expect);
+    }
+  } else if (HEADER_IS("x-amz-checksum-sha256")) {
+    set_sha256(first, last - first, expect);
+  } else if (HEADER_IS("x-amz-checksum-crc32c")) {
+    set_crc32c(first, last - first, expect);
+  }
+#undef HEADER_IS
+}
+
+void checksum_parse_etag(const char *etag, checksum_expect *expect) {
+  // 弱いETagは内容のハッシュ値ではない
+  if (strncmp(etag, "W/", 2) == 0) {
+    return;
+  }
+  size_t len = strlen(etag);
+  if (len >= 2 && etag[0] == '"' && etag[len - 1] == '"') {
+    etag++;
+    len -= 2;
+  }
+  if (len != 64) {
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (!isxdigit((unsigned char)etag[i])) {
+      return;
+    }
+  }
+  for (size_t i = 0; i < len; i++) {
+    expect->sha256[i] = tolower((unsigned char)etag[i]);
+  }
+  expect->sha256[len] = '\0';
+}
@@ -0,0 +1,93 @@
+/*
+ * checksum
+ * ダウンロード中のデータからSHA-256, CRC32Cを逐次計算する
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+extern "C" {
+#include <openssl/evp.h>
+}
+
+// 計算するチェックサムの種類
+#define CHECKSUM_SHA256 1
+#define CHECKSUM_CRC32C 2
+
+// チェックサムの計算状態
+typedef struct {
+  EVP_MD_CTX *sha256; // SHA-256の計算状態, 計算しないときNULL
+  int crc32c_enabled; // CRC32Cを計算するとき `1`
+  uint32_t crc32c;
+  off_t offset; // 先頭から計算済みのバイト数
+} checksum;
+
+// サーバが提示したチェックサム
+typedef struct {
+  char sha256[65]; // 16進文字列, 提示されていないとき空
+  int has_crc32c;  // CRC32Cが提示されたとき `1`
+  uint32_t crc32c;
+} checksum_expect;
+
+/// @brief チェックサムの計算を開始します
+/// @param sum [OUT] 計算状態
+/// @param types [IN] 計算するチェックサム (`CHECKSUM_SHA256`, `CHECKSUM_CRC32C` の論理和), `0` のとき計算しない
+/// @return 終了コード, `0` のとき正常終了
+int checksum_init(checksum *sum, int types);
+
+/// @brief 計算状態を解放します
+/// @param sum [IN/OUT] 計算状態
+void checksum_cleanup(checksum *sum);
+
+/// @brief チェックサムを計算するかを返します
+int checksum_enabled(const checksum *sum);
+
+/// @brief 先頭から続くデータをチェックサムに加えます
+/// @param sum [IN/OUT] 計算状態
+/// @param data [IN] `sum->offset` の位置から始まるデータ
+/// @param size [IN] データの長さ
+/// @return 終了コード, `0` のとき正常終了
+int checksum_update(checksum *sum, const void *data, size_t size);
+
+/// @brief ファイルに書き込み済みのデータを `end` の位置までチェックサムに加えます
+/// 並列に受信した区間のうち, 受信時に計算できなかった範囲を読み直すために使う
+/// @param sum [IN/OUT] 計算状態
+/// @param fd [IN] 読み込み可能なファイル
+/// @param end [IN] 計算する範囲の終端 (この位置を含まない)
+/// @return 終了コード, `0` のとき正常終了
+int checksum_read(checksum *sum, int fd, off_t end);
+
+/// @brief チェックサムの計算を完了します
+/// @param sum [IN/OUT] 計算状態
+/// @param sha256 [OUT] SHA-256の16進文字列, 計算しないときは空
+/// @param crc32c [OUT] CRC32C
+/// @return 終了コード, `0` のとき正常終了
+int checksum_final(checksum *sum, char sha256[65], uint32_t *crc32c);
+
+/// @brief CRC32C (Castagnoli) を更新します
+/// @param crc [IN] これまでのデータのCRC32C, 初回は `0`
+/// @param data [IN] データ
+/// @param size [IN] データの長さ
+/// @return 更新したCRC32C
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size);
+
+/// @brief 応答ヘッダ行からサーバが提示したチェックサムを読み取ります
+/// `Digest`, `Repr-Digest`, `x-amz-checksum-sha256`, `x-amz-checksum-crc32c`,
+/// `x-goog-hash` に対応する
+/// @param line [IN] ヘッダ行
+/// @param length [IN] ヘッダ行の長さ
+/// @param expect [IN/OUT] 読み取ったチェックサム
+void checksum_parse_header(const char *line, size_t length,
+                           checksum_expect *expect);
+
+/// @brief ETagがSHA-256の16進文字列のときチェックサムとして読み取ります
+/// @param etag [IN] ETag (引用符を含む)
+/// @param expect [IN/OUT] 読み取ったチェックサム
+void checksum_parse_etag(const char *etag, checksum_expect *expect);
+
+#endif
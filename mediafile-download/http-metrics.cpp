@@ -0,0 +1,259 @@
+/*
+ * http-metrics
+ * HTTP要求の段階ごとの所要時間, 転送量, 応答コードを集計し
+ * Prometheusのテキスト形式で出力する
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "http-metrics.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// 所要時間の段階
+enum Phase {
+  PHASE_DNS = 0,  // 名前解決
+  PHASE_CONNECT,  // TCP接続
+  PHASE_TLS,      // TLSハンドシェイク
+  PHASE_SERVER,   // 要求の送信完了から応答の最初のバイトまで (サーバの処理時間)
+  PHASE_TRANSFER, // 応答の受信
+  PHASE_TOTAL,    // 全体
+  NUM_PHASES,
+};
+
+static const char *phase_names[NUM_PHASES] = {
+    "dns", "connect", "tls", "server", "transfer", "total",
+};
+
+// ヒストグラムの上限値 [sec]
+static const double bucket_bounds[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+    0.5,   1.0,    2.5,   5.0,  10.0,  30.0, 60.0,
+};
+#define NUM_BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+
+typedef struct {
+  uint64_t counts[NUM_BUCKETS + 1]; // 各区間の件数, 最後は上限超過
+  uint64_t count;
+  double sum;
+} histogram;
+
+typedef struct {
+  const char *name;
+  histogram phases[NUM_PHASES];
+  struct {
+    long code; // 応答コード, 応答がないとき `0`
+    uint64_t count;
+  } codes[HTTP_METRICS_MAX_CODES];
+  int ncodes;
+  uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t new_connections;
+} endpoint_metrics;
+
+// プロセス内の集計結果, 要求ごとにメモリ確保を行わない
+static struct {
+  endpoint_metrics endpoints[HTTP_METRICS_MAX_ENDPOINTS];
+  int nendpoints;
+} metrics;
+
+/// @brief エンドポイントの集計領域を返します, 初めてのときは作成する
+static endpoint_metrics *find_endpoint(const char *name) {
+  for (int i = 0; i < metrics.nendpoints; i++) {
+    if (metrics.endpoints[i].name == name ||
+        strcmp(metrics.endpoints[i].name, name) == 0) {
+      return &metrics.endpoints[i];
+    }
+  }
+  if (metrics.nendpoints == HTTP_METRICS_MAX_ENDPOINTS) {
+    return NULL;
+  }
+  endpoint_metrics *ep = &metrics.endpoints[metrics.nendpoints++];
+  ep->name = name;
+  return ep;
+}
+
+/// @brief ヒストグラムに値を加えます
+static void observe(histogram *h, double value) {
+  size_t i = 0;
+  while (i < NUM_BUCKETS && bucket_bounds[i] < value) {
+    i++;
+  }
+  h->counts[i]++;
+  h->count++;
+  h->sum += value;
+}
+
+/// @brief 2つの時点の差 [sec] を返します, 段階が記録されていないときは負
+static double elapsed(curl_off_t from, curl_off_t to) {
+  if (to <= 0) {
+    return -1.0;
+  }
+  return (to > from) ? (double)(to - from) / 1e6 : 0.0;
+}
+
+void http_metrics_record(const char *endpoint, CURL *curl) {
+  endpoint_metrics *ep = find_endpoint(endpoint);
+  if (ep == NULL) {
+    return;
+  }
+
+  // 各時点は要求開始からの経過時間 [usec]
+  curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0,
+             starttransfer = 0, total = 0;
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+  curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  long new_connections = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+
+  if (new_connections > 0) {
+    // 新しく接続したときのみ接続までの段階を記録する
+    observe(&ep->phases[PHASE_DNS], (double)namelookup / 1e6);
+    double t = elapsed(namelookup, connect);
+    if (t >= 0.0) {
+      observe(&ep->phases[PHASE_CONNECT], t);
+    }
+    t = elapsed(connect, appconnect);
+    if (t >= 0.0) {
+      observe(&ep->phases[PHASE_TLS], t);
+    }
+  }
+  double t = elapsed(pretransfer, starttransfer);
+  if (t >= 0.0) {
+    observe(&ep->phases[PHASE_SERVER], t);
+    observe(&ep->phases[PHASE_TRANSFER], elapsed(starttransfer, total));
+  }
+  observe(&ep->phases[PHASE_TOTAL], (double)total / 1e6);
+
+  long code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+  int i = 0;
+  while (i < ep->ncodes && ep->codes[i].code != code) {
+    i++;
+  }
+  if (i == ep->ncodes && ep->ncodes < HTTP_METRICS_MAX_CODES) {
+    ep->codes[ep->ncodes].code = code;
+    ep->codes[ep->ncodes].count = 0;
+    ep->ncodes++;
+  }
+  if (i < ep->ncodes) {
+    ep->codes[i].count++;
+  }
+
+  curl_off_t received = 0, sent = 0;
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+  ep->bytes_received += received;
+  ep->bytes_sent += sent;
+  ep->new_connections += new_connections;
+}
+
+/// @brief ラベルの値として出力します, `\` と `"` をエスケープする
+static void print_label(FILE *fp, const char *value) {
+  for (const char *p = value; *p != '\0'; p++) {
+    if (*p == '\\' || *p == '"') {
+      fputc('\\', fp);
+    }
+    fputc(*p, fp);
+  }
+}
+
+/// @brief エンドポイントごとのカウンタを出力します
+static void print_counter(FILE *fp, const char *name, const char *help,
+                          size_t offset) {
+  fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (int i = 0; i < metrics.nendpoints; i++) {
+    endpoint_metrics *ep = &metrics.endpoints[i];
+    fprintf(fp, "%s{endpoint=\"", name);
+    print_label(fp, ep->name);
+    fprintf(fp, "\"} %llu\n",
+            (unsigned long long)*(uint64_t *)((char *)ep + offset));
+  }
+}
+
+int http_metrics_write(const char *path) {
+  char tmp[512];
+  int n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (n >= sizeof(tmp)) {
+    fprintf(stderr, "error: metrics filename too long\n");
+    return 1;
+  }
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to write %s: %s\n", tmp, strerror(errno));
+    return 1;
+  }
+
+  const char *name = "safie_http_request_duration_seconds";
+  fprintf(fp,
+          "# HELP %s Duration of each phase of HTTP requests.\n"
+          "# TYPE %s histogram\n",
+          name, name);
+  for (int i = 0; i < metrics.nendpoints; i++) {
+    endpoint_metrics *ep = &metrics.endpoints[i];
+    for (int p = 0; p < NUM_PHASES; p++) {
+      histogram *h = &ep->phases[p];
+      if (h->count == 0) {
+        continue;
+      }
+      uint64_t cumulative = 0;
+      for (size_t b = 0; b <= NUM_BUCKETS; b++) {
+        cumulative += h->counts[b];
+        fprintf(fp, "%s_bucket{endpoint=\"", name);
+        print_label(fp, ep->name);
+        if (b < NUM_BUCKETS) {
+          fprintf(fp, "\",phase=\"%s\",le=\"%g\"} %llu\n", phase_names[p],
+                  bucket_bounds[b], (unsigned long long)cumulative);
+        } else {
+          fprintf(fp, "\",phase=\"%s\",le=\"+Inf\"} %llu\n", phase_names[p],
+                  (unsigned long long)cumulative);
+        }
+      }
+      fprintf(fp, "%s_sum{endpoint=\"", name);
+      print_label(fp, ep->name);
+      fprintf(fp, "\",phase=\"%s\"} %.6f\n", phase_names[p], h->sum);
+      fprintf(fp, "%s_count{endpoint=\"", name);
+      print_label(fp, ep->name);
+      fprintf(fp, "\",phase=\"%s\"} %llu\n", phase_names[p],
+              (unsigned long long)h->count);
+    }
+  }
+
+  name = "safie_http_requests_total";
+  fprintf(fp,
+          "# HELP %s HTTP requests by response code (0: no response).\n"
+          "# TYPE %s counter\n",
+          name, name);
+  for (int i = 0; i < metrics.nendpoints; i++) {
+    endpoint_metrics *ep = &metrics.endpoints[i];
+    for (int c = 0; c < ep->ncodes; c++) {
+      fprintf(fp, "%s{endpoint=\"", name);
+      print_label(fp, ep->name);
+      fprintf(fp, "\",code=\"%ld\"} %llu\n", ep->codes[c].code,
+              (unsigned long long)ep->codes[c].count);
+    }
+  }
+  print_counter(fp, "safie_http_response_bytes_total",
+                "Bytes of HTTP response bodies received.",
+                offsetof(endpoint_metrics, bytes_received));
+  print_counter(fp, "safie_http_request_bytes_total",
+                "Bytes of HTTP request bodies sent.",
+                offsetof(endpoint_metrics, bytes_sent));
+  print_counter(fp, "safie_http_new_connections_total",
+                "Connections opened for HTTP requests.",
+                offsetof(endpoint_metrics, new_connections));
+
+  if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "error: failed to write %s: %s\n", path, strerror(errno));
+    remove(tmp);
+    return 1;
+  }
+  return 0;
+}
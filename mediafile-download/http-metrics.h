@@ -0,0 +1,38 @@
+/*
+ * http-metrics
+ * HTTP要求の段階ごとの所要時間, 転送量, 応答コードを集計し
+ * Prometheusのテキスト形式で出力する
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+extern "C" {
+#include <curl/curl.h>
+}
+
+// 集計するエンドポイント数の上限, 超えた分は記録しない
+#define HTTP_METRICS_MAX_ENDPOINTS 16
+// エンドポイントごとに集計する応答コードの種類の上限
+#define HTTP_METRICS_MAX_CODES 8
+// メトリクスファイルを書き出す間隔 [sec]
+#define HTTP_METRICS_INTERVAL 15.0
+
+/// @brief 完了したHTTP要求の所要時間, 転送量, 応答コードを記録します
+/// 所要時間は名前解決, 接続, TLSハンドシェイク, サーバの処理, 応答の受信,
+/// 全体に分けてヒストグラムに集計する
+/// 接続を再利用した要求では名前解決, 接続, TLSハンドシェイクは記録しない
+/// @param endpoint [IN] エンドポイント名 (例: `GET /v2/devices/{device_id}/image`),
+/// 文字列リテラルなどプロセス終了まで有効な文字列
+/// @param curl [IN] 要求を終えたeasyハンドル
+void http_metrics_record(const char *endpoint, CURL *curl);
+
+/// @brief 集計結果をPrometheusのテキスト形式でファイルに書き出します
+/// node_exporterのtextfile collectorが書き込み途中のファイルを読まないよう,
+/// 一時ファイルに書き込んでから置き換える
+/// @param path [IN] 出力ファイル
+/// @return 終了コード, `0` のとき正常終了
+int http_metrics_write(const char *path);
+
+#endif
@@ -10,6 +10,8 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 extern "C" {
@@ -17,6 +19,12 @@ extern "C" {
 #include <curl/curl.h>
 }
 
+#include "checksum.h"
+#include "http-metrics.h"
+#include "output-sink.h"
+#include "rate-limit.h"
+#include "session-cache.h"
+
 /// @brief ポインタを返す `expr` を評価し値がNULLのときerrorラベルにjumpします
 /// @param expr ポインタを返す式
 #define CHECK_NULL(expr)                                                       \
@@ -35,22 +43,138 @@ typedef struct {
   size_t capacity;
 } buffer;
 
+// 応答バッファのプールに保持するバッファ数の上限
+#define BUFFER_POOL_SIZE 16
+
+// Content-Lengthから受信前に確保する容量の上限 [byte]
+// 超える応答は受信に合わせて拡張し, 不正な値で大きな領域を確保しない
+#define BUFFER_PRESIZE_MAX (4 * 1024 * 1024)
+
+// プールに返却するバッファの容量の上限 [byte], 超えるバッファは解放する
+#define BUFFER_POOL_MAX_CAPACITY (4 * 1024 * 1024)
+
+// 応答バッファの統計
+typedef struct {
+  unsigned long acquired;    // バッファの取得回数
+  unsigned long reused;      // プールのバッファを再利用した回数
+  unsigned long allocations; // メモリ確保 (malloc/realloc) の回数
+  unsigned long long copied; // バッファにコピーしたバイト数
+} buffer_stats;
+
+// 応答バッファのプール
+// 返却されたバッファを次の要求で再利用し, 定常状態ではメモリ確保を行わない
+static struct {
+  buffer idle[BUFFER_POOL_SIZE]; // 再利用待ちのバッファ
+  int nidle;
+  buffer_stats stats;
+} buffer_pool;
+
+/// @brief プールから空のバッファを取得します
+/// プールが空のときは領域を持たないバッファを返し, 領域は応答の受信時に確保する
+/// @param buf [OUT] バッファ
+void buffer_acquire(buffer *buf) {
+  buffer_pool.stats.acquired++;
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+  if (buffer_pool.nidle == 0) {
+    return;
+  }
+
+  // 最も大きいバッファを使い再確保の機会を減らす
+  int k = 0;
+  for (int i = 1; i < buffer_pool.nidle; i++) {
+    if (buffer_pool.idle[k].capacity < buffer_pool.idle[i].capacity) {
+      k = i;
+    }
+  }
+  *buf = buffer_pool.idle[k];
+  buffer_pool.idle[k] = buffer_pool.idle[--buffer_pool.nidle];
+  buf->size = 0;
+  buffer_pool.stats.reused++;
+}
+
+/// @brief バッファをプールに返却します
+/// @param buf [IN/OUT] バッファ, 返却後は領域を持たない
+void buffer_release(buffer *buf) {
+  if (buf->data == NULL) {
+    return;
+  }
+  if (buffer_pool.nidle < BUFFER_POOL_SIZE &&
+      buf->capacity <= BUFFER_POOL_MAX_CAPACITY) {
+    buffer_pool.idle[buffer_pool.nidle++] = *buf;
+  } else {
+    free(buf->data);
+  }
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+}
+
+/// @brief バッファの容量を `capacity` 以上にします
+/// @param buf [IN/OUT] バッファ
+/// @param capacity [IN] 必要な容量 [byte]
+/// @return 終了コード, `0` のとき正常終了
+int buffer_reserve(buffer *buf, size_t capacity) {
+  if (capacity <= buf->capacity) {
+    return 0;
+  }
+  char *data = (char *)realloc(buf->data, capacity);
+  if (data == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  buffer_pool.stats.allocations++;
+  buf->data = data;
+  buf->capacity = capacity;
+  return 0;
+}
+
+/// @brief プール内のバッファを解放します
+void buffer_pool_cleanup() {
+  for (int i = 0; i < buffer_pool.nidle; i++) {
+    free(buffer_pool.idle[i].data);
+  }
+  buffer_pool.nidle = 0;
+}
+
+/// @brief 応答ヘッダのContent-Lengthから受信前にバッファの容量を確保します
+size_t on_curl_header_buffer(char *ptr, size_t size, size_t nmemb,
+                             void *userdata) {
+  size_t realsize = size * nmemb;
+  buffer *buf = (buffer *)userdata;
+  const char *name = "Content-Length:";
+  size_t len = strlen(name);
+  if (realsize > len && strncasecmp(ptr, name, len) == 0) {
+    unsigned long long length = strtoull(ptr + len, NULL, 10);
+    // 終端のNUL文字の分を加える
+    if (length > 0 && length <= BUFFER_PRESIZE_MAX &&
+        buffer_reserve(buf, buf->size + length + 1) != 0) {
+      return 0;
+    }
+  }
+  return realsize;
+}
+
 size_t on_curl_write_buffer(char *ptr, size_t size, size_t nmemb,
                             void *userdata) {
   size_t realsize = size * nmemb;
   buffer *buf = (buffer *)userdata;
-  if (buf->capacity - 1 < buf->size + realsize) {
+  if (buf->capacity < buf->size + realsize + 1) {
+    // Content-Lengthが無い応答のときは倍々に拡張する
     size_t newcapacity = buf->capacity * 2;
-    CHECK_NULL(buf->data = (char *)realloc(buf->data, newcapacity));
-    buf->capacity = newcapacity;
+    if (newcapacity < buf->size + realsize + 1) {
+      newcapacity = buf->size + realsize + 1;
+    }
+    if (buffer_reserve(buf, newcapacity) != 0) {
+      return 0;
+    }
   }
   memcpy(buf->data + buf->size, ptr, realsize);
   buf->size += realsize;
   buf->data[buf->size] = '\0';
+  buffer_pool.stats.copied += realsize;
   return realsize;
-
-error:
-  return 0;
 }
 
 size_t on_curl_debug(CURL *handle, curl_infotype type, char *data, size_t size,
@@ -74,52 +198,263 @@ void print_help() {
       "download recorded media by Safie API, using API key\n"
       "\n"
       "  -k, --apikey=APIKEY       API key, required\n"
-      "  -d, --device-id=DEVICEID  device ID, required\n"
-      "  -s, --start=DATETIME      start time of recorded media, required, "
-      "in 'yyyy-mm-ddTHH:MM:SS' format\n"
-      "  -e, --end=DATETIME        end time of recorded media, required, in "
-      "'yyyy-mm-ddTHH:MM:SS' format\n"
+      "  -d, --device-id=DEVICEID  device ID, required unless --jobs\n"
+      "  -s, --start=DATETIME      start time of recorded media, required "
+      "unless --jobs, in 'yyyy-mm-ddTHH:MM:SS' format\n"
+      "  -e, --end=DATETIME        end time of recorded media, required "
+      "unless --jobs, in 'yyyy-mm-ddTHH:MM:SS' format\n"
+      "  -o, --output-dir=.        output directory\n"
+      "  -O, --output=FILE         output file, defaults to "
+      "'<output-dir>/<request_id>.mp4',\n"
+      "                            '-' for stdout, '|COMMAND' to pipe into "
+      "COMMAND,\n"
+      "                            or a named pipe\n"
+      "  -j, --jobs=FILE           download every job listed in FILE ('-' for "
+      "stdin),\n"
+      "                            one 'DEVICEID START END [OUTPUT]' per line\n"
+      "  -c, --concurrency=4       max number of jobs processed at once\n"
+      "  -n, --segments=4          number of parallel range requests per "
+      "file,\n"
+      "                            always 1 with --checksum\n"
+      "  -S, --session-cache=FILE  reuse TLS sessions and resolved addresses "
+      "across runs,\n"
+      "                            defaults to $SAFIE_SESSION_CACHE\n"
+      "  -C, --checksum=LIST       compute 'sha256' and/or 'crc32c' while "
+      "downloading,\n"
+      "                            write '<output>.sha256' and verify against "
+      "server\n"
+      "                            checksum or ETag, downloads each file "
+      "over\n"
+      "                            a single connection\n"
+      "  -r, --rate-limit=RATE     limit download bandwidth to RATE bytes/sec "
+      "(k, M, G)\n"
+      "  -g, --rate-limit-group=NAME\n"
+      "                            share the bandwidth limit with other "
+      "processes on\n"
+      "                            this host in group NAME, defaults to\n"
+      "                            $SAFIE_RATE_LIMIT_GROUP\n"
+      "  -M, --metrics-file=FILE   write per-phase HTTP latency metrics to FILE "
+      "in\n"
+      "                            Prometheus text format\n"
+      "  -v, --verbose             enable verbose logging\n"
       "  -h, --help                print this help\n");
 }
 
-/// @brief 「メディアファイル 作成要求」APIを実行します
+// HTTPクライアント
+// プロセス内のすべてのAPI呼び出しでeasyハンドル, 接続, DNSキャッシュ, TLSセッションを再利用する
+#define HTTP_POOL_SIZE 64
+#define HTTP_DNS_CACHE_TIMEOUT 300L  // DNSキャッシュの有効期間 [sec]
+#define HTTP_KEEPALIVE_IDLE 30L      // keep-aliveを送り始めるまでのアイドル時間 [sec]
+#define HTTP_KEEPALIVE_INTERVAL 15L  // keep-aliveの送信間隔 [sec]
+#define HTTP_MAXAGE_CONN 300L        // 再利用する接続の最大アイドル時間 [sec]
+
+/// @brief HTTPクライアントを初期化します
+/// @param cache [IN/OUT] プロセスをまたいで再利用するセッションキャッシュ, NULLのとき使用しない
+/// @return 終了コード, `0` のとき正常終了
+int http_client_init(session_cache *cache);
+
+/// @brief HTTPクライアントを解放します
+void http_client_cleanup();
+
+/// @brief HTTP要求に使用するeasyハンドルを取得します
+/// 返却済みのハンドルがあれば設定を初期化して再利用する
+/// @return easyハンドル, 失敗したときNULL
+CURL *http_acquire();
+
+/// @brief easyハンドルを返却します, multiハンドルから外してから呼び出すこと
+/// @param curl [IN] `http_acquire` で取得したeasyハンドル, NULLのとき何もしない
+void http_release(CURL *curl);
+
+/// @brief 接続できなかった要求の接続先をセッションキャッシュから破棄します
+/// @param curl [IN] 接続に失敗したeasyハンドル
+void http_forget_address(CURL *curl);
+
+// 非同期HTTP要求の構造体
+typedef struct {
+  CURL *curl;
+  struct curl_slist *headers;
+  buffer buf;
+} transfer;
+
+/// @brief HTTP要求に使用したリソースを解放します
+/// @param t [IN/OUT] HTTP要求
+void transfer_cleanup(transfer *t);
+
+/// @brief 「メディアファイル 作成要求」APIのHTTP要求を準備します
 /// @param api_key [IN] APIキー
 /// @param device_id [IN] 対象デバイスID
 /// @param start [IN] メディアの開始日時 (ローカル時間)
 /// @param end [IN] メディアの終了日時 (ローカル時間)
-/// @param request_id [OUT] リクエストID
+/// @param t [OUT] 準備されたHTTP要求
 /// @param verbosity [IN] `1` のときログ出力
 /// @return 終了コード, `0` のとき正常終了
 int post_request(const char *api_key, const char *device_id,
-                 const struct tm start, const struct tm end, int *request_id,
+                 const struct tm start, const struct tm end, transfer *t,
                  int verbosity);
 
+/// @brief 「メディアファイル 作成要求」APIのレスポンスを処理します
+/// @param t [IN] 完了したHTTP要求
+/// @param request_id [OUT] リクエストID
+/// @return 終了コード, `0` のとき正常終了
+int parse_post_request(transfer *t, int *request_id);
+
 enum State {
   FAILED = 1,
   PROCESSING,
   AVAILABLE,
 };
 
-/// @brief 「メディアファイル 作成要求取得」APIを実行します
+/// @brief 「メディアファイル 作成要求取得」APIのHTTP要求を準備します
 /// @param api_key [IN] APIキー
 /// @param device_id [IN] 対象デバイスID
 /// @param request_id [IN] リクエストID
+/// @param t [OUT] 準備されたHTTP要求
+/// @param verbosity [IN] `1` のときログ出力
+/// @return 終了コード, `0` のとき正常終了
+int get_request(const char *api_key, const char *device_id, int request_id,
+                transfer *t, int verbosity);
+
+/// @brief 「メディアファイル 作成要求取得」APIのレスポンスを処理します
+/// @param t [IN] 完了したHTTP要求
 /// @param state [OUT] メディアファイル作成状況
 /// @param file_url [OUT] メディアファイル取得URL, `state == AVAILABLE`
 /// のときのみ
-/// @param verbosity [IN] `1` のときログ出力
 /// @return 終了コード, `0` のとき正常終了
-int get_request(const char *api_key, const char *device_id, int request_id,
-                enum State *state, char **file_url, int verbosity);
+int parse_get_request(transfer *t, enum State *state, char **file_url);
+
+// 分割ダウンロードの最小区間サイズ [byte]
+// 最初にこのサイズの区間を要求し, 応答からファイルサイズとRange要求の可否を得る
+#define SEGMENT_MIN_SIZE (4 * 1024 * 1024)
 
-/// @brief メディアファイルをダウンロードしファイルに保存します
+// メディアファイルのダウンロードの1区間
+typedef struct {
+  transfer xfer;
+  int fd;                 // 出力ファイル
+  curl_off_t offset;      // 次に書き込むファイル上の位置
+  curl_off_t end;         // 区間の終端 (この位置を含まない), `-1` のとき末尾まで
+  curl_off_t total;       // ファイル全体のサイズ, 不明のとき `-1`
+  curl_off_t begin;       // 区間の開始位置
+  curl_off_t range_start; // 応答のContent-Rangeの開始位置
+  int started;            // 応答ボディの受信を開始したとき `1`
+  int ranged;             // サーバがRange要求に応じたとき `1`
+  int conditional;        // If-Rangeを付けて要求したとき `1`
+  int changed;            // 前回のダウンロードからファイルが変わっていたとき `1`
+  char etag[128];         // 応答のETag
+  char last_modified[64]; // 応答のLast-Modified
+  checksum_expect expect; // 応答ヘッダで提示されたチェックサム
+  checksum *sum;          // ファイルのチェックサムの計算状態
+  output_sink *sink; // ファイルを経由しない出力先, ファイルに書き込むときNULL
+  int paused; // 出力先が受け取れず受信を一時停止しているとき `1`
+  rate_limit *limiter; // 受信帯域の制限, 制限しないときNULL
+  int throttled;       // 帯域制限により受信を一時停止しているとき `1`
+  double resume_at; // 帯域制限による一時停止を解除する時刻 (CLOCK_MONOTONIC)
+} segment;
+
+/// @brief メディアファイルの1区間をダウンロードしファイルに保存するHTTP要求を準備します
 /// @param api_key [IN] APIキー
 /// @param url [IN] メディアファイルURL (「作成要求取得」APIで取得されたもの)
-/// @param fp [IN] 出力ファイル
+/// @param seg [IN/OUT] ダウンロードする区間, HTTP要求は `seg->xfer` に作成される
+/// @param if_range [IN] If-Rangeヘッダの値 (ETagまたはLast-Modified), NULLのとき無し
 /// @param verbosity [IN] `1` のときログ出力
 /// @return 終了コード, `0` のとき正常終了
-int download_mediafile(const char *api_key, const char *url, FILE *fp,
-                       int verbosity);
+int download_mediafile(const char *api_key, const char *url, segment *seg,
+                       const char *if_range, int verbosity);
+
+// ジョブの進行段階
+enum Phase {
+  PHASE_PENDING = 0, // 未開始
+  PHASE_POST,        // 作成要求中
+  PHASE_WAIT,        // 作成完了待ち
+  PHASE_GET,         // 作成状況取得中
+  PHASE_DOWNLOAD,    // ダウンロード中
+  PHASE_DONE,        // 正常終了
+  PHASE_ERROR,       // 異常終了
+};
+
+// 作成状況取得の間隔 [sec]
+// 初回は短い間隔で取得し、以降は上限まで指数的に間隔を広げる
+#define POLL_INTERVAL_INITIAL 2.0
+#define POLL_INTERVAL_MAX 30.0
+#define POLL_BACKOFF 2.0
+// 取得間隔に加えるゆらぎの割合, 複数ジョブの取得時刻を分散させる
+#define POLL_JITTER 0.2
+// 作成完了待ちの期限 [sec], 基本値に録画時間に比例する時間を加える
+#define POLL_DEADLINE_BASE 180.0
+#define POLL_DEADLINE_RATIO 1.0
+
+// ジャーナルを保存する間隔 [sec]
+#define JOURNAL_INTERVAL 5.0
+
+// 1件のメディアファイルのダウンロードジョブ
+typedef struct {
+  char device_id[64];
+  struct tm start, end;
+  char output[256]; // 出力ファイル, 空のとき<output_dir>/<request_id>.mp4
+  char label[96];   // ログ出力用の名前
+
+  enum Phase phase;
+  int request_id;
+  char *file_url;
+  int polls;             // 作成状況取得の回数
+  double poll_interval;  // 現在の作成状況取得の間隔 [sec]
+  double next_poll;      // 次に作成状況を取得する時刻 (CLOCK_MONOTONIC)
+  double requested_at;   // 作成要求の完了時刻 (CLOCK_MONOTONIC)
+  double poll_deadline;  // 作成完了待ちの期限 (CLOCK_MONOTONIC)
+  transfer xfer;
+
+  char path[256];    // 出力ファイル
+  char part[264];    // ダウンロード中の出力ファイル, 完了後に `path` に移動する
+  char journal[512]; // 中断したダウンロードを再開するためのジャーナル
+  int fd;            // ダウンロード中の出力ファイル
+  segment *segs; // ダウンロード中の区間, 先頭はサイズ確認を兼ねた最初の区間
+  int nsegs;     // 要求済みの区間の数
+  int split;     // 残りの区間の要求を済ませたとき `1`
+  curl_off_t size;        // ファイル全体のサイズ, 不明のとき `-1`
+  char etag[128];         // ファイルのETag, 再開時の検証に使う
+  char last_modified[64]; // ファイルのLast-Modified, 再開時の検証に使う
+  int resumable;          // Range要求によりダウンロードを再開できるとき `1`
+  int resumed;            // ジャーナルからダウンロードを再開したとき `1`
+  double next_journal;    // 次にジャーナルを保存する時刻 (CLOCK_MONOTONIC)
+  checksum sum;           // 受信中に計算するチェックサム
+  checksum_expect expect; // サーバが提示したチェックサム
+  output_sink *sink; // ファイルを経由しない出力先, ファイルに保存するときNULL
+} job;
+
+// ジョブ実行の設定
+typedef struct {
+  const char *api_key;
+  const char *output_dir; // 出力ファイルが指定されていないジョブの出力先
+  int concurrency;        // 同時に処理するジョブ数の上限
+  int segments;           // 1ファイルあたりの並列Range要求数
+  int checksum;           // 計算するチェックサム (`CHECKSUM_*` の論理和)
+  rate_limit *limiter;    // 受信帯域の制限, 制限しないときNULL
+  const char *metrics_file; // HTTPメトリクスの出力先, 出力しないときNULL
+  int verbosity;            // `1` のときログ出力
+} config;
+
+/// @brief ジョブを初期化します
+/// @param j [OUT] ジョブ
+/// @param device_id [IN] 対象デバイスID
+/// @param start [IN] メディアの開始日時 (ローカル時間)
+/// @param end [IN] メディアの終了日時 (ローカル時間)
+/// @param output [IN] 出力ファイル, NULLのとき `<output_dir>/<request_id>.mp4`
+/// @return 終了コード, `0` のとき正常終了
+int init_job(job *j, const char *device_id, const struct tm start,
+             const struct tm end, const char *output);
+
+/// @brief ジョブ一覧をファイルから読み込みます
+/// @param path [IN] ジョブ一覧のファイル, `-` のとき標準入力
+/// @param jobs [OUT] 読み込まれたジョブの配列, 呼び出し側で `free` すること
+/// @param njobs [OUT] ジョブ数
+/// @return 終了コード, `0` のとき正常終了
+int load_jobs(const char *path, job **jobs, int *njobs);
+
+/// @brief ジョブ一覧をmultiハンドル上のイベントループにより並行して処理します
+/// @param cfg [IN] 実行の設定
+/// @param jobs [IN/OUT] ジョブの配列
+/// @param njobs [IN] ジョブ数
+/// @return 失敗したジョブの数
+int run_jobs(const config *cfg, job *jobs, int njobs);
 
 int main(int argc, char *argv[]) {
   /*
@@ -131,6 +466,17 @@ int main(int argc, char *argv[]) {
   memset(&start, 0, sizeof(struct tm));
   memset(&end, 0, sizeof(struct tm));
   const char *output_dir = ".";
+  const char *output = NULL;
+  const char *jobs_file = NULL;
+  int concurrency = 4;
+  int segments = 4;
+  const char *session_cache_path = getenv("SAFIE_SESSION_CACHE");
+  session_cache *cache = NULL;
+  int checksum_types = 0;
+  double rate = 0.0;
+  const char *rate_group = getenv("SAFIE_RATE_LIMIT_GROUP");
+  rate_limit *limiter = NULL;
+  const char *metrics_file = NULL;
   int verbosity = 0;
 
   int opt;
@@ -140,12 +486,21 @@ int main(int argc, char *argv[]) {
       {"start", required_argument, NULL, 's'},
       {"end", required_argument, NULL, 'e'},
       {"output-dir", required_argument, NULL, 'o'},
+      {"output", required_argument, NULL, 'O'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"concurrency", required_argument, NULL, 'c'},
+      {"segments", required_argument, NULL, 'n'},
+      {"session-cache", required_argument, NULL, 'S'},
+      {"checksum", required_argument, NULL, 'C'},
+      {"rate-limit", required_argument, NULL, 'r'},
+      {"rate-limit-group", required_argument, NULL, 'g'},
+      {"metrics-file", required_argument, NULL, 'M'},
       {"verbose", no_argument, NULL, 'v'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
   };
-  while ((opt = getopt_long(argc, argv, "k:d:s:e:o:vh", long_options, NULL)) !=
-         -1) {
+  while ((opt = getopt_long(argc, argv, "k:d:s:e:o:O:j:c:n:S:C:r:g:M:vh",
+                            long_options, NULL)) != -1) {
     switch (opt) {
     case 'k':
       api_key = optarg;
@@ -172,6 +527,65 @@ int main(int argc, char *argv[]) {
     case 'o':
       output_dir = optarg;
       break;
+    case 'O':
+      output = optarg;
+      break;
+    case 'j':
+      jobs_file = optarg;
+      break;
+    case 'c':
+      errno = 0;
+      concurrency = strtol(optarg, NULL, 10);
+      if (errno != 0 || concurrency < 1) {
+        fprintf(stderr, "error: invalid `--concurrency`\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'n':
+      errno = 0;
+      segments = strtol(optarg, NULL, 10);
+      if (errno != 0 || segments < 1) {
+        fprintf(stderr, "error: invalid `--segments`\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'S':
+      session_cache_path = optarg;
+      break;
+    case 'C': {
+      // `sha256`, `crc32c` のカンマ区切り
+      char list[64];
+      snprintf(list, sizeof(list), "%s", optarg);
+      char *saveptr = NULL;
+      for (char *name = strtok_r(list, ",", &saveptr); name != NULL;
+           name = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(name, "sha256") == 0) {
+          checksum_types |= CHECKSUM_SHA256;
+        } else if (strcmp(name, "crc32c") == 0) {
+          checksum_types |= CHECKSUM_CRC32C;
+        } else {
+          fprintf(stderr, "error: invalid `--checksum`\n");
+          print_help();
+          exit(2);
+        }
+      }
+      break;
+    }
+    case 'r':
+      if (rate_limit_parse(optarg, &rate) != 0) {
+        fprintf(stderr, "error: invalid `--rate-limit`\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'g':
+      rate_group = optarg;
+      break;
+    case 'M':
+      metrics_file = optarg;
+      break;
     case 'v':
       verbosity++;
       break;
@@ -192,238 +606,1541 @@ int main(int argc, char *argv[]) {
     print_help();
     exit(2);
   }
-  if (device_id == NULL) {
-    fprintf(stderr, "error: missing device ID\n");
-    print_help();
-    exit(2);
-  }
-  if (start.tm_year == 0) {
-    fprintf(stderr, "error: missing start time\n");
-    print_help();
-    exit(2);
+  if (checksum_types != 0) {
+    // チェックサムは先頭から順に計算するため, 分割すると後方の区間を
+    // ファイルから読み直すことになり, その間はすべての受信が止まる
+    segments = 1;
   }
-  if (end.tm_year == 0) {
-    fprintf(stderr, "error: missing end time\n");
-    print_help();
-    exit(2);
+  if (jobs_file != NULL) {
+    if (device_id != NULL || start.tm_year != 0 || end.tm_year != 0 ||
+        output != NULL) {
+      fprintf(stderr, "error: `--jobs` cannot be combined with `--device-id`, "
+                      "`--start`, `--end` or `--output`\n");
+      print_help();
+      exit(2);
+    }
+  } else {
+    if (device_id == NULL) {
+      fprintf(stderr, "error: missing device ID\n");
+      print_help();
+      exit(2);
+    }
+    if (start.tm_year == 0) {
+      fprintf(stderr, "error: missing start time\n");
+      print_help();
+      exit(2);
+    }
+    if (end.tm_year == 0) {
+      fprintf(stderr, "error: missing end time\n");
+      print_help();
+      exit(2);
+    }
   }
 
   /*
-   * メディアファイル作成の開始
+   * ジョブの作成
    */
-  FILE *fp = NULL;
-  char *file_url = NULL;
+  job *jobs = NULL;
+  int njobs = 0;
+  if (jobs_file != NULL) {
+    if (load_jobs(jobs_file, &jobs, &njobs) != 0) {
+      free(jobs);
+      return 1;
+    }
+  } else {
+    CHECK_NULL(jobs = (job *)calloc(1, sizeof(job)));
+    njobs = 1;
+    if (init_job(&jobs[0], device_id, start, end, output) != 0) {
+      goto error;
+    }
+  }
+  int stdout_jobs;
+  stdout_jobs = 0;
+  for (int i = 0; i < njobs; i++) {
+    stdout_jobs += (strcmp(jobs[i].output, "-") == 0) ? 1 : 0;
+  }
+  if (stdout_jobs > 1) {
+    fprintf(stderr, "error: only one job can write to stdout\n");
+    goto error;
+  }
 
-  // メディアファイル作成要求
-  fprintf(stderr, "requesting media file creation\n");
-  int request_id;
-  int rc = post_request(api_key, device_id, start, end, &request_id, verbosity);
-  if (rc != 0) {
+  /*
+   * メディアファイル作成とダウンロードの実行
+   */
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  if (session_cache_path != NULL && session_cache_path[0] != '\0') {
+    CHECK_NULL(cache = session_cache_load(session_cache_path));
+  }
+  if (http_client_init(cache) != 0) {
     goto error;
   }
+  if (rate > 0.0 || (rate_group != NULL && rate_group[0] != '\0')) {
+    const char *group =
+        (rate_group != NULL && rate_group[0] != '\0') ? rate_group : NULL;
+    CHECK_NULL(limiter = rate_limit_open(group, rate));
+  }
+  srand48(time(NULL) ^ getpid());
+  config cfg;
+  cfg.api_key = api_key;
+  cfg.output_dir = output_dir;
+  cfg.concurrency = concurrency;
+  cfg.segments = segments;
+  cfg.checksum = checksum_types;
+  cfg.limiter = limiter;
+  cfg.metrics_file = metrics_file;
+  cfg.verbosity = verbosity;
+  int failed;
+  failed = run_jobs(&cfg, jobs, njobs);
+  if (metrics_file != NULL && http_metrics_write(metrics_file) != 0) {
+    failed = (failed == 0) ? 1 : failed;
+  }
+  if (cache != NULL) {
+    // 共有のセッションキャッシュからTLSセッションを書き出すため, 解放前に保存する
+    CURL *curl = http_acquire();
+    session_cache_save(cache, curl);
+    http_release(curl);
+  }
+  http_client_cleanup();
+  curl_global_cleanup();
+  if (verbosity) {
+    fprintf(stderr,
+            "response buffers: %lu acquired (%lu reused), %lu allocations, "
+            "%llu bytes copied\n",
+            buffer_pool.stats.acquired, buffer_pool.stats.reused,
+            buffer_pool.stats.allocations, buffer_pool.stats.copied);
+  }
+  buffer_pool_cleanup();
+  if (njobs > 1) {
+    fprintf(stderr, "%d of %d jobs completed\n", njobs - failed, njobs);
+  }
 
-  int i;
-  for (i = 0; i < 10; i++) {
-    fprintf(stderr, "awaiting 30 sec to complete...\n");
-    sleep(30);
+  rate_limit_close(limiter);
+  session_cache_free(cache);
+  free(jobs);
+  return (failed == 0) ? 0 : 1;
 
-    // 30秒ごとに状況を取得
-    enum State state;
-    rc = get_request(api_key, device_id, request_id, &state, &file_url,
-                     verbosity);
-    if (rc != 0) {
-      goto error;
+error:
+  rate_limit_close(limiter);
+  session_cache_free(cache);
+  free(jobs);
+  return 1;
+}
+
+int init_job(job *j, const char *device_id, const struct tm start,
+             const struct tm end, const char *output) {
+  memset(j, 0, sizeof(job));
+  int n = snprintf(j->device_id, sizeof(j->device_id), "%s", device_id);
+  if (n >= sizeof(j->device_id)) {
+    fprintf(stderr, "error: device ID too long\n");
+    return 1;
+  }
+  j->start = start;
+  j->end = end;
+  j->fd = -1;
+  if (output != NULL) {
+    n = snprintf(j->output, sizeof(j->output), "%s", output);
+    if (n >= sizeof(j->output)) {
+      fprintf(stderr, "error: filename too long\n");
+      return 1;
     }
-    if (state == FAILED) {
-      // 処理失敗
-      fprintf(stderr, "error: server reported media creation failed\n");
-      goto error;
+  }
+
+  char dt[32];
+  strftime(dt, sizeof(dt), "%Y-%m-%dT%H:%M:%S", &start);
+  snprintf(j->label, sizeof(j->label), "%s@%s", device_id, dt);
+  j->phase = PHASE_PENDING;
+  return 0;
+}
+
+int load_jobs(const char *path, job **jobs, int *njobs) {
+  FILE *fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open job list: %s\n", strerror(errno));
+    return 1;
+  }
+
+  // 1行ごとに `DEVICEID START END [OUTPUT]` を読む, `#` 以降はコメント
+  char line[1024];
+  int lineno = 0;
+  int capacity = 0;
+  *jobs = NULL;
+  *njobs = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
     }
-    if (state == PROCESSING) {
-      // 処理中
+
+    char device_id[64], start_str[32], end_str[32], output[256];
+    int n = sscanf(line, "%63s %31s %31s %255s", device_id, start_str,
+                   end_str, output);
+    if (n <= 0) {
+      // 空行
       continue;
     }
 
-    char filename[256];
-    int n = snprintf(filename, sizeof(filename), "%s/%d.mp4", output_dir,
-                     request_id);
-    if (n >= sizeof(filename)) {
-      fprintf(stderr, "error: filename too long\n");
+    struct tm start, end;
+    memset(&start, 0, sizeof(struct tm));
+    memset(&end, 0, sizeof(struct tm));
+    if (n < 3 || strptime(start_str, "%Y-%m-%dT%H:%M:%S", &start) == NULL ||
+        strptime(end_str, "%Y-%m-%dT%H:%M:%S", &end) == NULL) {
+      fprintf(stderr, "error: invalid job at %s:%d\n", path, lineno);
       goto error;
     }
 
-    fp = fopen(filename, "w");
-    if (fp == NULL) {
-      fprintf(stderr, "error: failed to open file: %s\n", strerror(errno));
-      goto error;
+    if (*njobs == capacity) {
+      capacity = (capacity == 0) ? 16 : capacity * 2;
+      CHECK_NULL(*jobs = (job *)realloc(*jobs, capacity * sizeof(job)));
     }
-
-    // ファイルをダウンロードする
-    fprintf(stderr, "downloading media file to %s\n", filename);
-    rc = download_mediafile(api_key, file_url, fp, verbosity);
-    if (rc != 0) {
+    if (init_job(&(*jobs)[*njobs], device_id, start, end,
+                 (n >= 4) ? output : NULL) != 0) {
+      fprintf(stderr, "error: invalid job at %s:%d\n", path, lineno);
       goto error;
     }
-    fclose(fp);
-    fp = NULL;
-    break;
+    (*njobs)++;
   }
-  if (i >= 10) {
-    fprintf(stderr, "media creation did not complete in 300 sec\n");
+  if (*njobs == 0) {
+    fprintf(stderr, "error: no job found in %s\n", path);
     goto error;
   }
 
-  free(file_url);
+  if (fp != stdin) {
+    fclose(fp);
+  }
   return 0;
 
 error:
-  free(file_url);
-  if (fp != NULL) {
+  if (fp != stdin) {
     fclose(fp);
   }
   return 1;
 }
 
-int post_request(const char *api_key, const char *device_id,
-                 const struct tm start, const struct tm end, int *request_id,
-                 int verbosity) {
-  struct curl_slist *headers = NULL;
-  cJSON *req = NULL;
-  buffer buf = {NULL, 0, 16384};
-  CURL *curl = NULL;
-  cJSON *res = NULL;
-  CHECK_NULL(buf.data = (char *)malloc(16384));
+/// @brief 単調増加時計の現在時刻 [sec] を返します
+static double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  // リクエストURL
-  char url[256];
-  int n;
-  n = snprintf(url, sizeof(url),
-               "https://openapi.safie.link/v2/devices/%s/media_files/requests",
-               device_id);
-  if (n >= sizeof(url)) {
-    fprintf(stderr, "error: url too long\n");
-    goto error;
+/// @brief 次の作成状況取得を予約します
+/// @param j [IN/OUT] ジョブ
+/// @param retry_after [IN] サーバが指定した待ち時間 [sec], 指定がないとき `0`
+/// @return 終了コード, 期限を過ぎているとき `1`
+static int schedule_poll(job *j, double retry_after) {
+  double now = monotonic_now();
+  if (j->poll_deadline <= now) {
+    fprintf(stderr, "%s: media creation did not complete in %.0f sec\n",
+            j->label, now - j->requested_at);
+    return 1;
   }
 
-  // Authorizationおよびほかのヘッダ
-  char auth[64];
-  n = snprintf(auth, sizeof(auth), "Safie-API-Key: %s", api_key);
-  if (n >= sizeof(auth)) {
-    fprintf(stderr, "error: api-key too long\n");
-    goto error;
+  // 指数バックオフにゆらぎを加え, サーバの指定があればそれ以上待つ
+  double wait = j->poll_interval *
+                (1.0 + POLL_JITTER * (2.0 * drand48() - 1.0));
+  if (wait < retry_after) {
+    wait = retry_after;
   }
-  headers = curl_slist_append(headers, auth);
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-
-  // リクエストボディ
-  CHECK_NULL(req = cJSON_CreateObject());
-  {
-    char dt[32];
-    strftime(dt, sizeof(dt), "%Y-%m-%dT%H:%M:%S%z", &start);
-    // strftimeの%zをRFC3339のtime-numoffsetに変更
-    memmove(dt + 23, dt + 22, 3);
-    dt[22] = ':';
-    CHECK_NULL(cJSON_AddStringToObject(req, "start", dt));
+  if (now + wait > j->poll_deadline) {
+    wait = j->poll_deadline - now;
   }
-  {
-    char dt[32];
-    strftime(dt, sizeof(dt), "%Y-%m-%dT%H:%M:%S%z", &end);
-    // strftimeの%zをRFC3339のtime-numoffsetに変更
-    memmove(dt + 23, dt + 22, 3);
-    dt[22] = ':';
-    CHECK_NULL(cJSON_AddStringToObject(req, "end", dt));
+  j->poll_interval *= POLL_BACKOFF;
+  if (j->poll_interval > POLL_INTERVAL_MAX) {
+    j->poll_interval = POLL_INTERVAL_MAX;
   }
 
-  curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, cJSON_PrintUnformatted(req));
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_curl_write_buffer);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-  curl_easy_setopt(curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
-  curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
-
-  CURLcode ret;
-  ret = curl_easy_perform(curl);
-  if (ret != CURLE_OK) {
-    fprintf(stderr, "error: curl failed: %d: %s\n", ret,
-            curl_easy_strerror(ret));
-    goto error;
+  fprintf(stderr, "%s: awaiting %.1f sec to complete...\n", j->label, wait);
+  j->next_poll = now + wait;
+  j->phase = PHASE_WAIT;
+  return 0;
+}
+
+/// @brief 応答の `Retry-After` ヘッダの値 [sec] を返します, 指定がないとき `0`
+static double retry_after_of(CURL *curl) {
+  curl_off_t retry_after = 0;
+  if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after) !=
+      CURLE_OK) {
+    return 0.0;
   }
+  return (double)retry_after;
+}
 
-  // レスポンスの処理
-  CHECK_NULL(res = cJSON_Parse(buf.data));
-  cJSON *el;
-  el = cJSON_GetObjectItemCaseSensitive(res, "request_id");
-  if (!cJSON_IsNumber(el)) {
-    fprintf(stderr, "error: invalid response\n");
-    goto error;
+/// @brief ダウンロード中の区間と出力ファイルを解放します
+static void cleanup_download(CURLM *multi, job *j) {
+  for (int i = 0; i < j->nsegs; i++) {
+    if (j->segs[i].xfer.curl != NULL) {
+      curl_multi_remove_handle(multi, j->segs[i].xfer.curl);
+    }
+    transfer_cleanup(&j->segs[i].xfer);
   }
-  *request_id = el->valueint;
+  free(j->segs);
+  j->segs = NULL;
+  j->nsegs = 0;
+  if (j->fd >= 0) {
+    close(j->fd);
+    j->fd = -1;
+  }
+  // 途中で終了したときは不完全な出力であることを出力先に伝える
+  output_sink_close(j->sink, 1);
+  j->sink = NULL;
+  checksum_cleanup(&j->sum);
+}
 
-  cJSON_Delete(res);
-  free(buf.data);
-  curl_easy_cleanup(curl);
-  cJSON_Delete(req);
-  curl_slist_free_all(headers);
+/// @brief 先頭から連続して書き込み済みの範囲のチェックサムを計算します
+/// 区間は並列に受信されるため, 受信時に計算できなかった範囲はファイルから読み直す
+/// @param j [IN/OUT] ジョブ
+/// @param limit [IN] 計算する範囲の終端
+/// @return 終了コード, `0` のとき正常終了
+static int update_checksum(job *j, curl_off_t limit) {
+  if (!checksum_enabled(&j->sum)) {
+    return 0;
+  }
+  // 未受信の範囲の手前までに限る
+  for (int i = 0; i < j->nsegs; i++) {
+    segment *seg = &j->segs[i];
+    int pending = (seg->end < 0 || seg->offset < seg->end);
+    if (pending && (seg->end < 0 || j->sum.offset < seg->end)) {
+      curl_off_t first =
+          (seg->offset > j->sum.offset) ? seg->offset : j->sum.offset;
+      if (first < limit) {
+        limit = first;
+      }
+    }
+  }
+  if (checksum_read(&j->sum, j->fd, limit) != 0) {
+    fprintf(stderr, "%s: error: failed to compute checksum\n", j->label);
+    return 1;
+  }
   return 0;
+}
 
-error:
-  cJSON_Delete(res);
-  free(buf.data);
-  curl_easy_cleanup(curl);
-  cJSON_Delete(req);
-  curl_slist_free_all(headers);
-  return 1;
+/// @brief 計算したチェックサムをサーバが提示した値と照合します
+/// 応答ヘッダでSHA-256が提示されていないときはETagを照合に使う
+/// @param j [IN/OUT] ジョブ
+/// @param sha256 [IN] 計算したSHA-256, 計算していないとき空
+/// @param crc32c [IN] 計算したCRC32C
+/// @param has_crc32c [IN] CRC32Cを計算したとき `1`
+/// @return 終了コード, `0` のとき正常終了
+static int verify_checksum(job *j, const char *sha256, uint32_t crc32c,
+                           int has_crc32c) {
+  if (j->expect.sha256[0] == '\0') {
+    checksum_parse_etag(j->etag, &j->expect);
+  }
+  int sha256_verified = 0;
+  if (sha256[0] != '\0' && j->expect.sha256[0] != '\0') {
+    if (strcmp(sha256, j->expect.sha256) != 0) {
+      fprintf(stderr, "%s: error: SHA-256 mismatch: expected %s, got %s\n",
+              j->label, j->expect.sha256, sha256);
+      return 1;
+    }
+    sha256_verified = 1;
+  }
+  int crc32c_verified = 0;
+  if (has_crc32c && j->expect.has_crc32c) {
+    if (crc32c != j->expect.crc32c) {
+      fprintf(stderr, "%s: error: CRC32C mismatch: expected %08x, got %08x\n",
+              j->label, j->expect.crc32c, crc32c);
+      return 1;
+    }
+    crc32c_verified = 1;
+  }
+  if (sha256[0] != '\0') {
+    fprintf(stderr, "%s: sha256 %s (%s)\n", j->label, sha256,
+            sha256_verified ? "verified" : "no checksum from server");
+  }
+  if (has_crc32c) {
+    fprintf(stderr, "%s: crc32c %08x (%s)\n", j->label, crc32c,
+            crc32c_verified ? "verified" : "no checksum from server");
+  }
+  return 0;
 }
 
-int get_request(const char *api_key, const char *device_id, int request_id,
-                enum State *state, char **file_url, int verbosity) {
-  struct curl_slist *headers = NULL;
-  CURL *curl = NULL;
-  buffer buf = {NULL, 0, 16384};
-  cJSON *res = NULL;
-  CHECK_NULL(buf.data = (char *)malloc(16384));
+/// @brief チェックサムを `sha256sum -c` で検証できる形式で書き込みます
+/// @param j [IN] ジョブ
+/// @param sha256 [IN] SHA-256の16進文字列
+/// @return 終了コード, `0` のとき正常終了
+static int write_checksum_file(job *j, const char *sha256) {
+  char path[sizeof(j->path) + 8];
+  snprintf(path, sizeof(path), "%s.sha256", j->path);
+  const char *name = strrchr(j->path, '/');
+  name = (name != NULL) ? name + 1 : j->path;
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "%s: error: failed to write %s: %s\n", j->label, path,
+            strerror(errno));
+    return 1;
+  }
+  int written = fprintf(fp, "%s  %s\n", sha256, name);
+  if (fclose(fp) != 0 || written < 0) {
+    fprintf(stderr, "%s: error: failed to write %s: %s\n", j->label, path,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
 
-  char url[256];
+/// @brief ジョブのジャーナルのパスを決めます
+/// 出力ファイルの指定がないときは作成要求前に探せるようデバイスIDと日時から決める
+static int journal_path(job *j, const config *cfg) {
   int n;
-  n = snprintf(
-      url, sizeof(url),
-      "https://openapi.safie.link/v2/devices/%s/media_files/requests/%d",
-      device_id, request_id);
+  if (j->output[0] != '\0') {
+    n = snprintf(j->journal, sizeof(j->journal), "%s.journal", j->output);
+  } else {
+    char start[32], end[32];
+    strftime(start, sizeof(start), "%Y%m%dT%H%M%S", &j->start);
+    strftime(end, sizeof(end), "%Y%m%dT%H%M%S", &j->end);
+    n = snprintf(j->journal, sizeof(j->journal), "%s/%s_%s_%s.journal",
+                 cfg->output_dir, j->device_id, start, end);
+  }
+  if (n >= sizeof(j->journal)) {
+    fprintf(stderr, "%s: error: filename too long\n", j->label);
+    return 1;
+  }
+  return 0;
+}
+
+/// @brief ダウンロードの進捗をジャーナルに保存します
+/// 受信済みのデータをディスクに書き出してから, 完了した範囲を記録する
+/// @return 終了コード, `0` のとき正常終了
+static int save_journal(job *j) {
+  if (!j->resumable || !j->split || j->fd < 0) {
+    return 0;
+  }
+  if (fdatasync(j->fd) != 0) {
+    fprintf(stderr, "%s: error: failed to sync file: %s\n", j->label,
+            strerror(errno));
+    return 1;
+  }
+
+  // 未完了の範囲を位置の順に並べ, その間を完了した範囲とする
+  int npending = 0;
+  curl_off_t(*pending)[2] =
+      (curl_off_t(*)[2])calloc(j->nsegs + 1, sizeof(*pending));
+  if (pending == NULL) {
+    fprintf(stderr, "%s: error: out of memory\n", j->label);
+    return 1;
+  }
+  for (int i = 0; i < j->nsegs; i++) {
+    segment *seg = &j->segs[i];
+    if (seg->offset >= seg->end) {
+      continue;
+    }
+    int k = npending++;
+    while (k > 0 && pending[k - 1][0] > seg->offset) {
+      pending[k][0] = pending[k - 1][0];
+      pending[k][1] = pending[k - 1][1];
+      k--;
+    }
+    pending[k][0] = seg->offset;
+    pending[k][1] = seg->end;
+  }
+
+  cJSON *journal = NULL;
+  char *text = NULL;
+  FILE *fp = NULL;
+  char tmp[sizeof(j->journal) + 4];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", j->journal);
+
+  CHECK_NULL(journal = cJSON_CreateObject());
+  CHECK_NULL(cJSON_AddNumberToObject(journal, "request_id", j->request_id));
+  CHECK_NULL(cJSON_AddStringToObject(journal, "url", j->file_url));
+  CHECK_NULL(cJSON_AddStringToObject(journal, "path", j->path));
+  CHECK_NULL(cJSON_AddNumberToObject(journal, "size", (double)j->size));
+  CHECK_NULL(cJSON_AddStringToObject(journal, "etag", j->etag));
+  CHECK_NULL(
+      cJSON_AddStringToObject(journal, "last_modified", j->last_modified));
+  cJSON *completed;
+  CHECK_NULL(completed = cJSON_AddArrayToObject(journal, "completed"));
+  curl_off_t pos;
+  pos = 0;
+  for (int i = 0; i <= npending; i++) {
+    curl_off_t next = (i < npending) ? pending[i][0] : j->size;
+    if (pos < next) {
+      cJSON *range;
+      CHECK_NULL(range = cJSON_CreateArray());
+      cJSON_AddItemToArray(completed, range);
+      cJSON_AddItemToArray(range, cJSON_CreateNumber((double)pos));
+      cJSON_AddItemToArray(range, cJSON_CreateNumber((double)next));
+    }
+    if (i < npending) {
+      pos = pending[i][1];
+    }
+  }
+  CHECK_NULL(text = cJSON_Print(journal));
+
+  // 書きかけのジャーナルが残らないよう一時ファイルから置き換える
+  fp = fopen(tmp, "w");
+  if (fp == NULL || fputs(text, fp) < 0 || fflush(fp) != 0 ||
+      fsync(fileno(fp)) != 0) {
+    fprintf(stderr, "%s: error: failed to write journal: %s\n", j->label,
+            strerror(errno));
+    goto error;
+  }
+  fclose(fp);
+  fp = NULL;
+  if (rename(tmp, j->journal) != 0) {
+    fprintf(stderr, "%s: error: failed to write journal: %s\n", j->label,
+            strerror(errno));
+    goto error;
+  }
+  j->next_journal = monotonic_now() + JOURNAL_INTERVAL;
+
+  free(pending);
+  cJSON_free(text);
+  cJSON_Delete(journal);
+  return 0;
+
+error:
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  free(pending);
+  cJSON_free(text);
+  cJSON_Delete(journal);
+  return 1;
+}
+
+/// @brief ジャーナルを読み込みジョブに中断したダウンロードを復元します
+/// @param j [IN/OUT] ジョブ
+/// @param completed [OUT] 完了した範囲の配列, 呼び出し側で `free` すること
+/// @param ncompleted [OUT] 完了した範囲の数
+/// @return ジャーナルを読み込んだとき `0`
+static int load_journal(job *j, curl_off_t (**completed)[2],
+                        int *ncompleted) {
+  cJSON *journal = NULL;
+  char *text = NULL;
+  *completed = NULL;
+  *ncompleted = 0;
+
+  FILE *fp = fopen(j->journal, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+  long length;
+  if (fseek(fp, 0, SEEK_END) != 0 || (length = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) != 0) {
+    fclose(fp);
+    return 1;
+  }
+  text = (char *)calloc(length + 1, 1);
+  if (text == NULL || fread(text, 1, length, fp) != (size_t)length) {
+    fclose(fp);
+    free(text);
+    return 1;
+  }
+  fclose(fp);
+
+  cJSON *el_request_id, *el_url, *el_path, *el_size, *el_etag,
+      *el_last_modified, *el_completed, *el_range;
+  journal = cJSON_Parse(text);
+  if (journal == NULL) {
+    fprintf(stderr, "%s: warning: ignoring invalid journal %s\n", j->label,
+            j->journal);
+    goto error;
+  }
+  el_request_id = cJSON_GetObjectItemCaseSensitive(journal, "request_id");
+  el_url = cJSON_GetObjectItemCaseSensitive(journal, "url");
+  el_path = cJSON_GetObjectItemCaseSensitive(journal, "path");
+  el_size = cJSON_GetObjectItemCaseSensitive(journal, "size");
+  el_etag = cJSON_GetObjectItemCaseSensitive(journal, "etag");
+  el_last_modified = cJSON_GetObjectItemCaseSensitive(journal, "last_modified");
+  el_completed = cJSON_GetObjectItemCaseSensitive(journal, "completed");
+  if (!cJSON_IsNumber(el_request_id) || !cJSON_IsString(el_url) ||
+      !cJSON_IsString(el_path) || !cJSON_IsNumber(el_size) ||
+      !cJSON_IsString(el_etag) || !cJSON_IsString(el_last_modified) ||
+      !cJSON_IsArray(el_completed) ||
+      strlen(el_path->valuestring) >= sizeof(j->path) ||
+      strlen(el_etag->valuestring) >= sizeof(j->etag) ||
+      strlen(el_last_modified->valuestring) >= sizeof(j->last_modified)) {
+    fprintf(stderr, "%s: warning: ignoring invalid journal %s\n", j->label,
+            j->journal);
+    goto error;
+  }
+
+  CHECK_NULL(*completed = (curl_off_t(*)[2])calloc(
+                 cJSON_GetArraySize(el_completed) + 1, sizeof(**completed)));
+  cJSON_ArrayForEach(el_range, el_completed) {
+    cJSON *first = cJSON_GetArrayItem(el_range, 0);
+    cJSON *last = cJSON_GetArrayItem(el_range, 1);
+    if (!cJSON_IsNumber(first) || !cJSON_IsNumber(last)) {
+      fprintf(stderr, "%s: warning: ignoring invalid journal %s\n", j->label,
+              j->journal);
+      goto error;
+    }
+    (*completed)[*ncompleted][0] = (curl_off_t)first->valuedouble;
+    (*completed)[*ncompleted][1] = (curl_off_t)last->valuedouble;
+    (*ncompleted)++;
+  }
+
+  j->request_id = el_request_id->valueint;
+  free(j->file_url);
+  CHECK_NULL(j->file_url = strdup(el_url->valuestring));
+  strcpy(j->path, el_path->valuestring);
+  j->size = (curl_off_t)el_size->valuedouble;
+  strcpy(j->etag, el_etag->valuestring);
+  strcpy(j->last_modified, el_last_modified->valuestring);
+
+  cJSON_Delete(journal);
+  free(text);
+  return 0;
+
+error:
+  free(*completed);
+  *completed = NULL;
+  *ncompleted = 0;
+  cJSON_Delete(journal);
+  free(text);
+  return 1;
+}
+
+/// @brief ジョブを異常終了とし使用中のリソースを解放します
+/// ダウンロード中のときはジャーナルを保存し次回の実行で再開できるようにする
+static void fail_job(CURLM *multi, job *j) {
+  if (j->xfer.curl != NULL) {
+    curl_multi_remove_handle(multi, j->xfer.curl);
+  }
+  transfer_cleanup(&j->xfer);
+  if (j->phase == PHASE_DOWNLOAD && j->resumable && save_journal(j) == 0) {
+    fprintf(stderr, "%s: download can be resumed from %s\n", j->label,
+            j->journal);
+  }
+  cleanup_download(multi, j);
+  free(j->file_url);
+  j->file_url = NULL;
+  j->phase = PHASE_ERROR;
+}
+
+/// @brief 準備されたHTTP要求をmultiハンドルに登録します
+static int start_transfer(CURLM *multi, job *j, transfer *t) {
+  curl_easy_setopt(t->curl, CURLOPT_PRIVATE, j);
+  CURLMcode mc = curl_multi_add_handle(multi, t->curl);
+  if (mc != CURLM_OK) {
+    fprintf(stderr, "%s: error: curl multi failed: %d: %s\n", j->label, mc,
+            curl_multi_strerror(mc));
+    return 1;
+  }
+  return 0;
+}
+
+/// @brief ファイルを経由せずに出力先へ書き出すダウンロードを開始します
+/// 出力先には先頭から順に書き出す必要があるため, 分割と再開は行わない
+static int start_stream(CURLM *multi, job *j, const config *cfg) {
+  // コマンドにはジョブの情報を環境変数で渡す
+  char device_id[96], request_id[32], start[48], end[48];
+  snprintf(device_id, sizeof(device_id), "SAFIE_DEVICE_ID=%s", j->device_id);
+  snprintf(request_id, sizeof(request_id), "SAFIE_REQUEST_ID=%d",
+           j->request_id);
+  strftime(start, sizeof(start), "SAFIE_START=%Y-%m-%dT%H:%M:%S", &j->start);
+  strftime(end, sizeof(end), "SAFIE_END=%Y-%m-%dT%H:%M:%S", &j->end);
+  const char *vars[] = {device_id, request_id, start, end, NULL};
+  j->sink = output_sink_open(j->path, vars);
+  if (j->sink == NULL) {
+    return 1;
+  }
+
+  j->segs = (segment *)calloc(1, sizeof(segment));
+  if (j->segs == NULL) {
+    fprintf(stderr, "%s: error: out of memory\n", j->label);
+    return 1;
+  }
+  memset(&j->expect, 0, sizeof(j->expect));
+  if (checksum_init(&j->sum, cfg->checksum) != 0) {
+    return 1;
+  }
+  segment *seg = &j->segs[0];
+  seg->fd = -1;
+  seg->sink = j->sink;
+  seg->sum = &j->sum;
+  seg->limiter = cfg->limiter;
+  seg->offset = 0;
+  seg->end = -1;
+  seg->total = -1;
+  j->nsegs = 1;
+  j->split = 1;
+  j->size = -1;
+  j->resumable = 0;
+  j->phase = PHASE_DOWNLOAD;
+  if (download_mediafile(cfg->api_key, j->file_url, seg, NULL,
+                         cfg->verbosity) != 0) {
+    return 1;
+  }
+  return start_transfer(multi, j, &seg->xfer);
+}
+
+/// @brief メディアファイルのダウンロードを開始します
+/// サイズ確認を兼ねて最初の区間のみを要求し, 残りは `split_download` で要求する
+static int start_download(CURLM *multi, job *j, const config *cfg) {
+  if (output_sink_is_stream(j->path)) {
+    return start_stream(multi, j, cfg);
+  }
+  int n = snprintf(j->part, sizeof(j->part), "%s.part", j->path);
+  if (n >= sizeof(j->part)) {
+    fprintf(stderr, "%s: error: filename too long\n", j->label);
+    return 1;
+  }
+  // 受信時に計算できなかった範囲のチェックサムのために読み込みも可能にする
+  j->fd = open(j->part, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (j->fd < 0) {
+    fprintf(stderr, "%s: error: failed to open file: %s\n", j->label,
+            strerror(errno));
+    return 1;
+  }
+
+  j->segs = (segment *)calloc(1 + cfg->segments, sizeof(segment));
+  if (j->segs == NULL) {
+    fprintf(stderr, "%s: error: out of memory\n", j->label);
+    return 1;
+  }
+  memset(&j->expect, 0, sizeof(j->expect));
+  if (checksum_init(&j->sum, cfg->checksum) != 0) {
+    return 1;
+  }
+  segment *probe = &j->segs[0];
+  probe->fd = j->fd;
+  probe->sum = &j->sum;
+  probe->limiter = cfg->limiter;
+  probe->offset = 0;
+  // 分割しないときも中断後に再開できるよう, 末尾までのRange要求で全体を要求する
+  probe->end = (cfg->segments > 1) ? SEGMENT_MIN_SIZE : -1;
+  probe->total = -1;
+  j->nsegs = 1;
+  j->split = 0;
+  j->size = -1;
+  j->phase = PHASE_DOWNLOAD;
+  if (download_mediafile(cfg->api_key, j->file_url, probe, NULL,
+                         cfg->verbosity) != 0) {
+    return 1;
+  }
+  return start_transfer(multi, j, &probe->xfer);
+}
+
+/// @brief 最初の区間の応答を元に残りの区間を分割して並列に要求します
+static int split_download(CURLM *multi, job *j, const config *cfg) {
+  segment *probe = &j->segs[0];
+  j->split = 1;
+  j->size = probe->total;
+  strcpy(j->etag, probe->etag);
+  strcpy(j->last_modified, probe->last_modified);
+  if (!probe->ranged) {
+    // Range要求に応じないサーバでは1本のまま受信する
+    return 0;
+  }
+  j->resumable = 1;
+  if (probe->total <= probe->end) {
+    // 最初の区間で全体を取得済み
+    return 0;
+  }
+
+  curl_off_t rest = probe->total - probe->end;
+  curl_off_t n = cfg->segments;
+  if (rest < n * SEGMENT_MIN_SIZE) {
+    n = (rest + SEGMENT_MIN_SIZE - 1) / SEGMENT_MIN_SIZE;
+  }
+  curl_off_t size = rest / n;
+  for (int i = 0; i < n; i++) {
+    segment *seg = &j->segs[j->nsegs];
+    seg->fd = j->fd;
+    seg->sum = &j->sum;
+    seg->limiter = cfg->limiter;
+    seg->offset = probe->end + i * size;
+    seg->begin = seg->offset;
+    seg->end = (i == n - 1) ? probe->total : seg->offset + size;
+    seg->total = probe->total;
+    j->nsegs++;
+    if (download_mediafile(cfg->api_key, j->file_url, seg, NULL,
+                           cfg->verbosity) != 0) {
+      return 1;
+    }
+    if (start_transfer(multi, j, &seg->xfer) != 0) {
+      return 1;
+    }
+  }
+  return save_journal(j);
+}
+
+/// @brief ジャーナルに記録された未完了の範囲のダウンロードを再開します
+/// 前回から変わったファイルを受信しないよう, 各区間はIf-Rangeを付けて要求する
+static int resume_download(CURLM *multi, job *j, const config *cfg,
+                           curl_off_t (*completed)[2], int ncompleted) {
+  j->fd = open(j->part, O_RDWR);
+  if (j->fd < 0) {
+    fprintf(stderr, "%s: error: failed to open file: %s\n", j->label,
+            strerror(errno));
+    return 1;
+  }
+
+  // 完了した範囲の間を未完了の区間とする
+  j->segs = (segment *)calloc(1 + cfg->segments + ncompleted, sizeof(segment));
+  if (j->segs == NULL) {
+    fprintf(stderr, "%s: error: out of memory\n", j->label);
+    return 1;
+  }
+  memset(&j->expect, 0, sizeof(j->expect));
+  if (checksum_init(&j->sum, cfg->checksum) != 0) {
+    return 1;
+  }
+  j->nsegs = 0;
+  j->split = 1;
+  j->resumable = 1;
+  j->resumed = 1;
+  j->phase = PHASE_DOWNLOAD;
+  const char *if_range = (j->etag[0] != '\0') ? j->etag : j->last_modified;
+  curl_off_t pos = 0;
+  curl_off_t remaining = 0;
+  for (int i = 0; i <= ncompleted; i++) {
+    curl_off_t next = (i < ncompleted) ? completed[i][0] : j->size;
+    if (pos < next) {
+      segment *seg = &j->segs[j->nsegs++];
+      seg->fd = j->fd;
+      seg->sum = &j->sum;
+      seg->limiter = cfg->limiter;
+      seg->offset = pos;
+      seg->begin = pos;
+      seg->end = next;
+      seg->total = j->size;
+      seg->conditional = (if_range[0] != '\0');
+      remaining += next - pos;
+      if (download_mediafile(cfg->api_key, j->file_url, seg,
+                             seg->conditional ? if_range : NULL,
+                             cfg->verbosity) != 0 ||
+          start_transfer(multi, j, &seg->xfer) != 0) {
+        return 1;
+      }
+    }
+    if (i < ncompleted) {
+      pos = completed[i][1];
+    }
+  }
+  fprintf(stderr, "%s: resuming download to %s (%lld of %lld bytes left)\n",
+          j->label, j->path, (long long)remaining, (long long)j->size);
+  j->next_journal = monotonic_now() + JOURNAL_INTERVAL;
+  // 前回までに受信した先頭の範囲のチェックサムを計算しておく
+  return update_checksum(j, j->size);
+}
+
+/// @brief 出力先への書き出しを完了します
+/// チェックサムが一致しないときは不完全な出力として出力先を閉じる
+static int finish_stream(CURLM *multi, job *j) {
+  curl_off_t size = j->segs[0].offset;
+  strcpy(j->etag, j->segs[0].etag);
+  char sha256[65] = "";
+  uint32_t crc32c = 0;
+  int has_checksum = checksum_enabled(&j->sum);
+  int has_crc32c = j->sum.crc32c_enabled;
+  if (has_checksum && checksum_final(&j->sum, sha256, &crc32c) != 0) {
+    return 1;
+  }
+
+  int ret = output_sink_drain(j->sink);
+  if (ret == 0 && has_checksum) {
+    ret = verify_checksum(j, sha256, crc32c, has_crc32c);
+  }
+  if (output_sink_close(j->sink, ret != 0) != 0) {
+    ret = 1;
+  }
+  j->sink = NULL;
+  cleanup_download(multi, j);
+  if (ret != 0) {
+    return 1;
+  }
+  free(j->file_url);
+  j->file_url = NULL;
+  fprintf(stderr, "%s: streamed media file to %s (%lld bytes)\n", j->label,
+          j->path, (long long)size);
+  j->phase = PHASE_DONE;
+  return 0;
+}
+
+/// @brief 出力先へバッファのデータを書き出し, 空きができたら一時停止していた受信を再開します
+/// @param j [IN/OUT] ストリームに出力中のジョブ
+/// @param wfd [OUT] 出力先が書き込み可能になるのを待つとき設定される
+/// @param next_wakeup [IN/OUT] 名前付きパイプの読み込み側を待つとき,
+/// 開き直す時刻 (`monotonic_now`) [sec] まで早める
+/// @return 待つとき `1`, 待たないとき `0`, エラーのとき `-1`
+static int pump_stream(job *j, struct curl_waitfd *wfd, double *next_wakeup) {
+  segment *seg = &j->segs[0];
+  if (output_sink_flush(j->sink) != 0) {
+    return -1;
+  }
+  if (seg->paused && output_sink_pending(j->sink) <= OUTPUT_SINK_RESUME_SIZE) {
+    seg->paused = 0;
+    curl_easy_pause(seg->xfer.curl, CURLPAUSE_CONT);
+  }
+  if (output_sink_pending(j->sink) == 0) {
+    return 0;
+  }
+  if (output_sink_fd(j->sink) < 0) {
+    double retry_at = monotonic_now() + OUTPUT_SINK_RETRY_INTERVAL_MS / 1e3;
+    if (retry_at < *next_wakeup) {
+      *next_wakeup = retry_at;
+    }
+    return 0;
+  }
+  wfd->fd = output_sink_fd(j->sink);
+  wfd->events = CURL_WAIT_POLLOUT;
+  wfd->revents = 0;
+  return 1;
+}
+
+/// @brief ダウンロードを完了し, 出力ファイルを最終的な名前に置き換えます
+static int finish_download(CURLM *multi, job *j) {
+  if (j->sink != NULL) {
+    return finish_stream(multi, j);
+  }
+  curl_off_t size = j->size;
+  for (int i = 0; i < j->nsegs; i++) {
+    if (size < j->segs[i].end) {
+      size = j->segs[i].end;
+    }
+  }
+
+  // 受信時に計算できなかった範囲を読み直してチェックサムを完了する
+  char sha256[65] = "";
+  uint32_t crc32c = 0;
+  int has_checksum = checksum_enabled(&j->sum);
+  int has_crc32c = j->sum.crc32c_enabled;
+  if (has_checksum && (update_checksum(j, size) != 0 ||
+                       checksum_final(&j->sum, sha256, &crc32c) != 0)) {
+    return 1;
+  }
+
+  int nsegs = j->nsegs;
+  int ret = fdatasync(j->fd);
+  ret |= close(j->fd);
+  j->fd = -1;
+  j->resumable = 0;
+  cleanup_download(multi, j);
+  if (ret != 0) {
+    fprintf(stderr, "%s: error: failed to close file: %s\n", j->label,
+            strerror(errno));
+    return 1;
+  }
+  if (has_checksum && verify_checksum(j, sha256, crc32c, has_crc32c) != 0) {
+    // 破損したファイルは残さず, 次回は最初からダウンロードする
+    unlink(j->part);
+    unlink(j->journal);
+    return 1;
+  }
+  if (rename(j->part, j->path) != 0) {
+    fprintf(stderr, "%s: error: failed to rename file: %s\n", j->label,
+            strerror(errno));
+    return 1;
+  }
+  if (sha256[0] != '\0' && write_checksum_file(j, sha256) != 0) {
+    return 1;
+  }
+  unlink(j->journal);
+  free(j->file_url);
+  j->file_url = NULL;
+  fprintf(stderr, "%s: downloaded media file to %s (%lld bytes, %d segments)\n",
+          j->label, j->path, (long long)size, nsegs);
+  j->phase = PHASE_DONE;
+  return 0;
+}
+
+/// @brief ジョブを開始します
+/// 中断したダウンロードのジャーナルがあれば作成要求をせずにダウンロードを再開する
+static int start_job(CURLM *multi, job *j, const config *cfg) {
+  curl_off_t(*completed)[2];
+  int ncompleted;
+  // ストリームへの出力は再開できない
+  if (!(j->output[0] != '\0' && output_sink_is_stream(j->output)) &&
+      load_journal(j, &completed, &ncompleted) == 0) {
+    int n = snprintf(j->part, sizeof(j->part), "%s.part", j->path);
+    struct stat st;
+    if (n < sizeof(j->part) && access(j->part, W_OK) == 0) {
+      int ret = resume_download(multi, j, cfg, completed, ncompleted);
+      free(completed);
+      if (ret == 0 && j->nsegs == 0) {
+        return finish_download(multi, j);
+      }
+      return ret;
+    }
+    free(completed);
+    if (stat(j->path, &st) == 0 && st.st_size == j->size) {
+      // 完了後にジャーナルの削除だけが行われなかったとき
+      unlink(j->journal);
+      fprintf(stderr, "%s: already downloaded to %s\n", j->label, j->path);
+      j->phase = PHASE_DONE;
+      return 0;
+    }
+    unlink(j->journal);
+  }
+
+  fprintf(stderr, "%s: requesting media file creation\n", j->label);
+  j->phase = PHASE_POST;
+  if (post_request(cfg->api_key, j->device_id, j->start, j->end, &j->xfer,
+                   cfg->verbosity) != 0) {
+    return 1;
+  }
+  return start_transfer(multi, j, &j->xfer);
+}
+
+/// @brief 再開したダウンロードを破棄し, 作成要求からやり直します
+static int restart_job(CURLM *multi, job *j, const config *cfg) {
+  cleanup_download(multi, j);
+  unlink(j->part);
+  unlink(j->journal);
+  free(j->file_url);
+  j->file_url = NULL;
+  j->resumable = 0;
+  j->resumed = 0;
+  j->etag[0] = '\0';
+  j->last_modified[0] = '\0';
+  j->polls = 0;
+  return start_job(multi, j, cfg);
+}
+
+/// @brief 区間のダウンロード完了を処理し, すべて完了したらジョブを終了します
+static int on_segment_done(CURLM *multi, job *j, CURL *easy, CURLcode result,
+                           const config *cfg) {
+  segment *seg = NULL;
+  for (int i = 0; i < j->nsegs; i++) {
+    if (j->segs[i].xfer.curl == easy) {
+      seg = &j->segs[i];
+    }
+  }
+  if (seg == NULL) {
+    fprintf(stderr, "%s: error: unexpected transfer\n", j->label);
+    return 1;
+  }
+  curl_multi_remove_handle(multi, easy);
+  long response_code = 0;
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response_code);
+  transfer_cleanup(&seg->xfer);
+  if (result != CURLE_OK && j->resumed &&
+      (seg->changed || (400 <= response_code && response_code < 500))) {
+    // ファイルが変わっているか取得できなくなっているときは最初からやり直す
+    fprintf(stderr, "%s: media file changed or expired, starting over\n",
+            j->label);
+    return restart_job(multi, j, cfg);
+  }
+  if (result != CURLE_OK) {
+    fprintf(stderr, "%s: error: curl failed: %d: %s\n", j->label, result,
+            curl_easy_strerror(result));
+    return 1;
+  }
+  if (!seg->ranged || seg->end < 0) {
+    seg->end = (seg->total >= 0) ? seg->total : seg->offset;
+  } else if (seg->total < seg->end) {
+    // 最初の区間がファイル全体より長かったとき
+    seg->end = seg->total;
+  }
+  if (seg->offset != seg->end) {
+    fprintf(stderr, "%s: error: incomplete segment\n", j->label);
+    return 1;
+  }
+  if (j->expect.sha256[0] == '\0') {
+    strcpy(j->expect.sha256, seg->expect.sha256);
+  }
+  if (!j->expect.has_crc32c && seg->expect.has_crc32c) {
+    j->expect.has_crc32c = 1;
+    j->expect.crc32c = seg->expect.crc32c;
+  }
+  if (!j->split && split_download(multi, j, cfg) != 0) {
+    return 1;
+  }
+  if (update_checksum(j, j->size) != 0) {
+    return 1;
+  }
+
+  for (int i = 0; i < j->nsegs; i++) {
+    if (j->segs[i].xfer.curl != NULL) {
+      // 受信中の区間が残っている
+      return save_journal(j);
+    }
+  }
+  return finish_download(multi, j);
+}
+
+/// @brief ジョブの段階に対応するHTTPメトリクスのエンドポイント名を返します
+static const char *endpoint_name(enum Phase phase) {
+  switch (phase) {
+  case PHASE_POST:
+    return "POST /v2/devices/{device_id}/media_files/requests";
+  case PHASE_GET:
+    return "GET /v2/devices/{device_id}/media_files/requests/{request_id}";
+  default:
+    return "GET media_file";
+  }
+}
+
+/// @brief HTTP要求の完了を処理しジョブを次の段階に進めます
+static int on_transfer_done(CURLM *multi, job *j, CURL *easy, CURLcode result,
+                            const config *cfg) {
+  if (j->phase == PHASE_DOWNLOAD) {
+    return on_segment_done(multi, j, easy, result, cfg);
+  }
+
+  curl_multi_remove_handle(multi, j->xfer.curl);
+  if (result == CURLE_HTTP_RETURNED_ERROR && j->phase == PHASE_GET) {
+    // 混雑による一時的なエラーのときは期限まで取得を続ける
+    long response_code = 0;
+    curl_easy_getinfo(j->xfer.curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code == 429 || response_code == 503) {
+      double retry_after = retry_after_of(j->xfer.curl);
+      transfer_cleanup(&j->xfer);
+      fprintf(stderr, "%s: server busy: %ld\n", j->label, response_code);
+      return schedule_poll(j, retry_after);
+    }
+  }
+  if (result != CURLE_OK) {
+    fprintf(stderr, "%s: error: curl failed: %d: %s\n", j->label, result,
+            curl_easy_strerror(result));
+    return 1;
+  }
+
+  switch (j->phase) {
+  case PHASE_POST:
+    if (parse_post_request(&j->xfer, &j->request_id) != 0) {
+      return 1;
+    }
+    transfer_cleanup(&j->xfer);
+
+    // 録画時間に応じて作成完了待ちの期限を決める
+    struct tm start, end;
+    start = j->start;
+    end = j->end;
+    j->requested_at = monotonic_now();
+    j->poll_deadline = j->requested_at + POLL_DEADLINE_BASE +
+                       POLL_DEADLINE_RATIO * difftime(mktime(&end),
+                                                      mktime(&start));
+    j->poll_interval = POLL_INTERVAL_INITIAL;
+    return schedule_poll(j, 0.0);
+
+  case PHASE_GET: {
+    enum State state;
+    if (parse_get_request(&j->xfer, &state, &j->file_url) != 0) {
+      return 1;
+    }
+    double retry_after = retry_after_of(j->xfer.curl);
+    transfer_cleanup(&j->xfer);
+    if (state == FAILED) {
+      // 処理失敗
+      fprintf(stderr, "%s: error: server reported media creation failed\n",
+              j->label);
+      return 1;
+    }
+    if (state == PROCESSING) {
+      // 処理中
+      return schedule_poll(j, retry_after);
+    }
+
+    int n;
+    if (j->output[0] != '\0') {
+      n = snprintf(j->path, sizeof(j->path), "%s", j->output);
+    } else {
+      n = snprintf(j->path, sizeof(j->path), "%s/%d.mp4", cfg->output_dir,
+                   j->request_id);
+    }
+    if (n >= sizeof(j->path)) {
+      fprintf(stderr, "%s: error: filename too long\n", j->label);
+      return 1;
+    }
+
+    // ファイルをダウンロードする
+    fprintf(stderr, "%s: media file created in %.1f sec (%d polls)\n",
+            j->label, monotonic_now() - j->requested_at, j->polls);
+    fprintf(stderr, "%s: downloading media file to %s\n", j->label, j->path);
+    return start_download(multi, j, cfg);
+  }
+
+  default:
+    fprintf(stderr, "%s: error: unexpected transfer\n", j->label);
+    return 1;
+  }
+}
+
+int run_jobs(const config *cfg, job *jobs, int njobs) {
+  CURLM *multi = curl_multi_init();
+  if (multi == NULL) {
+    fprintf(stderr, "error: \"curl_multi_init()\": NULL at %s(%d)\n",
+            __FILE__, __LINE__);
+    return njobs;
+  }
+  // ストリームの出力先が書き込み可能になるのを待つためのディスクリプタ
+  struct curl_waitfd *waitfds =
+      (struct curl_waitfd *)calloc(njobs, sizeof(struct curl_waitfd));
+  if (waitfds == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    curl_multi_cleanup(multi);
+    return njobs;
+  }
+
+  int next_job = 0; // 次に開始するジョブ
+  int active = 0;   // 処理中のジョブ数
+  int failed = 0;
+  double next_metrics = monotonic_now() + HTTP_METRICS_INTERVAL;
+  while (next_job < njobs || active > 0) {
+    double now = monotonic_now();
+
+    // 実行中もHTTPメトリクスを一定間隔で書き出す
+    if (cfg->metrics_file != NULL && next_metrics <= now) {
+      http_metrics_write(cfg->metrics_file);
+      next_metrics = now + HTTP_METRICS_INTERVAL;
+    }
+
+    // 上限まで新しいジョブを開始する
+    while (next_job < njobs && active < cfg->concurrency) {
+      job *j = &jobs[next_job++];
+      active++;
+      if (journal_path(j, cfg) != 0 || start_job(multi, j, cfg) != 0) {
+        fail_job(multi, j);
+      }
+      if (j->phase == PHASE_DONE || j->phase == PHASE_ERROR) {
+        active--;
+        failed += (j->phase == PHASE_ERROR) ? 1 : 0;
+      }
+    }
+
+    // 待機時間が経過したジョブの作成状況を取得する
+    double next_wakeup = now + 1.0;
+    for (int i = 0; i < next_job; i++) {
+      job *j = &jobs[i];
+      if (j->phase != PHASE_WAIT) {
+        continue;
+      }
+      if (now < j->next_poll) {
+        if (j->next_poll < next_wakeup) {
+          next_wakeup = j->next_poll;
+        }
+        continue;
+      }
+      j->polls++;
+      j->phase = PHASE_GET;
+      if (get_request(cfg->api_key, j->device_id, j->request_id, &j->xfer,
+                      cfg->verbosity) != 0 ||
+          start_transfer(multi, j, &j->xfer) != 0) {
+        fail_job(multi, j);
+        active--;
+        failed++;
+      }
+    }
+
+    // 通信を進め完了したHTTP要求を処理する
+    int running;
+    curl_multi_perform(multi, &running);
+
+    // 最初の区間の受信が始まったジョブは残りの区間を要求する
+    // また一定間隔でダウンロードの進捗をジャーナルに保存する
+    for (int i = 0; i < next_job; i++) {
+      job *j = &jobs[i];
+      if (j->phase != PHASE_DOWNLOAD) {
+        continue;
+      }
+      int ret = 0;
+      if (!j->split && j->segs[0].started) {
+        ret = split_download(multi, j, cfg);
+      } else if (j->resumable && j->next_journal <= now) {
+        ret = save_journal(j);
+      }
+      if (ret != 0) {
+        fail_job(multi, j);
+        active--;
+        failed++;
+      }
+    }
+
+    CURLMsg *msg;
+    int queued;
+    while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      job *j;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&j);
+      if (msg->data.result == CURLE_COULDNT_CONNECT) {
+        // 次の要求からは名前解決をやり直す
+        http_forget_address(msg->easy_handle);
+      }
+      if (cfg->metrics_file != NULL) {
+        http_metrics_record(endpoint_name(j->phase), msg->easy_handle);
+      }
+      if (on_transfer_done(multi, j, msg->easy_handle, msg->data.result,
+                           cfg) != 0) {
+        fail_job(multi, j);
+      }
+      if (j->phase == PHASE_DONE || j->phase == PHASE_ERROR) {
+        active--;
+        failed += (j->phase == PHASE_ERROR) ? 1 : 0;
+      }
+    }
+
+    // ストリームの出力先へ書き出し, 受け取れない出力先は書き込み可能になるのを待つ
+    int nwaitfds = 0;
+    for (int i = 0; i < next_job; i++) {
+      job *j = &jobs[i];
+      if (j->phase != PHASE_DOWNLOAD || j->sink == NULL) {
+        continue;
+      }
+      int ret = pump_stream(j, &waitfds[nwaitfds], &next_wakeup);
+      if (ret < 0) {
+        fail_job(multi, j);
+        active--;
+        failed++;
+      } else if (ret > 0) {
+        nwaitfds++;
+      }
+    }
+
+    // 帯域制限の待ち時間が経過した区間の受信を再開する
+    now = monotonic_now();
+    for (int i = 0; i < next_job; i++) {
+      job *j = &jobs[i];
+      if (j->phase != PHASE_DOWNLOAD) {
+        continue;
+      }
+      for (int k = 0; k < j->nsegs; k++) {
+        segment *seg = &j->segs[k];
+        if (!seg->throttled || seg->xfer.curl == NULL) {
+          continue;
+        }
+        if (now < seg->resume_at) {
+          if (seg->resume_at < next_wakeup) {
+            next_wakeup = seg->resume_at;
+          }
+          continue;
+        }
+        curl_easy_pause(seg->xfer.curl, CURLPAUSE_CONT);
+      }
+    }
+
+    // 通信があるか次の作成状況取得の時刻まで待つ
+    int timeout_ms = (int)((next_wakeup - monotonic_now()) * 1000.0);
+    if (timeout_ms > 0) {
+      curl_multi_poll(multi, waitfds, nwaitfds, timeout_ms, NULL);
+    }
+  }
+
+  free(waitfds);
+  curl_multi_cleanup(multi);
+  return failed;
+}
+
+// HTTPクライアントの状態
+static struct {
+  CURLSH *share;              // DNS, TLSセッション, 接続の共有
+  CURL *idle[HTTP_POOL_SIZE]; // 再利用待ちのeasyハンドル
+  int nidle;
+  session_cache *cache; // プロセスをまたいで再利用するセッションキャッシュ
+} http_client;
+
+int http_client_init(session_cache *cache) {
+  CHECK_NULL(http_client.share = curl_share_init());
+  curl_share_setopt(http_client.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(http_client.share, CURLSHOPT_SHARE,
+                    CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(http_client.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  http_client.nidle = 0;
+  http_client.cache = cache;
+  return 0;
+
+error:
+  return 1;
+}
+
+void http_client_cleanup() {
+  // 共有オブジェクトを参照するハンドルを先に解放する
+  for (int i = 0; i < http_client.nidle; i++) {
+    curl_easy_cleanup(http_client.idle[i]);
+  }
+  http_client.nidle = 0;
+  curl_share_cleanup(http_client.share);
+  http_client.share = NULL;
+}
+
+CURL *http_acquire() {
+  CURL *curl;
+  if (http_client.nidle > 0) {
+    curl = http_client.idle[--http_client.nidle];
+    curl_easy_reset(curl);
+  } else {
+    curl = curl_easy_init();
+    if (curl == NULL) {
+      return NULL;
+    }
+  }
+  curl_easy_setopt(curl, CURLOPT_SHARE, http_client.share);
+  curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, HTTP_DNS_CACHE_TIMEOUT);
+  // 要求の合間に接続が切断されないようTCP keep-aliveを送る
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, HTTP_KEEPALIVE_IDLE);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, HTTP_KEEPALIVE_INTERVAL);
+  curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, HTTP_MAXAGE_CONN);
+  if (http_client.cache != NULL &&
+      session_cache_apply(http_client.cache, curl) != 0) {
+    curl_easy_cleanup(curl);
+    return NULL;
+  }
+  return curl;
+}
+
+void http_forget_address(CURL *curl) {
+  if (http_client.cache != NULL) {
+    session_cache_forget(http_client.cache, curl);
+  }
+}
+
+void http_release(CURL *curl) {
+  if (curl == NULL) {
+    return;
+  }
+  if (http_client.cache != NULL) {
+    session_cache_update(http_client.cache, curl);
+  }
+  if (http_client.nidle < HTTP_POOL_SIZE) {
+    http_client.idle[http_client.nidle++] = curl;
+  } else {
+    curl_easy_cleanup(curl);
+  }
+}
+
+void transfer_cleanup(transfer *t) {
+  buffer_release(&t->buf);
+  http_release(t->curl);
+  t->curl = NULL;
+  curl_slist_free_all(t->headers);
+  t->headers = NULL;
+}
+
+int post_request(const char *api_key, const char *device_id,
+                 const struct tm start, const struct tm end, transfer *t,
+                 int verbosity) {
+  cJSON *req = NULL;
+  char *body = NULL;
+  buffer_acquire(&t->buf);
+
+  // リクエストURL
+  char url[256];
+  int n;
+  n = snprintf(url, sizeof(url),
+               "https://openapi.safie.link/v2/devices/%s/media_files/requests",
+               device_id);
   if (n >= sizeof(url)) {
     fprintf(stderr, "error: url too long\n");
     goto error;
   }
 
+  // Authorizationおよびほかのヘッダ
   char auth[64];
   n = snprintf(auth, sizeof(auth), "Safie-API-Key: %s", api_key);
   if (n >= sizeof(auth)) {
     fprintf(stderr, "error: api-key too long\n");
     goto error;
   }
+  t->headers = curl_slist_append(t->headers, auth);
+  t->headers = curl_slist_append(t->headers, "Content-Type: application/json");
+
+  // リクエストボディ
+  CHECK_NULL(req = cJSON_CreateObject());
+  {
+    char dt[32];
+    strftime(dt, sizeof(dt), "%Y-%m-%dT%H:%M:%S%z", &start);
+    // strftimeの%zをRFC3339のtime-numoffsetに変更
+    memmove(dt + 23, dt + 22, 3);
+    dt[22] = ':';
+    CHECK_NULL(cJSON_AddStringToObject(req, "start", dt));
+  }
+  {
+    char dt[32];
+    strftime(dt, sizeof(dt), "%Y-%m-%dT%H:%M:%S%z", &end);
+    // strftimeの%zをRFC3339のtime-numoffsetに変更
+    memmove(dt + 23, dt + 22, 3);
+    dt[22] = ':';
+    CHECK_NULL(cJSON_AddStringToObject(req, "end", dt));
+  }
+  CHECK_NULL(body = cJSON_PrintUnformatted(req));
+
+  CHECK_NULL(t->curl = http_acquire());
+  curl_easy_setopt(t->curl, CURLOPT_URL, url);
+  curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+  // 要求の完了までbodyを保持するためコピーさせる
+  curl_easy_setopt(t->curl, CURLOPT_COPYPOSTFIELDS, body);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, on_curl_header_buffer);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, &t->buf);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, on_curl_write_buffer);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->buf);
+  curl_easy_setopt(t->curl, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(t->curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
+  curl_easy_setopt(t->curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
+
+  cJSON_free(body);
+  cJSON_Delete(req);
+  return 0;
+
+error:
+  cJSON_free(body);
+  cJSON_Delete(req);
+  transfer_cleanup(t);
+  return 1;
+}
+
+int parse_post_request(transfer *t, int *request_id) {
+  cJSON *res = NULL;
+
+  // レスポンスの処理
+  CHECK_NULL(res = cJSON_Parse(t->buf.data));
+  cJSON *el;
+  el = cJSON_GetObjectItemCaseSensitive(res, "request_id");
+  if (!cJSON_IsNumber(el)) {
+    fprintf(stderr, "error: invalid response\n");
+    goto error;
+  }
+  *request_id = el->valueint;
+
+  cJSON_Delete(res);
+  return 0;
 
-  headers = curl_slist_append(headers, auth);
+error:
+  cJSON_Delete(res);
+  return 1;
+}
+
+int get_request(const char *api_key, const char *device_id, int request_id,
+                transfer *t, int verbosity) {
+  buffer_acquire(&t->buf);
 
-  curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_curl_write_buffer);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-  curl_easy_setopt(curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
-  curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
+  char url[256];
+  int n;
+  n = snprintf(
+      url, sizeof(url),
+      "https://openapi.safie.link/v2/devices/%s/media_files/requests/%d",
+      device_id, request_id);
+  if (n >= sizeof(url)) {
+    fprintf(stderr, "error: url too long\n");
+    goto error;
+  }
 
-  CURLcode ret;
-  ret = curl_easy_perform(curl);
-  if (ret != CURLE_OK) {
-    fprintf(stderr, "error: curl failed: %d: %s\n", ret,
-            curl_easy_strerror(ret));
+  char auth[64];
+  n = snprintf(auth, sizeof(auth), "Safie-API-Key: %s", api_key);
+  if (n >= sizeof(auth)) {
+    fprintf(stderr, "error: api-key too long\n");
     goto error;
   }
 
-  CHECK_NULL(res = cJSON_Parse(buf.data));
+  t->headers = curl_slist_append(t->headers, auth);
+
+  CHECK_NULL(t->curl = http_acquire());
+  curl_easy_setopt(t->curl, CURLOPT_URL, url);
+  curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, on_curl_header_buffer);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, &t->buf);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, on_curl_write_buffer);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->buf);
+  curl_easy_setopt(t->curl, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(t->curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
+  curl_easy_setopt(t->curl, CURLOPT_DEBUGFUNCTION, on_curl_debug);
+  return 0;
+
+error:
+  transfer_cleanup(t);
+  return 1;
+}
+
+int parse_get_request(transfer *t, enum State *state, char **file_url) {
+  cJSON *res = NULL;
+  CHECK_NULL(res = cJSON_Parse(t->buf.data));
 
   cJSON *el_state;
   el_state = cJSON_GetObjectItemCaseSensitive(res, "state");
@@ -445,6 +2162,7 @@ int get_request(const char *api_key, const char *device_id, int request_id,
   cJSON *el_url;
   el_url = cJSON_GetObjectItemCaseSensitive(res, "url");
   if (cJSON_IsString(el_url)) {
+    free(*file_url);
     *file_url = strdup(el_url->valuestring);
   } else if (*state == AVAILABLE) {
     fprintf(stderr, "error: invalid response\n");
@@ -452,24 +2170,168 @@ int get_request(const char *api_key, const char *device_id, int request_id,
   }
 
   cJSON_Delete(res);
-  free(buf.data);
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
   return 0;
 
 error:
   cJSON_Delete(res);
-  free(buf.data);
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
   return 1;
 }
 
-int download_mediafile(const char *api_key, const char *url, FILE *fp,
-                       int verbosity) {
-  struct curl_slist *headers = NULL;
-  CURL *curl = NULL;
+/// @brief 応答ヘッダ行が `name` のとき値を前後の空白を除いて `value` にコピーします
+static void header_value(const char *line, size_t length, const char *name,
+                         char *value, size_t size) {
+  size_t len = strlen(name);
+  if (length <= len || strncasecmp(line, name, len) != 0) {
+    return;
+  }
+  const char *first = line + len;
+  const char *last = line + length;
+  while (first < last && (*first == ' ' || *first == '\t')) {
+    first++;
+  }
+  while (first < last && (last[-1] == '\r' || last[-1] == '\n' ||
+                          last[-1] == ' ' || last[-1] == '\t')) {
+    last--;
+  }
+  if ((size_t)(last - first) < size) {
+    memcpy(value, first, last - first);
+    value[last - first] = '\0';
+  }
+}
+
+/// @brief 応答ヘッダからContent-Range, ETag, Last-Modified, チェックサムを読み取ります
+static size_t on_curl_header_segment(char *ptr, size_t size, size_t nmemb,
+                                     void *userdata) {
+  size_t realsize = size * nmemb;
+  segment *seg = (segment *)userdata;
+  const char *name = "Content-Range:";
+  size_t len = strlen(name);
+  if (realsize > len && strncasecmp(ptr, name, len) == 0) {
+    long long first, last, total;
+    if (sscanf(ptr + len, " bytes %lld-%lld/%lld", &first, &last, &total) ==
+        3) {
+      seg->range_start = first;
+      seg->total = total;
+    }
+  }
+  header_value(ptr, realsize, "ETag:", seg->etag, sizeof(seg->etag));
+  header_value(ptr, realsize, "Last-Modified:", seg->last_modified,
+               sizeof(seg->last_modified));
+  checksum_parse_header(ptr, realsize, &seg->expect);
+  return realsize;
+}
+
+/// @brief 出力ファイルの領域を確保します
+static int preallocate(int fd, curl_off_t size) {
+#ifdef __linux__
+  if (fallocate(fd, 0, 0, size) == 0) {
+    return 0;
+  }
+  if (errno != EOPNOTSUPP) {
+    return 1;
+  }
+#endif
+  return ftruncate(fd, size);
+}
 
+/// @brief 受信したデータを区間の位置に書き込みます
+static size_t on_curl_write_segment(char *ptr, size_t size, size_t nmemb,
+                                    void *userdata) {
+  size_t realsize = size * nmemb;
+  segment *seg = (segment *)userdata;
+  if (!seg->started) {
+    seg->started = 1;
+    long code = 0;
+    curl_easy_getinfo(seg->xfer.curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code == 206) {
+      seg->ranged = 1;
+      if (seg->range_start != seg->offset) {
+        fprintf(stderr, "error: unexpected Content-Range\n");
+        return 0;
+      }
+      if (seg->end < 0) {
+        // 末尾までの要求は, 応答のContent-Rangeで終端を確定する
+        seg->end = seg->total;
+      }
+    } else if (seg->conditional) {
+      // If-Rangeの条件を満たさない, 前回からファイルが変わっている
+      seg->changed = 1;
+      return 0;
+    } else if (seg->offset == 0) {
+      // Range要求に応じないサーバでは全体を1本で受信する
+      seg->ranged = 0;
+      seg->end = -1;
+      curl_easy_getinfo(seg->xfer.curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                        &seg->total);
+    } else {
+      fprintf(stderr, "error: server ignored range request\n");
+      return 0;
+    }
+    if (seg->sink == NULL && seg->offset == 0 && seg->total > 0 &&
+        preallocate(seg->fd, seg->total) != 0) {
+      fprintf(stderr, "error: failed to allocate file: %s\n", strerror(errno));
+      return 0;
+    }
+  }
+  if (seg->end >= 0 && seg->offset + (curl_off_t)realsize > seg->end) {
+    fprintf(stderr, "error: received more data than requested\n");
+    return 0;
+  }
+  if (seg->limiter != NULL && seg->throttled) {
+    // 待ち時間が経過して再開したときは待っていたデータを受け取る
+    // 待っていた区間が順に帯域を使えるよう, 他の区間の受信を待たない
+    seg->throttled = 0;
+  } else if (seg->limiter != NULL) {
+    // 帯域に余裕がないときは受信を一時停止し, 同じデータを再開後に受け取る
+    double delay = rate_limit_delay(seg->limiter, RATE_CLASS_BULK);
+    if (delay > 0.0) {
+      seg->throttled = 1;
+      seg->resume_at = monotonic_now() + delay;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+  }
+
+  if (seg->sink != NULL) {
+    // 出力先が受け取れないときは受信を一時停止し, 同じデータを再開後に受け取る
+    int ret = output_sink_write(seg->sink, ptr, realsize);
+    if (ret < 0) {
+      return 0;
+    }
+    if (ret > 0) {
+      seg->paused = 1;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+  } else {
+    size_t written = 0;
+    while (written < realsize) {
+      ssize_t n = pwrite(seg->fd, ptr + written, realsize - written,
+                         seg->offset + written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        fprintf(stderr, "error: failed to write file: %s\n", strerror(errno));
+        return 0;
+      }
+      written += n;
+    }
+  }
+  // 先頭から連続する位置のデータは受信したバッファから直接チェックサムを計算する
+  if (seg->sum != NULL && checksum_enabled(seg->sum) &&
+      seg->sum->offset == seg->offset &&
+      checksum_update(seg->sum, ptr, realsize) != 0) {
+    return 0;
+  }
+  if (seg->limiter != NULL) {
+    rate_limit_consume(seg->limiter, realsize);
+  }
+  seg->offset += realsize;
+  return realsize;
+}
+
+int download_mediafile(const char *api_key, const char *url, segment *seg,
+                       const char *if_range, int verbosity) {
+  transfer *t = &seg->xfer;
   char auth[64];
   int n = snprintf(auth, sizeof(auth), "Safie-API-Key: %s", api_key);
   if (n >= sizeof(auth)) {
@@ -477,30 +2339,48 @@ int download_mediafile(const char *api_key, const char *url, FILE *fp,
     goto error;
   }
 
-  headers = curl_slist_append(headers, auth);
-
-  curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  // libcurlのデフォルトコールバックを使用
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-  curl_easy_setopt(curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
+  t->headers = curl_slist_append(t->headers, auth);
+  if (if_range != NULL) {
+    char header[256];
+    n = snprintf(header, sizeof(header), "If-Range: %s", if_range);
+    if (n >= sizeof(header)) {
+      fprintf(stderr, "error: If-Range too long\n");
+      goto error;
+    }
+    t->headers = curl_slist_append(t->headers, header);
+  }
 
-  CURLcode ret;
-  ret = curl_easy_perform(curl);
-  if (ret != CURLE_OK) {
-    fprintf(stderr, "error: curl failed: %d: %s\n", ret,
-            curl_easy_strerror(ret));
-    goto error;
+  // 要求する範囲, 終端の位置を含む
+  char range[64];
+  if (seg->end >= 0) {
+    snprintf(range, sizeof(range), "%lld-%lld", (long long)seg->offset,
+             (long long)seg->end - 1);
+  } else {
+    snprintf(range, sizeof(range), "%lld-", (long long)seg->offset);
   }
+  seg->started = 0;
+  seg->changed = 0;
+  seg->range_start = -1;
+  seg->etag[0] = '\0';
+  seg->last_modified[0] = '\0';
+  seg->paused = 0;
+  seg->throttled = 0;
+  memset(&seg->expect, 0, sizeof(seg->expect));
 
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
+  CHECK_NULL(t->curl = http_acquire());
+  curl_easy_setopt(t->curl, CURLOPT_URL, url);
+  curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
+  // 先頭からの要求もRange要求とし, 応答からRange要求の可否を確認する
+  curl_easy_setopt(t->curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, on_curl_header_segment);
+  curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, seg);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, on_curl_write_segment);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, seg);
+  curl_easy_setopt(t->curl, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(t->curl, CURLOPT_VERBOSE, (verbosity) ? 1 : 0);
   return 0;
 
 error:
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(headers);
+  transfer_cleanup(t);
   return 1;
 }
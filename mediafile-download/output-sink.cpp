@@ -0,0 +1,368 @@
+/*
+ * output-sink
+ * ダウンロードしたデータをファイルを経由せずに標準出力, 名前付きパイプ,
+ * コマンドの標準入力へ書き出す出力先
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "output-sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// バッファのアライメント [byte]
+#define OUTPUT_SINK_ALIGNMENT 4096
+
+struct output_sink {
+  char name[256]; // ログ出力用の名前
+  int fd;
+  int owns_fd; // 閉じるときに `fd` を閉じるとき `1`
+  int shared;  // 非ブロッキングにできない共有の標準出力のとき `1`
+  char *fifo;  // 読み込み側を待っている名前付きパイプ, 開いた後はNULL
+  pid_t pid;   // コマンドのプロセスID, コマンドでないとき `-1`
+  char *buf;   // 出力バッファ, `head` から `tail` までが未書き出し
+  size_t capacity;
+  size_t head;
+  size_t tail;
+};
+
+int output_sink_is_stream(const char *target) {
+  if (strcmp(target, "-") == 0 || target[0] == '|') {
+    return 1;
+  }
+  struct stat st;
+  return (stat(target, &st) == 0 && S_ISFIFO(st.st_mode)) ? 1 : 0;
+}
+
+/// @brief パイプの容量をバッファのサイズまで広げます, 失敗しても続行する
+static void enlarge_pipe(int fd) {
+#ifdef F_SETPIPE_SZ
+  fcntl(fd, F_SETPIPE_SZ, OUTPUT_SINK_BUFFER_SIZE);
+#else
+  (void)fd;
+#endif
+}
+
+/// @brief 名前付きパイプの読み込み側が開いていれば, 書き込み側を開きます
+/// 読み込み側を待つ間もイベントループを止めないよう, ブロックせずに開く
+/// @return 終了コード, `0` のとき正常終了 (読み込み側がまだないときも含む)
+static int open_fifo(output_sink *sink) {
+  int fd = open(sink->fifo, O_WRONLY | O_NONBLOCK);
+  if (fd < 0 && errno == ENXIO) {
+    return 0;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "error: failed to open %s: %s\n", sink->fifo,
+            strerror(errno));
+    return 1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  sink->fd = fd;
+  sink->owns_fd = 1;
+  free(sink->fifo);
+  sink->fifo = NULL;
+  enlarge_pipe(sink->fd);
+  return 0;
+}
+
+/// @brief `/bin/sh -c command` を起動し, 標準入力につながるパイプを返します
+/// @return パイプの書き込み側, 失敗したとき `-1`
+static int spawn_command(const char *command, const char *const vars[],
+                         pid_t *pid) {
+  int fds[2] = {-1, -1};
+  char **envp = NULL;
+  int spawned = -1;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  // パイプラインのすべてのプロセスを終了できるよう新しいプロセスグループで起動する
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+  if (pipe(fds) != 0) {
+    fprintf(stderr, "error: failed to create pipe: %s\n", strerror(errno));
+    goto error;
+  }
+  // 以降に起動するコマンドへ書き込み側を引き継がない
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+
+  {
+    // 環境変数に `vars` を追加する
+    int nenv = 0, nvars = 0;
+    while (environ[nenv] != NULL) {
+      nenv++;
+    }
+    while (vars != NULL && vars[nvars] != NULL) {
+      nvars++;
+    }
+    envp = (char **)calloc(nenv + nvars + 1, sizeof(char *));
+    if (envp == NULL) {
+      fprintf(stderr, "error: out of memory\n");
+      goto error;
+    }
+    memcpy(envp, environ, nenv * sizeof(char *));
+    memcpy(envp + nenv, vars, nvars * sizeof(char *));
+
+    char *argv[] = {(char *)"sh", (char *)"-c", (char *)command, NULL};
+    spawned = posix_spawn(pid, "/bin/sh", &actions, &attr, argv, envp);
+    if (spawned != 0) {
+      fprintf(stderr, "error: failed to run command: %s\n",
+              strerror(spawned));
+      goto error;
+    }
+  }
+  free(envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  close(fds[0]);
+  return fds[1];
+
+error:
+  free(envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (fds[0] >= 0) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  return -1;
+}
+
+output_sink *output_sink_open(const char *target, const char *const vars[]) {
+  output_sink *sink = (output_sink *)calloc(1, sizeof(output_sink));
+  if (sink == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  sink->fd = -1;
+  sink->pid = -1;
+  snprintf(sink->name, sizeof(sink->name), "%s",
+           (strcmp(target, "-") == 0) ? "stdout" : target);
+  sink->capacity = OUTPUT_SINK_BUFFER_SIZE;
+  if (posix_memalign((void **)&sink->buf, OUTPUT_SINK_ALIGNMENT,
+                     sink->capacity) != 0) {
+    fprintf(stderr, "error: out of memory\n");
+    sink->buf = NULL;
+    goto error;
+  }
+  // 読み込み側が先に終了したときはシグナルで終了せずEPIPEとして扱う
+  signal(SIGPIPE, SIG_IGN);
+
+  if (strcmp(target, "-") == 0) {
+    sink->fd = STDOUT_FILENO;
+    struct stat st;
+    if (fstat(sink->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      // 通常のファイルへの書き込みは読み込み側を待たないため, まとめて書き込む
+      return sink;
+    }
+    if (fstat(sink->fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+      // 同じパイプを別のファイル記述として開き直し, 親プロセスなどと共有する
+      // ファイル状態フラグを変えずに非ブロッキングで書き込む
+      int fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK);
+      if (fd >= 0) {
+        sink->fd = fd;
+        sink->owns_fd = 1;
+        enlarge_pipe(sink->fd);
+        return sink;
+      }
+    }
+    // 開き直せないときはファイル状態フラグを変えず,
+    // 書き込み可能なときのみ書き込む
+    sink->shared = 1;
+    enlarge_pipe(sink->fd);
+    return sink;
+  }
+  if (target[0] != '|') {
+    // 名前付きパイプは読み込み側が開くまで, 書き出しのたびに開き直す
+    if ((sink->fifo = strdup(target)) == NULL) {
+      fprintf(stderr, "error: out of memory\n");
+      goto error;
+    }
+    if (open_fifo(sink) != 0) {
+      goto error;
+    }
+    if (sink->fd < 0) {
+      fprintf(stderr, "waiting for a reader on %s\n", target);
+    }
+    return sink;
+  }
+
+  sink->fd = spawn_command(target + 1, vars, &sink->pid);
+  sink->owns_fd = 1;
+  if (sink->fd < 0) {
+    goto error;
+  }
+  // 出力先が受け取れないときに受信側を止められるよう書き込みをブロックしない
+  int flags;
+  flags = fcntl(sink->fd, F_GETFL);
+  if (flags < 0 || fcntl(sink->fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    fprintf(stderr, "error: failed to set non-blocking mode: %s\n",
+            strerror(errno));
+    goto error;
+  }
+  enlarge_pipe(sink->fd);
+  return sink;
+
+error:
+  output_sink_close(sink, 1);
+  return NULL;
+}
+
+/// @brief 標準出力が書き込み可能かを返します
+/// 書き込み可能なとき, パイプには `PIPE_BUF` バイトまでブロックせずに書き込める
+/// (空きの大きさは分からないため, それを超えるとブロックする可能性がある)
+static int stdout_writable(const output_sink *sink) {
+  struct pollfd pfd;
+  pfd.fd = sink->fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLOUT | POLLERR));
+}
+
+int output_sink_flush(output_sink *sink) {
+  if (sink->fifo != NULL && open_fifo(sink) != 0) {
+    return 1;
+  }
+  if (sink->fd < 0) {
+    return 0;
+  }
+  while (sink->head < sink->tail) {
+    size_t size = sink->tail - sink->head;
+    if (sink->shared) {
+      // ブロッキングのまま共有する標準出力のみ, ブロックしない大きさに分ける
+      if (!stdout_writable(sink)) {
+        break;
+      }
+      if (size > PIPE_BUF) {
+        size = PIPE_BUF;
+      }
+    }
+    ssize_t n = write(sink->fd, sink->buf + sink->head, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n < 0) {
+      fprintf(stderr, "error: failed to write to %s: %s\n", sink->name,
+              strerror(errno));
+      return 1;
+    }
+    sink->head += n;
+  }
+  if (sink->head == sink->tail) {
+    sink->head = 0;
+    sink->tail = 0;
+  }
+  return 0;
+}
+
+int output_sink_write(output_sink *sink, const char *data, size_t size) {
+  if (sink->tail + size > sink->capacity) {
+    if (sink->tail - sink->head + size > sink->capacity &&
+        output_sink_flush(sink) != 0) {
+      return -1;
+    }
+    // 未書き出しのデータをバッファの先頭に詰める
+    memmove(sink->buf, sink->buf + sink->head, sink->tail - sink->head);
+    sink->tail -= sink->head;
+    sink->head = 0;
+  }
+  if (sink->tail + size > sink->capacity) {
+    if (sink->tail > 0) {
+      return 1;
+    }
+    // バッファより大きいデータ (通常は起こらない) のときはバッファを広げる
+    char *buf;
+    if (posix_memalign((void **)&buf, OUTPUT_SINK_ALIGNMENT, size) != 0) {
+      fprintf(stderr, "error: out of memory\n");
+      return -1;
+    }
+    free(sink->buf);
+    sink->buf = buf;
+    sink->capacity = size;
+  }
+  memcpy(sink->buf + sink->tail, data, size);
+  sink->tail += size;
+  if (sink->tail - sink->head >= OUTPUT_SINK_WRITE_SIZE &&
+      output_sink_flush(sink) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+size_t output_sink_pending(const output_sink *sink) {
+  return sink->tail - sink->head;
+}
+
+int output_sink_fd(const output_sink *sink) { return sink->fd; }
+
+int output_sink_drain(output_sink *sink) {
+  while (1) {
+    if (output_sink_flush(sink) != 0) {
+      return 1;
+    }
+    if (output_sink_pending(sink) == 0) {
+      return 0;
+    }
+    // 名前付きパイプの読み込み側がまだないときは, 間隔を空けて開き直す
+    struct pollfd pfd;
+    pfd.fd = sink->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int timeout_ms = (sink->fd < 0) ? OUTPUT_SINK_RETRY_INTERVAL_MS : -1;
+    if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+      fprintf(stderr, "error: failed to wait for %s: %s\n", sink->name,
+              strerror(errno));
+      return 1;
+    }
+  }
+}
+
+int output_sink_close(output_sink *sink, int abort) {
+  if (sink == NULL) {
+    return 0;
+  }
+  int ret = 0;
+  if (abort && sink->pid > 0) {
+    // 不完全なデータを正常な入力として扱わせないよう, 入力を閉じる前に終了させる
+    kill(-sink->pid, SIGTERM);
+  }
+  if (sink->owns_fd && sink->fd >= 0 && close(sink->fd) != 0) {
+    fprintf(stderr, "error: failed to close %s: %s\n", sink->name,
+            strerror(errno));
+    ret = 1;
+  }
+  if (sink->pid > 0) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(sink->pid, &status, 0)) < 0 && errno == EINTR) {
+    }
+    if (!abort && (pid < 0 || !WIFEXITED(status) ||
+                   WEXITSTATUS(status) != 0)) {
+      fprintf(stderr, "error: command '%s' failed with status %d\n",
+              sink->name + 1,
+              (pid >= 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1);
+      ret = 1;
+    }
+  }
+  free(sink->fifo);
+  free(sink->buf);
+  free(sink);
+  return ret;
+}
@@ -0,0 +1,69 @@
+/*
+ * output-sink
+ * ダウンロードしたデータをファイルを経由せずに標準出力, 名前付きパイプ,
+ * コマンドの標準入力へ書き出す出力先
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <stddef.h>
+
+// 出力バッファのサイズ [byte]
+#define OUTPUT_SINK_BUFFER_SIZE (1024 * 1024)
+// バッファにこのサイズ以上溜まったときに書き出す [byte]
+#define OUTPUT_SINK_WRITE_SIZE (256 * 1024)
+// 受信を一時停止した後, バッファがこのサイズ以下になったら受信を再開する [byte]
+#define OUTPUT_SINK_RESUME_SIZE (OUTPUT_SINK_BUFFER_SIZE / 2)
+// 名前付きパイプの読み込み側を待つときに開き直す間隔 [msec]
+#define OUTPUT_SINK_RETRY_INTERVAL_MS 100
+
+typedef struct output_sink output_sink;
+
+/// @brief 出力先がファイルを経由しないストリームかを返します
+/// @param target [IN] 出力先, `-` (標準出力), `|COMMAND` または名前付きパイプのとき `1`
+/// @return ストリームのとき `1`
+int output_sink_is_stream(const char *target);
+
+/// @brief 出力先を開きます
+/// `|COMMAND` のときは `/bin/sh -c COMMAND` を起動し, その標準入力に書き出す
+/// 名前付きパイプは読み込み側が開くまで待たず, `output_sink_flush` で開き直す
+/// @param target [IN] 出力先
+/// @param vars [IN] コマンドに追加する環境変数 (`NAME=VALUE`, NULL終端), NULLのとき無し
+/// @return 出力先, 失敗したときNULL
+output_sink *output_sink_open(const char *target, const char *const vars[]);
+
+/// @brief データをバッファに追加します
+/// 出力先が受け取れずバッファに空きがないときは何も追加しない
+/// @param sink [IN/OUT] 出力先
+/// @param data [IN] データ
+/// @param size [IN] データの長さ
+/// @return 追加したとき `0`, 空きがないとき `1`, エラーのとき `-1`
+int output_sink_write(output_sink *sink, const char *data, size_t size);
+
+/// @brief バッファのデータを出力先が受け取れるだけ書き出します (ブロックしない)
+/// @param sink [IN/OUT] 出力先
+/// @return 終了コード, `0` のとき正常終了
+int output_sink_flush(output_sink *sink);
+
+/// @brief 書き出していないデータのバイト数を返します
+size_t output_sink_pending(const output_sink *sink);
+
+/// @brief 書き込み可能になるのを待つためのファイルディスクリプタを返します
+/// @return ファイルディスクリプタ, 名前付きパイプの読み込み側を待っているとき `-1`
+int output_sink_fd(const output_sink *sink);
+
+/// @brief バッファのデータをすべて書き出すまで待ちます
+/// @param sink [IN/OUT] 出力先
+/// @return 終了コード, `0` のとき正常終了
+int output_sink_drain(output_sink *sink);
+
+/// @brief 出力先を閉じて解放します
+/// コマンドのときは標準入力を閉じて終了を待ち, 終了ステータスを確認する
+/// @param sink [IN] 出力先, NULLのとき何もしない
+/// @param abort [IN] `1` のとき不完全な出力とし, コマンドを終了させる
+/// @return 終了コード, `0` のとき正常終了
+int output_sink_close(output_sink *sink, int abort);
+
+#endif
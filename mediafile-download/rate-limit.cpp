@@ -0,0 +1,170 @@
+/*
+ * rate-limit
+ * プロセス内のすべての受信, および同じホスト上で協調するプロセス間で
+ * 共有する受信帯域の制限 (GCRAによるトークンバケット)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "rate-limit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// バケットの状態, 共有メモリに置くためすべてアトミックに読み書きする
+// 0で初期化された状態はそのまま有効なため, 作成時の排他は不要
+typedef struct {
+  uint64_t rate; // 帯域 [byte/sec]
+  uint64_t tat;  // 次の受信が帯域内に収まる時刻 [nsec] (CLOCK_MONOTONIC)
+} rate_limit_state;
+
+struct rate_limit {
+  rate_limit_state *state;
+  int shared; // `state` が共有メモリのとき `1`
+};
+
+/// @brief 単調増加時計の現在時刻 [nsec] を返します
+/// CLOCK_MONOTONICは同じホスト上のプロセス間で共通
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int rate_limit_parse(const char *text, double *rate) {
+  char *end;
+  errno = 0;
+  double value = strtod(text, &end);
+  if (errno != 0 || end == text || value <= 0.0) {
+    return 1;
+  }
+  switch (*end) {
+  case '\0':
+    break;
+  case 'k':
+  case 'K':
+    value *= 1024.0;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    value *= 1024.0 * 1024.0;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    value *= 1024.0 * 1024.0 * 1024.0;
+    end++;
+    break;
+  default:
+    return 1;
+  }
+  if (*end != '\0' || value < 1.0) {
+    return 1;
+  }
+  *rate = value;
+  return 0;
+}
+
+rate_limit *rate_limit_open(const char *group, double rate) {
+  rate_limit *rl = (rate_limit *)calloc(1, sizeof(rate_limit));
+  if (rl == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  if (group == NULL) {
+    rl->state = (rate_limit_state *)calloc(1, sizeof(rate_limit_state));
+    if (rl->state == NULL) {
+      fprintf(stderr, "error: out of memory\n");
+      goto error;
+    }
+  } else {
+    char name[128];
+    int n = snprintf(name, sizeof(name), "/safie-rate-limit-%s", group);
+    if (n >= sizeof(name) || strchr(group, '/') != NULL) {
+      fprintf(stderr, "error: invalid rate limit group\n");
+      goto error;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+      fprintf(stderr, "error: failed to open shared memory %s: %s\n", name,
+              strerror(errno));
+      goto error;
+    }
+    // 既存の共有メモリでは同じサイズへの切り詰めとなり内容は変わらない
+    if (ftruncate(fd, sizeof(rate_limit_state)) != 0) {
+      fprintf(stderr, "error: failed to resize shared memory %s: %s\n", name,
+              strerror(errno));
+      close(fd);
+      goto error;
+    }
+    void *addr = mmap(NULL, sizeof(rate_limit_state), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "error: failed to map shared memory %s: %s\n", name,
+              strerror(errno));
+      goto error;
+    }
+    rl->state = (rate_limit_state *)addr;
+    rl->shared = 1;
+  }
+
+  // 帯域は最後に指定したプロセスのものをグループ全体で使う
+  if (rate > 0.0) {
+    __atomic_store_n(&rl->state->rate, (uint64_t)rate, __ATOMIC_RELAXED);
+  }
+  if (__atomic_load_n(&rl->state->rate, __ATOMIC_RELAXED) == 0) {
+    fprintf(stderr, "error: rate limit not set for group %s\n",
+            (group != NULL) ? group : "(none)");
+    goto error;
+  }
+  return rl;
+
+error:
+  rate_limit_close(rl);
+  return NULL;
+}
+
+double rate_limit_delay(rate_limit *rl, enum RateClass cls) {
+  uint64_t tat = __atomic_load_n(&rl->state->tat, __ATOMIC_ACQUIRE);
+  uint64_t now = now_ns();
+  uint64_t burst =
+      (cls == RATE_CLASS_LIVE) ? (uint64_t)(RATE_LIMIT_LIVE_BURST * 1e9) : 0;
+  if (tat <= now + burst) {
+    return 0.0;
+  }
+  return (double)(tat - now - burst) / 1e9;
+}
+
+void rate_limit_consume(rate_limit *rl, size_t bytes) {
+  uint64_t rate = __atomic_load_n(&rl->state->rate, __ATOMIC_RELAXED);
+  uint64_t cost = (uint64_t)((double)bytes * 1e9 / (double)rate);
+  uint64_t tat = __atomic_load_n(&rl->state->tat, __ATOMIC_ACQUIRE);
+  uint64_t next;
+  do {
+    // 帯域を使っていない期間の分は貯めない
+    uint64_t now = now_ns();
+    next = ((tat > now) ? tat : now) + cost;
+  } while (!__atomic_compare_exchange_n(&rl->state->tat, &tat, next, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+void rate_limit_close(rate_limit *rl) {
+  if (rl == NULL) {
+    return;
+  }
+  if (rl->shared) {
+    munmap(rl->state, sizeof(rate_limit_state));
+  } else {
+    free(rl->state);
+  }
+  free(rl);
+}
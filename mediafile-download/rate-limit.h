@@ -0,0 +1,53 @@
+/*
+ * rate-limit
+ * プロセス内のすべての受信, および同じホスト上で協調するプロセス間で
+ * 共有する受信帯域の制限 (GCRAによるトークンバケット)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stddef.h>
+
+// 受信の優先度
+enum RateClass {
+  RATE_CLASS_LIVE = 0, // ライブ映像, 帯域の上限まで先行して受信できる
+  RATE_CLASS_BULK,     // 録画の一括ダウンロード, 帯域に余裕があるときのみ受信する
+};
+
+// ライブ映像が帯域を先取りできる時間 [sec]
+// 一括ダウンロードはこの時間分の余裕を残して受信するため, ライブ映像の受信は待たされない
+#define RATE_LIMIT_LIVE_BURST 0.5
+
+typedef struct rate_limit rate_limit;
+
+/// @brief 帯域の文字列を解析します
+/// @param text [IN] バイト毎秒, 接尾辞 `k`, `M`, `G` (1024倍) を付けられる
+/// @param rate [OUT] 帯域 [byte/sec]
+/// @return 終了コード, `0` のとき正常終了
+int rate_limit_parse(const char *text, double *rate);
+
+/// @brief 帯域制限を開きます
+/// `group` を指定したときは共有メモリ上のバケットを同じ名前のグループのプロセスと共有する
+/// @param group [IN] グループ名, NULLのときプロセス内のみで制限する
+/// @param rate [IN] 帯域 [byte/sec], `0` のときグループに設定済みの帯域を使う
+/// @return 帯域制限, 失敗したときNULL
+rate_limit *rate_limit_open(const char *group, double rate);
+
+/// @brief 受信を続けるまでに待つ時間を返します
+/// @param rl [IN] 帯域制限
+/// @param cls [IN] 受信の優先度
+/// @return 待ち時間 [sec], 受信してよいとき `0`
+double rate_limit_delay(rate_limit *rl, enum RateClass cls);
+
+/// @brief 受信したバイト数をバケットから差し引きます
+/// @param rl [IN/OUT] 帯域制限
+/// @param bytes [IN] 受信したバイト数
+void rate_limit_consume(rate_limit *rl, size_t bytes);
+
+/// @brief 帯域制限を閉じます, 共有メモリは他のプロセスのために残す
+/// @param rl [IN] 帯域制限, NULLのとき何もしない
+void rate_limit_close(rate_limit *rl);
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ * async-io
+ * mp4ファイルへの書き込みを大きなバッファにまとめ, 別のスレッドで非同期に書き込む
+ * (多数のカメラの小さな書き込みがディスク上で細かいランダムな書き込みになるのを避けるため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "async-io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// FFmpegの出力のバッファのサイズ [byte], 溜まるたびにファイルごとのバッファへ移す
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+typedef struct async_file async_file;
+
+// 1つの書き込み
+typedef struct request {
+  struct request *next;
+  async_file *f;
+  char *buf;
+  size_t len;
+  size_t done; // 書き込み済みのバイト数
+  int64_t offset;
+  int barrier;      // 前の書き込みと範囲が重なり得るとき `1`
+  double submitted; // 依頼した時刻 [sec]
+} request;
+
+// 書き込み用に開いたファイル, 書き込みはFFmpegの出力を使う1つのスレッドから行う
+struct async_file {
+  async_io *io;
+  int fd;
+  int flush;
+  AVIOContext *pb;
+  char *buf;             // 溜めているバッファ, ないときNULL
+  int64_t buf_offset;    // `buf` の先頭のファイル上の位置
+  size_t fill;           // `buf` に溜めたバイト数
+  int64_t pos;           // 次に書き込む位置
+  int64_t size;          // 書き込んだ範囲の末尾
+  int64_t submitted_end; // 依頼済みの書き込みの末尾
+
+  // 書き込みの排他で保護する
+  int pending; // 完了していない書き込み数
+  int error;   // 失敗した書き込みの `errno`
+};
+
+struct async_io {
+  size_t buffer_size;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;      // 書き込みの依頼または終了
+  pthread_cond_t done_cond; // 書き込みの完了
+  request *head;            // 依頼された順の書き込み
+  request *tail;
+  char **free_buffers; // 再利用するバッファ
+  int nfree;
+  async_io_stats stats;
+  pthread_t thread;
+  int running;  // 書き込みスレッドを開始したとき `1`
+  int stopping; // 終了するとき `1`
+#ifdef HAVE_LIBURING
+  struct io_uring ring;
+  int uring; // io_uringを使うとき `1`
+#endif
+};
+
+/// @brief 単調増加する時刻 [sec] を返します
+static double monotonic_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief バッファを取得します, 空きがないときは確保する
+/// @return バッファ, 失敗したときNULL
+static char *get_buffer(async_io *io) {
+  char *buf = NULL;
+  pthread_mutex_lock(&io->mutex);
+  if (io->nfree > 0) {
+    buf = io->free_buffers[--io->nfree];
+  }
+  pthread_mutex_unlock(&io->mutex);
+  if (buf == NULL) {
+    void *p;
+    if (posix_memalign(&p, ASYNC_IO_ALIGNMENT, io->buffer_size) == 0) {
+      buf = (char *)p;
+    }
+  }
+  return buf;
+}
+
+/// @brief バッファを返却します
+/// 書き込みの排他を取得して呼び出す
+static void put_buffer(async_io *io, char *buf) {
+  if (io->nfree < ASYNC_IO_QUEUE_DEPTH) {
+    io->free_buffers[io->nfree++] = buf;
+  } else {
+    free(buf);
+  }
+}
+
+/// @brief 書き込みの完了を記録し, 待っているファイルに通知します
+/// 書き込みの排他を取得して呼び出す
+/// @param io [IN/OUT] 非同期の書き込み
+/// @param req [IN/OUT] 完了した書き込み, 解放される
+/// @param err [IN] 失敗したときの `errno`, 成功したとき `0`
+static void complete(async_io *io, request *req, int err) {
+  double latency = monotonic_time() - req->submitted;
+  io->stats.writes++;
+  io->stats.bytes += req->done;
+  io->stats.latency_total += latency;
+  if (latency > io->stats.latency_max) {
+    io->stats.latency_max = latency;
+  }
+  io->stats.depth--;
+  async_file *f = req->f;
+  if (err != 0 && f->error == 0) {
+    f->error = err;
+  }
+  f->pending--;
+  put_buffer(io, req->buf);
+  free(req);
+  pthread_cond_broadcast(&io->done_cond);
+}
+
+/// @brief 溜めているバッファの書き込みを依頼します
+/// 完了していない書き込みが上限に達しているときは, 完了を待つ
+/// @param f [IN/OUT] ファイル
+/// @return 終了コード, `0` のとき正常終了
+static int submit(async_file *f) {
+  async_io *io = f->io;
+  if (f->buf == NULL) {
+    return 0;
+  }
+  if (f->fill == 0) {
+    pthread_mutex_lock(&io->mutex);
+    put_buffer(io, f->buf);
+    pthread_mutex_unlock(&io->mutex);
+    f->buf = NULL;
+    return 0;
+  }
+  request *req = (request *)calloc(1, sizeof(request));
+  if (req == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  req->f = f;
+  req->buf = f->buf;
+  req->len = f->fill;
+  req->offset = f->buf_offset;
+  // トレーラのための後方への書き込みは, 前の書き込みを追い越さないようにする
+  req->barrier = (f->buf_offset < f->submitted_end);
+  if (f->buf_offset + (int64_t)f->fill > f->submitted_end) {
+    f->submitted_end = f->buf_offset + f->fill;
+  }
+  f->buf = NULL;
+  f->fill = 0;
+
+  pthread_mutex_lock(&io->mutex);
+  if (io->stats.depth >= ASYNC_IO_QUEUE_DEPTH) {
+    double since = monotonic_time();
+    io->stats.stalls++;
+    while (io->stats.depth >= ASYNC_IO_QUEUE_DEPTH) {
+      pthread_cond_wait(&io->done_cond, &io->mutex);
+    }
+    io->stats.stalled += monotonic_time() - since;
+  }
+  req->submitted = monotonic_time();
+  if (io->tail != NULL) {
+    io->tail->next = req;
+  } else {
+    io->head = req;
+  }
+  io->tail = req;
+  if (++io->stats.depth > io->stats.depth_max) {
+    io->stats.depth_max = io->stats.depth;
+  }
+  f->pending++;
+  pthread_cond_signal(&io->cond);
+  pthread_mutex_unlock(&io->mutex);
+  return 0;
+}
+
+/// @brief 出力データをバッファに溜めます (`AVIOContext` の書き込み関数)
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int write_file(void *opaque, const uint8_t *data, int size) {
+#else
+static int write_file(void *opaque, uint8_t *data, int size) {
+#endif
+  async_file *f = (async_file *)opaque;
+  async_io *io = f->io;
+  pthread_mutex_lock(&io->mutex);
+  int err = f->error;
+  pthread_mutex_unlock(&io->mutex);
+  if (err != 0) {
+    return AVERROR(err);
+  }
+
+  int remaining = size;
+  while (remaining > 0) {
+    if (f->buf == NULL) {
+      if ((f->buf = get_buffer(io)) == NULL) {
+        return AVERROR(ENOMEM);
+      }
+      f->buf_offset = f->pos;
+      f->fill = 0;
+    }
+    size_t at = f->pos - f->buf_offset;
+    size_t n = io->buffer_size - at;
+    if (n > (size_t)remaining) {
+      n = remaining;
+    }
+    memcpy(f->buf + at, data, n);
+    data += n;
+    remaining -= n;
+    f->pos += n;
+    if (at + n > f->fill) {
+      f->fill = at + n;
+    }
+    if (f->pos > f->size) {
+      f->size = f->pos;
+    }
+    if (at + n == io->buffer_size) {
+      int ret = submit(f);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+  }
+  // FFmpegの出力のバッファより短いときは `avio_flush` による書き込み
+  if (f->flush && size < f->pb->buffer_size) {
+    int ret = submit(f);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  return size;
+}
+
+/// @brief 書き込む位置を変更します (`AVIOContext` のシーク関数)
+/// 溜めているバッファの範囲内はバッファを上書きし, 範囲外はバッファの書き込みを依頼する
+static int64_t seek_file(void *opaque, int64_t offset, int whence) {
+  async_file *f = (async_file *)opaque;
+  if (whence & AVSEEK_SIZE) {
+    return f->size;
+  }
+  int64_t pos;
+  switch (whence & ~AVSEEK_FORCE) {
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = f->pos + offset;
+    break;
+  case SEEK_END:
+    pos = f->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  if (pos < 0) {
+    return AVERROR(EINVAL);
+  }
+  if (f->buf != NULL &&
+      (pos < f->buf_offset || pos > f->buf_offset + (int64_t)f->fill)) {
+    int ret = submit(f);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  f->pos = pos;
+  return pos;
+}
+
+/// @brief 依頼された書き込みをpwriteで順に実行し続けます
+/// 書き込みの排他を取得して呼び出す
+static void run_pwrite(async_io *io) {
+  while (1) {
+    while (io->head == NULL && !io->stopping) {
+      pthread_cond_wait(&io->cond, &io->mutex);
+    }
+    request *req = io->head;
+    if (req == NULL) {
+      break;
+    }
+    io->head = req->next;
+    if (io->head == NULL) {
+      io->tail = NULL;
+    }
+    pthread_mutex_unlock(&io->mutex);
+
+    int err = 0;
+    while (req->done < req->len) {
+      ssize_t n = pwrite(req->f->fd, req->buf + req->done,
+                         req->len - req->done, req->offset + req->done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        err = (n < 0) ? errno : EIO;
+        break;
+      }
+      req->done += n;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    complete(io, req, err);
+  }
+}
+
+#ifdef HAVE_LIBURING
+/// @brief 依頼された書き込みをio_uringで実行し続けます
+/// 複数の書き込みを同時に発行し, 後方への書き込みは先に発行した書き込みの完了後に実行させる
+/// 書き込みの排他を取得して呼び出す
+static void run_uring(async_io *io) {
+  int inflight = 0;
+  while (1) {
+    while (io->head == NULL && inflight == 0 && !io->stopping) {
+      pthread_cond_wait(&io->cond, &io->mutex);
+    }
+    if (io->head == NULL && inflight == 0) {
+      break;
+    }
+    int queued = 0;
+    while (io->head != NULL && inflight < ASYNC_IO_QUEUE_DEPTH) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+      if (sqe == NULL) {
+        break;
+      }
+      request *req = io->head;
+      io->head = req->next;
+      if (io->head == NULL) {
+        io->tail = NULL;
+      }
+      io_uring_prep_write(sqe, req->f->fd, req->buf + req->done,
+                          req->len - req->done, req->offset + req->done);
+      if (req->barrier) {
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+      }
+      io_uring_sqe_set_data(sqe, req);
+      inflight++;
+      queued++;
+    }
+    pthread_mutex_unlock(&io->mutex);
+
+    if (queued > 0) {
+      io_uring_submit(&io->ring);
+    }
+    // 少なくとも1つの完了を待ち, 完了した書き込みをまとめて処理する
+    struct io_uring_cqe *cqe = NULL;
+    int ret = (inflight > 0) ? io_uring_wait_cqe(&io->ring, &cqe) : -EAGAIN;
+    pthread_mutex_lock(&io->mutex);
+    while (ret == 0) {
+      request *req = (request *)io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+      io_uring_cqe_seen(&io->ring, cqe);
+      inflight--;
+      if (res > 0 && req->done + res < req->len) {
+        // 途中まで書き込まれたときは残りを先頭に戻す
+        req->done += res;
+        req->barrier = 1;
+        req->next = io->head;
+        io->head = req;
+        if (io->tail == NULL) {
+          io->tail = req;
+        }
+      } else {
+        if (res > 0) {
+          req->done += res;
+        }
+        complete(io, req, (res < 0) ? -res : (res == 0) ? EIO : 0);
+      }
+      ret = io_uring_peek_cqe(&io->ring, &cqe);
+    }
+  }
+}
+#endif
+
+/// @brief 依頼された書き込みを実行し続けます
+/// 終了を要求された後も, 依頼済みの書き込みをすべて実行してから終了する
+/// @param arg [IN/OUT] 非同期の書き込み (`async_io`)
+/// @return NULL
+static void *io_thread(void *arg) {
+  async_io *io = (async_io *)arg;
+  pthread_mutex_lock(&io->mutex);
+#ifdef HAVE_LIBURING
+  if (io->uring) {
+    run_uring(io);
+  } else {
+    run_pwrite(io);
+  }
+#else
+  run_pwrite(io);
+#endif
+  pthread_mutex_unlock(&io->mutex);
+  return NULL;
+}
+
+async_io *async_io_open(size_t buffer_size) {
+  async_io *io = (async_io *)calloc(1, sizeof(async_io));
+  if (io == NULL ||
+      (io->free_buffers = (char **)calloc(ASYNC_IO_QUEUE_DEPTH,
+                                          sizeof(char *))) == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    free(io);
+    return NULL;
+  }
+  io->buffer_size = (buffer_size + ASYNC_IO_ALIGNMENT - 1) /
+                    ASYNC_IO_ALIGNMENT * ASYNC_IO_ALIGNMENT;
+  if (io->buffer_size == 0) {
+    io->buffer_size = ASYNC_IO_ALIGNMENT;
+  }
+  pthread_mutex_init(&io->mutex, NULL);
+  pthread_cond_init(&io->cond, NULL);
+  pthread_cond_init(&io->done_cond, NULL);
+#ifdef HAVE_LIBURING
+  // カーネルが対応していないときなどはpwriteで書き込む
+  io->uring = (io_uring_queue_init(ASYNC_IO_QUEUE_DEPTH, &io->ring, 0) == 0);
+#endif
+  if (pthread_create(&io->thread, NULL, io_thread, io) != 0) {
+    fprintf(stderr, "error: failed to start write thread\n");
+    async_io_close(io);
+    return NULL;
+  }
+  io->running = 1;
+  return io;
+}
+
+const char *async_io_backend(const async_io *io) {
+#ifdef HAVE_LIBURING
+  if (io->uring) {
+    return "io_uring";
+  }
+#endif
+  return "thread";
+}
+
+int async_io_open_file(async_io *io, const char *path, int flags,
+                       AVIOContext **pb) {
+  unsigned char *buffer = NULL;
+  async_file *f = (async_file *)calloc(1, sizeof(async_file));
+  if (f == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  f->io = io;
+  f->flush = (flags & ASYNC_IO_FLUSH) != 0;
+  f->fd = open(path,
+               O_WRONLY | O_CREAT | ((flags & ASYNC_IO_TRUNCATE) ? O_TRUNC : 0),
+               0644);
+  if (f->fd < 0) {
+    int ret = AVERROR(errno);
+    free(f);
+    return ret;
+  }
+  if ((buffer = (unsigned char *)av_malloc(AVIO_BUFFER_SIZE)) == NULL ||
+      (f->pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, f, NULL,
+                                  write_file, seek_file)) == NULL) {
+    av_free(buffer);
+    close(f->fd);
+    free(f);
+    return AVERROR(ENOMEM);
+  }
+  // mp4のトレーラでmdatのサイズを書き戻せるようにする
+  f->pb->seekable = AVIO_SEEKABLE_NORMAL;
+  *pb = f->pb;
+  return 0;
+}
+
+int async_io_close_file(AVIOContext **pb) {
+  if (*pb == NULL) {
+    return 0;
+  }
+  async_file *f = (async_file *)(*pb)->opaque;
+  async_io *io = f->io;
+  avio_flush(*pb);
+  int ret = ((*pb)->error < 0) ? (*pb)->error : 0;
+  if (submit(f) < 0) {
+    ret = AVERROR(ENOMEM);
+    pthread_mutex_lock(&io->mutex);
+    put_buffer(io, f->buf);
+    pthread_mutex_unlock(&io->mutex);
+  }
+  pthread_mutex_lock(&io->mutex);
+  while (f->pending > 0) {
+    pthread_cond_wait(&io->done_cond, &io->mutex);
+  }
+  if (f->error != 0 && ret == 0) {
+    ret = AVERROR(f->error);
+  }
+  pthread_mutex_unlock(&io->mutex);
+  if (close(f->fd) != 0 && ret == 0) {
+    ret = AVERROR(errno);
+  }
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  free(f);
+  return ret;
+}
+
+void async_io_get_stats(async_io *io, async_io_stats *stats, int reset) {
+  pthread_mutex_lock(&io->mutex);
+  *stats = io->stats;
+  if (reset) {
+    io->stats.latency_max = 0.0;
+    io->stats.depth_max = io->stats.depth;
+  }
+  pthread_mutex_unlock(&io->mutex);
+}
+
+void async_io_close(async_io *io) {
+  if (io == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&io->mutex);
+  io->stopping = 1;
+  pthread_cond_broadcast(&io->cond);
+  pthread_mutex_unlock(&io->mutex);
+  if (io->running) {
+    pthread_join(io->thread, NULL);
+  }
+#ifdef HAVE_LIBURING
+  if (io->uring) {
+    io_uring_queue_exit(&io->ring);
+  }
+#endif
+  for (int i = 0; i < io->nfree; i++) {
+    free(io->free_buffers[i]);
+  }
+  free(io->free_buffers);
+  pthread_mutex_destroy(&io->mutex);
+  pthread_cond_destroy(&io->cond);
+  pthread_cond_destroy(&io->done_cond);
+  free(io);
+}
@@ -0,0 +1,79 @@
+/*
+ * async-io
+ * mp4ファイルへの書き込みを大きなバッファにまとめ, 別のスレッドで非同期に書き込む
+ * (多数のカメラの小さな書き込みがディスク上で細かいランダムな書き込みになるのを避けるため)
+ *
+ * - FFmpegの出力 (`AVIOContext`) の書き込みを, ファイルごとに境界を揃えたバッファへ溜める
+ * - 溜まったバッファは書き込みスレッドがio_uring (liburingがあるとき) またはpwriteで書き込む
+ * - トレーラのための後方へのシークは, 前の書き込みの完了を待ってから書き込む
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+#include <stddef.h>
+#include <stdint.h>
+
+// バッファの境界 [byte]
+#define ASYNC_IO_ALIGNMENT 4096
+// 書き込み中のバッファ数の上限 (io_uringのキューの深さ)
+#define ASYNC_IO_QUEUE_DEPTH 64
+
+// `async_io_open_file` のフラグ
+#define ASYNC_IO_TRUNCATE 1 // 既存のファイルの内容を捨てる
+#define ASYNC_IO_FLUSH 2    // `avio_flush` のたびにバッファを書き込む
+
+typedef struct async_io async_io;
+
+// 書き込みの統計
+typedef struct {
+  uint64_t writes;      // 完了した書き込み数
+  uint64_t bytes;       // 書き込んだバイト数
+  double latency_total; // 依頼から完了までの時間の合計 [sec]
+  double latency_max;   // 依頼から完了までの時間の最大 [sec]
+  int depth;            // 完了していない書き込み数
+  int depth_max;        // 完了していない書き込み数の最大
+  uint64_t stalls;      // 書き込み数の上限により依頼を待たせた回数
+  double stalled;       // 依頼を待たせた時間の合計 [sec]
+} async_io_stats;
+
+/// @brief 書き込みスレッドを開始します
+/// @param buffer_size [IN] ファイルごとのバッファのサイズ [byte], `ASYNC_IO_ALIGNMENT` の倍数に切り上げる
+/// @return 非同期の書き込み, 失敗したときNULL
+async_io *async_io_open(size_t buffer_size);
+
+/// @brief 書き込みの方式を返します
+/// @param io [IN] 非同期の書き込み
+/// @return `"io_uring"` または `"thread"`
+const char *async_io_backend(const async_io *io);
+
+/// @brief ファイルを書き込み用に開きます
+/// @param io [IN/OUT] 非同期の書き込み
+/// @param path [IN] ファイル名
+/// @param flags [IN] `ASYNC_IO_TRUNCATE`, `ASYNC_IO_FLUSH` の組み合わせ
+/// @param pb [OUT] 出力, `async_io_close_file` で閉じる
+/// @return 終了コード, `0` のとき正常終了, 失敗したときFFmpegのエラーコード
+int async_io_open_file(async_io *io, const char *path, int flags,
+                       AVIOContext **pb);
+
+/// @brief 残りのデータを書き込み, 完了を待ってからファイルを閉じます
+/// @param pb [IN/OUT] `async_io_open_file` で開いた出力, 閉じた後はNULL
+/// @return 終了コード, `0` のとき正常終了, 書き込みに失敗したときFFmpegのエラーコード
+int async_io_close_file(AVIOContext **pb);
+
+/// @brief 書き込みの統計を返します
+/// @param io [IN/OUT] 非同期の書き込み
+/// @param stats [OUT] 統計
+/// @param reset [IN] `1` のとき最大値を0に戻す
+void async_io_get_stats(async_io *io, async_io_stats *stats, int reset);
+
+/// @brief 書き込みスレッドを終了します, すべてのファイルを閉じてから呼び出す
+/// @param io [IN/OUT] 非同期の書き込み, NULLのときは何もしない
+void async_io_close(async_io *io);
+
+#endif
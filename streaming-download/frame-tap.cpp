@@ -0,0 +1,389 @@
+/*
+ * frame-tap
+ * 受信した映像のキーフレームのみを復号・縮小し, 解析関数に渡す
+ * (静止画APIを周期的に呼び出さずに, 録画中のストリームを解析するため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "frame-tap.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+// 解析に渡すフレームの画素形式 (OpenCVの既定の並び)
+#define FRAME_TAP_PIX_FMT AV_PIX_FMT_BGR24
+
+struct frame_tap_channel {
+  char name[64];
+  frame_tap *tap;
+  int video_stream_index; // 受信スレッドのみが使う
+
+  // タップの排他で保護する
+  struct frame_tap_channel *next; // 解析待ちのリスト
+  int scheduled; // 解析待ちまたは解析中のとき `1`
+  AVCodecParameters *par; // 新しい入力の映像のパラメータ, 解析スレッドが受け取る
+  AVRational time_base;
+  AVPacket *pending;   // 解析待ちのキーフレーム
+  int has_pending;     // `pending` があるとき `1`
+  double pending_time; // `pending` を受信した時刻 [sec]
+
+  // 解析スレッドのみが使う, 同時に1つのスレッドのみが扱う
+  AVCodecContext *dec;
+  struct SwsContext *sws;
+  int warned; // 復号の失敗を表示したとき `1`, 入力ごとに1回のみ表示する
+
+  uint64_t analyzed;
+  uint64_t skipped;
+};
+
+struct frame_tap {
+  int width;
+  int height;
+  frame_analyzer analyzer;
+  void *opaque;
+  frame_tap_channel *channels[FRAME_TAP_MAX_CHANNELS];
+  int nchannels;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  frame_tap_channel *head; // 解析待ちのチャネル
+  frame_tap_channel *tail;
+  // 縮小したフレームのプール, スレッド数と同数を確保し再利用する
+  AVFrame **frames;
+  int nframes;
+  int stopping; // 終了するとき `1`
+  pthread_t *threads;
+  int nthreads;
+};
+
+/// @brief 現在のUNIX時間 [sec] を返します
+static double realtime_now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/// @brief チャネルを解析待ちのリストに追加します, タップの排他を取得して呼び出す
+static void schedule(frame_tap *tap, frame_tap_channel *ch) {
+  ch->scheduled = 1;
+  ch->next = NULL;
+  if (tap->tail != NULL) {
+    tap->tail->next = ch;
+  } else {
+    tap->head = ch;
+  }
+  tap->tail = ch;
+  pthread_cond_signal(&tap->cond);
+}
+
+/// @brief 新しい入力の復号器を開きます
+static int open_decoder(frame_tap_channel *ch, const AVCodecParameters *par,
+                        AVRational time_base) {
+  avcodec_free_context(&ch->dec);
+  ch->warned = 0;
+  const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+  if (codec == NULL) {
+    fprintf(stderr, "%s: warning: no decoder for %s, not analyzing\n",
+            ch->name, avcodec_get_name(par->codec_id));
+    return 1;
+  }
+  if ((ch->dec = avcodec_alloc_context3(codec)) == NULL ||
+      avcodec_parameters_to_context(ch->dec, par) < 0) {
+    goto error;
+  }
+  ch->dec->pkt_timebase = time_base;
+  // キーフレームのみを渡すため, 非参照フレームの復号は省く
+  ch->dec->skip_frame = AVDISCARD_NONREF;
+  // 並列化はカメラ間で行い, 1台の復号は1スレッドで済ませる
+  ch->dec->thread_count = 1;
+  if (avcodec_open2(ch->dec, codec, NULL) < 0) {
+    goto error;
+  }
+  return 0;
+
+error:
+  fprintf(stderr, "%s: warning: failed to open decoder, not analyzing\n",
+          ch->name);
+  avcodec_free_context(&ch->dec);
+  return 1;
+}
+
+/// @brief キーフレームを復号・縮小し解析関数に渡します
+/// @param tap [IN] 解析のタップ
+/// @param ch [IN/OUT] チャネル
+/// @param pkt [IN] キーフレーム
+/// @param t [IN] 受信した時刻 [sec]
+/// @param decoded [IN/OUT] 復号したフレームの作業領域
+/// @param scaled [IN/OUT] 縮小したフレーム, プールから取り出したもの
+/// @return `AVERROR`, `0` 以上のとき正常終了
+static int analyze_packet(frame_tap *tap, frame_tap_channel *ch,
+                          const AVPacket *pkt, double t, AVFrame *decoded,
+                          AVFrame *scaled) {
+  int ret = avcodec_send_packet(ch->dec, pkt);
+  if (ret >= 0) {
+    // 後続のフレームを待たずに出力させる
+    ret = avcodec_send_packet(ch->dec, NULL);
+  }
+  while (ret >= 0) {
+    if ((ret = avcodec_receive_frame(ch->dec, decoded)) < 0) {
+      break;
+    }
+    ch->sws = sws_getCachedContext(
+        ch->sws, decoded->width, decoded->height,
+        (enum AVPixelFormat)decoded->format, tap->width, tap->height,
+        FRAME_TAP_PIX_FMT, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if (ch->sws == NULL) {
+      ret = AVERROR(EINVAL);
+      break;
+    }
+    sws_scale(ch->sws, (const uint8_t *const *)decoded->data,
+              decoded->linesize, 0, decoded->height, scaled->data,
+              scaled->linesize);
+    scaled->pts = decoded->best_effort_timestamp;
+    av_frame_unref(decoded);
+    tap->analyzer(ch->name, scaled, t, tap->opaque);
+    __atomic_add_fetch(&ch->analyzed, 1, __ATOMIC_RELAXED);
+  }
+  // 次のキーフレームのために復号器を初期状態に戻す
+  avcodec_flush_buffers(ch->dec);
+  return (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) ? 0 : ret;
+}
+
+/// @brief 解析待ちのチャネルのキーフレームを解析し続けます
+/// @param arg [IN/OUT] 解析のタップ (`frame_tap`)
+/// @return NULL
+static void *analyze_thread(void *arg) {
+  frame_tap *tap = (frame_tap *)arg;
+  AVPacket *pkt = av_packet_alloc();
+  AVFrame *decoded = av_frame_alloc();
+  if (pkt == NULL || decoded == NULL) {
+    fprintf(stderr, "error: out of memory in analysis thread\n");
+    goto end;
+  }
+
+  pthread_mutex_lock(&tap->mutex);
+  while (1) {
+    while (!tap->stopping && tap->head == NULL) {
+      pthread_cond_wait(&tap->cond, &tap->mutex);
+    }
+    if (tap->stopping) {
+      break;
+    }
+    frame_tap_channel *ch = tap->head;
+    tap->head = ch->next;
+    if (tap->head == NULL) {
+      tap->tail = NULL;
+    }
+    AVCodecParameters *par = ch->par;
+    ch->par = NULL;
+    AVRational time_base = ch->time_base;
+    int has_packet = ch->has_pending;
+    double t = ch->pending_time;
+    av_packet_move_ref(pkt, ch->pending);
+    ch->has_pending = 0;
+    AVFrame *scaled = tap->frames[--tap->nframes];
+    pthread_mutex_unlock(&tap->mutex);
+
+    if (par != NULL) {
+      open_decoder(ch, par, time_base);
+      avcodec_parameters_free(&par);
+    }
+    if (has_packet && ch->dec != NULL) {
+      int ret = analyze_packet(tap, ch, pkt, t, decoded, scaled);
+      if (ret < 0 && !ch->warned) {
+        char buf[64];
+        av_strerror(ret, buf, sizeof(buf));
+        fprintf(stderr, "%s: warning: failed to decode keyframe: %s\n",
+                ch->name, buf);
+        ch->warned = 1;
+      }
+    }
+    av_packet_unref(pkt);
+
+    pthread_mutex_lock(&tap->mutex);
+    tap->frames[tap->nframes++] = scaled;
+    // 解析中に届いたキーフレームは後ろに並び直して処理する
+    if (ch->has_pending || ch->par != NULL) {
+      schedule(tap, ch);
+    } else {
+      ch->scheduled = 0;
+    }
+  }
+  pthread_mutex_unlock(&tap->mutex);
+
+end:
+  av_frame_free(&decoded);
+  av_packet_free(&pkt);
+  return NULL;
+}
+
+frame_tap *frame_tap_open(int width, int height, int nthreads,
+                          frame_analyzer analyzer, void *opaque) {
+  frame_tap *tap = (frame_tap *)calloc(1, sizeof(frame_tap));
+  if (tap == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  tap->width = width;
+  tap->height = height;
+  tap->analyzer = analyzer;
+  tap->opaque = opaque;
+  pthread_mutex_init(&tap->mutex, NULL);
+  pthread_cond_init(&tap->cond, NULL);
+  if ((tap->frames = (AVFrame **)calloc(nthreads, sizeof(AVFrame *))) ==
+          NULL ||
+      (tap->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) ==
+          NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    goto error;
+  }
+
+  // 縮小先のフレームは最初にまとめて確保し, 解析のたびに確保しない
+  for (; tap->nframes < nthreads; tap->nframes++) {
+    AVFrame *frame = av_frame_alloc();
+    tap->frames[tap->nframes] = frame;
+    if (frame == NULL) {
+      fprintf(stderr, "error: out of memory\n");
+      goto error;
+    }
+    frame->width = width;
+    frame->height = height;
+    frame->format = FRAME_TAP_PIX_FMT;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+      fprintf(stderr, "error: failed to allocate %dx%d frame\n", width,
+              height);
+      tap->nframes++;
+      goto error;
+    }
+  }
+  for (; tap->nthreads < nthreads; tap->nthreads++) {
+    if (pthread_create(&tap->threads[tap->nthreads], NULL, analyze_thread,
+                       tap) != 0) {
+      fprintf(stderr, "error: failed to start analysis thread\n");
+      goto error;
+    }
+  }
+  fprintf(stderr, "analyzing keyframes at %dx%d on %d threads\n", width,
+          height, nthreads);
+  return tap;
+
+error:
+  frame_tap_close(tap);
+  return NULL;
+}
+
+frame_tap_channel *frame_tap_add_channel(frame_tap *tap, const char *name) {
+  if (tap->nchannels == FRAME_TAP_MAX_CHANNELS) {
+    fprintf(stderr, "error: too many analysis channels\n");
+    return NULL;
+  }
+  frame_tap_channel *ch =
+      (frame_tap_channel *)calloc(1, sizeof(frame_tap_channel));
+  if (ch == NULL || (ch->pending = av_packet_alloc()) == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    free(ch);
+    return NULL;
+  }
+  snprintf(ch->name, sizeof(ch->name), "%s", name);
+  ch->tap = tap;
+  ch->video_stream_index = -1;
+  tap->channels[tap->nchannels++] = ch;
+  return ch;
+}
+
+int frame_tap_set_input(frame_tap_channel *ch, const AVFormatContext *ic,
+                        int video_stream_index) {
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  if (par == NULL ||
+      avcodec_parameters_copy(
+          par, ic->streams[video_stream_index]->codecpar) < 0) {
+    fprintf(stderr, "%s: error: failed to copy stream for analysis\n",
+            ch->name);
+    avcodec_parameters_free(&par);
+    return 1;
+  }
+  ch->video_stream_index = video_stream_index;
+
+  frame_tap *tap = ch->tap;
+  pthread_mutex_lock(&tap->mutex);
+  avcodec_parameters_free(&ch->par);
+  ch->par = par;
+  ch->time_base = ic->streams[video_stream_index]->time_base;
+  // 古い入力のキーフレームは新しい復号器に渡さない
+  av_packet_unref(ch->pending);
+  ch->has_pending = 0;
+  if (!ch->scheduled) {
+    schedule(tap, ch);
+  }
+  pthread_mutex_unlock(&tap->mutex);
+  return 0;
+}
+
+void frame_tap_publish(frame_tap_channel *ch, const AVPacket *pkt) {
+  if (pkt->stream_index != ch->video_stream_index ||
+      !(pkt->flags & AV_PKT_FLAG_KEY)) {
+    return;
+  }
+  double t = realtime_now();
+  frame_tap *tap = ch->tap;
+  pthread_mutex_lock(&tap->mutex);
+  if (ch->has_pending) {
+    // 解析が追いつかないときは最新のキーフレームのみを残す
+    av_packet_unref(ch->pending);
+    ch->has_pending = 0;
+    __atomic_add_fetch(&ch->skipped, 1, __ATOMIC_RELAXED);
+  }
+  if (av_packet_ref(ch->pending, pkt) >= 0) {
+    ch->has_pending = 1;
+    ch->pending_time = t;
+    if (!ch->scheduled) {
+      schedule(tap, ch);
+    }
+  }
+  pthread_mutex_unlock(&tap->mutex);
+}
+
+void frame_tap_stats(const frame_tap_channel *ch, uint64_t *analyzed,
+                     uint64_t *skipped) {
+  *analyzed = __atomic_load_n(&ch->analyzed, __ATOMIC_RELAXED);
+  *skipped = __atomic_load_n(&ch->skipped, __ATOMIC_RELAXED);
+}
+
+void frame_tap_close(frame_tap *tap) {
+  if (tap == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&tap->mutex);
+  tap->stopping = 1;
+  pthread_cond_broadcast(&tap->cond);
+  pthread_mutex_unlock(&tap->mutex);
+  for (int i = 0; i < tap->nthreads; i++) {
+    pthread_join(tap->threads[i], NULL);
+  }
+
+  for (int i = 0; i < tap->nchannels; i++) {
+    frame_tap_channel *ch = tap->channels[i];
+    avcodec_parameters_free(&ch->par);
+    av_packet_free(&ch->pending);
+    avcodec_free_context(&ch->dec);
+    sws_freeContext(ch->sws);
+    free(ch);
+  }
+  if (tap->frames != NULL) {
+    for (int i = 0; i < tap->nframes; i++) {
+      av_frame_free(&tap->frames[i]);
+    }
+  }
+  pthread_mutex_destroy(&tap->mutex);
+  pthread_cond_destroy(&tap->cond);
+  free(tap->frames);
+  free(tap->threads);
+  free(tap);
+}
@@ -0,0 +1,74 @@
+/*
+ * frame-tap
+ * 受信した映像のキーフレームのみを復号・縮小し, 解析関数に渡す
+ * (静止画APIを周期的に呼び出さずに, 録画中のストリームを解析するため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef FRAME_TAP_H
+#define FRAME_TAP_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// 解析するカメラ数の上限
+#define FRAME_TAP_MAX_CHANNELS 1024
+
+typedef struct frame_tap frame_tap;
+typedef struct frame_tap_channel frame_tap_channel;
+
+/// @brief 解析関数, 解析スレッドから呼び出される
+/// 異なるカメラのフレームは複数のスレッドから同時に呼び出されることがある
+/// @param name [IN] カメラの名前 (デバイスID)
+/// @param frame [IN] 縮小したフレーム (BGR24), 呼び出しの間のみ有効
+/// @param t [IN] キーフレームを受信した時刻 (UNIX時間) [sec]
+/// @param opaque [IN/OUT] `frame_tap_open` に渡したポインタ
+typedef void (*frame_analyzer)(const char *name, const AVFrame *frame,
+                               double t, void *opaque);
+
+/// @brief 解析スレッドを開始します
+/// @param width [IN] 縮小後の幅 [pixel]
+/// @param height [IN] 縮小後の高さ [pixel]
+/// @param nthreads [IN] 解析スレッド数
+/// @param analyzer [IN] 解析関数
+/// @param opaque [IN/OUT] 解析関数に渡すポインタ
+/// @return 解析のタップ, 失敗したときNULL
+frame_tap *frame_tap_open(int width, int height, int nthreads,
+                          frame_analyzer analyzer, void *opaque);
+
+/// @brief 解析するカメラを登録します, 受信を開始する前に呼び出す
+/// @param tap [IN/OUT] 解析のタップ
+/// @param name [IN] カメラの名前 (デバイスID)
+/// @return 解析のチャネル, 失敗したときNULL
+frame_tap_channel *frame_tap_add_channel(frame_tap *tap, const char *name);
+
+/// @brief 新しい入力の映像ストリームを通知します (受信スレッド)
+/// 解析スレッドは次のキーフレームの前に復号器を開き直す
+/// @param ch [IN/OUT] チャネル
+/// @param ic [IN] 入力
+/// @param video_stream_index [IN] 映像ストリームの番号
+/// @return 終了コード, `0` のとき正常終了
+int frame_tap_set_input(frame_tap_channel *ch, const AVFormatContext *ic,
+                        int video_stream_index);
+
+/// @brief 映像のキーフレームを解析スレッドへ渡します (受信スレッド)
+/// それ以外のパケットは無視する, データはコピーせず参照を増やす
+/// 前のキーフレームの解析が終わっていないときは, 待たずに古い方を捨てる
+/// @param ch [IN/OUT] チャネル
+/// @param pkt [IN] パケット
+void frame_tap_publish(frame_tap_channel *ch, const AVPacket *pkt);
+
+/// @brief 解析の統計を返します
+/// @param ch [IN] チャネル
+/// @param analyzed [OUT] 解析したフレーム数
+/// @param skipped [OUT] 解析が間に合わず捨てたキーフレーム数
+void frame_tap_stats(const frame_tap_channel *ch, uint64_t *analyzed,
+                     uint64_t *skipped);
+
+/// @brief 解析スレッドを終了します, 解析中のフレームを待ち未処理のものは捨てる
+/// @param tap [IN/OUT] 解析のタップ, NULLのときは何もしない
+void frame_tap_close(frame_tap *tap);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * packet-queue
+ * 受信スレッドから書き込みスレッドへパケットを渡す固定長のキュー
+ * (単一生産者, 単一消費者のロックフリーなリングバッファ)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "packet-queue.h"
+
+#include <string.h>
+
+#define PACKET_QUEUE_MASK (PACKET_QUEUE_SIZE - 1)
+
+int packet_queue_init(packet_queue *q) {
+  memset(q, 0, sizeof(packet_queue));
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  return 0;
+}
+
+void packet_queue_cleanup(packet_queue *q) {
+  for (int i = 0; i < PACKET_QUEUE_SIZE; i++) {
+    // 枠のパケットが持つ参照も解放される, 未確保の枠は何もしない
+    av_packet_free(&q->slots[i]);
+  }
+  pthread_mutex_destroy(&q->mutex);
+  pthread_cond_destroy(&q->cond);
+}
+
+int packet_queue_push(packet_queue *q, AVPacket *pkt, int video_stream_index) {
+  uint64_t tail = q->tail;
+  uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+  // 満杯の後はキーフレームから再開し, 途中から復号できないパケットを残さない
+  if (q->dropping && pkt->stream_index >= 0) {
+    if (pkt->stream_index != video_stream_index ||
+        !(pkt->flags & AV_PKT_FLAG_KEY) || tail - head == PACKET_QUEUE_SIZE) {
+      av_packet_unref(pkt);
+      __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    q->dropping = 0;
+  } else if (tail - head == PACKET_QUEUE_SIZE) {
+    q->dropping = 1;
+    av_packet_unref(pkt);
+    __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  AVPacket **slot = &q->slots[tail & PACKET_QUEUE_MASK];
+  if (*slot == NULL && (*slot = av_packet_alloc()) == NULL) {
+    av_packet_unref(pkt);
+    __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  av_packet_move_ref(*slot, pkt);
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  // 消費者が待っているときのみ起こす
+  if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+  }
+  return 1;
+}
+
+void packet_queue_close(packet_queue *q, int error) {
+  q->error = error;
+  __atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&q->mutex);
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+int packet_queue_pop(packet_queue *q, AVPacket *pkt) {
+  uint64_t head = q->head;
+  uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    // `waiting` を立ててから再確認するため, 生産者の追加を見逃さない
+    pthread_mutex_lock(&q->mutex);
+    __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+      // 終了の通知より前に追加されたパケットを取りこぼさないよう先に読む
+      int closed = __atomic_load_n(&q->closed, __ATOMIC_SEQ_CST);
+      tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+      if (tail != head || closed) {
+        break;
+      }
+      pthread_cond_wait(&q->cond, &q->mutex);
+    }
+    __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->mutex);
+    if (head == tail) {
+      return 0;
+    }
+  }
+  av_packet_move_ref(pkt, q->slots[head & PACKET_QUEUE_MASK]);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int packet_queue_try_pop(packet_queue *q, AVPacket *pkt) {
+  uint64_t head = q->head;
+  // 終了の通知より前に追加されたパケットを取りこぼさないよう先に読む
+  int closed = __atomic_load_n(&q->closed, __ATOMIC_SEQ_CST);
+  uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+  if (head == tail) {
+    return closed ? -1 : 0;
+  }
+  av_packet_move_ref(pkt, q->slots[head & PACKET_QUEUE_MASK]);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+uint64_t packet_queue_depth(packet_queue *q) {
+  uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  return tail - head;
+}
+
+uint64_t packet_queue_dropped(packet_queue *q) {
+  return __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,87 @@
+/*
+ * packet-queue
+ * 受信スレッドから書き込みスレッドへパケットを渡す固定長のキュー
+ * (単一生産者, 単一消費者のロックフリーなリングバッファ)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// キューの容量 [パケット], 2のべき乗
+// ライブ映像 (映像30fps + 音声) の1分以上に相当し, ディスクの一時的な停滞を吸収する
+#define PACKET_QUEUE_SIZE 4096
+
+typedef struct {
+  // 枠のパケットは初めて使うときに確保し, 以降は再利用する
+  // 多数のカメラを扱うときもメモリは実際に溜まったパケット数の分のみ使う
+  AVPacket *slots[PACKET_QUEUE_SIZE];
+  uint64_t head; // 次に取り出す位置, 消費者のみが書き込む
+  uint64_t tail; // 次に追加する位置, 生産者のみが書き込む
+  int closed;    // 生産者が終了したとき `1`
+  int error;     // 生産者の終了コード, `0` のとき正常終了
+
+  // 空のキューで消費者が待つときのみ使う
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int waiting; // 消費者が待っているとき `1`
+
+  // 統計, 生産者のみが書き込む
+  uint64_t dropped; // キューが満杯のため捨てたパケット数
+  int dropping; // 満杯になった後, 次のキーフレームまで捨てているとき `1`
+} packet_queue;
+
+/// @brief キューを初期化します
+/// @param q [OUT] キュー
+/// @return 終了コード, `0` のとき正常終了
+int packet_queue_init(packet_queue *q);
+
+/// @brief キューを解放します, 残っているパケットも解放する
+/// @param q [IN/OUT] キュー
+void packet_queue_cleanup(packet_queue *q);
+
+/// @brief パケットをキューに追加します (生産者)
+/// データはコピーせず参照を移し, `pkt` は空になる
+/// キューが満杯のときは待たずに捨て, 以降も次の映像のキーフレームまで捨てる
+/// `stream_index` が負の制御パケットはキーフレームを待つ間も捨てない
+/// @param q [IN/OUT] キュー
+/// @param pkt [IN/OUT] 追加するパケット
+/// @param video_stream_index [IN] キーフレームを判定する映像ストリーム
+/// @return キューに追加したとき `1`, 捨てたとき `0`
+int packet_queue_push(packet_queue *q, AVPacket *pkt, int video_stream_index);
+
+/// @brief キューの終了を通知します (生産者)
+/// @param q [IN/OUT] キュー
+/// @param error [IN] 生産者の終了コード
+void packet_queue_close(packet_queue *q, int error);
+
+/// @brief パケットをキューから取り出します (消費者), 空のときは追加されるまで待つ
+/// @param q [IN/OUT] キュー
+/// @param pkt [OUT] 取り出したパケット, 参照が移される
+/// @return 取り出したとき `1`, キューが終了し空のとき `0`
+int packet_queue_pop(packet_queue *q, AVPacket *pkt);
+
+/// @brief パケットをキューから待たずに取り出します (消費者)
+/// @param q [IN/OUT] キュー
+/// @param pkt [OUT] 取り出したパケット, 参照が移される
+/// @return 取り出したとき `1`, 空のとき `0`, キューが終了し空のとき `-1`
+int packet_queue_try_pop(packet_queue *q, AVPacket *pkt);
+
+/// @brief キューに溜まっているパケット数を返します
+/// @param q [IN] キュー
+/// @return パケット数
+uint64_t packet_queue_depth(packet_queue *q);
+
+/// @brief キューが満杯のため捨てたパケット数を返します
+/// @param q [IN] キュー
+/// @return パケット数
+uint64_t packet_queue_dropped(packet_queue *q);
+
+#endif
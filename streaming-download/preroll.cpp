@@ -0,0 +1,129 @@
+/*
+ * preroll
+ * 直近の一定時間のパケットをメモリに保持するリングバッファ
+ * (切り出しの要求より前の映像を書き込むため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "preroll.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// 最初に確保するパケット数
+#define PREROLL_INITIAL_CAPACITY 256
+
+void preroll_init(preroll *r) { memset(r, 0, sizeof(preroll)); }
+
+void preroll_cleanup(preroll *r) {
+  preroll_clear(r);
+  for (int i = 0; i < r->capacity; i++) {
+    av_packet_free(&r->pkts[i]);
+  }
+  free(r->pkts);
+  free(r->times);
+  memset(r, 0, sizeof(preroll));
+}
+
+void preroll_clear(preroll *r) {
+  for (int i = 0; i < r->count; i++) {
+    av_packet_unref(preroll_at(r, i));
+  }
+  r->head = 0;
+  r->count = 0;
+  r->bytes = 0;
+}
+
+/// @brief 先頭から `n` 個のパケットを捨てます
+static void drop(preroll *r, int n) {
+  for (int i = 0; i < n; i++) {
+    AVPacket *pkt = preroll_at(r, 0);
+    r->bytes -= pkt->size;
+    av_packet_unref(pkt);
+    r->head = (r->head + 1) % r->capacity;
+    r->count--;
+  }
+}
+
+/// @brief 容量を倍にします, 古い順に並べ直す
+static int grow(preroll *r) {
+  int capacity =
+      (r->capacity == 0) ? PREROLL_INITIAL_CAPACITY : r->capacity * 2;
+  AVPacket **pkts = (AVPacket **)calloc(capacity, sizeof(AVPacket *));
+  double *times = (double *)calloc(capacity, sizeof(double));
+  if (pkts == NULL || times == NULL) {
+    free(pkts);
+    free(times);
+    return -1;
+  }
+  // 確保済みのパケットは再利用する
+  for (int i = 0; i < r->capacity; i++) {
+    int j = (r->head + i) % r->capacity;
+    pkts[i] = r->pkts[j];
+    times[i] = r->times[j];
+  }
+  free(r->pkts);
+  free(r->times);
+  r->pkts = pkts;
+  r->times = times;
+  r->capacity = capacity;
+  r->head = 0;
+  return 0;
+}
+
+int preroll_push(preroll *r, const AVPacket *pkt, double t, int keyframe) {
+  if (r->count == 0 && !keyframe) {
+    return 0;
+  }
+  if (r->count == r->capacity && grow(r) != 0) {
+    return -1;
+  }
+  int i = (r->head + r->count) % r->capacity;
+  if (r->pkts[i] == NULL && (r->pkts[i] = av_packet_alloc()) == NULL) {
+    return -1;
+  }
+  if (av_packet_ref(r->pkts[i], pkt) < 0) {
+    return -1;
+  }
+  r->times[i] = t;
+  r->count++;
+  r->bytes += pkt->size;
+  return 1;
+}
+
+void preroll_trim(preroll *r, double keep, int64_t max_bytes,
+                  int video_stream_index) {
+  while (r->count > 0) {
+    // 次のGOPの先頭を探す
+    int next = 1;
+    while (next < r->count) {
+      AVPacket *pkt = preroll_at(r, next);
+      if (pkt->stream_index == video_stream_index &&
+          pkt->flags & AV_PKT_FLAG_KEY) {
+        break;
+      }
+      next++;
+    }
+    if (next == r->count) {
+      // 最新のGOPは上限を超えても捨てない
+      break;
+    }
+    double newest = r->times[(r->head + r->count - 1) % r->capacity];
+    double start = r->times[(r->head + next) % r->capacity];
+    if (start > newest - keep && r->bytes <= max_bytes) {
+      break;
+    }
+    drop(r, next);
+  }
+}
+
+AVPacket *preroll_at(const preroll *r, int i) {
+  return r->pkts[(r->head + i) % r->capacity];
+}
+
+double preroll_duration(const preroll *r) {
+  if (r->count == 0) {
+    return 0.0;
+  }
+  return r->times[(r->head + r->count - 1) % r->capacity] - r->times[r->head];
+}
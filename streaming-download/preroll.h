@@ -0,0 +1,70 @@
+/*
+ * preroll
+ * 直近の一定時間のパケットをメモリに保持するリングバッファ
+ * (切り出しの要求より前の映像を書き込むため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef PREROLL_H
+#define PREROLL_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+typedef struct {
+  // 古い順のパケット (リングバッファ), 必要に応じて拡張する
+  // 先頭は常に映像のキーフレームで, 先頭から復号できる
+  AVPacket **pkts;
+  double *times; // 各パケットの時刻 [sec]
+  int capacity;
+  int head;
+  int count;
+  int64_t bytes; // 保持しているパケットのデータ量の合計 [byte]
+} preroll;
+
+/// @brief リングバッファを初期化します
+/// @param r [OUT] リングバッファ
+void preroll_init(preroll *r);
+
+/// @brief リングバッファを解放します, 保持しているパケットも解放する
+/// @param r [IN/OUT] リングバッファ
+void preroll_cleanup(preroll *r);
+
+/// @brief 保持しているパケットをすべて捨てます
+/// @param r [IN/OUT] リングバッファ
+void preroll_clear(preroll *r);
+
+/// @brief パケットの参照を追加します, データはコピーしない
+/// 空のときは映像のキーフレームまで追加しない
+/// @param r [IN/OUT] リングバッファ
+/// @param pkt [IN] パケット
+/// @param t [IN] パケットの時刻 [sec]
+/// @param keyframe [IN] 映像のキーフレームのとき `1`
+/// @return 追加したとき `1`, 追加しなかったとき `0`, 失敗したとき負
+int preroll_push(preroll *r, const AVPacket *pkt, double t, int keyframe);
+
+/// @brief 古いパケットをGOP単位で捨てます
+/// 最新のパケットから `keep` 秒前以前に始まるGOPのうち最後のものから保持し,
+/// データ量が `max_bytes` を超えるときはさらに古いGOPから捨てる
+/// @param r [IN/OUT] リングバッファ
+/// @param keep [IN] 保持する時間 [sec]
+/// @param max_bytes [IN] 保持するデータ量の上限 [byte]
+/// @param video_stream_index [IN] キーフレームを判定する映像ストリーム
+void preroll_trim(preroll *r, double keep, int64_t max_bytes,
+                  int video_stream_index);
+
+/// @brief 古い方から `i` 番目のパケットを返します
+/// @param r [IN] リングバッファ
+/// @param i [IN] 番号, `0` 以上 `count` 未満
+/// @return パケット
+AVPacket *preroll_at(const preroll *r, int i);
+
+/// @brief 保持しているパケットの時間 [sec] を返します
+/// @param r [IN] リングバッファ
+/// @return 最古と最新のパケットの時刻の差, 空のとき `0`
+double preroll_duration(const preroll *r);
+
+#endif
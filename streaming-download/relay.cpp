@@ -0,0 +1,614 @@
+/*
+ * relay
+ * 受信したパケットをローカルのHTTPクライアントへMPEG-TSで中継する
+ * (1つのHLSの受信を録画と複数の利用者で共有する)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "relay.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "packet-queue.h"
+
+// クライアントへの送信バッファのサイズ [byte], MPEG-TSのパケット (188byte) の倍数
+#define RELAY_IO_BUFFER_SIZE (188 * 64)
+// 要求を受信するときのタイムアウト [sec]
+#define RELAY_REQUEST_TIMEOUT 5
+
+// 入力のストリーム構成, 参照がなくなったとき解放する
+typedef struct {
+  int refs;
+  int nb_streams;
+  AVCodecParameters **params;
+  AVRational *time_bases;
+  int video_stream_index;
+} relay_streams;
+
+// 中継先のクライアント
+typedef struct subscriber {
+  struct subscriber *next;
+  relay *r;
+  relay_channel *ch;
+  int fd;
+  char peer[64];
+  int linked; // チャネルの中継先に含まれるとき `1`, チャネルの排他で保護する
+  packet_queue queue; // 受信スレッドから渡されたパケット
+} subscriber;
+
+struct relay_channel {
+  char name[64];
+  pthread_mutex_t mutex;
+  subscriber *subscribers; // 中継先のリスト
+  int nsubscribers;
+  relay_streams *streams; // 現在の入力のストリーム構成
+  AVPacket *pkt;          // 中継先に渡すパケットの参照, 受信スレッドのみが使う
+};
+
+struct relay {
+  int fd;
+  pthread_t thread;
+  int accepting; // 接続を受け付けるスレッドを開始したとき `1`
+  relay_channel *channels[RELAY_MAX_CHANNELS];
+  int nchannels;
+
+  // 接続中のクライアントのスレッド数, 終了時に待つ
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int nclients;
+  int stopping; // 終了するとき `1`
+};
+
+/// @brief ストリーム構成の参照を解放します
+static void streams_unref(relay_streams *st) {
+  if (st == NULL || __atomic_sub_fetch(&st->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  for (int i = 0; i < st->nb_streams; i++) {
+    avcodec_parameters_free(&st->params[i]);
+  }
+  free(st->params);
+  free(st->time_bases);
+  free(st);
+}
+
+/// @brief ストリーム構成の参照を増やします
+static relay_streams *streams_ref(relay_streams *st) {
+  if (st != NULL) {
+    __atomic_add_fetch(&st->refs, 1, __ATOMIC_RELAXED);
+  }
+  return st;
+}
+
+/// @brief 入力のストリーム構成を複製します
+static relay_streams *streams_copy(const AVFormatContext *ic,
+                                   int video_stream_index) {
+  relay_streams *st = (relay_streams *)calloc(1, sizeof(relay_streams));
+  if (st == NULL) {
+    return NULL;
+  }
+  st->refs = 1;
+  st->video_stream_index = video_stream_index;
+  st->params = (AVCodecParameters **)calloc(ic->nb_streams,
+                                            sizeof(AVCodecParameters *));
+  st->time_bases = (AVRational *)calloc(ic->nb_streams, sizeof(AVRational));
+  if (st->params == NULL || st->time_bases == NULL) {
+    streams_unref(st);
+    return NULL;
+  }
+  for (; st->nb_streams < ic->nb_streams; st->nb_streams++) {
+    int i = st->nb_streams;
+    if ((st->params[i] = avcodec_parameters_alloc()) == NULL ||
+        avcodec_parameters_copy(st->params[i], ic->streams[i]->codecpar) <
+            0) {
+      st->nb_streams++;
+      streams_unref(st);
+      return NULL;
+    }
+    st->time_bases[i] = ic->streams[i]->time_base;
+  }
+  return st;
+}
+
+/// @brief クライアントをチャネルの中継先から外します, チャネルの排他を取得して呼び出す
+static void unlink_subscriber(relay_channel *ch, subscriber *s) {
+  if (!s->linked) {
+    return;
+  }
+  for (subscriber **p = &ch->subscribers; *p != NULL; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  s->linked = 0;
+  __atomic_store_n(&ch->nsubscribers, ch->nsubscribers - 1, __ATOMIC_RELAXED);
+}
+
+relay *relay_open(const char *address) {
+  // `[HOST:]PORT` を分解する
+  char host[64] = "127.0.0.1";
+  const char *port = address;
+  const char *colon = strrchr(address, ':');
+  if (colon != NULL) {
+    if (colon - address >= sizeof(host)) {
+      fprintf(stderr, "error: invalid relay address: %s\n", address);
+      return NULL;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    port = colon + 1;
+  }
+  char *end;
+  long portno = strtol(port, &end, 10);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)portno);
+  if (*port == '\0' || *end != '\0' || portno <= 0 || portno > 65535 ||
+      inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "error: invalid relay address: %s\n", address);
+    return NULL;
+  }
+
+  relay *r = (relay *)calloc(1, sizeof(relay));
+  if (r == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  int on = 1;
+  if ((r->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+      setsockopt(r->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(r->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(r->fd, 16) != 0) {
+    fprintf(stderr, "error: failed to listen on %s:%ld: %s\n", host, portno,
+            strerror(errno));
+    if (r->fd >= 0) {
+      close(r->fd);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->cond);
+    free(r);
+    return NULL;
+  }
+  fprintf(stderr, "relaying on http://%s:%ld/<DEVICEID>.ts\n", host, portno);
+  return r;
+}
+
+relay_channel *relay_add_channel(relay *r, const char *name) {
+  if (r->nchannels == RELAY_MAX_CHANNELS) {
+    fprintf(stderr, "error: too many relay channels\n");
+    return NULL;
+  }
+  relay_channel *ch = (relay_channel *)calloc(1, sizeof(relay_channel));
+  if (ch == NULL || (ch->pkt = av_packet_alloc()) == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    free(ch);
+    return NULL;
+  }
+  snprintf(ch->name, sizeof(ch->name), "%s", name);
+  pthread_mutex_init(&ch->mutex, NULL);
+  r->channels[r->nchannels++] = ch;
+  return ch;
+}
+
+int relay_set_input(relay_channel *ch, const AVFormatContext *ic,
+                    int video_stream_index) {
+  relay_streams *st = streams_copy(ic, video_stream_index);
+  if (st == NULL) {
+    fprintf(stderr, "%s: error: failed to copy streams for relay\n",
+            ch->name);
+    // 前の入力の構成で新しいパケットを中継しないよう, 次の入力まで中継を止める
+    pthread_mutex_lock(&ch->mutex);
+    streams_unref(ch->streams);
+    ch->streams = NULL;
+    pthread_mutex_unlock(&ch->mutex);
+    return 1;
+  }
+
+  pthread_mutex_lock(&ch->mutex);
+  streams_unref(ch->streams);
+  ch->streams = st;
+  // 接続中のクライアントには, 以降のパケットの構成を制御パケットで知らせる
+  subscriber *next;
+  for (subscriber *s = ch->subscribers; s != NULL; s = next) {
+    next = s->next;
+    relay_streams *ref = streams_ref(st);
+    if (av_new_packet(ch->pkt, sizeof(relay_streams *)) >= 0) {
+      memcpy(ch->pkt->data, &ref, sizeof(relay_streams *));
+      ch->pkt->stream_index = -1;
+      if (packet_queue_push(&s->queue, ch->pkt, st->video_stream_index)) {
+        continue;
+      }
+    }
+    // 構成を知らせられないクライアントは切断する
+    streams_unref(ref);
+    fprintf(stderr, "%s: relay: dropped %s, failed to switch streams\n",
+            ch->name, s->peer);
+    unlink_subscriber(ch, s);
+    packet_queue_close(&s->queue, 1);
+    shutdown(s->fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&ch->mutex);
+  return 0;
+}
+
+void relay_publish(relay_channel *ch, const AVPacket *pkt) {
+  if (__atomic_load_n(&ch->nsubscribers, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&ch->mutex);
+  // 入力のストリーム情報を複製できなかったときは中継しない
+  if (ch->streams == NULL) {
+    pthread_mutex_unlock(&ch->mutex);
+    return;
+  }
+  subscriber *next;
+  for (subscriber *s = ch->subscribers; s != NULL; s = next) {
+    next = s->next;
+    uint64_t depth = packet_queue_depth(&s->queue);
+    if (depth >= RELAY_QUEUE_LIMIT) {
+      // 遅いクライアントのために受信を待たせない
+      fprintf(stderr, "%s: relay: dropped %s, %llu packets behind\n",
+              ch->name, s->peer, (unsigned long long)depth);
+      unlink_subscriber(ch, s);
+      packet_queue_close(&s->queue, 1);
+      shutdown(s->fd, SHUT_RDWR);
+      continue;
+    }
+    // データはコピーせず参照のみ増やす
+    if (av_packet_ref(ch->pkt, pkt) < 0) {
+      continue;
+    }
+    packet_queue_push(&s->queue, ch->pkt, ch->streams->video_stream_index);
+  }
+  pthread_mutex_unlock(&ch->mutex);
+}
+
+/// @brief 出力データをクライアントへ送信します (`AVIOContext` の書き込み関数)
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int write_socket(void *opaque, const uint8_t *buf, int size) {
+#else
+static int write_socket(void *opaque, uint8_t *buf, int size) {
+#endif
+  subscriber *s = (subscriber *)opaque;
+  int sent = 0;
+  while (sent < size) {
+    ssize_t n = send(s->fd, buf + sent, size - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return AVERROR(EPIPE);
+    }
+    sent += n;
+  }
+  return size;
+}
+
+/// @brief クライアントへのMPEG-TSの出力を開始します
+static int open_muxer(subscriber *s, relay_streams *st, AVIOContext *pb,
+                      AVFormatContext **poc) {
+  AVFormatContext *oc = NULL;
+  AVDictionary *opts = NULL;
+  if (avformat_alloc_output_context2(&oc, NULL, "mpegts", NULL) < 0) {
+    goto error;
+  }
+  for (int i = 0; i < st->nb_streams; i++) {
+    AVStream *os = avformat_new_stream(oc, NULL);
+    if (os == NULL ||
+        avcodec_parameters_copy(os->codecpar, st->params[i]) < 0) {
+      goto error;
+    }
+    os->codecpar->codec_tag = 0;
+  }
+  oc->pb = pb;
+  // パケットごとに送信し, 遅延を小さくする
+  av_dict_set(&opts, "flush_packets", "1", 0);
+  if (avformat_write_header(oc, &opts) < 0) {
+    goto error;
+  }
+  av_dict_free(&opts);
+  *poc = oc;
+  return 0;
+
+error:
+  fprintf(stderr, "%s: relay: error: failed to start MPEG-TS for %s\n",
+          s->ch->name, s->peer);
+  av_dict_free(&opts);
+  avformat_free_context(oc);
+  *poc = NULL;
+  return 1;
+}
+
+/// @brief クライアントへのMPEG-TSの出力を終了します
+static void close_muxer(AVFormatContext **poc) {
+  if (*poc == NULL) {
+    return;
+  }
+  av_write_trailer(*poc);
+  // 送信用の `AVIOContext` はクライアントごとに再利用する
+  (*poc)->pb = NULL;
+  avformat_free_context(*poc);
+  *poc = NULL;
+}
+
+/// @brief HTTP要求を受信し, 要求されたチャネルを返します
+/// 要求が不正なときは応答を返しNULLを返す
+static relay_channel *read_request(subscriber *s) {
+  char buf[1024];
+  size_t len = 0;
+  while (len < sizeof(buf) - 1) {
+    ssize_t n = recv(s->fd, buf + len, sizeof(buf) - 1 - len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return NULL;
+    }
+    len += n;
+    buf[len] = '\0';
+    if (strstr(buf, "\r\n\r\n") != NULL || strstr(buf, "\n\n") != NULL) {
+      break;
+    }
+  }
+  buf[len] = '\0';
+
+  const char *status = "400 Bad Request";
+  char method[8], path[128];
+  if (sscanf(buf, "%7s %127s", method, path) == 2) {
+    status = "404 Not Found";
+    if (strcmp(method, "GET") != 0) {
+      status = "405 Method Not Allowed";
+    } else if (path[0] == '/' && strlen(path) > 4 &&
+               strcmp(path + strlen(path) - 3, ".ts") == 0) {
+      path[strlen(path) - 3] = '\0';
+      for (int i = 0; i < s->r->nchannels; i++) {
+        if (strcmp(s->r->channels[i]->name, path + 1) == 0) {
+          return s->r->channels[i];
+        }
+      }
+    }
+  }
+  char res[128];
+  int n = snprintf(res, sizeof(res),
+                   "HTTP/1.0 %s\r\nConnection: close\r\n\r\n", status);
+  send(s->fd, res, n, MSG_NOSIGNAL);
+  return NULL;
+}
+
+/// @brief 1つのクライアントへ中継し続けます
+/// @param arg [IN/OUT] クライアント (`subscriber`), 終了時に解放する
+/// @return NULL
+static void *client_thread(void *arg) {
+  subscriber *s = (subscriber *)arg;
+  relay *r = s->r;
+  relay_streams *st = NULL;
+  AVIOContext *pb = NULL;
+  AVFormatContext *oc = NULL;
+  AVPacket *pkt = NULL;
+  unsigned char *buffer = NULL;
+  packet_queue_init(&s->queue);
+
+  if ((s->ch = read_request(s)) == NULL) {
+    goto end;
+  }
+  if ((pkt = av_packet_alloc()) == NULL ||
+      (buffer = (unsigned char *)av_malloc(RELAY_IO_BUFFER_SIZE)) == NULL ||
+      (pb = avio_alloc_context(buffer, RELAY_IO_BUFFER_SIZE, 1, s, NULL,
+                               write_socket, NULL)) == NULL) {
+    fprintf(stderr, "%s: relay: error: out of memory\n", s->ch->name);
+    goto end;
+  }
+  buffer = NULL;
+
+  {
+    const char *header = "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: video/mp2t\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n\r\n";
+    if (write_socket(s, (unsigned char *)header, strlen(header)) < 0) {
+      goto end;
+    }
+  }
+
+  // 中継先に加える, 終了処理の開始後は加えない
+  pthread_mutex_lock(&s->ch->mutex);
+  if (!__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+    st = streams_ref(s->ch->streams);
+    s->next = s->ch->subscribers;
+    s->ch->subscribers = s;
+    s->linked = 1;
+    __atomic_store_n(&s->ch->nsubscribers, s->ch->nsubscribers + 1,
+                     __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&s->ch->mutex);
+  if (!s->linked) {
+    goto end;
+  }
+  fprintf(stderr, "%s: relay: %s connected\n", s->ch->name, s->peer);
+
+  // 切断されたときは溜まったパケットを送らずに終了する
+  while (!__atomic_load_n(&s->queue.closed, __ATOMIC_ACQUIRE) &&
+         packet_queue_pop(&s->queue, pkt) > 0) {
+    if (pkt->stream_index < 0) {
+      // 入力が切り替わったので, 新しい構成で出力し直す
+      close_muxer(&oc);
+      streams_unref(st);
+      memcpy(&st, pkt->data, sizeof(relay_streams *));
+      av_packet_unref(pkt);
+      continue;
+    }
+    if (oc == NULL) {
+      // 映像のキーフレームから出力を開始する
+      if (st == NULL || pkt->stream_index != st->video_stream_index ||
+          !(pkt->flags & AV_PKT_FLAG_KEY)) {
+        av_packet_unref(pkt);
+        continue;
+      }
+      if (open_muxer(s, st, pb, &oc) != 0) {
+        break;
+      }
+    }
+    if (pkt->stream_index >= oc->nb_streams) {
+      av_packet_unref(pkt);
+      continue;
+    }
+    av_packet_rescale_ts(pkt, st->time_bases[pkt->stream_index],
+                         oc->streams[pkt->stream_index]->time_base);
+    pkt->pos = -1;
+    if (av_write_frame(oc, pkt) < 0) {
+      break;
+    }
+    av_packet_unref(pkt);
+  }
+  fprintf(stderr, "%s: relay: %s disconnected\n", s->ch->name, s->peer);
+
+end:
+  if (s->ch != NULL) {
+    pthread_mutex_lock(&s->ch->mutex);
+    unlink_subscriber(s->ch, s);
+    pthread_mutex_unlock(&s->ch->mutex);
+  }
+  // 外した後は受信スレッドが追加しないため, 残りのパケットを解放する
+  if (pkt != NULL) {
+    while (packet_queue_try_pop(&s->queue, pkt) > 0) {
+      if (pkt->stream_index < 0) {
+        relay_streams *ref;
+        memcpy(&ref, pkt->data, sizeof(relay_streams *));
+        streams_unref(ref);
+      }
+      av_packet_unref(pkt);
+    }
+  }
+  if (oc != NULL) {
+    oc->pb = NULL;
+    avformat_free_context(oc);
+  }
+  if (pb != NULL) {
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+  }
+  av_free(buffer);
+  av_packet_free(&pkt);
+  streams_unref(st);
+  packet_queue_cleanup(&s->queue);
+  close(s->fd);
+  free(s);
+
+  pthread_mutex_lock(&r->mutex);
+  r->nclients--;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+/// @brief クライアントの接続を受け付け続けます
+/// @param arg [IN/OUT] 中継サーバ (`relay`)
+/// @return NULL
+static void *accept_thread(void *arg) {
+  relay *r = (relay *)arg;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (!__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd = accept(r->fd, (struct sockaddr *)&addr, &addrlen);
+    if (fd < 0) {
+      if (errno != EINTR && !__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+        // ファイル記述子の不足などは一時的なものとして待つ
+        usleep(100 * 1000);
+      }
+      continue;
+    }
+    subscriber *s = (subscriber *)calloc(1, sizeof(subscriber));
+    if (s == NULL) {
+      close(fd);
+      continue;
+    }
+    s->r = r;
+    s->fd = fd;
+    char host[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+    snprintf(s->peer, sizeof(s->peer), "%s:%d", host, ntohs(addr.sin_port));
+    struct timeval tv = {RELAY_REQUEST_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    pthread_mutex_lock(&r->mutex);
+    r->nclients++;
+    pthread_mutex_unlock(&r->mutex);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, client_thread, s) != 0) {
+      pthread_mutex_lock(&r->mutex);
+      r->nclients--;
+      pthread_mutex_unlock(&r->mutex);
+      close(fd);
+      free(s);
+    }
+  }
+  pthread_attr_destroy(&attr);
+  return NULL;
+}
+
+int relay_start(relay *r) {
+  if (pthread_create(&r->thread, NULL, accept_thread, r) != 0) {
+    fprintf(stderr, "error: failed to start relay thread\n");
+    return 1;
+  }
+  r->accepting = 1;
+  return 0;
+}
+
+void relay_close(relay *r) {
+  if (r == NULL) {
+    return;
+  }
+  __atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+  // 受け付けを中断させる
+  shutdown(r->fd, SHUT_RDWR);
+  if (r->accepting) {
+    pthread_join(r->thread, NULL);
+  }
+  close(r->fd);
+
+  // 接続中のクライアントを切断し, スレッドの終了を待つ
+  for (int i = 0; i < r->nchannels; i++) {
+    relay_channel *ch = r->channels[i];
+    pthread_mutex_lock(&ch->mutex);
+    while (ch->subscribers != NULL) {
+      subscriber *s = ch->subscribers;
+      unlink_subscriber(ch, s);
+      packet_queue_close(&s->queue, 0);
+      shutdown(s->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&ch->mutex);
+  }
+  pthread_mutex_lock(&r->mutex);
+  while (r->nclients > 0) {
+    pthread_cond_wait(&r->cond, &r->mutex);
+  }
+  pthread_mutex_unlock(&r->mutex);
+
+  for (int i = 0; i < r->nchannels; i++) {
+    relay_channel *ch = r->channels[i];
+    streams_unref(ch->streams);
+    av_packet_free(&ch->pkt);
+    pthread_mutex_destroy(&ch->mutex);
+    free(ch);
+  }
+  pthread_mutex_destroy(&r->mutex);
+  pthread_cond_destroy(&r->cond);
+  free(r);
+}
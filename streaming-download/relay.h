@@ -0,0 +1,61 @@
+/*
+ * relay
+ * 受信したパケットをローカルのHTTPクライアントへMPEG-TSで中継する
+ * (1つのHLSの受信を録画と複数の利用者で共有する)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// 中継先ごとに溜められるパケット数の上限
+// 映像30fps + 音声で約5秒に相当し, 超えた中継先は受信を待たせずに切断する
+#define RELAY_QUEUE_LIMIT 256
+// 中継するカメラ数の上限
+#define RELAY_MAX_CHANNELS 1024
+
+typedef struct relay relay;
+typedef struct relay_channel relay_channel;
+
+/// @brief 中継サーバを開始します
+/// @param address [IN] 待ち受けるアドレス `[HOST:]PORT`, HOSTの既定は127.0.0.1
+/// @return 中継サーバ, 失敗したときNULL
+relay *relay_open(const char *address);
+
+/// @brief 中継するカメラを登録します, `relay_open` の直後に呼び出す
+/// クライアントは `GET /<name>.ts` で受信する
+/// @param r [IN/OUT] 中継サーバ
+/// @param name [IN] カメラの名前 (デバイスID)
+/// @return 中継のチャネル, 失敗したときNULL
+relay_channel *relay_add_channel(relay *r, const char *name);
+
+/// @brief クライアントの受け付けを開始します, すべてのカメラを登録した後に呼び出す
+/// @param r [IN/OUT] 中継サーバ
+/// @return 終了コード, `0` のとき正常終了
+int relay_start(relay *r);
+
+/// @brief 新しい入力のストリーム構成を通知します (受信スレッド)
+/// 接続中のクライアントは次の映像のキーフレームから新しい構成で中継する
+/// @param ch [IN/OUT] チャネル
+/// @param ic [IN] 入力
+/// @param video_stream_index [IN] 映像ストリームの番号
+/// @return 終了コード, `0` のとき正常終了, 失敗したときは次の入力まで中継しない
+int relay_set_input(relay_channel *ch, const AVFormatContext *ic,
+                    int video_stream_index);
+
+/// @brief パケットを接続中のクライアントへ渡します (受信スレッド)
+/// データはコピーせず参照を増やす, 溜まったパケットが上限を超えたクライアントは切断する
+/// @param ch [IN/OUT] チャネル
+/// @param pkt [IN] パケット
+void relay_publish(relay_channel *ch, const AVPacket *pkt);
+
+/// @brief 中継サーバを終了します, すべてのクライアントを切断し終了を待つ
+/// @param r [IN/OUT] 中継サーバ, NULLのときは何もしない
+void relay_close(relay *r);
+
+#endif
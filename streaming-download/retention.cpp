@@ -0,0 +1,510 @@
+/*
+ * retention
+ * 出力ディレクトリの容量と保存期間を一定に保つ
+ * (外部からの一括削除による書き込みの停滞や断片化を避けるため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "retention.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// 録画済みのファイル
+typedef struct segment {
+  struct segment *next;
+  char name[64];     // 出力ディレクトリでのファイル名
+  int64_t size;      // [byte]
+  double start_time; // 書き込み開始時刻 (UNIX時間) [sec]
+} segment;
+
+// 予備のファイルの状態
+enum SpareState {
+  SPARE_FREE,  // なし
+  SPARE_BUSY,  // 名前の変更中
+  SPARE_READY, // 再利用できる
+};
+
+struct retention_channel {
+  retention *r;
+  char dir[256];
+  char name[64];
+
+  // 容量の管理の排他で保護する
+  segment *head; // 古い順
+  segment *tail;
+  int nsegments;
+  int64_t bytes; // 録画済みのファイルの合計 [byte]
+  enum SpareState spare_state[RETENTION_SPARES];
+  int64_t spare_size[RETENTION_SPARES];
+  double bitrate; // 観測したビットレート [byte/sec]
+  uint64_t recycled;
+  uint64_t deleted;
+};
+
+struct retention {
+  int64_t max_bytes;
+  double max_age;
+  retention_channel **channels;
+  int nchannels;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int running;  // 整理するスレッドを開始したとき `1`
+  int stopping; // 終了するとき `1`
+};
+
+/// @brief 現在のUNIX時間 [sec] を返します
+static double realtime_now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/// @brief 予備のファイル名を返します
+static void spare_path(const retention_channel *ch, int i, char *buf,
+                       size_t size) {
+  snprintf(buf, size, "%s/.%s-spare-%d.mp4", ch->dir, ch->name, i);
+}
+
+/// @brief 削除中のファイル名を返します
+static void delete_path(const retention_channel *ch, char *buf, size_t size) {
+  snprintf(buf, size, "%s/.%s-delete.mp4", ch->dir, ch->name);
+}
+
+/// @brief 録画済みのファイルを古い順のリストの末尾に追加します
+/// 容量の管理の排他を取得して呼び出す
+static void append_segment(retention_channel *ch, segment *seg) {
+  seg->next = NULL;
+  if (ch->tail != NULL) {
+    ch->tail->next = seg;
+  } else {
+    ch->head = seg;
+  }
+  ch->tail = seg;
+  ch->nsegments++;
+  ch->bytes += seg->size;
+}
+
+/// @brief ファイルを書き込み開始時刻の順に比較します (`qsort` の比較関数)
+static int compare_segments(const void *a, const void *b) {
+  const segment *x = *(segment *const *)a;
+  const segment *y = *(segment *const *)b;
+  if (x->start_time != y->start_time) {
+    return (x->start_time < y->start_time) ? -1 : 1;
+  }
+  // 同じ秒のファイルは番号の無いもの, 番号の小さいものの順
+  size_t xlen = strlen(x->name), ylen = strlen(y->name);
+  if (xlen != ylen) {
+    return (xlen < ylen) ? -1 : 1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+/// @brief 出力ディレクトリにある録画済みのファイルと予備のファイルを数えます
+/// @return 終了コード, `0` のとき正常終了
+static int scan_directory(retention_channel *ch) {
+  DIR *dp = opendir(ch->dir);
+  if (dp == NULL) {
+    fprintf(stderr, "error: failed to open %s: %s\n", ch->dir,
+            strerror(errno));
+    return 1;
+  }
+  segment **list = NULL;
+  int n = 0, capacity = 0;
+  char path[512], spare[512];
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", ch->dir, de->d_name);
+    // 前回の終了時に削除中だったファイル
+    delete_path(ch, spare, sizeof(spare));
+    if (strcmp(path, spare) == 0) {
+      unlink(path);
+      continue;
+    }
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    for (int i = 0; i < RETENTION_SPARES; i++) {
+      spare_path(ch, i, spare, sizeof(spare));
+      if (strcmp(path, spare) == 0) {
+        ch->spare_state[i] = SPARE_READY;
+        ch->spare_size[i] = st.st_size;
+      }
+    }
+    // 書き込み開始時刻の名前のファイルのみを対象にする
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(de->d_name, "%Y-%m-%d %H_%M_%S", &tm);
+    if (end != NULL && end[0] == '_' && isdigit((unsigned char)end[1])) {
+      // 同じ秒に書き込みを開始したファイルの番号 (`_N`)
+      end++;
+      while (isdigit((unsigned char)*end)) {
+        end++;
+      }
+    }
+    if (end == NULL || strcmp(end, ".mp4") != 0 ||
+        strlen(de->d_name) >= sizeof(list[0]->name)) {
+      continue;
+    }
+    if (n == capacity) {
+      capacity = (capacity == 0) ? 256 : capacity * 2;
+      segment **p = (segment **)realloc(list, capacity * sizeof(segment *));
+      if (p == NULL) {
+        break;
+      }
+      list = p;
+    }
+    segment *seg = (segment *)calloc(1, sizeof(segment));
+    if (seg == NULL) {
+      break;
+    }
+    snprintf(seg->name, sizeof(seg->name), "%.*s",
+             (int)sizeof(seg->name) - 1, de->d_name);
+    seg->size = st.st_size;
+    tm.tm_isdst = -1;
+    seg->start_time = (double)mktime(&tm);
+    list[n++] = seg;
+  }
+  closedir(dp);
+
+  // 書き込み開始時刻の順に並べる
+  if (n > 0) {
+    qsort(list, n, sizeof(segment *), compare_segments);
+  }
+  for (int i = 0; i < n; i++) {
+    append_segment(ch, list[i]);
+  }
+  free(list);
+  return 0;
+}
+
+/// @brief 上限を超えたときに最も古いファイルを取り出します
+/// 容量の管理の排他を取得して呼び出す
+/// @param expired [OUT] 保存期間を超えたとき `1`, 容量のみを超えたとき `0`
+/// @return 取り出したファイル, 上限を超えていないときNULL
+static segment *evict(retention *r, retention_channel *ch, double now,
+                      int *expired) {
+  if (ch->head == NULL) {
+    return NULL;
+  }
+  int64_t bytes = ch->bytes;
+  for (int i = 0; i < RETENTION_SPARES; i++) {
+    bytes += ch->spare_size[i];
+  }
+  *expired = r->max_age > 0 && ch->head->start_time < now - r->max_age;
+  if (!(r->max_bytes > 0 && bytes > r->max_bytes) && !*expired) {
+    return NULL;
+  }
+  segment *seg = ch->head;
+  ch->head = seg->next;
+  if (ch->head == NULL) {
+    ch->tail = NULL;
+  }
+  ch->nsegments--;
+  ch->bytes -= seg->size;
+  return seg;
+}
+
+/// @brief ファイルを少しずつ切り詰めてから削除します
+/// 大きなファイルを一度に削除するとブロックの解放で書き込みが停滞するため
+static void delete_file(retention *r, retention_channel *ch,
+                        const char *path) {
+  char tmp[512];
+  // 途中で終了しても録画済みのファイルに見えないよう, 先に名前を変える
+  delete_path(ch, tmp, sizeof(tmp));
+  if (rename(path, tmp) != 0) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "%s: warning: failed to delete %s: %s\n", ch->name,
+              path, strerror(errno));
+    }
+    return;
+  }
+  int fd = open(tmp, O_WRONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0) {
+    off_t size = st.st_size;
+    while (size > RETENTION_DELETE_CHUNK &&
+           !__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+      size -= RETENTION_DELETE_CHUNK;
+      if (ftruncate(fd, size) != 0) {
+        break;
+      }
+      usleep((useconds_t)(RETENTION_DELETE_INTERVAL * 1e6));
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  unlink(tmp);
+  pthread_mutex_lock(&r->mutex);
+  ch->deleted++;
+  pthread_mutex_unlock(&r->mutex);
+}
+
+/// @brief このスレッドのCPUとI/Oの優先度を下げます
+static void lower_priority() {
+#ifdef __linux__
+  pid_t tid = (pid_t)syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+  // I/Oのスケジューリングクラスをアイドルにする (IOPRIO_WHO_PROCESS,
+  // IOPRIO_CLASS_IDLE)
+  syscall(SYS_ioprio_set, 1, tid, 3 << 13);
+#endif
+#endif
+}
+
+/// @brief 上限を超えた古いファイルを整理し続けます
+/// 容量を超えたファイルは予備に空きがあれば予備に回し, なければ削除する
+/// 保存期間を超えたファイルは内容を残さないよう常に削除する
+/// @param arg [IN/OUT] 容量の管理 (`retention`)
+/// @return NULL
+static void *retention_thread(void *arg) {
+  retention *r = (retention *)arg;
+  lower_priority();
+
+  pthread_mutex_lock(&r->mutex);
+  while (!r->stopping) {
+    double now = realtime_now();
+    retention_channel *ch = NULL;
+    segment *seg = NULL;
+    int expired = 0;
+    for (int i = 0; i < r->nchannels && seg == NULL; i++) {
+      ch = r->channels[i];
+      seg = evict(r, ch, now, &expired);
+    }
+    if (seg == NULL) {
+      // 新しいファイルの登録か, 保存期間の経過を待つ
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += 1;
+      pthread_cond_timedwait(&r->cond, &r->mutex, &until);
+      continue;
+    }
+    int slot = -1;
+    for (int i = 0; i < RETENTION_SPARES && slot < 0 && !expired; i++) {
+      if (ch->spare_state[i] == SPARE_FREE) {
+        ch->spare_state[i] = SPARE_BUSY;
+        slot = i;
+      }
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", ch->dir, seg->name);
+    if (slot >= 0) {
+      char spare[512];
+      spare_path(ch, slot, spare, sizeof(spare));
+      int ret = rename(path, spare);
+      if (ret != 0 && errno != ENOENT) {
+        fprintf(stderr, "%s: warning: failed to rename %s: %s\n", ch->name,
+                path, strerror(errno));
+      }
+      pthread_mutex_lock(&r->mutex);
+      ch->spare_state[slot] = (ret == 0) ? SPARE_READY : SPARE_FREE;
+      ch->spare_size[slot] = (ret == 0) ? seg->size : 0;
+      pthread_mutex_unlock(&r->mutex);
+    } else {
+      delete_file(r, ch, path);
+    }
+    free(seg);
+    pthread_mutex_lock(&r->mutex);
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+retention *retention_open(int64_t max_bytes, double max_age) {
+  retention *r = (retention *)calloc(1, sizeof(retention));
+  if (r == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  r->max_bytes = max_bytes;
+  r->max_age = max_age;
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  return r;
+}
+
+retention_channel *retention_add_channel(retention *r, const char *dir,
+                                         const char *name) {
+  retention_channel **p = (retention_channel **)realloc(
+      r->channels, (r->nchannels + 1) * sizeof(retention_channel *));
+  if (p == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  r->channels = p;
+  retention_channel *ch =
+      (retention_channel *)calloc(1, sizeof(retention_channel));
+  if (ch == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  ch->r = r;
+  snprintf(ch->dir, sizeof(ch->dir), "%s", dir);
+  snprintf(ch->name, sizeof(ch->name), "%s", name);
+  if (scan_directory(ch) != 0) {
+    free(ch);
+    return NULL;
+  }
+  r->channels[r->nchannels++] = ch;
+  return ch;
+}
+
+int retention_start(retention *r) {
+  if (pthread_create(&r->thread, NULL, retention_thread, r) != 0) {
+    fprintf(stderr, "error: failed to start retention thread\n");
+    return 1;
+  }
+  r->running = 1;
+  return 0;
+}
+
+int retention_prepare(retention_channel *ch, const char *path,
+                      double duration) {
+  retention *r = ch->r;
+  int slot = -1;
+  pthread_mutex_lock(&r->mutex);
+  for (int i = 0; i < RETENTION_SPARES && slot < 0; i++) {
+    if (ch->spare_state[i] == SPARE_READY) {
+      ch->spare_state[i] = SPARE_BUSY;
+      slot = i;
+    }
+  }
+  int64_t expected =
+      (int64_t)(ch->bitrate * duration * RETENTION_PREALLOCATE_MARGIN);
+  pthread_mutex_unlock(&r->mutex);
+
+  int reused = 0;
+  if (slot >= 0) {
+    // 古いファイルの削除を省き, 名前を変えて使う
+    char spare[512];
+    spare_path(ch, slot, spare, sizeof(spare));
+    reused = (rename(spare, path) == 0);
+    pthread_mutex_lock(&r->mutex);
+    ch->spare_state[slot] = SPARE_FREE;
+    ch->spare_size[slot] = 0;
+    if (reused) {
+      ch->recycled++;
+    }
+    pthread_mutex_unlock(&r->mutex);
+  }
+
+  // 書き込みの失敗や異常終了で末尾に古い内容が残らないよう, 先に切り詰める
+  int fd = open(path, O_WRONLY | O_CREAT | (reused ? O_TRUNC : 0), 0644);
+  if (fd < 0) {
+    fprintf(stderr, "%s: error: failed to create %s: %s\n", ch->name, path,
+            strerror(errno));
+    return 1;
+  }
+#ifdef FALLOC_FL_KEEP_SIZE
+  // ファイルサイズは変えずにブロックを先に確保し, 書き込み中の割り当てと断片化を避ける
+  if (expected > 0) {
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected);
+  }
+#else
+  (void)expected;
+#endif
+  close(fd);
+  return 0;
+}
+
+void retention_commit(retention_channel *ch, const char *path, int64_t size,
+                      double start_time, double duration) {
+  retention *r = ch->r;
+  // 確保したが使わなかったブロックを解放する
+  int fd = open(path, O_WRONLY);
+  if (fd >= 0) {
+    if (ftruncate(fd, size) != 0) {
+      fprintf(stderr, "%s: warning: failed to truncate %s: %s\n", ch->name,
+              path, strerror(errno));
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (int64_t)st.st_blocks * 512 > size) {
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size,
+                (off_t)st.st_blocks * 512);
+    }
+#endif
+    close(fd);
+  }
+
+  segment *seg = (segment *)calloc(1, sizeof(segment));
+  if (seg == NULL) {
+    return;
+  }
+  const char *slash = strrchr(path, '/');
+  snprintf(seg->name, sizeof(seg->name), "%s",
+           (slash != NULL) ? slash + 1 : path);
+  seg->size = size;
+  seg->start_time = start_time;
+  pthread_mutex_lock(&r->mutex);
+  append_segment(ch, seg);
+  if (duration > 0.0) {
+    // 直近のファイルを重くした移動平均
+    double bitrate = size / duration;
+    ch->bitrate =
+        (ch->bitrate == 0.0) ? bitrate : ch->bitrate * 0.7 + bitrate * 0.3;
+  }
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+}
+
+void retention_stats(retention_channel *ch, int64_t *bytes, int *files,
+                     uint64_t *recycled, uint64_t *deleted) {
+  retention *r = ch->r;
+  pthread_mutex_lock(&r->mutex);
+  *bytes = ch->bytes;
+  for (int i = 0; i < RETENTION_SPARES; i++) {
+    *bytes += ch->spare_size[i];
+  }
+  *files = ch->nsegments;
+  *recycled = ch->recycled;
+  *deleted = ch->deleted;
+  pthread_mutex_unlock(&r->mutex);
+}
+
+void retention_close(retention *r) {
+  if (r == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&r->mutex);
+  __atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+  if (r->running) {
+    pthread_join(r->thread, NULL);
+  }
+  for (int i = 0; i < r->nchannels; i++) {
+    retention_channel *ch = r->channels[i];
+    while (ch->head != NULL) {
+      segment *seg = ch->head;
+      ch->head = seg->next;
+      free(seg);
+    }
+    free(ch);
+  }
+  free(r->channels);
+  pthread_mutex_destroy(&r->mutex);
+  pthread_cond_destroy(&r->cond);
+  free(r);
+}
@@ -0,0 +1,81 @@
+/*
+ * retention
+ * 出力ディレクトリの容量と保存期間を一定に保つ
+ * (外部からの一括削除による書き込みの停滞や断片化を避けるため)
+ *
+ * - 容量を超えた古いファイルは予備のファイルとして残し, 次の出力ファイルに再利用する
+ * - 保存期間を超えたファイルは予備に回さず削除する
+ * - 予備が足りているときは, 優先度の低いスレッドで少しずつ切り詰めてから削除する
+ * - 出力ファイルは観測したビットレートから見積もったサイズを先に確保する
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdint.h>
+
+// カメラごとに保持する予備のファイル数
+#define RETENTION_SPARES 2
+// 削除するファイルを1回に切り詰めるサイズ [byte] と間隔 [sec]
+#define RETENTION_DELETE_CHUNK (32 * 1024 * 1024)
+#define RETENTION_DELETE_INTERVAL 0.05
+// 確保するサイズの見積もりに対する余裕
+#define RETENTION_PREALLOCATE_MARGIN 1.2
+
+typedef struct retention retention;
+typedef struct retention_channel retention_channel;
+
+/// @brief 容量の管理を開始します
+/// @param max_bytes [IN] カメラごとの容量の上限 [byte], `0` のとき制限しない
+/// @param max_age [IN] 保存期間 [sec], `0` のとき制限しない
+/// @return 容量の管理, 失敗したときNULL
+retention *retention_open(int64_t max_bytes, double max_age);
+
+/// @brief カメラの出力ディレクトリを登録します, `retention_start` の前に呼び出す
+/// ディレクトリにある録画済みのファイル (`YYYY-MM-DD HH_MM_SS.mp4`) と予備のファイルを数える
+/// @param r [IN/OUT] 容量の管理
+/// @param dir [IN] 出力ディレクトリ
+/// @param name [IN] カメラの名前 (デバイスID), 予備のファイル名に使う
+/// @return チャネル, 失敗したときNULL
+retention_channel *retention_add_channel(retention *r, const char *dir,
+                                         const char *name);
+
+/// @brief 古いファイルを整理するスレッドを開始します
+/// @param r [IN/OUT] 容量の管理
+/// @return 終了コード, `0` のとき正常終了
+int retention_start(retention *r);
+
+/// @brief 出力ファイルを用意します, 予備のファイルがあれば名前を変えて再利用する
+/// 再利用するファイルは空にしてからブロックを確保し直す
+/// 用意したファイルは切り詰めずに開き, 書き込み後に `retention_commit` を呼び出す
+/// @param ch [IN/OUT] チャネル
+/// @param path [IN] 出力ファイル名
+/// @param duration [IN] ファイルの長さの見込み [sec], 確保するサイズの見積もりに使う
+/// @return 終了コード, `0` のとき正常終了
+int retention_prepare(retention_channel *ch, const char *path, double duration);
+
+/// @brief 書き込みを終えたファイルを登録します
+/// 先の確保による余分な領域を解放し, 容量の上限を超えたときは整理を始める
+/// @param ch [IN/OUT] チャネル
+/// @param path [IN] ファイル名
+/// @param size [IN] 書き込んだサイズ [byte]
+/// @param start_time [IN] 書き込み開始時刻 (UNIX時間) [sec]
+/// @param duration [IN] 書き込んだ長さ [sec]
+void retention_commit(retention_channel *ch, const char *path, int64_t size,
+                      double start_time, double duration);
+
+/// @brief 容量の統計を返します
+/// @param ch [IN] チャネル
+/// @param bytes [OUT] 録画済みのファイルと予備のファイルの合計 [byte]
+/// @param files [OUT] 録画済みのファイル数
+/// @param recycled [OUT] 再利用したファイル数
+/// @param deleted [OUT] 削除したファイル数
+void retention_stats(retention_channel *ch, int64_t *bytes, int *files,
+                     uint64_t *recycled, uint64_t *deleted);
+
+/// @brief 整理を終了します, 削除中のファイルはすぐに削除する
+/// @param r [IN/OUT] 容量の管理, NULLのときは何もしない
+void retention_close(retention *r);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * segment-index
+ * 書き込んだmp4ファイルの時刻とキーフレームの位置を追記するインデックス
+ * (時刻の範囲に対応するファイルとバイト位置を, 全ファイルを解析せずに二分探索で求めるため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "segment-index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct segment_index {
+  int fd;                 // `.segments`
+  int keyframes_fd;       // `.keyframes`
+  int64_t nentries;       // 追記済みのレコード数
+  int64_t nkeyframes;     // 追記済みのキーフレーム数
+  int64_t last_start_us;  // 最後のレコードの書き込み開始時刻
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint64_t next_seq; // 次に追記する番号
+};
+
+/// @brief すべてのデータを書き込みます
+static int write_all(int fd, const void *buf, size_t size) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/// @brief インデックスのファイルを開き, ヘッダを確認します
+/// 新しいファイルにはヘッダを書き込み, 途中まで書き込まれたレコードは切り詰める
+/// @param path [IN] ファイル名
+/// @param magic [IN] マジック
+/// @param record_size [IN] レコードのサイズ [byte]
+/// @param count [OUT] レコード数
+/// @return ファイル記述子, 失敗したとき負
+static int open_file(const char *path, const char *magic, uint32_t record_size,
+                     int64_t *count) {
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  segment_index_header header;
+  if (fstat(fd, &st) != 0) {
+    goto error;
+  }
+  if (st.st_size < (off_t)sizeof(header)) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.record_size = record_size;
+    if (ftruncate(fd, 0) != 0 || write_all(fd, &header, sizeof(header)) != 0) {
+      goto error;
+    }
+    *count = 0;
+    return fd;
+  }
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+      header.record_size != record_size) {
+    fprintf(stderr, "error: %s is not a segment index of this version\n",
+            path);
+    close(fd);
+    return -1;
+  }
+  // 書き込み中に終了したときの端数を捨てる
+  *count = (st.st_size - sizeof(header)) / record_size;
+  if (ftruncate(fd, sizeof(header) + *count * record_size) != 0) {
+    goto error;
+  }
+  return fd;
+
+error:
+  fprintf(stderr, "error: failed to initialize %s: %s\n", path,
+          strerror(errno));
+  close(fd);
+  return -1;
+}
+
+segment_index *segment_index_open(const char *prefix) {
+  char path[1024];
+  segment_index *idx = (segment_index *)calloc(1, sizeof(segment_index));
+  if (idx == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return NULL;
+  }
+  idx->fd = idx->keyframes_fd = -1;
+  pthread_mutex_init(&idx->mutex, NULL);
+  pthread_cond_init(&idx->cond, NULL);
+
+  snprintf(path, sizeof(path), "%s.segments", prefix);
+  if ((idx->fd = open_file(path, SEGMENT_INDEX_MAGIC, sizeof(segment_entry),
+                           &idx->nentries)) < 0) {
+    goto error;
+  }
+  snprintf(path, sizeof(path), "%s.keyframes", prefix);
+  if ((idx->keyframes_fd =
+           open_file(path, SEGMENT_KEYFRAME_MAGIC, sizeof(segment_keyframe),
+                     &idx->nkeyframes)) < 0) {
+    goto error;
+  }
+  if (idx->nentries > 0) {
+    segment_entry last;
+    off_t pos = sizeof(segment_index_header) +
+                (idx->nentries - 1) * sizeof(segment_entry);
+    if (pread(idx->fd, &last, sizeof(last), pos) == sizeof(last)) {
+      idx->last_start_us = last.start_us;
+    }
+  }
+  return idx;
+
+error:
+  segment_index_close(idx);
+  return NULL;
+}
+
+int segment_index_append(segment_index *idx, uint64_t seq,
+                         const segment_entry *entry,
+                         const segment_keyframe *keyframes, int nkeyframes) {
+  int ret = 0;
+  pthread_mutex_lock(&idx->mutex);
+  while (idx->next_seq != seq) {
+    pthread_cond_wait(&idx->cond, &idx->mutex);
+  }
+  if (entry != NULL) {
+    segment_entry e = *entry;
+    e.keyframe_first = idx->nkeyframes;
+    e.keyframe_count = nkeyframes;
+    if (e.start_us < idx->last_start_us) {
+      // 時計が戻ったときは順序が崩れ, そのファイルは検索で見つからないことがある
+      fprintf(stderr, "warning: %s starts before the previous file\n",
+              e.name);
+    }
+    // キーフレームを先に書き込み, レコードが参照する範囲を必ず存在させる
+    if (write_all(idx->keyframes_fd, keyframes,
+                  nkeyframes * sizeof(segment_keyframe)) != 0 ||
+        write_all(idx->fd, &e, sizeof(e)) != 0) {
+      fprintf(stderr, "error: failed to append %s to segment index: %s\n",
+              e.name, strerror(errno));
+      // 途中まで書き込んだ分を戻す
+      if (ftruncate(idx->keyframes_fd,
+                    sizeof(segment_index_header) +
+                        idx->nkeyframes * sizeof(segment_keyframe)) != 0 ||
+          ftruncate(idx->fd, sizeof(segment_index_header) +
+                                 idx->nentries * sizeof(segment_entry)) !=
+              0) {
+        fprintf(stderr, "error: failed to restore segment index\n");
+      }
+      ret = 1;
+    } else {
+      idx->nkeyframes += nkeyframes;
+      idx->nentries++;
+      idx->last_start_us = e.start_us;
+    }
+  }
+  idx->next_seq++;
+  pthread_cond_broadcast(&idx->cond);
+  pthread_mutex_unlock(&idx->mutex);
+  return ret;
+}
+
+void segment_index_close(segment_index *idx) {
+  if (idx == NULL) {
+    return;
+  }
+  if (idx->fd >= 0) {
+    close(idx->fd);
+  }
+  if (idx->keyframes_fd >= 0) {
+    close(idx->keyframes_fd);
+  }
+  pthread_mutex_destroy(&idx->mutex);
+  pthread_cond_destroy(&idx->cond);
+  free(idx);
+}
+
+/// @brief インデックスのファイルを読み込み用にmmapします
+/// @param path [IN] ファイル名
+/// @param magic [IN] マジック
+/// @param record_size [IN] レコードのサイズ [byte]
+/// @param map [OUT] mmapした領域, レコードがないときNULL
+/// @param size [OUT] mmapした領域のサイズ [byte]
+/// @param count [OUT] レコード数
+/// @return 終了コード, `0` のとき正常終了
+static int map_file(const char *path, const char *magic, uint32_t record_size,
+                    void **map, size_t *size, int64_t *count) {
+  segment_index_header header;
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+      header.record_size != record_size) {
+    fprintf(stderr, "error: %s is not a segment index of this version\n",
+            path);
+    close(fd);
+    return 1;
+  }
+  *count = (st.st_size - sizeof(header)) / record_size;
+  *size = sizeof(header) + *count * record_size;
+  *map = NULL;
+  if (*count > 0) {
+    *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+      fprintf(stderr, "error: failed to map %s: %s\n", path, strerror(errno));
+      *map = NULL;
+      close(fd);
+      return 1;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+int segment_index_map_open(const char *prefix, segment_index_map *m) {
+  char path[1024];
+  memset(m, 0, sizeof(segment_index_map));
+  snprintf(path, sizeof(path), "%s.segments", prefix);
+  if (map_file(path, SEGMENT_INDEX_MAGIC, sizeof(segment_entry),
+               &m->entries_map, &m->entries_size, &m->nentries) != 0) {
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s.keyframes", prefix);
+  if (map_file(path, SEGMENT_KEYFRAME_MAGIC, sizeof(segment_keyframe),
+               &m->keyframes_map, &m->keyframes_size, &m->nkeyframes) != 0) {
+    segment_index_map_close(m);
+    return 1;
+  }
+  if (m->entries_map != NULL) {
+    m->entries = (const segment_entry *)((const char *)m->entries_map +
+                                         sizeof(segment_index_header));
+  }
+  if (m->keyframes_map != NULL) {
+    m->keyframes = (const segment_keyframe *)((const char *)m->keyframes_map +
+                                              sizeof(segment_index_header));
+  }
+  return 0;
+}
+
+void segment_index_map_close(segment_index_map *m) {
+  if (m->entries_map != NULL) {
+    munmap(m->entries_map, m->entries_size);
+  }
+  if (m->keyframes_map != NULL) {
+    munmap(m->keyframes_map, m->keyframes_size);
+  }
+  memset(m, 0, sizeof(segment_index_map));
+}
+
+int64_t segment_index_find(const segment_index_map *m, int64_t t_us) {
+  // `start_us <= t_us` となる最後のレコードを探す
+  int64_t lo = 0, hi = m->nentries;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (m->entries[mid].start_us <= t_us) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+const segment_keyframe *segment_index_keyframe(const segment_index_map *m,
+                                               const segment_entry *e,
+                                               int64_t t_us) {
+  // 書き込み中に追記されたレコードは, 開いた時点のキーフレームの範囲外になり得る
+  if (e->keyframe_count <= 0 ||
+      e->keyframe_first + e->keyframe_count > m->nkeyframes) {
+    return NULL;
+  }
+  const segment_keyframe *kf = m->keyframes + e->keyframe_first;
+  int64_t lo = 0, hi = e->keyframe_count;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (kf[mid].time_us <= t_us) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return &kf[(lo > 0) ? lo - 1 : 0];
+}
@@ -0,0 +1,121 @@
+/*
+ * segment-index
+ * 書き込んだmp4ファイルの時刻とキーフレームの位置を追記するインデックス
+ * (時刻の範囲に対応するファイルとバイト位置を, 全ファイルを解析せずに二分探索で求めるため)
+ *
+ * カメラごとに次の2つのファイルからなり, どちらも固定長のレコードを追記する
+ * - `<DEVICEID>.segments`: ファイルごとの `segment_entry`
+ * - `<DEVICEID>.keyframes`: キーフレームごとの `segment_keyframe`
+ * レコードは書き込み開始時刻の順に並ぶため, mmapしてそのまま二分探索できる
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef SEGMENT_INDEX_H
+#define SEGMENT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ファイルの先頭のマジック, 形式を変えたときは番号を上げる
+#define SEGMENT_INDEX_MAGIC "SDSEGIX1"
+#define SEGMENT_KEYFRAME_MAGIC "SDKEYFR1"
+
+// インデックスのファイルのヘッダ
+typedef struct {
+  char magic[8];
+  uint32_t record_size; // レコードのサイズ [byte]
+  uint32_t reserved;
+} segment_index_header;
+
+// 1つのmp4ファイル
+typedef struct {
+  int64_t start_us;  // 最初のパケットの実時刻 (UNIX時間) [usec]
+  int64_t end_us;    // 最後のパケットの実時刻 (UNIX時間) [usec]
+  int64_t first_pts; // 最初のパケットの入力のPTS [usec]
+  int64_t last_pts;  // 最後のパケットの入力のPTS [usec]
+  int64_t size;      // ファイルサイズ [byte]
+  int64_t keyframe_first; // `.keyframes` での最初のキーフレームの番号
+  int32_t keyframe_count; // キーフレーム数
+  int32_t reserved;
+  char name[256]; // インデックスと同じディレクトリでのファイル名
+} segment_entry;
+
+// 1つのキーフレーム
+typedef struct {
+  int64_t time_us; // 実時刻 (UNIX時間) [usec]
+  int64_t offset;  // ファイルの先頭からの位置 [byte], キーフレームのデータはこれ以降にある
+} segment_keyframe;
+
+/*
+ * 書き込み (streaming-download)
+ */
+
+typedef struct segment_index segment_index;
+
+/// @brief インデックスを追記用に開きます, ないときは作成する
+/// 途中まで書き込まれたレコードは切り詰める
+/// @param prefix [IN] インデックスのファイル名から拡張子を除いたもの (`DIR/DEVICEID`)
+/// @return インデックス, 失敗したときNULL
+segment_index *segment_index_open(const char *prefix);
+
+/// @brief ファイルのレコードを追記します, 複数のスレッドから呼び出してよい
+/// 書き込み開始時刻の順に並ぶよう, `seq` (`0` からの連番) の順に追記する
+/// 前の番号の追記 (または `entry` がNULLの呼び出し) を待つ
+/// @param idx [IN/OUT] インデックス
+/// @param seq [IN] ファイルを閉じた順の番号
+/// @param entry [IN] レコード, キーフレームの番号は設定される, NULLのときは番号を進めるのみ
+/// @param keyframes [IN] キーフレームの配列
+/// @param nkeyframes [IN] キーフレーム数
+/// @return 終了コード, `0` のとき正常終了
+int segment_index_append(segment_index *idx, uint64_t seq,
+                         const segment_entry *entry,
+                         const segment_keyframe *keyframes, int nkeyframes);
+
+/// @brief インデックスを閉じます
+/// @param idx [IN/OUT] インデックス, NULLのときは何もしない
+void segment_index_close(segment_index *idx);
+
+/*
+ * 検索 (segment-lookup)
+ */
+
+// 読み込み用にmmapしたインデックス
+typedef struct {
+  const segment_entry *entries;
+  int64_t nentries;
+  const segment_keyframe *keyframes;
+  int64_t nkeyframes;
+  void *entries_map;
+  size_t entries_size;
+  void *keyframes_map;
+  size_t keyframes_size;
+} segment_index_map;
+
+/// @brief インデックスを読み込み用にmmapします
+/// 書き込み中のインデックスも開け, 開いた時点のレコードのみを参照する
+/// @param prefix [IN] インデックスのファイル名から拡張子を除いたもの (`DIR/DEVICEID`)
+/// @param m [OUT] インデックス
+/// @return 終了コード, `0` のとき正常終了
+int segment_index_map_open(const char *prefix, segment_index_map *m);
+
+/// @brief mmapしたインデックスを閉じます
+/// @param m [IN/OUT] インデックス
+void segment_index_map_close(segment_index_map *m);
+
+/// @brief 時刻を含むファイルを二分探索します
+/// @param m [IN] インデックス
+/// @param t_us [IN] 時刻 (UNIX時間) [usec]
+/// @return 書き込み開始時刻が `t_us` 以前の最後のファイルの番号, ないとき `-1`
+int64_t segment_index_find(const segment_index_map *m, int64_t t_us);
+
+/// @brief ファイル内の時刻に対応するキーフレームを二分探索します
+/// @param m [IN] インデックス
+/// @param e [IN] ファイル
+/// @param t_us [IN] 時刻 (UNIX時間) [usec]
+/// @return `t_us` 以前の最後のキーフレーム, ないときは最初のキーフレーム,
+/// キーフレームがないときNULL
+const segment_keyframe *segment_index_keyframe(const segment_index_map *m,
+                                               const segment_entry *e,
+                                               int64_t t_us);
+
+#endif
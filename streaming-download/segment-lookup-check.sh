@@ -0,0 +1,93 @@
+#!/bin/sh
+# segment-lookup-check
+# 断片化mp4 (-F) の録画から segment-lookup が表示するバイト範囲を切り出し,
+# 初期化セグメント (先頭から最初のmoofまで) と連結して終了時刻まで復号できるかを確かめる
+#
+# usage: segment-lookup-check.sh INDEX FROM TO
+#   INDEX, FROM, TO は segment-lookup と同じ
+#   環境変数 SEGMENT_LOOKUP に segment-lookup のパスを指定できる
+# 終了コード: 0 のとき, すべてのファイルで範囲の終了時刻まで復号できた
+#
+# Copyright (c) 2023 Safie Inc.
+set -eu
+
+if [ $# -ne 3 ]; then
+  echo "usage: segment-lookup-check.sh INDEX FROM TO" >&2
+  exit 2
+fi
+lookup=${SEGMENT_LOOKUP:-$(dirname "$0")/segment-lookup}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# 時刻 (segment-lookup の形式, または `@UNIX時間`) をUNIX時間 [sec] にする
+to_unix() {
+  case "$1" in
+  @*) echo "${1#@}" ;;
+  *) date -d "$1" +%s.%N ;;
+  esac
+}
+
+# 先頭から最初のmoofまでのバイト数を表示する
+init_size() {
+  off=0
+  size=$(stat -c %s "$1")
+  while [ "$off" -lt "$size" ]; do
+    set -- "$1" $(od -An -tu1 -j "$off" -N 8 "$1")
+    [ $# -eq 9 ] || return 1
+    len=$((($2 << 24) | ($3 << 16) | ($4 << 8) | $5))
+    type=$(printf "\\$(printf %o "$6")\\$(printf %o "$7")\\$(printf %o "$8")\\$(printf %o "$9")")
+    if [ "$type" = moof ]; then
+      echo "$off"
+      return 0
+    fi
+    # moofより前のボックスは32bitのサイズで書き込まれる
+    [ "$len" -ge 8 ] || return 1
+    off=$((off + len))
+  done
+  return 1
+}
+
+"$lookup" "$1" "$2" "$3" >"$tmp/ranges"
+to=$(to_unix "$3")
+status=0
+tab=$(printf '\t')
+while IFS=$tab read -r path start end t0 t1; do
+  if ! init=$(init_size "$path"); then
+    echo "$path: no moof, not a fragmented mp4" >&2
+    status=1
+    continue
+  fi
+  if [ "$start" -lt "$init" ]; then
+    head -c "$end" "$path" >"$tmp/range.mp4"
+  else
+    {
+      head -c "$init" "$path"
+      tail -c "+$((start + 1))" "$path" | head -c "$((end - start))"
+    } >"$tmp/range.mp4"
+  fi
+
+  # 復号できた映像フレームの時刻の範囲を, 範囲の開始時刻から終了時刻 (`to` まで) と比べる
+  # 1フレーム分の誤差を許す
+  ffprobe -v error -select_streams v:0 \
+    -show_entries frame=best_effort_timestamp_time -of csv=p=0 \
+    "$tmp/range.mp4" >"$tmp/frames" 2>"$tmp/errors" || true
+  first=$(grep -v '^N/A' "$tmp/frames" | head -n 1)
+  last=$(grep -v '^N/A' "$tmp/frames" | tail -n 1)
+  if [ -s "$tmp/errors" ] || [ -z "$first" ]; then
+    echo "$path: failed to decode bytes $start-$end:" >&2
+    cat "$tmp/errors" >&2
+    status=1
+    continue
+  fi
+  if awk -v first="$first" -v last="$last" -v t0="$(to_unix "$t0")" \
+    -v t1="$(to_unix "$t1")" -v to="$to" 'BEGIN {
+      want = ((to < t1) ? to : t1) - t0
+      exit !(last - first >= want - 0.1)
+    }'; then
+    echo "$path: bytes $start-$end decode $first-$last sec"
+  else
+    echo "$path: bytes $start-$end decode $first-$last sec, ends before $t1" >&2
+    status=1
+  fi
+done <"$tmp/ranges"
+exit $status
@@ -0,0 +1,181 @@
+/*
+ * segment-lookup
+ * streaming-downloadのインデックスから, 時刻の範囲を含むmp4ファイルとバイト位置を表示する。
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "segment-index.h"
+
+// プログラムの説明文を表示する
+void print_help() {
+  fprintf(stderr,
+          "usage: segment-lookup [OPTION]... INDEX FROM TO\n"
+          "print mp4 files and byte ranges recorded by streaming-download "
+          "--index\n"
+          "between FROM and TO, one 'FILE START_OFFSET END_OFFSET START END' "
+          "per line.\n"
+          "\n"
+          "  INDEX       index of a camera, '<output-dir>/<DEVICEID>'\n"
+          "  FROM, TO    local time 'YYYY-MM-DD HH:MM:SS' or UNIX time "
+          "'@SECONDS'\n"
+          "  -h, --help  shows this help\n");
+}
+
+/// @brief 時刻を解析します
+/// @param s [IN] 時刻, ローカル時刻 `YYYY-MM-DD HH:MM:SS` またはUNIX時間 `@SECONDS`
+/// @param t_us [OUT] 時刻 (UNIX時間) [usec]
+/// @return 終了コード, `0` のとき正常終了
+int parse_time(const char *s, int64_t *t_us) {
+  if (s[0] == '@') {
+    char *end;
+    double t = strtod(s + 1, &end);
+    if (end == s + 1 || *end != '\0') {
+      return 1;
+    }
+    *t_us = (int64_t)(t * 1e6);
+    return 0;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+  if (end == NULL || *end != '\0') {
+    return 1;
+  }
+  tm.tm_isdst = -1;
+  *t_us = (int64_t)mktime(&tm) * 1000000;
+  return 0;
+}
+
+/// @brief 時刻をローカル時刻の文字列にします
+/// @param t_us [IN] 時刻 (UNIX時間) [usec]
+/// @param buf [OUT] 文字列
+/// @param size [IN] `buf` のサイズ
+void format_time(int64_t t_us, char *buf, size_t size) {
+  time_t sec = (time_t)(t_us / 1000000);
+  struct tm lt;
+  localtime_r(&sec, &lt);
+  size_t n = strftime(buf, size, "%F %T", &lt);
+  snprintf(buf + n, size - n, ".%03d", (int)(t_us % 1000000 / 1000));
+}
+
+int main(int argc, char *argv[]) {
+  segment_index_map m;
+  int64_t from, to;
+  int found = 0;
+
+  int opt;
+  static struct option long_options[] = {
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+  while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      print_help();
+      exit(0);
+      break;
+    default:
+      print_help();
+      exit(2);
+      break;
+    }
+  }
+  if (argc - optind != 3) {
+    print_help();
+    exit(2);
+  }
+  if (parse_time(argv[optind + 1], &from) != 0 ||
+      parse_time(argv[optind + 2], &to) != 0 || to < from) {
+    fprintf(stderr, "error: invalid time range\n");
+    print_help();
+    exit(2);
+  }
+
+  // `DIR/DEVICEID.segments` を指定されたときは拡張子を除く
+  char prefix[1024];
+  int n = snprintf(prefix, sizeof(prefix), "%s", argv[optind]);
+  if (n >= sizeof(prefix)) {
+    fprintf(stderr, "error: index path too long\n");
+    exit(2);
+  }
+  char *ext = strrchr(prefix, '.');
+  if (ext != NULL && strcmp(ext, ".segments") == 0) {
+    *ext = '\0';
+  }
+  char dir[1024] = ".";
+  char *slash = strrchr(prefix, '/');
+  if (slash != NULL) {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - prefix), prefix);
+  }
+
+  if (segment_index_map_open(prefix, &m) != 0) {
+    exit(1);
+  }
+
+  // `from` を含むファイルから, `to` より後に始まるファイルの手前まで
+  int64_t i = segment_index_find(&m, from);
+  if (i < 0) {
+    i = 0;
+  } else if (m.entries[i].end_us < from) {
+    // 欠落している時間を指定されたときは次のファイルから
+    i++;
+  }
+  for (; i < m.nentries && m.entries[i].start_us <= to; i++) {
+    const segment_entry *e = &m.entries[i];
+    // --retention-size などにより削除または再利用されたファイルは除く
+    char path[1400];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%.*s", dir, (int)sizeof(e->name),
+             e->name);
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+    int64_t start_offset = 0, end_offset = e->size;
+    int64_t start_us = e->start_us, end_us = e->end_us;
+    const segment_keyframe *kf;
+    if (e->start_us < from && (kf = segment_index_keyframe(&m, e, from))) {
+      // `from` 以前の最後のキーフレームから復号できる
+      start_offset = kf->offset;
+      start_us = kf->time_us;
+    }
+    if (e->end_us > to && (kf = segment_index_keyframe(&m, e, to)) &&
+        kf + 1 < m.keyframes + e->keyframe_first + e->keyframe_count) {
+      // `to` を含むGOPの終わりまで
+      // 位置は書き込み前に記録するため, `to` より後の最初のキーフレームの位置では
+      // インターリーブで待たされた末尾のパケットや, 断片化mp4で次のキーフレームの
+      // 書き込み時に出力される断片を含まない
+      // その後に位置が進んだ (GOPの書き出しを終えた) キーフレームの位置までとする
+      end_us = kf[1].time_us;
+      const segment_keyframe *last =
+          m.keyframes + e->keyframe_first + e->keyframe_count;
+      const segment_keyframe *next = kf + 2;
+      while (next < last && next->offset <= kf[1].offset) {
+        next++;
+      }
+      if (next < last) {
+        end_offset = next->offset;
+      }
+    }
+    char start[32], end[32];
+    format_time(start_us, start, sizeof(start));
+    format_time(end_us, end, sizeof(end));
+    printf("%s\t%lld\t%lld\t%s\t%s\n", path, (long long)start_offset,
+           (long long)end_offset, start, end);
+    found++;
+  }
+  segment_index_map_close(&m);
+
+  if (found == 0) {
+    fprintf(stderr, "no recordings between %s and %s\n", argv[optind + 1],
+            argv[optind + 2]);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * stream-cache
+ * 入力のストリーム情報をファイルに保存し, 次回の接続で再利用する
+ * (接続のたびに複数のセグメントを解析するのを避け, 録画の開始を早めるため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "stream-cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// キャッシュのファイルの1行目, 形式を変えたときは番号を上げる
+#define STREAM_CACHE_MAGIC "streaming-download stream cache 1"
+
+// ファイルから読み込んだストリーム情報
+typedef struct {
+  int nb_streams;
+  AVRational time_base[STREAM_CACHE_MAX_STREAMS];
+  AVCodecParameters *par[STREAM_CACHE_MAX_STREAMS];
+} stream_cache;
+
+/// @brief 音声のチャンネル数を返します
+static int get_channels(const AVCodecParameters *par) {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  return par->ch_layout.nb_channels;
+#else
+  return par->channels;
+#endif
+}
+
+/// @brief 音声のチャンネル数を設定します, 配置は既定のものにする
+static void set_channels(AVCodecParameters *par, int channels) {
+  if (channels <= 0) {
+    return;
+  }
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  av_channel_layout_uninit(&par->ch_layout);
+  av_channel_layout_default(&par->ch_layout, channels);
+#else
+  par->channels = channels;
+  par->channel_layout = av_get_default_channel_layout(channels);
+#endif
+}
+
+/// @brief 書き込みに必要なパラメータが揃っているか判定します
+static int is_complete(const AVCodecParameters *par) {
+  switch (par->codec_type) {
+  case AVMEDIA_TYPE_VIDEO:
+    // mp4にはSPS/PPSなどのextradataが必要
+    return par->width > 0 && par->height > 0 && par->extradata_size > 0;
+  case AVMEDIA_TYPE_AUDIO:
+    return par->sample_rate > 0 && get_channels(par) > 0;
+  default:
+    return 1;
+  }
+}
+
+/// @brief 解析で得られたパラメータがキャッシュと異なるか判定します
+/// 得られなかったパラメータ (`0`) は比較しない
+static int differs(const AVCodecParameters *par,
+                   const AVCodecParameters *cached) {
+  return par->codec_id != cached->codec_id ||
+         (par->width > 0 && par->width != cached->width) ||
+         (par->height > 0 && par->height != cached->height) ||
+         (par->sample_rate > 0 && par->sample_rate != cached->sample_rate) ||
+         (get_channels(par) > 0 &&
+          get_channels(par) != get_channels(cached)) ||
+         (par->extradata_size > 0 &&
+          (par->extradata_size != cached->extradata_size ||
+           memcmp(par->extradata, cached->extradata, par->extradata_size) !=
+               0));
+}
+
+/// @brief 読み込んだストリーム情報を解放します
+static void cache_free(stream_cache *c) {
+  for (int i = 0; i < c->nb_streams; i++) {
+    avcodec_parameters_free(&c->par[i]);
+  }
+  c->nb_streams = 0;
+}
+
+/// @brief 16進数の文字列をextradataにデコードします, `-` のときは空にする
+/// @return 終了コード, `0` のとき正常終了
+static int decode_extradata(const char *s, AVCodecParameters *par) {
+  size_t len = strcspn(s, " \r\n");
+  if (len == 1 && s[0] == '-') {
+    return 0;
+  }
+  if (len == 0 || len % 2 != 0) {
+    return -1;
+  }
+  par->extradata =
+      (uint8_t *)av_mallocz(len / 2 + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (par->extradata == NULL) {
+    return -1;
+  }
+  par->extradata_size = (int)(len / 2);
+  for (size_t i = 0; i < len / 2; i++) {
+    unsigned int byte;
+    if (sscanf(s + i * 2, "%2x", &byte) != 1) {
+      return -1;
+    }
+    par->extradata[i] = (uint8_t)byte;
+  }
+  return 0;
+}
+
+/// @brief キャッシュのファイルを読み込みます
+/// @param path [IN] ファイル名
+/// @param c [OUT] ストリーム情報, 失敗したときは空
+/// @return 終了コード, `0` のとき正常終了
+static int cache_load(const char *path, stream_cache *c) {
+  FILE *fp = NULL;
+  char *line = NULL;
+  size_t cap = 0;
+  int n = 0;
+
+  memset(c, 0, sizeof(stream_cache));
+  if ((fp = fopen(path, "r")) == NULL) {
+    goto error;
+  }
+  if (getline(&line, &cap, fp) < 0 ||
+      strcmp(line, STREAM_CACHE_MAGIC "\n") != 0) {
+    goto error;
+  }
+  if (getline(&line, &cap, fp) < 0 || sscanf(line, "%d", &n) != 1 || n < 1 ||
+      n > STREAM_CACHE_MAX_STREAMS) {
+    goto error;
+  }
+  while (c->nb_streams < n) {
+    AVCodecParameters *par;
+    AVRational *tb = &c->time_base[c->nb_streams];
+    int type, codec_id, channels, pos = 0;
+    unsigned int codec_tag;
+    long long bit_rate;
+    if (getline(&line, &cap, fp) < 0 ||
+        (par = avcodec_parameters_alloc()) == NULL) {
+      goto error;
+    }
+    c->par[c->nb_streams++] = par;
+    if (sscanf(line, "%d %d %u %d/%d %d %d %d %d %d %d/%d %d %d %d %lld %n",
+               &type, &codec_id, &codec_tag, &tb->num, &tb->den,
+               &par->format, &par->profile, &par->level, &par->width,
+               &par->height, &par->sample_aspect_ratio.num,
+               &par->sample_aspect_ratio.den, &par->sample_rate, &channels,
+               &par->frame_size, &bit_rate, &pos) != 16 ||
+        pos == 0) {
+      goto error;
+    }
+    par->codec_type = (enum AVMediaType)type;
+    par->codec_id = (enum AVCodecID)codec_id;
+    par->codec_tag = codec_tag;
+    par->bit_rate = bit_rate;
+    set_channels(par, channels);
+    if (decode_extradata(line + pos, par) != 0) {
+      goto error;
+    }
+  }
+  free(line);
+  fclose(fp);
+  return 0;
+
+error:
+  cache_free(c);
+  free(line);
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  return -1;
+}
+
+/// @brief 入力のストリーム情報をキャッシュのファイルに書き込みます
+/// 一時ファイルに書き込んでから置き換えるため, 書き込み中に読まれても壊れない
+/// @param path [IN] ファイル名
+/// @param ic [IN] 解析済みの入力
+/// @return 終了コード, `0` のとき正常終了
+static int cache_save(const char *path, const AVFormatContext *ic) {
+  if (ic->nb_streams < 1 || ic->nb_streams > STREAM_CACHE_MAX_STREAMS) {
+    return -1;
+  }
+  char tmp[1024];
+  int n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (n >= sizeof(tmp)) {
+    return -1;
+  }
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "warning: failed to write %s\n", tmp);
+    return -1;
+  }
+  fprintf(fp, "%s\n%u\n", STREAM_CACHE_MAGIC, ic->nb_streams);
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const AVStream *st = ic->streams[i];
+    const AVCodecParameters *par = st->codecpar;
+    fprintf(fp, "%d %d %u %d/%d %d %d %d %d %d %d/%d %d %d %d %lld ",
+            par->codec_type, par->codec_id, par->codec_tag,
+            st->time_base.num, st->time_base.den, par->format, par->profile,
+            par->level, par->width, par->height, par->sample_aspect_ratio.num,
+            par->sample_aspect_ratio.den, par->sample_rate,
+            get_channels(par), par->frame_size, (long long)par->bit_rate);
+    if (par->extradata_size > 0) {
+      for (int j = 0; j < par->extradata_size; j++) {
+        fprintf(fp, "%02x", par->extradata[j]);
+      }
+    } else {
+      fputc('-', fp);
+    }
+    fputc('\n', fp);
+  }
+  if (ferror(fp) != 0 || fclose(fp) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "warning: failed to write %s\n", path);
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/// @brief 入力のストリーム構成がキャッシュと一致するか判定します
+static int cache_matches(const AVFormatContext *ic, const stream_cache *c) {
+  if (ic->nb_streams != c->nb_streams) {
+    return 0;
+  }
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    const AVStream *st = ic->streams[i];
+    if (st->codecpar->codec_type != c->par[i]->codec_type ||
+        st->codecpar->codec_id != c->par[i]->codec_id ||
+        av_cmp_q(st->time_base, c->time_base[i]) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int stream_cache_find_stream_info(AVFormatContext *ic, const char *path,
+                                  int *hit) {
+  stream_cache cache;
+  int64_t probesize = ic->probesize;
+  int64_t max_analyze_duration = ic->max_analyze_duration;
+  int changed = 0, ret;
+
+  *hit = 0;
+  memset(&cache, 0, sizeof(cache));
+  if (path == NULL || cache_load(path, &cache) != 0 ||
+      !cache_matches(ic, &cache)) {
+    goto probe;
+  }
+
+  // 構成が既知のため, 解析は最初のパケットを読む程度で打ち切る
+  ic->probesize = STREAM_CACHE_PROBESIZE;
+  ic->max_analyze_duration = STREAM_CACHE_ANALYZE_DURATION;
+  ret = avformat_find_stream_info(ic, NULL);
+  ic->probesize = probesize;
+  ic->max_analyze_duration = max_analyze_duration;
+  if (ret < 0) {
+    goto probe;
+  }
+  for (unsigned int i = 0; i < ic->nb_streams; i++) {
+    AVCodecParameters *par = ic->streams[i]->codecpar;
+    if (differs(par, cache.par[i])) {
+      // 解像度の変更などで得られた値がキャッシュと異なる
+      if (!is_complete(par)) {
+        goto probe;
+      }
+      changed = 1;
+    } else if (!is_complete(par) &&
+               (avcodec_parameters_copy(par, cache.par[i]) < 0 ||
+                !is_complete(par))) {
+      goto probe;
+    }
+  }
+  cache_free(&cache);
+  *hit = 1;
+  if (changed) {
+    cache_save(path, ic);
+  }
+  return ret;
+
+probe:
+  // キャッシュを使わずに既定の設定で解析する
+  cache_free(&cache);
+  ret = avformat_find_stream_info(ic, NULL);
+  if (ret >= 0 && path != NULL) {
+    cache_save(path, ic);
+  }
+  return ret;
+}
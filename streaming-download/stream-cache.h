@@ -0,0 +1,33 @@
+/*
+ * stream-cache
+ * 入力のストリーム情報をファイルに保存し, 次回の接続で再利用する
+ * (接続のたびに複数のセグメントを解析するのを避け, 録画の開始を早めるため)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef STREAM_CACHE_H
+#define STREAM_CACHE_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// キャッシュがあるときの解析の上限
+// ストリームの構成は既知のため, 最初のセグメントの先頭を読むだけで済ませる
+#define STREAM_CACHE_PROBESIZE (64 * 1024)
+#define STREAM_CACHE_ANALYZE_DURATION (AV_TIME_BASE / 2)
+// キャッシュに保存するストリーム数の上限
+#define STREAM_CACHE_MAX_STREAMS 8
+
+/// @brief 入力のストリーム情報を取得します (`avformat_find_stream_info` の代わり)
+/// キャッシュのストリーム構成が入力と一致するときは短い解析のみを行い,
+/// 解析で得られなかったパラメータをキャッシュで補う
+/// 一致しないとき, または補えないときは既定の設定で解析し直し, キャッシュを更新する
+/// @param ic [IN/OUT] `avformat_open_input` で開いた入力
+/// @param path [IN] キャッシュのファイル名, NULLのときはキャッシュを使わない
+/// @param hit [OUT] キャッシュを使ったとき `1`
+/// @return `AVERROR`, `0` 以上のとき正常終了
+int stream_cache_find_stream_info(AVFormatContext *ic, const char *path,
+                                  int *hit);
+
+#endif
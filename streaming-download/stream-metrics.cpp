@@ -0,0 +1,127 @@
+/*
+ * stream-metrics
+ * カメラごとの受信と書き込みの遅延を計測する
+ * (録画が実時間に遅れていないかを常時監視するため, 更新はパケットごとに数回の加算のみ)
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include "stream-metrics.h"
+
+#include <sys/time.h>
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+const double stream_metrics_bounds[STREAM_METRICS_BUCKETS - 1] = {
+    0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 2.0, 5.0, 10.0, 30.0,
+};
+
+/// @brief 現在のUNIX時間 [usec] を返します
+static int64_t realtime_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/// @brief 値を加算します, 書き込むスレッドは1つのためロックしない
+static void add(uint64_t *p, uint64_t v) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+                   __ATOMIC_RELAXED);
+}
+
+/// @brief 遅延を記録します
+static void record(latency_histogram *h, double seconds) {
+  uint64_t us = (seconds > 0.0) ? (uint64_t)(seconds * 1e6) : 0;
+  int i = 0;
+  while (i < STREAM_METRICS_BUCKETS - 1 && seconds > stream_metrics_bounds[i]) {
+    i++;
+  }
+  add(&h->buckets[i], 1);
+  add(&h->sum_us, us);
+  add(&h->count, 1);
+  // 集計で0に戻された直後に上書きしても, 記録した値のいずれかが残る
+  if (us > __atomic_load_n(&h->max_us, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&h->max_us, us, __ATOMIC_RELAXED);
+  }
+}
+
+int stream_metrics_connect(stream_metrics *m) {
+  int connection = m->connections + 1;
+  // 2つ前の接続のパケットは書き込み済みのため, その基準を再利用する
+  __atomic_store_n(&m->clock_offset[connection & 1], INT64_MAX,
+                   __ATOMIC_RELAXED);
+  m->last_arrival_us = 0;
+  __atomic_store_n(&m->connections, connection, __ATOMIC_RELEASE);
+  return connection;
+}
+
+void stream_metrics_arrival(stream_metrics *m, int64_t pts_us, int video) {
+  int64_t now = realtime_us();
+  int64_t *offset = &m->clock_offset[m->connections & 1];
+  if (now - pts_us < __atomic_load_n(offset, __ATOMIC_RELAXED)) {
+    __atomic_store_n(offset, now - pts_us, __ATOMIC_RELAXED);
+  }
+  if (!video) {
+    return;
+  }
+  if (m->last_arrival_us != 0) {
+    // J += (|D| - J) / 16
+    int64_t d = (now - m->last_arrival_us) - (pts_us - m->last_pts_us);
+    int64_t j = (int64_t)__atomic_load_n(&m->jitter_us, __ATOMIC_RELAXED);
+    j += ((d < 0 ? -d : d) - j) / 16;
+    __atomic_store_n(&m->jitter_us, (uint64_t)j, __ATOMIC_RELAXED);
+  }
+  m->last_arrival_us = now;
+  m->last_pts_us = pts_us;
+}
+
+void stream_metrics_segment(stream_metrics *m, double seconds) {
+  record(&m->segment, seconds);
+}
+
+void stream_metrics_written(stream_metrics *m, int connection, int64_t pts_us,
+                            double seconds) {
+  record(&m->write, seconds);
+  if (pts_us == AV_NOPTS_VALUE) {
+    return;
+  }
+  int64_t offset =
+      __atomic_load_n(&m->clock_offset[connection & 1], __ATOMIC_RELAXED);
+  if (offset == INT64_MAX) {
+    return;
+  }
+  record(&m->glass_to_disk, (realtime_us() - (pts_us + offset)) / 1e6);
+}
+
+uint64_t latency_histogram_interval(latency_histogram *h, latency_mark *mark,
+                                    double *avg, double *max) {
+  uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  uint64_t sum_us = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+  uint64_t n = count - mark->count;
+  *avg = (n > 0) ? (sum_us - mark->sum_us) / 1e6 / n : 0.0;
+  *max = __atomic_exchange_n(&h->max_us, 0, __ATOMIC_RELAXED) / 1e6;
+  mark->count = count;
+  mark->sum_us = sum_us;
+  return n;
+}
+
+void latency_histogram_print(FILE *fp, const char *name, const char *labels,
+                             const latency_histogram *h) {
+  uint64_t cumulative = 0;
+  for (int i = 0; i < STREAM_METRICS_BUCKETS; i++) {
+    cumulative += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if (i < STREAM_METRICS_BUCKETS - 1) {
+      fprintf(fp, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+              stream_metrics_bounds[i], (unsigned long long)cumulative);
+    } else {
+      fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+              (unsigned long long)cumulative);
+    }
+  }
+  // 件数は区間の合計と一致させる
+  fprintf(fp, "%s_sum{%s} %.6f\n", name, labels,
+          __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1e6);
+  fprintf(fp, "%s_count{%s} %llu\n", name, labels,
+          (unsigned long long)cumulative);
+}
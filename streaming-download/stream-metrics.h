@@ -0,0 +1,98 @@
+/*
+ * stream-metrics
+ * カメラごとの受信と書き込みの遅延を計測する
+ * (録画が実時間に遅れていないかを常時監視するため, 更新はパケットごとに数回の加算のみ)
+ *
+ * - パケットの到着間隔の揺らぎ (RFC 3550の推定)
+ * - HLSのセグメントの取得の遅延 (接続から応答まで)
+ * - パケットの撮影時刻から出力に書き込むまでの遅延 (glass-to-disk)
+ * - `av_interleaved_write_frame` の所要時間
+ *
+ * 撮影時刻はPTSから推定する。接続ごとに「受信時刻 - PTS」の最小値を基準とし,
+ * 最も早く届いたパケットの遅延を0とみなすため, カメラから配信サーバまでの遅延は含まない
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#ifndef STREAM_METRICS_H
+#define STREAM_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// 遅延のヒストグラムの区間数 (最後は上限なし)
+#define STREAM_METRICS_BUCKETS 12
+
+// 遅延のヒストグラムの各区間の上限 [sec]
+extern const double stream_metrics_bounds[STREAM_METRICS_BUCKETS - 1];
+
+// 遅延のヒストグラム, 1つのスレッドが更新し, 他のスレッドが読む
+typedef struct {
+  uint64_t buckets[STREAM_METRICS_BUCKETS]; // 区間ごとの件数 (累積しない)
+  uint64_t count;
+  uint64_t sum_us; // 合計 [usec]
+  uint64_t max_us; // 最大 [usec], `latency_histogram_interval` で0に戻す
+} latency_histogram;
+
+// 前回の集計の時点の値
+typedef struct {
+  uint64_t count;
+  uint64_t sum_us;
+} latency_mark;
+
+// カメラごとの計測値
+typedef struct {
+  // 受信スレッドが書き込む
+  uint64_t jitter_us;        // パケットの到着間隔の揺らぎ [usec]
+  latency_histogram segment; // セグメントの取得
+  int64_t clock_offset[2]; // 接続ごとの「受信時刻 - PTS」の最小値 [usec]
+  int connections;         // 接続した回数
+  int64_t last_arrival_us; // 前の映像パケットの受信時刻 [usec]
+  int64_t last_pts_us;     // 前の映像パケットのPTS [usec]
+
+  // 書き込みワーカーが書き込む
+  latency_histogram write;         // `av_interleaved_write_frame`
+  latency_histogram glass_to_disk; // 撮影から書き込みまで
+} stream_metrics;
+
+/// @brief 新しい接続の計測を始めます (受信スレッド)
+/// @param m [IN/OUT] 計測値
+/// @return 接続の番号 (`1` から), 書き込み時に `stream_metrics_written` に渡す
+int stream_metrics_connect(stream_metrics *m);
+
+/// @brief パケットの受信を記録します (受信スレッド)
+/// @param m [IN/OUT] 計測値
+/// @param pts_us [IN] PTS [usec]
+/// @param video [IN] 映像のパケットのとき `1`, 到着間隔の揺らぎは映像のみで計算する
+void stream_metrics_arrival(stream_metrics *m, int64_t pts_us, int video);
+
+/// @brief セグメントの取得を記録します (受信スレッド)
+/// @param m [IN/OUT] 計測値
+/// @param seconds [IN] 取得の開始から応答までの時間 [sec]
+void stream_metrics_segment(stream_metrics *m, double seconds);
+
+/// @brief パケットの書き込みを記録します (書き込みワーカー)
+/// @param m [IN/OUT] 計測値
+/// @param connection [IN] パケットを受信した接続の番号
+/// @param pts_us [IN] PTS [usec], `AV_NOPTS_VALUE` のとき遅延は記録しない
+/// @param seconds [IN] `av_interleaved_write_frame` の所要時間 [sec]
+void stream_metrics_written(stream_metrics *m, int connection, int64_t pts_us,
+                            double seconds);
+
+/// @brief 前回の集計からの平均と最大を返します
+/// @param h [IN/OUT] ヒストグラム, 最大は0に戻す
+/// @param mark [IN/OUT] 前回の集計の時点の値, 更新される
+/// @param avg [OUT] 平均 [sec], 記録がないとき `0`
+/// @param max [OUT] 最大 [sec]
+/// @return 前回の集計からの記録の数
+uint64_t latency_histogram_interval(latency_histogram *h, latency_mark *mark,
+                                    double *avg, double *max);
+
+/// @brief ヒストグラムをPrometheusのテキスト形式で出力します
+/// @param fp [IN/OUT] 出力先
+/// @param name [IN] メトリクス名
+/// @param labels [IN] ラベル (`device="..."`)
+/// @param h [IN] ヒストグラム
+void latency_histogram_print(FILE *fp, const char *name, const char *labels,
+                             const latency_histogram *h);
+
+#endif
@@ -4,15 +4,38 @@
  *
  * Copyright (c) 2023 Safie Inc.
  */
+#include <errno.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#include "async-io.h"
+#include "frame-tap.h"
+#include "packet-queue.h"
+#include "preroll.h"
+#include "rate-limit.h"
+#include "relay.h"
+#include "retention.h"
+#include "segment-index.h"
+#include "stream-cache.h"
+#include "stream-metrics.h"
+
 /// @brief `AVError` を返す `expr` を評価し値が0以下のときラベル `end`
 /// にジャンプします
 /// @param expr `AVError` を返す式
@@ -28,37 +51,1741 @@ extern "C" {
     }                                                                          \
   }
 
-/// @brief ポインタを返す `expr` を評価し値がNULLのときプログラムを終了します
-/// @param expr ポインタを返す式
-#define CHECK_NULL(expr)                                                       \
-  {                                                                            \
-    if ((expr) == NULL) {                                                      \
-      fprintf(stderr, "error: \"%s\": NULL at %s(%d)\n", #expr, __FILE__,      \
-              __LINE__);                                                       \
-      goto error;                                                              \
-    }                                                                          \
+/// @brief ポインタを返す `expr` を評価し値がNULLのときプログラムを終了します
+/// @param expr ポインタを返す式
+#define CHECK_NULL(expr)                                                       \
+  {                                                                            \
+    if ((expr) == NULL) {                                                      \
+      fprintf(stderr, "error: \"%s\": NULL at %s(%d)\n", #expr, __FILE__,      \
+              __LINE__);                                                       \
+      goto error;                                                              \
+    }                                                                          \
+  }
+
+// プログラムの説明文を表示する
+void print_help() {
+  fprintf(stderr,
+          "usage: streaming-download [OPTION]...\n"
+          "obtain camera image from Safie Streaming API and save to mp4 file.\n"
+          "\n"
+          "  -k, --apikey=APIKEY     API key, required\n"
+          "  -d, --device-id=DEVICEID camera ID to obtain image from, can be "
+          "repeated\n"
+          "  -l, --device-list=FILE   record every camera listed in FILE ('-' "
+          "for stdin),\n"
+          "                           one 'DEVICEID [OUTPUT_DIR]' per line\n"
+          "  -o, --output-dir=.       output directory, '<output-dir>/"
+          "<DEVICEID>' when\n"
+          "                           recording more than one camera\n"
+          "  -s, --split-duration=60  split duration [sec] of output MP4 file\n"
+          "  -F, --fragmented         write fragmented MP4 (CMAF) flushed at "
+          "every\n"
+          "                           keyframe, readable while being written\n"
+          "  -f, --fragment-duration=SEC\n"
+          "                           minimum duration [sec] of a fragment, "
+          "implies -F\n"
+          "  -w, --workers=N          number of threads writing MP4 files, "
+          "defaults to\n"
+          "                           the number of cameras up to 4\n"
+          "  -r, --rate-limit=RATE    limit bandwidth to RATE bytes/sec (k, M, "
+          "G)\n"
+          "  -g, --rate-limit-group=NAME\n"
+          "                           share the bandwidth limit with other "
+          "processes on\n"
+          "                           this host in group NAME, defaults to\n"
+          "                           $SAFIE_RATE_LIMIT_GROUP\n"
+          "  -R, --relay=[HOST:]PORT  relay the stream as MPEG-TS at\n"
+          "                           http://HOST:PORT/<DEVICEID>.ts, HOST "
+          "defaults to\n"
+          "                           127.0.0.1\n"
+          "  -c, --clip=PRE:POST      instead of recording continuously, keep "
+          "PRE seconds\n"
+          "                           in memory and save PRE + POST seconds "
+          "around each\n"
+          "                           clip request (SIGUSR1, --clip-socket, "
+          "--clip-file)\n"
+          "  -m, --preroll-max=32M    memory limit [bytes] of the pre-roll per "
+          "camera\n"
+          "  -C, --clip-socket=PATH   accept clip requests on UNIX socket "
+          "PATH, one line\n"
+          "                           of DEVICEIDs (empty for all cameras)\n"
+          "  -T, --clip-file=PATH     request clips when PATH is created, "
+          "containing\n"
+          "                           DEVICEIDs (empty for all cameras)\n"
+          "  -a, --analyze=WxH        decode keyframes, scale them to WxH and "
+          "pass them\n"
+          "                           to the analyzer alongside recording\n"
+          "  -A, --analyze-threads=N  number of analysis threads, defaults to "
+          "the number\n"
+          "                           of CPU cores\n"
+          "  -x, --index              keep an index of the written files "
+          "in\n"
+          "                           <output-dir>/<DEVICEID>.segments for "
+          "segment-lookup\n"
+          "  -Q, --retention-size=SIZE\n"
+          "                           keep at most SIZE bytes (k, M, G) of "
+          "files per\n"
+          "                           camera, reusing the oldest files for "
+          "new ones\n"
+          "  -e, --retention-age=SEC  delete files older than SEC seconds\n"
+          "  -B, --write-buffer=SIZE  gather writes of MP4 files into SIZE "
+          "bytes (k, M)\n"
+          "                           and write them on a background thread\n"
+          "  -P, --stream-cache=DIR   save stream parameters of each camera in "
+          "DIR and\n"
+          "                           reuse them to skip probing on the next "
+          "connection\n"
+          "  -M, --metrics=FILE       write latency and health metrics of each "
+          "camera to\n"
+          "                           FILE in Prometheus text format every "
+          "10 seconds\n"
+          "  -v, --verbose            enable verbose logging from FFmpeg\n"
+          "  -h, --help               shows this help\n");
+}
+
+// Ctrl+Cによりプログラムの終了を通知する
+static volatile sig_atomic_t stopping = 0;
+void sighandler(int signum) {
+  stopping = 1;
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+}
+
+// SIGUSR1によりすべてのカメラの映像の切り出しを要求する
+static volatile sig_atomic_t clip_signals = 0;
+void clip_sighandler(int signum) { clip_signals = clip_signals + 1; }
+
+/// @brief 受信したパケットの分を帯域制限のバケットから差し引き, 帯域を超えていれば待ちます
+/// ライブ映像は一括ダウンロードより優先され, 帯域の上限を超えたときのみ待つ
+/// @param limiter [IN/OUT] 帯域制限, NULLのとき何もしない
+/// @param pkt [IN] 受信したパケット
+void throttle(rate_limit *limiter, const AVPacket *pkt) {
+  if (limiter == NULL) {
+    return;
+  }
+  rate_limit_consume(limiter, pkt->size);
+  double delay = rate_limit_delay(limiter, RATE_CLASS_LIVE);
+  if (delay > 0.0 && !stopping) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)delay;
+    ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+  }
+}
+
+/// @brief 単調増加時計の現在時刻 [sec] を返します
+double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 書き込みの1ファイルあたりの統計
+typedef struct {
+  int packets;        // 書き込んだパケット数
+  uint64_t max_depth; // キューに溜まったパケット数の最大値
+  double max_stall;   // 1回の書き込み (準備済みでないファイルを開くのを含む) の最大所要時間 [sec]
+  double stalled;     // 書き込みの所要時間の合計 [sec]
+  uint64_t dropped;   // ファイルを開いた時点のキューの破棄数
+} mux_stats;
+
+/// @brief 書き込みの所要時間を統計に加えます
+/// @param stats [IN/OUT] 統計
+/// @param since [IN] 書き込みを開始した時刻 (`monotonic_now`)
+void add_stall(mux_stats *stats, double since) {
+  double elapsed = monotonic_now() - since;
+  stats->stalled += elapsed;
+  if (elapsed > stats->max_stall) {
+    stats->max_stall = elapsed;
+  }
+}
+
+// 受信スレッドのスタックサイズ
+// 受信スレッドはFFmpegの受信とキューへの追加のみを行うため, 既定より小さくしてカメラ数を増やせるようにする
+#define READER_STACK_SIZE (1024 * 1024)
+// 書き込みワーカーが1台のカメラを続けて処理するパケット数の上限
+#define MUX_BATCH 64
+// 受信量とメモリ使用量を表示する間隔 [sec]
+#define REPORT_INTERVAL 60.0
+// 計測値をファイルに書き出す間隔 [sec]
+#define METRICS_INTERVAL 10.0
+// 再接続の待ち時間 [sec], 失敗するたびに最大値まで倍にする
+#define RECONNECT_MIN_DELAY 1.0
+#define RECONNECT_MAX_DELAY 30.0
+// 書き込みワーカー数と解析スレッド数に指定できる上限
+#define MAX_THREADS 1024
+
+typedef struct mux_pool mux_pool;
+typedef struct file_pool file_pool;
+
+// 録画する1台のカメラ
+typedef struct {
+  char device_id[64];
+  char output_dir[256];
+  const char *apikey;
+  double duration; // 出力ファイルの分割間隔 [sec]
+  double fragment_duration; // 断片化mp4の断片の最小の長さ [sec], 負のとき断片化しない
+  rate_limit *limiter;
+  int verbosity;
+  mux_pool *pool;
+  file_pool *files;
+  relay_channel *relay; // 中継のチャネル, 中継しないときNULL
+  frame_tap_channel *tap; // キーフレームの解析のチャネル, 解析しないときNULL
+  segment_index *index;   // 出力ファイルのインデックス, 作成しないときNULL
+  retention_channel *retention; // 容量の管理のチャネル, 管理しないときNULL
+  async_io *io; // 出力ファイルの非同期の書き込み, 使わないときNULL
+  char stream_cache[512]; // ストリーム情報のキャッシュのファイル名, 空のとき使わない
+  // 切り出しモード (`clip_post` が正のとき), 要求の前後のみを書き込む
+  double clip_pre;     // 要求より前に書き込む時間 [sec]
+  double clip_post;    // 要求より後に書き込む時間 [sec]
+  int64_t preroll_max; // 要求より前のパケットを保持するデータ量の上限 [byte]
+  uint64_t clip_requests; // 切り出しの要求回数, メインスレッドが増やす
+
+  // 受信スレッドが書き込む
+  pthread_t thread;
+  int reading;        // 受信スレッドを開始したとき `1`
+  int abort;          // 書き込みに失敗し受信を中断させるとき `1`
+  packet_queue queue; // 書き込みワーカーへ渡すパケット
+  uint64_t bytes;     // 受信したバイト数
+  uint64_t packets;   // 受信したパケット数
+  uint64_t reconnects; // 再接続した回数
+  uint64_t gap_ms;     // 再接続により欠落した時間の合計 [msec]
+  // 遅延の計測値, 受信側と書き込み側の項目はそれぞれのスレッドが書き込む
+  stream_metrics metrics;
+
+  // 受信スレッドから書き込みワーカーへ渡す入力, ワーカーが受け取るとNULLに戻す
+  AVFormatContext *handoff;
+  int handoff_video_stream_index;
+
+  // 書き込みワーカーのみが読み書きする, ワーカー間の受け渡しは `mux_pool` の排他による
+  int scheduled; // 書き込みワーカーの実行待ちまたは実行中のとき `1`
+  AVFormatContext *ic; // 書き込み中のパケットの入力
+  int video_stream_index;
+  AVFormatContext *oc;
+  char filename[512];
+  int64_t pts_offset; // ファイルの最初のパケットのPTS
+  int64_t end_pts;    // このPTS以降のキーフレームで次のファイルに切り替える
+  // インデックスと容量の管理に登録するファイルの情報
+  int64_t start_us;   // 最初のパケットの実時刻 (UNIX時間) [usec]
+  int64_t first_pts;  // 最初のパケットのPTS [usec]
+  int64_t last_us;    // 最後のパケットの最初のパケットからの時間 [usec]
+  segment_keyframe *keyframes; // 書き込んだキーフレーム
+  int nkeyframes;
+  int keyframes_capacity;
+  uint64_t index_seq; // 閉じたファイルの数, インデックスに追記する順番
+  mux_stats stats;
+  int failed; // 受信または書き込みに失敗したとき `1`
+  int done;   // 受信を終えすべてのパケットを書き込んだとき `1`
+  int generation;         // 入力を切り替えた回数
+  uint64_t prepare_count; // 次の出力ファイルを準備した回数
+  char last_second[32];   // 前のファイルの書き込み開始時刻 (ファイル名の部分)
+  int same_second;        // 前のファイルと同じ秒に書き込みを開始したファイルの数
+  preroll recent;         // 切り出しモードで保持している直近のパケット
+  uint64_t clip_seen;     // 処理した切り出しの要求回数
+  int clipping;           // 切り出しを書き込み中のとき `1`
+  double clip_until;      // 切り出しを終える時刻 [sec]
+
+  // 次の出力ファイル, 出力ファイルの処理スレッドが準備し書き込みワーカーが受け取る
+  AVFormatContext *prepared;
+  char prepared_path[512]; // 準備中の一時的なファイル名
+  int prepared_generation; // 準備に使った入力の `generation`
+  int preparing;           // 準備を依頼し完了していないとき `1`
+  int file_failed;         // 出力ファイルの処理に失敗したとき `1`
+  // 名前の変更またはトレーラの書き込みを実行中のとき `1`, `file_pool` の排他で保護する
+  int file_running;
+
+  // メインスレッドのみが読み書きする
+  uint64_t reported_bytes;
+  uint64_t reported_packets;
+  latency_mark reported_segment;
+  latency_mark reported_delay;
+  latency_mark reported_write;
+} device;
+
+// 書き込みワーカーのプール
+// パケットが溜まったカメラを実行待ちの列に入れ, 固定数のワーカーが順に書き込む
+struct mux_pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  device **ready; // 実行待ちのカメラ (リングバッファ, 容量はカメラ数)
+  int capacity;
+  int head;
+  int count;
+  int stopping; // ワーカーを終了させるとき `1`
+  int finished; // 終了したカメラ数
+  pthread_t *threads;
+  int nthreads;
+};
+
+// 出力ファイルの処理の種類
+enum FileTaskType {
+  TASK_PREPARE,  // 次の出力ファイルを開きヘッダを書き込む
+  TASK_RENAME,   // 準備したファイルを書き込み開始時刻の名前に変更する (順序を保つ)
+  TASK_FINALIZE, // トレーラを書き込み出力ファイルを閉じる (順序を保つ)
+  TASK_DISCARD,  // 使わなかった出力ファイルを閉じて削除する
+};
+
+// 出力ファイルの処理
+// ファイルの切り替え時に書き込みワーカーを待たせないよう, 別のスレッドで行う
+typedef struct file_task {
+  struct file_task *next;
+  enum FileTaskType type;
+  device *d;
+  AVFormatContext *oc;        // 閉じる出力 (FINALIZE, DISCARD)
+  AVCodecParameters **params; // 入力のストリーム情報の複製 (PREPARE)
+  int nb_streams;
+  int generation;     // 準備に使った入力の `generation` (PREPARE)
+  char path[512];     // 対象のファイル名
+  char new_path[512]; // 変更後のファイル名 (RENAME)
+  mux_stats stats;    // 閉じるファイルの統計 (FINALIZE)
+  // インデックスに追記するレコード (FINALIZE), ファイルサイズはトレーラの後に設定する
+  // 容量の管理にも書き込み開始時刻と長さを使う
+  segment_entry entry;
+  segment_keyframe *keyframes;
+  int nkeyframes;
+  uint64_t seq;
+} file_task;
+
+// 出力ファイルの処理を行うスレッドのプール
+struct file_pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // 依頼された順の処理のリスト
+  // 名前の変更とトレーラの書き込みは, カメラごとに依頼された順に1つずつ実行する
+  file_task *head;
+  file_task *tail;
+  int stopping; // 依頼済みの処理を終えたらスレッドを終了させるとき `1`
+  pthread_t *threads;
+  int nthreads;
+};
+
+/// @brief カメラを書き込みワーカーの実行待ちに入れます, 既に入っているときは何もしない
+/// @param pool [IN/OUT] 書き込みワーカーのプール
+/// @param d [IN] カメラ
+void schedule_device(mux_pool *pool, device *d) {
+  if (__atomic_exchange_n(&d->scheduled, 1, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->ready[(pool->head + pool->count) % pool->capacity] = d;
+  pool->count++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/// @brief 終了要求があるか書き込みに失敗したカメラのFFmpegの入出力を中断します
+/// @param opaque [IN] カメラ (`device`)
+/// @return 中断するとき `1`
+int on_interrupt(void *opaque) {
+  device *d = (device *)opaque;
+  return stopping || __atomic_load_n(&d->abort, __ATOMIC_RELAXED);
+}
+
+// FFmpegの既定の `io_open`, すべての入力で同じ関数
+int (*default_io_open)(AVFormatContext *s, AVIOContext **pb, const char *url,
+                       int flags, AVDictionary **options) = NULL;
+
+/// @brief HLSのプレイリストとセグメントを開きます (`AVFormatContext.io_open`)
+/// セグメントの接続から応答までの時間を計測する
+/// (keep-aliveで接続を再利用したセグメントはFFmpegがこの関数を経由せずに取得する)
+/// @param s [IN] 入力
+/// @param pb [OUT] 開いた入力
+/// @param url [IN] URL
+/// @param flags [IN] `AVIO_FLAG_READ` など
+/// @param options [IN/OUT] オプション
+/// @return 終了コード, `0` のとき正常終了, 失敗したときFFmpegのエラーコード
+int open_hls_io(AVFormatContext *s, AVIOContext **pb, const char *url,
+                int flags, AVDictionary **options) {
+  device *d = (device *)s->interrupt_callback.opaque;
+  double since = monotonic_now();
+  int ret = default_io_open(s, pb, url, flags, options);
+  if (ret >= 0 && strstr(url, ".m3u8") == NULL) {
+    stream_metrics_segment(&d->metrics, monotonic_now() - since);
+  }
+  return ret;
+}
+
+/// @brief HLSに接続しストリーム情報を取得します
+/// @param d [IN] カメラ
+/// @param pic [OUT] 入力, 失敗したときNULL
+/// @param video_stream_index [OUT] 映像ストリームの番号
+/// @return 終了コード, `0` のとき正常終了
+int open_input(device *d, AVFormatContext **pic, int *video_stream_index) {
+  AVDictionary *dict = NULL;
+  AVFormatContext *ic = NULL;
+  double started = monotonic_now();
+  int cached = 0;
+
+  char url[256];
+  int n =
+      snprintf(url, sizeof(url),
+               "https://openapi.safie.link/v2/devices/%s/live/playlist.m3u8",
+               d->device_id);
+  if (n >= sizeof(url)) {
+    fprintf(stderr, "%s: error: url too long\n", d->device_id);
+    goto error;
+  }
+
+  char auth[256];
+  n = snprintf(auth, sizeof(auth), "Safie-API-Key: %s\r\n", d->apikey);
+  if (n >= sizeof(auth)) {
+    fprintf(stderr, "%s: error: auth header too long\n", d->device_id);
+    goto error;
+  }
+  CHECK_AVERROR(av_dict_set(&dict, "headers", auth, 0));
+  // リトライ回数を制限する
+  CHECK_AVERROR(av_dict_set(&dict, "max_reload", "2", 0));
+  CHECK_AVERROR(av_dict_set(&dict, "rw_timeout", "8000000", 0));
+
+  // Ctrl+Cで受信待ちを中断できるようにする
+  CHECK_NULL(ic = avformat_alloc_context());
+  ic->interrupt_callback.callback = on_interrupt;
+  ic->interrupt_callback.opaque = d;
+  __atomic_store_n(&default_io_open, ic->io_open, __ATOMIC_RELAXED);
+  ic->io_open = open_hls_io;
+  CHECK_AVERROR(avformat_open_input(&ic, url, NULL, &dict));
+  // キャッシュがあればセグメントの解析を最小限にして録画の開始を早める
+  CHECK_AVERROR(stream_cache_find_stream_info(
+      ic, (d->stream_cache[0] != '\0') ? d->stream_cache : NULL, &cached));
+  CHECK_AVERROR(*video_stream_index = av_find_best_stream(
+                    ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0));
+  fprintf(stderr, "%s: connected in %.1f sec%s\n", d->device_id,
+          monotonic_now() - started, cached ? " (cached stream info)" : "");
+
+  if (d->verbosity >= 1) {
+    // 入力ストリームの情報表示
+    av_dump_format(ic, 0, url, 0);
+  }
+  // 接続の番号は書き込みワーカーが入力を切り替えた後の `generation` と一致する
+  stream_metrics_connect(&d->metrics);
+  av_dict_free(&dict);
+  *pic = ic;
+  return 0;
+
+error:
+  avformat_close_input(&ic);
+  av_dict_free(&dict);
+  *pic = NULL;
+  return 1;
+}
+
+/// @brief 新しい入力を書き込みワーカーに渡します
+/// 入力の切り替えを示す制御パケットをキューに追加し, ワーカーはそれより前のパケットを
+/// 書き込み終えてから出力ファイルを閉じ, 古い入力を解放して新しい入力に切り替える
+/// @param d [IN/OUT] カメラ
+/// @param ic [IN] 新しい入力, 終了要求で中断したときはここで解放する
+/// @param video_stream_index [IN] 映像ストリームの番号
+void hand_over_input(device *d, AVFormatContext *ic, int video_stream_index) {
+  // 前回の切り替えが処理されていないとき, または制御パケットを追加できないときは待つ
+  while ((__atomic_load_n(&d->handoff, __ATOMIC_ACQUIRE) != NULL ||
+          packet_queue_depth(&d->queue) >= PACKET_QUEUE_SIZE) &&
+         !on_interrupt(d)) {
+    schedule_device(d->pool, d);
+    usleep(10000);
+  }
+  // 中断したときは前回の入力が残っている, またはキューが一杯のことがあるため渡さない
+  if (on_interrupt(d)) {
+    avformat_close_input(&ic);
+    return;
+  }
+  d->handoff_video_stream_index = video_stream_index;
+  __atomic_store_n(&d->handoff, ic, __ATOMIC_RELEASE);
+
+  AVPacket marker;
+  memset(&marker, 0, sizeof(marker));
+  marker.stream_index = -1;
+  packet_queue_push(&d->queue, &marker, video_stream_index);
+  schedule_device(d->pool, d);
+}
+
+/// @brief 再接続まで待ちます, 終了要求があれば中断する
+/// @param d [IN] カメラ
+/// @param delay [IN] 待ち時間 [sec]
+void wait_reconnect(device *d, double delay) {
+  double until = monotonic_now() + delay;
+  while (!on_interrupt(d) && monotonic_now() < until) {
+    usleep(100000);
+  }
+}
+
+/// @brief HLSに接続し, パケットを受信しキューに追加し続けます
+/// ファイルの書き込みを待たないため, ディスクが停滞してもプレイリストの再読み込みは遅れない
+/// 受信に失敗したときは待ち時間を延ばしながら再接続し, 新しい出力ファイルから書き込みを続ける
+/// @param arg [IN/OUT] カメラ (`device`)
+/// @return NULL
+void *read_thread(void *arg) {
+  device *d = (device *)arg;
+  AVFormatContext *ic = NULL;
+  int video_stream_index;
+  AVPacket *pkt = NULL;
+  unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)d;
+  double failed_at = 0.0;   // 受信に失敗した時刻 (`monotonic_now`)
+  double received_at = 0.0; // 最後にパケットを受信した時刻 (`monotonic_now`)
+
+  // 最初の接続に失敗したときは再接続しない
+  if (open_input(d, &ic, &video_stream_index) != 0) {
+    goto error;
+  }
+  CHECK_NULL(pkt = av_packet_alloc());
+  if (d->relay != NULL) {
+    relay_set_input(d->relay, ic, video_stream_index);
+  }
+  if (d->tap != NULL) {
+    frame_tap_set_input(d->tap, ic, video_stream_index);
+  }
+  hand_over_input(d, ic, video_stream_index);
+
+  while (!on_interrupt(d)) {
+    int ret = av_read_frame(ic, pkt);
+    if (ret >= 0) {
+      double now = monotonic_now();
+      if (failed_at > 0.0) {
+        // 再接続後の最初のパケット
+        double gap = now - received_at;
+        fprintf(stderr,
+                "%s: reconnected in %.1f sec, %.1f sec of video missing\n",
+                d->device_id, now - failed_at, gap);
+        __atomic_add_fetch(&d->reconnects, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&d->gap_ms, (uint64_t)(gap * 1e3),
+                           __ATOMIC_RELAXED);
+        failed_at = 0.0;
+      }
+      received_at = now;
+      __atomic_store_n(&d->bytes, d->bytes + pkt->size, __ATOMIC_RELAXED);
+      __atomic_store_n(&d->packets, d->packets + 1, __ATOMIC_RELAXED);
+      if (pkt->pts != AV_NOPTS_VALUE) {
+        stream_metrics_arrival(
+            &d->metrics,
+            av_rescale_q(pkt->pts, ic->streams[pkt->stream_index]->time_base,
+                         AV_TIME_BASE_Q),
+            pkt->stream_index == video_stream_index);
+      }
+      throttle(d->limiter, pkt);
+      if (d->relay != NULL) {
+        // 録画のキューへ移す前に, 中継先へ参照を渡す
+        relay_publish(d->relay, pkt);
+      }
+      if (d->tap != NULL) {
+        // キーフレームのみ解析スレッドへ渡し, 復号は待たない
+        frame_tap_publish(d->tap, pkt);
+      }
+      packet_queue_push(&d->queue, pkt, video_stream_index);
+      schedule_device(d->pool, d);
+      continue;
+    }
+    // 終了要求による中断はエラーとしない
+    if (on_interrupt(d)) {
+      break;
+    }
+    char buf[64];
+    av_strerror(ret, buf, sizeof(buf));
+    fprintf(stderr, "%s: error: \"av_read_frame(ic, pkt)\": %s\n",
+            d->device_id, buf);
+
+    // 古い入力は書き込みワーカーが解放する
+    failed_at = monotonic_now();
+    if (received_at == 0.0) {
+      received_at = failed_at;
+    }
+    ic = NULL;
+    double delay = RECONNECT_MIN_DELAY;
+    while (!on_interrupt(d)) {
+      // 多数のカメラが同時に再接続しないよう待ち時間をずらす
+      double wait = delay * (0.5 + 0.5 * rand_r(&seed) / RAND_MAX);
+      fprintf(stderr, "%s: reconnecting in %.1f sec\n", d->device_id, wait);
+      wait_reconnect(d, wait);
+      if (!on_interrupt(d) && open_input(d, &ic, &video_stream_index) == 0) {
+        break;
+      }
+      delay = (delay * 2.0 < RECONNECT_MAX_DELAY) ? delay * 2.0
+                                                  : RECONNECT_MAX_DELAY;
+    }
+    if (ic == NULL) {
+      break;
+    }
+    if (d->relay != NULL) {
+      relay_set_input(d->relay, ic, video_stream_index);
+    }
+    if (d->tap != NULL) {
+      frame_tap_set_input(d->tap, ic, video_stream_index);
+    }
+    hand_over_input(d, ic, video_stream_index);
+  }
+  av_packet_free(&pkt);
+  packet_queue_close(&d->queue, 0);
+  schedule_device(d->pool, d);
+  return NULL;
+
+error:
+  av_packet_free(&pkt);
+  avformat_close_input(&ic);
+  packet_queue_close(&d->queue, 1);
+  schedule_device(d->pool, d);
+  return NULL;
+}
+
+/// @brief 複製したストリーム情報を解放します
+/// @param params [IN/OUT] ストリーム情報の配列
+/// @param nb_streams [IN] ストリーム数
+void free_stream_params(AVCodecParameters **params, int nb_streams) {
+  if (params == NULL) {
+    return;
+  }
+  for (int i = 0; i < nb_streams; i++) {
+    avcodec_parameters_free(&params[i]);
+  }
+  free(params);
+}
+
+/// @brief 入力のストリーム情報を複製します
+/// 出力ファイルの準備中に受信スレッドが入力を切り替えても影響を受けないようにする
+/// @param ic [IN] 入力
+/// @return ストリーム情報の配列 (`ic->nb_streams` 個), 失敗したときNULL
+AVCodecParameters **copy_stream_params(const AVFormatContext *ic) {
+  AVCodecParameters **params = (AVCodecParameters **)calloc(
+      ic->nb_streams, sizeof(AVCodecParameters *));
+  if (params == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < ic->nb_streams; i++) {
+    if ((params[i] = avcodec_parameters_alloc()) == NULL ||
+        avcodec_parameters_copy(params[i], ic->streams[i]->codecpar) < 0) {
+      free_stream_params(params, ic->nb_streams);
+      return NULL;
+    }
+  }
+  return params;
+}
+
+/// @brief 出力ファイルのヘッダを書き込みます
+/// @param d [IN] カメラ
+/// @param oc [IN/OUT] 出力
+/// @return 終了コード, `0` のとき正常終了
+int write_header(const device *d, AVFormatContext *oc) {
+  AVDictionary *opts = NULL;
+  if (d->fragment_duration >= 0.0) {
+    // 断片化mp4 (CMAF): 最初にmoovを書き込み, キーフレームごとに断片を出力する
+    // サンプルテーブルは断片ごとに書き出すため, 分割間隔によらずメモリ使用量は一定になる
+    CHECK_AVERROR(av_dict_set(
+        &opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0));
+    if (d->fragment_duration > 0.0) {
+      CHECK_AVERROR(av_dict_set_int(&opts, "min_frag_duration",
+                                    (int64_t)(d->fragment_duration * 1e6), 0));
+    }
+    // 書き込み中のファイルを読む側が完成した断片をすぐに読めるようにする
+    CHECK_AVERROR(av_dict_set(&opts, "flush_packets", "1", 0));
+  }
+  CHECK_AVERROR(avformat_write_header(oc, &opts));
+  av_dict_free(&opts);
+  return 0;
+
+error:
+  av_dict_free(&opts);
+  return 1;
+}
+
+/// @brief 出力ファイルの書き込みを終えて閉じます
+/// @param d [IN] カメラ
+/// @param oc [IN/OUT] 出力
+/// @return 終了コード, `0` のとき正常終了, 失敗したときFFmpegのエラーコード
+int close_output(const device *d, AVFormatContext *oc) {
+  if (d->io != NULL) {
+    return async_io_close_file(&oc->pb);
+  }
+  return avio_closep(&oc->pb);
+}
+
+/// @brief 出力ファイルを開きます
+/// 断片化mp4ではmoovに書き込み開始時刻を含めるため, ヘッダは書き込まない
+/// @param d [IN] カメラ
+/// @param path [IN] 出力ファイル名
+/// @param params [IN] ストリーム情報の配列
+/// @param nb_streams [IN] ストリーム数
+/// @param poc [OUT] 出力, 失敗したときNULL
+/// @return 終了コード, `0` のとき正常終了
+int create_output(const device *d, const char *path,
+                  AVCodecParameters **params, int nb_streams,
+                  AVFormatContext **poc) {
+  AVFormatContext *oc = NULL;
+  AVDictionary *opts = NULL;
+  CHECK_AVERROR(avformat_alloc_output_context2(&oc, NULL, NULL, path));
+  for (int i = 0; i < nb_streams; i++) {
+    AVStream *os;
+    CHECK_NULL(os = avformat_new_stream(oc, NULL));
+    CHECK_AVERROR(avcodec_parameters_copy(os->codecpar, params[i]));
+    os->codecpar->codec_tag = 0;
+  }
+
+  if (d->verbosity >= 1) {
+    // 出力ストリームの情報表示
+    av_dump_format(oc, 0, path, 1);
+  }
+
+  if (d->retention != NULL) {
+    // 先に確保したブロックを解放しないよう, 開くときは切り詰めない
+    double expected =
+        (d->clip_post > 0.0) ? d->clip_pre + d->clip_post : d->duration;
+    if (retention_prepare(d->retention, path, expected) != 0) {
+      goto error;
+    }
+    CHECK_AVERROR(av_dict_set(&opts, "truncate", "0", 0));
+  }
+  if (d->io != NULL) {
+    int flags = (d->retention == NULL) ? ASYNC_IO_TRUNCATE : 0;
+    if (d->fragment_duration >= 0.0) {
+      // 書き込み中のファイルを読む側が完成した断片をすぐに読めるようにする
+      flags |= ASYNC_IO_FLUSH;
+    }
+    CHECK_AVERROR(async_io_open_file(d->io, path, flags, &oc->pb));
+  } else {
+    CHECK_AVERROR(avio_open2(&oc->pb, path, AVIO_FLAG_WRITE, NULL, &opts));
+  }
+  av_dict_free(&opts);
+  if (d->fragment_duration < 0.0 && write_header(d, oc) != 0) {
+    goto error;
+  }
+  *poc = oc;
+  return 0;
+
+error:
+  av_dict_free(&opts);
+  if (oc != NULL) {
+    close_output(d, oc);
+    avformat_free_context(oc);
+  }
+  *poc = NULL;
+  return 1;
+}
+
+/// @brief 出力ファイルの処理を実行します
+/// @param t [IN] 処理
+void run_task(const file_task *t) {
+  device *d = t->d;
+  AVFormatContext *oc = t->oc;
+  switch (t->type) {
+  case TASK_PREPARE:
+    if (create_output(d, t->path, t->params, t->nb_streams, &oc) != 0) {
+      fprintf(stderr, "%s: error: failed to prepare next file \"%s\"\n",
+              d->device_id, t->path);
+    } else {
+      // 準備済みのファイル名は `prepared` を公開する前に書き込む
+      snprintf(d->prepared_path, sizeof(d->prepared_path), "%s", t->path);
+      d->prepared_generation = t->generation;
+      __atomic_store_n(&d->prepared, oc, __ATOMIC_RELEASE);
+    }
+    free_stream_params(t->params, t->nb_streams);
+    __atomic_store_n(&d->preparing, 0, __ATOMIC_RELEASE);
+    break;
+
+  case TASK_RENAME:
+    if (rename(t->path, t->new_path) != 0) {
+      fprintf(stderr, "%s: error: failed to rename %s to %s: %s\n",
+              d->device_id, t->path, t->new_path, strerror(errno));
+      __atomic_store_n(&d->file_failed, 1, __ATOMIC_RELAXED);
+    }
+    break;
+
+  case TASK_FINALIZE: {
+    double since = monotonic_now();
+    int ret = av_write_trailer(oc);
+    // 先に確保した領域を除き, 書き込んだ末尾の位置をサイズとする
+    int64_t size = avio_tell(oc->pb);
+    // 非同期の書き込みでは, 書き込みの失敗は閉じるときに分かる
+    int closed = close_output(d, oc);
+    if (ret >= 0) {
+      ret = closed;
+    }
+    avformat_free_context(oc);
+    if (d->retention != NULL) {
+      // 失敗したファイルも容量に含める
+      retention_commit(d->retention, t->path, size,
+                       t->entry.start_us / 1e6,
+                       (t->entry.end_us - t->entry.start_us) / 1e6);
+    }
+    if (ret < 0) {
+      char buf[64];
+      av_strerror(ret, buf, sizeof(buf));
+      fprintf(stderr, "%s: error: failed to finalize \"%s\": %s\n",
+              d->device_id, t->path, buf);
+      __atomic_store_n(&d->file_failed, 1, __ATOMIC_RELAXED);
+      if (d->index != NULL) {
+        // 後のファイルの追記を待たせないよう, 番号のみ進める
+        segment_index_append(d->index, t->seq, NULL, NULL, 0);
+      }
+      free(t->keyframes);
+      break;
+    }
+    if (d->index != NULL) {
+      segment_entry entry = t->entry;
+      entry.size = size;
+      if (segment_index_append(d->index, t->seq, &entry, t->keyframes,
+                               t->nkeyframes) != 0) {
+        __atomic_store_n(&d->file_failed, 1, __ATOMIC_RELAXED);
+      }
+    }
+    free(t->keyframes);
+    fprintf(stderr,
+            "%s: closed file \"%s\": %d packets, queue depth max %llu/%d, "
+            "write stall max %.0f ms (total %.0f ms), %llu packets dropped, "
+            "trailer %.0f ms\n",
+            d->device_id, t->path, t->stats.packets,
+            (unsigned long long)t->stats.max_depth, PACKET_QUEUE_SIZE,
+            t->stats.max_stall * 1e3, t->stats.stalled * 1e3,
+            (unsigned long long)t->stats.dropped,
+            (monotonic_now() - since) * 1e3);
+    break;
+  }
+
+  case TASK_DISCARD:
+    close_output(d, oc);
+    avformat_free_context(oc);
+    remove(t->path);
+    break;
+  }
+}
+
+/// @brief 出力ファイルの処理をバックグラウンドのスレッドに依頼します
+/// 依頼を登録できないときはこのスレッドで実行する
+/// @param pool [IN/OUT] 出力ファイルの処理を行うスレッドのプール
+/// @param task [IN] 依頼する処理, 内容は複製される
+void submit_task(file_pool *pool, const file_task *task) {
+  file_task *t = (file_task *)malloc(sizeof(file_task));
+  if (t == NULL) {
+    run_task(task);
+    return;
+  }
+  *t = *task;
+  t->next = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->tail != NULL) {
+    pool->tail->next = t;
+  } else {
+    pool->head = t;
+  }
+  pool->tail = t;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/// @brief カメラごとに依頼された順に実行する処理かを返します
+/// トレーラの書き込みと容量の管理への登録は, 名前の変更の後のファイル名を使う
+static int is_ordered_task(const file_task *t) {
+  return t->type == TASK_RENAME || t->type == TASK_FINALIZE;
+}
+
+/// @brief 依頼された出力ファイルの処理を順に実行し続けます
+/// 終了を要求された後も, 依頼済みの処理をすべて実行してから終了する
+/// @param arg [IN/OUT] 出力ファイルの処理を行うスレッドのプール (`file_pool`)
+/// @return NULL
+void *file_thread(void *arg) {
+  file_pool *pool = (file_pool *)arg;
+  while (1) {
+    pthread_mutex_lock(&pool->mutex);
+    file_task *prev, *t;
+    while (1) {
+      // 同じカメラの順序を保つ処理を実行中のときは, そのカメラの後の処理を飛ばす
+      prev = NULL;
+      for (t = pool->head; t != NULL; prev = t, t = t->next) {
+        if (!is_ordered_task(t) || !t->d->file_running) {
+          break;
+        }
+      }
+      if (t != NULL || (pool->head == NULL && pool->stopping)) {
+        break;
+      }
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    if (t == NULL) {
+      pthread_mutex_unlock(&pool->mutex);
+      break;
+    }
+    if (prev != NULL) {
+      prev->next = t->next;
+    } else {
+      pool->head = t->next;
+    }
+    if (pool->tail == t) {
+      pool->tail = prev;
+    }
+    int ordered = is_ordered_task(t);
+    if (ordered) {
+      t->d->file_running = 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_task(t);
+    if (ordered) {
+      // 飛ばした処理を他のスレッドが実行できるようにする
+      pthread_mutex_lock(&pool->mutex);
+      t->d->file_running = 0;
+      pthread_cond_broadcast(&pool->cond);
+      pthread_mutex_unlock(&pool->mutex);
+    }
+    free(t);
+  }
+  return NULL;
+}
+
+/// @brief 次の出力ファイルの準備をバックグラウンドで開始します
+/// 準備中または準備済みのときは何もしない
+/// @param d [IN/OUT] カメラ
+void prepare_next(device *d) {
+  if (__atomic_load_n(&d->preparing, __ATOMIC_ACQUIRE) ||
+      __atomic_load_n(&d->prepared, __ATOMIC_ACQUIRE) != NULL) {
+    return;
+  }
+  file_task task;
+  memset(&task, 0, sizeof(task));
+  task.type = TASK_PREPARE;
+  task.d = d;
+  task.nb_streams = d->ic->nb_streams;
+  task.generation = d->generation;
+  // 切り替え前の名前の変更と重ならないよう, 準備するたびに別の名前を使う
+  int n = snprintf(task.path, sizeof(task.path), "%s/.%s-%llu.mp4",
+                   d->output_dir, d->device_id,
+                   (unsigned long long)d->prepare_count++);
+  if (n >= sizeof(task.path) ||
+      (task.params = copy_stream_params(d->ic)) == NULL) {
+    // 準備できないときは切り替え時に開く
+    return;
+  }
+  __atomic_store_n(&d->preparing, 1, __ATOMIC_RELEASE);
+  submit_task(d->files, &task);
+}
+
+/// @brief 準備済みの出力ファイルを受け取ります
+/// @param d [IN/OUT] カメラ
+/// @return 出力, 準備済みのファイルがないとき NULL
+AVFormatContext *take_prepared(device *d) {
+  AVFormatContext *oc = __atomic_exchange_n(&d->prepared, NULL,
+                                            __ATOMIC_ACQ_REL);
+  if (oc != NULL && d->prepared_generation != d->generation) {
+    // 入力を切り替える前のストリーム構成で準備したファイルは使わない
+    file_task task;
+    memset(&task, 0, sizeof(task));
+    task.type = TASK_DISCARD;
+    task.d = d;
+    task.oc = oc;
+    snprintf(task.path, sizeof(task.path), "%s", d->prepared_path);
+    submit_task(d->files, &task);
+    oc = NULL;
+  }
+  return oc;
+}
+
+/// @brief 出力ファイルを閉じます
+/// トレーラの書き込みはバックグラウンドで行う
+/// @param d [IN/OUT] カメラ
+void close_segment(device *d) {
+  if (d->oc == NULL) {
+    return;
+  }
+  file_task task;
+  memset(&task, 0, sizeof(task));
+  task.type = TASK_FINALIZE;
+  task.d = d;
+  task.oc = d->oc;
+  snprintf(task.path, sizeof(task.path), "%s", d->filename);
+  task.stats = d->stats;
+  task.stats.dropped = packet_queue_dropped(&d->queue) - d->stats.dropped;
+  segment_entry *e = &task.entry;
+  e->start_us = d->start_us;
+  e->end_us = d->start_us + d->last_us;
+  if (d->index != NULL) {
+    e->first_pts = d->first_pts;
+    e->last_pts = d->first_pts + d->last_us;
+    const char *slash = strrchr(d->filename, '/');
+    snprintf(e->name, sizeof(e->name), "%.*s", (int)sizeof(e->name) - 1,
+             (slash != NULL) ? slash + 1 : d->filename);
+    // キーフレームの配列はトレーラの書き込み後に解放される
+    task.keyframes = d->keyframes;
+    task.nkeyframes = d->nkeyframes;
+    task.seq = d->index_seq++;
+    d->keyframes = NULL;
+    d->nkeyframes = 0;
+    d->keyframes_capacity = 0;
+  }
+  submit_task(d->files, &task);
+  d->oc = NULL;
+}
+
+/// @brief 書き込むキーフレームの時刻と位置を記録します
+/// 記録できないときはインデックスから除かれるのみで, 書き込みは続ける
+/// @param d [IN/OUT] カメラ
+/// @param t_us [IN] ファイルの最初のパケットからの時間 [usec]
+void add_keyframe(device *d, int64_t t_us) {
+  if (d->nkeyframes == d->keyframes_capacity) {
+    int capacity = (d->keyframes_capacity == 0) ? 64
+                                                : d->keyframes_capacity * 2;
+    segment_keyframe *p = (segment_keyframe *)realloc(
+        d->keyframes, capacity * sizeof(segment_keyframe));
+    if (p == NULL) {
+      return;
+    }
+    d->keyframes = p;
+    d->keyframes_capacity = capacity;
+  }
+  segment_keyframe *kf = &d->keyframes[d->nkeyframes++];
+  kf->time_us = d->start_us + t_us;
+  // 以降のパケットはこの位置より後に書き込まれる
+  // (インターリーブのため待たされたパケットがあると, 実際の位置より手前になる)
+  // 断片化mp4では断片の書き出し時のみ位置が進むため, 常に断片の境界になり,
+  // このキーフレームのGOPは次のキーフレームの書き込み以降に出力される
+  kf->offset = avio_tell(d->oc->pb);
+}
+
+/// @brief 新しい出力ファイルに切り替えます
+/// バックグラウンドで準備済みのファイルがあるときはそれを使い, ないときはここで開く
+/// @param d [IN/OUT] カメラ
+/// @param pkt [IN] ファイルの最初のパケット
+/// @param backdate [IN] 最初のパケットから現在のパケットまでの時間 [sec]
+/// ファイル名と記録する書き込み開始時刻をこの分だけ遡らせる
+/// @return 終了コード, `0` のとき正常終了
+int open_segment(device *d, const AVPacket *pkt, double backdate) {
+  AVFormatContext *ic = d->ic;
+
+  // ファイル出力の最初のパケットのタイミングを計算
+  d->pts_offset = pkt->pts;
+  AVRational tb = ic->streams[pkt->stream_index]->time_base;
+  d->end_pts = pkt->pts + (int64_t)(d->duration * tb.den / tb.num);
+  d->first_pts = av_rescale_q(pkt->pts, tb, AV_TIME_BASE_Q);
+  d->last_us = 0;
+  memset(&d->stats, 0, sizeof(mux_stats));
+  d->stats.dropped = packet_queue_dropped(&d->queue);
+
+  /*
+   * ファイル出力の設定
+   */
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (backdate > 0.0) {
+    int64_t ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec -
+                 (int64_t)(backdate * 1e9);
+    now.tv_sec = ns / 1000000000;
+    now.tv_nsec = ns % 1000000000;
+  }
+  d->start_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  struct tm lt;
+  localtime_r(&now.tv_sec, &lt);
+  char timestr[32];
+  strftime(timestr, sizeof(timestr), "%F %H_%M_%S", &lt);
+  // 同じ秒に切り替えたときは, 前のファイルを上書きしないよう番号を付ける
+  if (strcmp(timestr, d->last_second) == 0) {
+    d->same_second++;
+  } else {
+    snprintf(d->last_second, sizeof(d->last_second), "%s", timestr);
+    d->same_second = 0;
+  }
+  int n;
+  if (d->same_second > 0) {
+    n = snprintf(d->filename, sizeof(d->filename), "%s/%s_%d.mp4",
+                 d->output_dir, timestr, d->same_second);
+  } else {
+    n = snprintf(d->filename, sizeof(d->filename), "%s/%s.mp4",
+                 d->output_dir, timestr);
+  }
+  if (n >= sizeof(d->filename)) {
+    fprintf(stderr, "%s: error: filename too long\n", d->device_id);
+    return 1;
+  }
+
+  fprintf(stderr, "%s: writing file \"%s\"...\n", d->device_id, d->filename);
+
+  d->oc = take_prepared(d);
+  if (d->oc != NULL) {
+    // 準備済みのファイルを書き込み開始時刻の名前に変更する
+    // 開いたままの名前の変更は書き込みに影響しないため, 完了を待たない
+    file_task task;
+    memset(&task, 0, sizeof(task));
+    task.type = TASK_RENAME;
+    task.d = d;
+    snprintf(task.path, sizeof(task.path), "%s", d->prepared_path);
+    snprintf(task.new_path, sizeof(task.new_path), "%s", d->filename);
+    submit_task(d->files, &task);
+  } else {
+    double since = monotonic_now();
+    AVCodecParameters **params;
+    CHECK_NULL(params = copy_stream_params(ic));
+    int ret = create_output(d, d->filename, params, ic->nb_streams, &d->oc);
+    free_stream_params(params, ic->nb_streams);
+    if (ret != 0) {
+      return 1;
+    }
+    add_stall(&d->stats, since);
+  }
+
+  // 再接続による欠落が分かるよう, 最初のパケットを書き込んだ実時刻を記録する
+  // mp4ではトレーラの書き込み時に出力されるため, ヘッダの書き込み後に設定してよい
+  // 断片化mp4ではヘッダのmoovに出力されるため, この後にヘッダを書き込む
+  struct tm utc;
+  gmtime_r(&now.tv_sec, &utc);
+  char creation_time[40];
+  strftime(creation_time, sizeof(creation_time), "%Y-%m-%dT%H:%M:%S", &utc);
+  snprintf(creation_time + strlen(creation_time),
+           sizeof(creation_time) - strlen(creation_time), ".%06ldZ",
+           now.tv_nsec / 1000);
+  CHECK_AVERROR(
+      av_dict_set(&d->oc->metadata, "creation_time", creation_time, 0));
+  if (d->fragment_duration >= 0.0) {
+    double since = monotonic_now();
+    if (write_header(d, d->oc) != 0) {
+      goto error;
+    }
+    add_stall(&d->stats, since);
+  }
+
+  // このファイルを書き込んでいる間に次のファイルを準備しておく
+  prepare_next(d);
+  return 0;
+
+error:
+  return 1;
+}
+
+/// @brief 開いている出力ファイルにパケットを書き込みます
+/// @param d [IN/OUT] カメラ
+/// @param pkt [IN/OUT] パケット, 書き込み後は空になる
+/// @return 終了コード, `0` のとき正常終了
+int write_packet(device *d, AVPacket *pkt) {
+  AVFormatContext *ic = d->ic;
+  if (pkt->stream_index >= d->oc->nb_streams) {
+    // ファイルを開いた後に現れたストリームは次のファイルから書き込む
+    av_packet_unref(pkt);
+    return 0;
+  }
+
+  uint64_t depth = packet_queue_depth(&d->queue);
+  if (depth > d->stats.max_depth) {
+    d->stats.max_depth = depth;
+  }
+
+  // パケットを出力
+  int64_t pts_us = AV_NOPTS_VALUE; // 入力のPTS [usec]
+  pkt->pts -= d->pts_offset;
+  pkt->dts -= d->pts_offset;
+  if (pkt->pts != AV_NOPTS_VALUE) {
+    int64_t t_us = av_rescale_q(
+        pkt->pts, ic->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q);
+    pts_us = d->first_pts + t_us;
+    if (t_us > d->last_us) {
+      d->last_us = t_us;
+    }
+    if (d->index != NULL && pkt->stream_index == d->video_stream_index &&
+        pkt->flags & AV_PKT_FLAG_KEY) {
+      add_keyframe(d, t_us);
+    }
+  }
+  av_packet_rescale_ts(pkt, ic->streams[pkt->stream_index]->time_base,
+                       d->oc->streams[pkt->stream_index]->time_base);
+  pkt->pos = -1;
+  double since = monotonic_now();
+  CHECK_AVERROR(av_interleaved_write_frame(d->oc, pkt));
+  stream_metrics_written(&d->metrics, d->generation, pts_us,
+                         monotonic_now() - since);
+  add_stall(&d->stats, since);
+  d->stats.packets++;
+  return 0;
+
+error:
+  return 1;
+}
+
+/// @brief パケットを出力ファイルに書き込みます
+/// 分割間隔を経過した後の映像のキーフレームで次のファイルに切り替える
+/// @param d [IN/OUT] カメラ
+/// @param pkt [IN/OUT] パケット, 書き込み後は空になる
+/// @return 終了コード, `0` のとき正常終了
+int mux_packet(device *d, AVPacket *pkt) {
+  if (d->oc != NULL && pkt->stream_index >= d->oc->nb_streams) {
+    // ファイルを開いた後に現れたストリームは次のファイルから書き込む
+    return 0;
+  }
+
+  // パケットがキーフレームでありdurationを経過した場合出力ファイルを閉じる
+  if (d->oc != NULL && pkt->stream_index == d->video_stream_index &&
+      pkt->flags & AV_PKT_FLAG_KEY && d->end_pts <= pkt->pts) {
+    close_segment(d);
+  }
+  if (d->oc == NULL && open_segment(d, pkt, 0.0) != 0) {
+    return 1;
+  }
+  return write_packet(d, pkt);
+}
+
+/// @brief 切り出しモードでパケットを処理します
+/// 直近のパケットをメモリに保持し, 切り出しを要求されたときは保持していた
+/// パケットから書き込み, 要求から `clip_post` 秒後にファイルを閉じる
+/// @param d [IN/OUT] カメラ
+/// @param pkt [IN/OUT] パケット, 処理後は空になる
+/// @return 終了コード, `0` のとき正常終了
+int clip_packet(device *d, AVPacket *pkt) {
+  AVRational tb = d->ic->streams[pkt->stream_index]->time_base;
+  double t = pkt->pts * (double)tb.num / tb.den;
+  int video = (pkt->stream_index == d->video_stream_index);
+  int keyframe = video && pkt->flags & AV_PKT_FLAG_KEY;
+  if (preroll_push(&d->recent, pkt, t, keyframe) < 0) {
+    fprintf(stderr, "%s: error: failed to keep packet for pre-roll\n",
+            d->device_id);
+    return 1;
+  }
+  preroll_trim(&d->recent, d->clip_pre, d->preroll_max,
+               d->video_stream_index);
+
+  uint64_t requests = __atomic_load_n(&d->clip_requests, __ATOMIC_RELAXED);
+  if (requests != d->clip_seen) {
+    d->clip_seen = requests;
+    if (!d->clipping) {
+      fprintf(stderr, "%s: clip requested, %.1f sec pre-roll buffered\n",
+              d->device_id, preroll_duration(&d->recent));
+    }
+    // 書き込み中に再度要求されたときは終了を延ばす
+    d->clipping = 1;
+    d->clip_until = t + d->clip_post;
+  }
+  if (!d->clipping) {
+    return 0;
+  }
+
+  if (d->oc == NULL) {
+    if (d->recent.count == 0) {
+      // 最初の映像のキーフレームから書き込む
+      return 0;
+    }
+    // 保持していたパケット (このパケットを含む) から書き込む
+    av_packet_unref(pkt);
+    double backdate = preroll_duration(&d->recent);
+    if (open_segment(d, preroll_at(&d->recent, 0), backdate) != 0) {
+      return 1;
+    }
+    for (int i = 0; i < d->recent.count; i++) {
+      CHECK_AVERROR(av_packet_ref(pkt, preroll_at(&d->recent, i)));
+      if (write_packet(d, pkt) != 0) {
+        return 1;
+      }
+    }
+  } else if (write_packet(d, pkt) != 0) {
+    return 1;
+  }
+
+  if (video && t >= d->clip_until) {
+    close_segment(d);
+    d->clipping = 0;
+  }
+  return 0;
+
+error:
+  return 1;
+}
+
+/// @brief 受信スレッドから渡された新しい入力に切り替えます
+/// 出力ファイルを閉じ, 次のパケットから新しいファイルに書き込む
+/// @param d [IN/OUT] カメラ
+void switch_input(device *d) {
+  close_segment(d);
+  avformat_close_input(&d->ic);
+  // 受信スレッドは `handoff` がNULLに戻るまで次の番号を書き込まないため,
+  // 番号は入力を受け取る前に読む
+  if (__atomic_load_n(&d->handoff, __ATOMIC_ACQUIRE) != NULL) {
+    d->video_stream_index = d->handoff_video_stream_index;
+  }
+  d->ic = __atomic_exchange_n(&d->handoff, NULL, __ATOMIC_ACQ_REL);
+  // ストリーム構成が変わり得るため, 準備済みのファイルは使わない
+  d->generation++;
+  // 保持していたパケットは前の入力のものなので捨て, 書き込み中の切り出しも終える
+  preroll_clear(&d->recent);
+  d->clipping = 0;
+}
+
+/// @brief 実行待ちのカメラのパケットを書き込み続けます
+/// @param arg [IN/OUT] 書き込みワーカーのプール (`mux_pool`)
+/// @return NULL
+void *mux_thread(void *arg) {
+  mux_pool *pool = (mux_pool *)arg;
+  AVPacket *pkt = av_packet_alloc();
+  if (pkt == NULL) {
+    fprintf(stderr, "error: \"av_packet_alloc()\": NULL at %s(%d)\n", __FILE__,
+            __LINE__);
+    exit(1);
+  }
+
+  while (1) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    if (pool->count == 0) {
+      pthread_mutex_unlock(&pool->mutex);
+      break;
+    }
+    device *d = pool->ready[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+    pthread_mutex_unlock(&pool->mutex);
+
+    // 1台のカメラがワーカーを占有しないよう, 一定数ごとに実行待ちの列に戻す
+    int ret = 0;
+    for (int i = 0; i < MUX_BATCH; i++) {
+      ret = packet_queue_try_pop(&d->queue, pkt);
+      if (ret <= 0) {
+        break;
+      }
+      if (pkt->stream_index < 0) {
+        // 入力の切り替え
+        switch_input(d);
+      } else if (!d->failed &&
+                 ((d->clip_post > 0.0) ? clip_packet(d, pkt)
+                                       : mux_packet(d, pkt)) != 0) {
+        // 受信を中断させ, 残りのパケットは捨てる
+        d->failed = 1;
+        __atomic_store_n(&d->abort, 1, __ATOMIC_RELAXED);
+      }
+      av_packet_unref(pkt);
+    }
+    if (ret < 0) {
+      // 受信を終えたので出力ファイルを閉じる
+      close_segment(d);
+      if (d->queue.error != 0) {
+        d->failed = 1;
+      }
+      d->done = 1;
+      pthread_mutex_lock(&pool->mutex);
+      pool->finished++;
+      pthread_mutex_unlock(&pool->mutex);
+      continue;
+    }
+    // 実行待ちを解除した後に追加されたパケットを取りこぼさないよう再確認する
+    __atomic_store_n(&d->scheduled, 0, __ATOMIC_SEQ_CST);
+    if (packet_queue_depth(&d->queue) > 0 ||
+        __atomic_load_n(&d->queue.closed, __ATOMIC_SEQ_CST)) {
+      schedule_device(pool, d);
+    }
+  }
+
+  av_packet_free(&pkt);
+  return NULL;
+}
+
+/// @brief プロセスの常駐メモリサイズを返します
+/// @return 常駐メモリサイズ [byte], 取得できないときは最大値
+uint64_t resident_memory() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp != NULL) {
+    unsigned long size, resident;
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (n == 2) {
+      return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+    }
   }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
 
-// プログラムの説明文を表示する
-void print_help() {
-  fprintf(stderr,
-          "usage: streaming-download [OPTION]...\n"
-          "obtain camera image from Safie Streaming API and save to mp4 file.\n"
-          "\n"
-          "  -k, --apikey=APIKEY     API key, required\n"
-          "  -d, --device-id=DEVICEID camera ID to obtain image from\n"
-          "  -o, --output-dir=.       output directory\n"
-          "  -d, --split-duration=60  split duration [sec] of output MP4 file\n"
-          "  -v, --verbose            enable verbose logging from FFmpeg\n"
-          "  -h, --help               shows this help\n");
+/// @brief カメラごとの受信量とプロセスのメモリ使用量を表示します
+/// @param devices [IN/OUT] カメラの配列
+/// @param ndevices [IN] カメラ数
+/// @param io [IN/OUT] 非同期の書き込み, 使わないときNULL
+/// @param elapsed [IN] 前回の表示からの経過時間 [sec]
+void report(device *devices, int ndevices, async_io *io, double elapsed) {
+  for (int i = 0; i < ndevices; i++) {
+    device *d = &devices[i];
+    uint64_t bytes = __atomic_load_n(&d->bytes, __ATOMIC_RELAXED);
+    uint64_t packets = __atomic_load_n(&d->packets, __ATOMIC_RELAXED);
+    fprintf(stderr,
+            "%s: %.0f kbit/s, %.1f packets/s, %llu packets dropped, "
+            "%llu reconnects (%.1f sec missing)\n",
+            d->device_id, (bytes - d->reported_bytes) * 8 / elapsed / 1e3,
+            (packets - d->reported_packets) / elapsed,
+            (unsigned long long)packet_queue_dropped(&d->queue),
+            (unsigned long long)__atomic_load_n(&d->reconnects,
+                                                __ATOMIC_RELAXED),
+            __atomic_load_n(&d->gap_ms, __ATOMIC_RELAXED) / 1e3);
+    d->reported_bytes = bytes;
+    d->reported_packets = packets;
+    // 遅延の最大は前回の表示からの値
+    double segment_avg, segment_max, delay_avg, delay_max, write_avg,
+        write_max;
+    latency_histogram_interval(&d->metrics.segment, &d->reported_segment,
+                               &segment_avg, &segment_max);
+    latency_histogram_interval(&d->metrics.glass_to_disk, &d->reported_delay,
+                               &delay_avg, &delay_max);
+    latency_histogram_interval(&d->metrics.write, &d->reported_write,
+                               &write_avg, &write_max);
+    fprintf(stderr,
+            "%s: jitter %.1f ms, segment fetch avg %.0f ms max %.0f ms, "
+            "glass-to-disk avg %.0f ms max %.0f ms, write avg %.2f ms max "
+            "%.2f ms\n",
+            d->device_id,
+            __atomic_load_n(&d->metrics.jitter_us, __ATOMIC_RELAXED) / 1e3,
+            segment_avg * 1e3, segment_max * 1e3, delay_avg * 1e3,
+            delay_max * 1e3, write_avg * 1e3, write_max * 1e3);
+    if (d->retention != NULL) {
+      int64_t bytes;
+      int files;
+      uint64_t recycled, deleted;
+      retention_stats(d->retention, &bytes, &files, &recycled, &deleted);
+      fprintf(stderr,
+              "%s: %.1f MiB in %d files, %llu files reused, %llu deleted\n",
+              d->device_id, bytes / 1048576.0, files,
+              (unsigned long long)recycled, (unsigned long long)deleted);
+    }
+    if (d->tap != NULL) {
+      uint64_t analyzed, skipped;
+      frame_tap_stats(d->tap, &analyzed, &skipped);
+      fprintf(stderr, "%s: %llu keyframes analyzed, %llu skipped\n",
+              d->device_id, (unsigned long long)analyzed,
+              (unsigned long long)skipped);
+    }
+  }
+  if (io != NULL) {
+    // 遅延とキューの深さの最大は前回の表示からの値
+    async_io_stats st;
+    async_io_get_stats(io, &st, 1);
+    fprintf(stderr,
+            "write (%s): %llu writes, %.1f MiB, latency avg %.1f ms max "
+            "%.1f ms, queue depth %d (max %d), %llu stalls (%.0f ms)\n",
+            async_io_backend(io), (unsigned long long)st.writes,
+            st.bytes / 1048576.0,
+            (st.writes > 0) ? st.latency_total / st.writes * 1e3 : 0.0,
+            st.latency_max * 1e3, st.depth, st.depth_max,
+            (unsigned long long)st.stalls, st.stalled * 1e3);
+  }
+  uint64_t rss = resident_memory();
+  fprintf(stderr, "resident memory %.1f MiB (%.2f MiB per camera)\n",
+          rss / 1048576.0, rss / 1048576.0 / ndevices);
 }
 
-// Ctrl+Cによりプログラムの終了を通知する
-static volatile sig_atomic_t stopping = 0;
-void sighandler(int signum) {
-  stopping = 1;
-  signal(SIGINT, SIG_DFL);
-  signal(SIGTERM, SIG_DFL);
+/// @brief カメラごとの計測値をPrometheusのテキスト形式でファイルに書き出します
+/// 読み手が書きかけのファイルを読まないよう, 一時ファイルに書いてから置き換える
+/// (node_exporterのtextfile collectorでそのまま収集できる)
+/// @param path [IN] ファイル名
+/// @param devices [IN] カメラの配列
+/// @param ndevices [IN] カメラ数
+/// @return 終了コード, `0` のとき正常終了
+int write_metrics(const char *path, device *devices, int ndevices) {
+  // カウンタ: 名前, 説明, カメラごとの値の位置
+  static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+  } counters[] = {
+      {"safie_stream_received_bytes_total", "Bytes received from the stream.",
+       offsetof(device, bytes)},
+      {"safie_stream_received_packets_total",
+       "Packets received from the stream.", offsetof(device, packets)},
+      {"safie_stream_reconnects_total", "Reconnections to the stream.",
+       offsetof(device, reconnects)},
+  };
+  static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+  } histograms[] = {
+      {"safie_stream_segment_fetch_seconds",
+       "Time from requesting an HLS segment to its response.",
+       offsetof(device, metrics.segment)},
+      {"safie_stream_glass_to_disk_seconds",
+       "Delay from the PTS-derived capture time to writing the packet.",
+       offsetof(device, metrics.glass_to_disk)},
+      {"safie_stream_write_frame_seconds",
+       "Time spent in av_interleaved_write_frame.",
+       offsetof(device, metrics.write)},
+  };
+  char tmp[1024], labels[128];
+  int n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (n >= sizeof(tmp)) {
+    fprintf(stderr, "error: metrics file name too long\n");
+    return 1;
+  }
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open %s: %s\n", tmp, strerror(errno));
+    return 1;
+  }
+
+  for (size_t k = 0; k < sizeof(counters) / sizeof(counters[0]); k++) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", counters[k].name,
+            counters[k].help, counters[k].name);
+    for (int i = 0; i < ndevices; i++) {
+      uint64_t *v = (uint64_t *)((char *)&devices[i] + counters[k].offset);
+      fprintf(fp, "%s{device=\"%s\"} %llu\n", counters[k].name,
+              devices[i].device_id,
+              (unsigned long long)__atomic_load_n(v, __ATOMIC_RELAXED));
+    }
+  }
+  fprintf(fp, "# HELP safie_stream_dropped_packets_total Packets dropped "
+              "because writing fell behind.\n"
+              "# TYPE safie_stream_dropped_packets_total counter\n");
+  for (int i = 0; i < ndevices; i++) {
+    fprintf(fp, "safie_stream_dropped_packets_total{device=\"%s\"} %llu\n",
+            devices[i].device_id,
+            (unsigned long long)packet_queue_dropped(&devices[i].queue));
+  }
+  fprintf(fp, "# HELP safie_stream_missing_seconds_total Video missing "
+              "because of reconnections.\n"
+              "# TYPE safie_stream_missing_seconds_total counter\n");
+  for (int i = 0; i < ndevices; i++) {
+    fprintf(fp, "safie_stream_missing_seconds_total{device=\"%s\"} %.3f\n",
+            devices[i].device_id,
+            __atomic_load_n(&devices[i].gap_ms, __ATOMIC_RELAXED) / 1e3);
+  }
+  fprintf(fp, "# HELP safie_stream_jitter_seconds Interarrival jitter of "
+              "video packets (RFC 3550).\n"
+              "# TYPE safie_stream_jitter_seconds gauge\n");
+  for (int i = 0; i < ndevices; i++) {
+    fprintf(fp, "safie_stream_jitter_seconds{device=\"%s\"} %.6f\n",
+            devices[i].device_id,
+            __atomic_load_n(&devices[i].metrics.jitter_us, __ATOMIC_RELAXED) /
+                1e6);
+  }
+  fprintf(fp, "# HELP safie_stream_queue_packets Packets waiting to be "
+              "written.\n"
+              "# TYPE safie_stream_queue_packets gauge\n");
+  for (int i = 0; i < ndevices; i++) {
+    fprintf(fp, "safie_stream_queue_packets{device=\"%s\"} %llu\n",
+            devices[i].device_id,
+            (unsigned long long)packet_queue_depth(&devices[i].queue));
+  }
+  for (size_t k = 0; k < sizeof(histograms) / sizeof(histograms[0]); k++) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", histograms[k].name,
+            histograms[k].help, histograms[k].name);
+    for (int i = 0; i < ndevices; i++) {
+      snprintf(labels, sizeof(labels), "device=\"%s\"", devices[i].device_id);
+      latency_histogram_print(
+          fp, histograms[k].name, labels,
+          (latency_histogram *)((char *)&devices[i] + histograms[k].offset));
+    }
+  }
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "error: failed to write %s\n", tmp);
+    unlink(tmp);
+    return 1;
+  }
+  if (rename(tmp, path) != 0) {
+    fprintf(stderr, "error: failed to rename %s: %s\n", tmp, strerror(errno));
+    unlink(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+/// @brief 縮小したキーフレームを解析します (`frame_analyzer`)
+/// サンプルでは画素値の平均をスコアとし, 物体検出などの処理に置き換えて使う
+/// @param name [IN] デバイスID
+/// @param frame [IN] 縮小したフレーム (BGR24)
+/// @param t [IN] キーフレームを受信した時刻 (UNIX時間) [sec]
+/// @param opaque [IN] 詳細度 (`int`)
+void analyze_frame(const char *name, const AVFrame *frame, double t,
+                   void *opaque) {
+  uint64_t sum = 0;
+  for (int y = 0; y < frame->height; y++) {
+    const uint8_t *row = frame->data[0] + y * frame->linesize[0];
+    for (int x = 0; x < frame->width * 3; x++) {
+      sum += row[x];
+    }
+  }
+  double score = sum / (255.0 * frame->width * frame->height * 3);
+  if (*(const int *)opaque >= 1) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    fprintf(stderr, "%s: keyframe analyzed: score=%f, %.0f ms after arrival\n",
+            name, score, (tv.tv_sec + tv.tv_usec / 1e6 - t) * 1e3);
+  }
+}
+
+/// @brief カメラを追加します
+/// @param devices [IN/OUT] カメラの配列, 必要に応じて再確保される
+/// @param ndevices [IN/OUT] カメラ数
+/// @param device_id [IN] デバイスID
+/// @param output_dir [IN] 出力ディレクトリ, NULLのとき既定の出力ディレクトリ
+/// @return 終了コード, `0` のとき正常終了
+int add_device(device **devices, int *ndevices, const char *device_id,
+               const char *output_dir) {
+  device *p = (device *)realloc(*devices, (*ndevices + 1) * sizeof(device));
+  if (p == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  *devices = p;
+  device *d = &p[*ndevices];
+  memset(d, 0, sizeof(device));
+  int n = snprintf(d->device_id, sizeof(d->device_id), "%s", device_id);
+  if (n >= sizeof(d->device_id)) {
+    fprintf(stderr, "error: device ID too long\n");
+    return 1;
+  }
+  if (output_dir != NULL) {
+    n = snprintf(d->output_dir, sizeof(d->output_dir), "%s", output_dir);
+    if (n >= sizeof(d->output_dir)) {
+      fprintf(stderr, "error: output directory too long\n");
+      return 1;
+    }
+  }
+  (*ndevices)++;
+  return 0;
+}
+
+/// @brief カメラの一覧をファイルから読み込みます
+/// 1行に `DEVICEID [OUTPUT_DIR]`, 空行と `#` で始まる行は無視する
+/// @param path [IN] カメラ一覧のファイル, `-` のとき標準入力
+/// @param devices [IN/OUT] カメラの配列
+/// @param ndevices [IN/OUT] カメラ数
+/// @return 終了コード, `0` のとき正常終了
+int load_devices(const char *path, device **devices, int *ndevices) {
+  FILE *fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  char line[512];
+  int lineno = 0;
+  int ret = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    char *saveptr = NULL;
+    char *device_id = strtok_r(line, " \t\r\n", &saveptr);
+    if (device_id == NULL || device_id[0] == '#') {
+      continue;
+    }
+    char *output_dir = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (strtok_r(NULL, " \t\r\n", &saveptr) != NULL) {
+      fprintf(stderr, "error: %s:%d: too many fields\n", path, lineno);
+      ret = 1;
+      break;
+    }
+    if (add_device(devices, ndevices, device_id, output_dir) != 0) {
+      ret = 1;
+      break;
+    }
+  }
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  return ret;
+}
+
+/// @brief 映像の切り出しを要求します
+/// @param devices [IN/OUT] カメラの配列
+/// @param ndevices [IN] カメラ数
+/// @param ids [IN/OUT] 空白区切りのデバイスID, 空のときはすべてのカメラ
+/// @return 要求したカメラ数
+int request_clip(device *devices, int ndevices, char *ids) {
+  int n = 0;
+  char *saveptr = NULL;
+  char *id = strtok_r(ids, " \t\r\n", &saveptr);
+  if (id == NULL) {
+    for (int i = 0; i < ndevices; i++) {
+      __atomic_add_fetch(&devices[i].clip_requests, 1, __ATOMIC_RELAXED);
+    }
+    return ndevices;
+  }
+  for (; id != NULL; id = strtok_r(NULL, " \t\r\n", &saveptr)) {
+    int i = 0;
+    while (i < ndevices && strcmp(devices[i].device_id, id) != 0) {
+      i++;
+    }
+    if (i == ndevices) {
+      fprintf(stderr, "error: clip requested for unknown device %s\n", id);
+      continue;
+    }
+    __atomic_add_fetch(&devices[i].clip_requests, 1, __ATOMIC_RELAXED);
+    n++;
+  }
+  return n;
+}
+
+/// @brief 切り出しの要求を受け付けるUNIXソケットを作成します
+/// @param path [IN] ソケットのパス, 既存のソケットは置き換える
+/// @return ソケット, 失敗したとき負
+int open_clip_socket(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: clip socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 8) != 0) {
+    fprintf(stderr, "error: failed to listen on %s: %s\n", path,
+            strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+/// @brief UNIXソケットで受け付けた切り出しの要求を処理します
+/// 要求は空白区切りのデバイスID (空のときはすべてのカメラ) で,
+/// 要求したカメラ数を `ok N` で返す
+/// @param fd [IN] 切り出しの要求を受け付けるソケット
+/// @param devices [IN/OUT] カメラの配列
+/// @param ndevices [IN] カメラ数
+void accept_clip_request(int fd, device *devices, int ndevices) {
+  int conn = accept(fd, NULL, NULL);
+  if (conn < 0) {
+    return;
+  }
+  struct timeval tv = {1, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  char buf[512];
+  size_t len = 0;
+  while (len < sizeof(buf) - 1) {
+    ssize_t n = recv(conn, buf + len, sizeof(buf) - 1 - len, 0);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+    if (memchr(buf, '\n', len) != NULL) {
+      break;
+    }
+  }
+  buf[len] = '\0';
+  char *eol = strchr(buf, '\n');
+  if (eol != NULL) {
+    *eol = '\0';
+  }
+  char res[32];
+  int n = snprintf(res, sizeof(res), "ok %d\n",
+                   request_clip(devices, ndevices, buf));
+  send(conn, res, n, MSG_NOSIGNAL);
+  close(conn);
+}
+
+/// @brief 切り出しの要求ファイルがあれば, 内容のデバイスIDの切り出しを要求し削除します
+/// @param path [IN] 要求ファイルのパス
+/// @param devices [IN/OUT] カメラの配列
+/// @param ndevices [IN] カメラ数
+void check_clip_file(const char *path, device *devices, int ndevices) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return;
+  }
+  char buf[512];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  buf[len] = '\0';
+  fclose(fp);
+  if (unlink(path) != 0) {
+    // 削除できないと要求を繰り返し処理するため無視する
+    fprintf(stderr, "error: failed to remove %s: %s\n", path,
+            strerror(errno));
+    return;
+  }
+  request_clip(devices, ndevices, buf);
 }
 
 // メイン関数
@@ -66,31 +1793,82 @@ int main(int argc, char *argv[]) {
   /*
    * 引数の処理
    */
-  char *device_id = NULL;
+  device *devices = NULL;
+  int ndevices = 0;
   char *apikey = getenv("SAFIE_API_KEY");
   double duration = 60.0;
+  double fragment_duration = -1.0;
   const char *output_dir = ".";
+  int workers = 0;
+  double rate = 0.0;
+  const char *rate_group = getenv("SAFIE_RATE_LIMIT_GROUP");
+  rate_limit *limiter = NULL;
+  const char *relay_address = NULL;
+  relay *relay_server = NULL;
+  double clip_pre = 0.0, clip_post = 0.0;
+  double preroll_max = 32.0 * 1024 * 1024;
+  const char *clip_socket = NULL;
+  const char *clip_file = NULL;
+  int clip_fd = -1;
+  const char *stream_cache_dir = NULL;
+  int analyze_width = 0, analyze_height = 0;
+  int analyze_threads = 0;
+  frame_tap *tap = NULL;
+  int write_index = 0;
+  double retention_size = 0.0;
+  double retention_age = 0.0;
+  retention *keeper = NULL;
+  double write_buffer = 0.0;
+  async_io *io = NULL;
+  const char *metrics_file = NULL;
   int verbosity = 0;
 
   int opt;
   static struct option long_options[] = {
       {"apikey", required_argument, NULL, 'k'},
       {"device-id", required_argument, NULL, 'd'},
+      {"device-list", required_argument, NULL, 'l'},
       {"output-dir", required_argument, NULL, 'o'},
       {"split-duration", required_argument, NULL, 's'},
+      {"fragmented", no_argument, NULL, 'F'},
+      {"fragment-duration", required_argument, NULL, 'f'},
+      {"workers", required_argument, NULL, 'w'},
+      {"rate-limit", required_argument, NULL, 'r'},
+      {"rate-limit-group", required_argument, NULL, 'g'},
+      {"relay", required_argument, NULL, 'R'},
+      {"clip", required_argument, NULL, 'c'},
+      {"preroll-max", required_argument, NULL, 'm'},
+      {"clip-socket", required_argument, NULL, 'C'},
+      {"clip-file", required_argument, NULL, 'T'},
+      {"analyze", required_argument, NULL, 'a'},
+      {"analyze-threads", required_argument, NULL, 'A'},
+      {"index", no_argument, NULL, 'x'},
+      {"write-buffer", required_argument, NULL, 'B'},
+      {"metrics", required_argument, NULL, 'M'},
+      {"stream-cache", required_argument, NULL, 'P'},
+      {"retention-size", required_argument, NULL, 'Q'},
+      {"retention-age", required_argument, NULL, 'e'},
       {"verbose", no_argument, NULL, 'v'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
   };
 
-  while ((opt = getopt_long(argc, argv, "k:d:o:s:vh", long_options, NULL)) !=
-         -1) {
+  while ((opt = getopt_long(argc, argv,
+                            "k:d:l:o:s:Ff:w:r:g:R:c:m:C:T:a:A:xB:P:Q:e:M:vh",
+                            long_options, NULL)) != -1) {
     switch (opt) {
     case 'k':
       apikey = optarg;
       break;
     case 'd':
-      device_id = optarg;
+      if (add_device(&devices, &ndevices, optarg, NULL) != 0) {
+        exit(2);
+      }
+      break;
+    case 'l':
+      if (load_devices(optarg, &devices, &ndevices) != 0) {
+        exit(2);
+      }
       break;
     case 'o':
       output_dir = optarg;
@@ -102,6 +1880,116 @@ int main(int argc, char *argv[]) {
         exit(2);
       }
       break;
+    case 'F':
+      if (fragment_duration < 0.0) {
+        fragment_duration = 0.0;
+      }
+      break;
+    case 'f':
+      fragment_duration = strtod(optarg, NULL);
+      if (fragment_duration < 0.0) {
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'w': {
+      char *end;
+      errno = 0;
+      long n = strtol(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || n < 1 || MAX_THREADS < n) {
+        fprintf(stderr, "error: invalid --workers\n");
+        print_help();
+        exit(2);
+      }
+      workers = (int)n;
+      break;
+    }
+    case 'r':
+      if (rate_limit_parse(optarg, &rate) != 0) {
+        fprintf(stderr, "error: invalid --rate-limit\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'g':
+      rate_group = optarg;
+      break;
+    case 'R':
+      relay_address = optarg;
+      break;
+    case 'c':
+      if (sscanf(optarg, "%lf:%lf", &clip_pre, &clip_post) != 2 ||
+          clip_pre < 0.0 || clip_post <= 0.0) {
+        fprintf(stderr, "error: invalid --clip\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'm':
+      if (rate_limit_parse(optarg, &preroll_max) != 0 || preroll_max <= 0.0) {
+        fprintf(stderr, "error: invalid --preroll-max\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'C':
+      clip_socket = optarg;
+      break;
+    case 'T':
+      clip_file = optarg;
+      break;
+    case 'a':
+      if (sscanf(optarg, "%dx%d", &analyze_width, &analyze_height) != 2 ||
+          analyze_width <= 0 || analyze_height <= 0) {
+        fprintf(stderr, "error: invalid --analyze\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'A': {
+      char *end;
+      errno = 0;
+      long n = strtol(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || n < 1 || MAX_THREADS < n) {
+        fprintf(stderr, "error: invalid --analyze-threads\n");
+        print_help();
+        exit(2);
+      }
+      analyze_threads = (int)n;
+      break;
+    }
+    case 'x':
+      write_index = 1;
+      break;
+    case 'B':
+      if (rate_limit_parse(optarg, &write_buffer) != 0 ||
+          write_buffer <= 0.0) {
+        fprintf(stderr, "error: invalid --write-buffer\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'P':
+      stream_cache_dir = optarg;
+      break;
+    case 'M':
+      metrics_file = optarg;
+      break;
+    case 'Q':
+      if (rate_limit_parse(optarg, &retention_size) != 0 ||
+          retention_size <= 0.0) {
+        fprintf(stderr, "error: invalid --retention-size\n");
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'e':
+      retention_age = strtod(optarg, NULL);
+      if (retention_age <= 0.0) {
+        print_help();
+        exit(2);
+      }
+      break;
     case 'v':
       verbosity++;
       break;
@@ -125,57 +2013,147 @@ int main(int argc, char *argv[]) {
     print_help();
     exit(2);
   }
-  if (device_id == NULL) {
+  if (ndevices == 0) {
     fprintf(stderr, "error: missing --device-id\n");
     print_help();
     exit(2);
   }
+  if (clip_post == 0.0 && (clip_socket != NULL || clip_file != NULL)) {
+    fprintf(stderr, "error: --clip-socket and --clip-file require --clip\n");
+    print_help();
+    exit(2);
+  }
 
   av_log_set_level(AV_LOG_WARNING + (8 * verbosity));
 
+  if (stream_cache_dir != NULL && mkdir(stream_cache_dir, 0755) != 0 &&
+      errno != EEXIST) {
+    fprintf(stderr, "error: failed to create %s: %s\n", stream_cache_dir,
+            strerror(errno));
+    exit(1);
+  }
+
+  if (rate > 0.0 || (rate_group != NULL && rate_group[0] != '\0')) {
+    limiter = rate_limit_open(
+        (rate_group != NULL && rate_group[0] != '\0') ? rate_group : NULL,
+        rate);
+    if (limiter == NULL) {
+      exit(1);
+    }
+  }
+
   /*
-   * HLS接続
+   * カメラごとの設定
    */
-  AVDictionary *dict = NULL;
-  AVFormatContext *ic = NULL;
-  AVPacket *pkt = av_packet_alloc();
-  if (pkt == NULL) {
-    fprintf(stderr, "error: \"av_packet_alloc()\": NULL at %s(%d)\n", __FILE__,
-            __LINE__);
-    exit(1);
+  mux_pool pool;
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  file_pool files;
+  memset(&files, 0, sizeof(files));
+  pthread_mutex_init(&files.mutex, NULL);
+  pthread_cond_init(&files.cond, NULL);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, READER_STACK_SIZE);
+  int failed = 0;
+  for (int i = 0; i < ndevices; i++) {
+    packet_queue_init(&devices[i].queue);
+    preroll_init(&devices[i].recent);
   }
-  AVFormatContext *oc = NULL;
 
-  char url[256];
-  int n =
-      snprintf(url, sizeof(url),
-               "https://openapi.safie.link/v2/devices/%s/live/playlist.m3u8",
-               device_id);
-  if (n >= sizeof(url)) {
-    fprintf(stderr, "error: url too long\n");
-    goto error;
+  if (write_buffer > 0.0) {
+    CHECK_NULL(io = async_io_open((size_t)write_buffer));
+  }
+  if (retention_size > 0.0 || retention_age > 0.0) {
+    CHECK_NULL(keeper =
+                   retention_open((int64_t)retention_size, retention_age));
+  }
+  for (int i = 0; i < ndevices; i++) {
+    device *d = &devices[i];
+    if (d->output_dir[0] == '\0') {
+      // 複数のカメラを録画するときはカメラごとのディレクトリに出力する
+      int n = (ndevices == 1)
+                  ? snprintf(d->output_dir, sizeof(d->output_dir), "%s",
+                             output_dir)
+                  : snprintf(d->output_dir, sizeof(d->output_dir), "%s/%s",
+                             output_dir, d->device_id);
+      if (n >= sizeof(d->output_dir)) {
+        fprintf(stderr, "error: output directory too long\n");
+        goto error;
+      }
+    }
+    if (mkdir(d->output_dir, 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "error: failed to create %s: %s\n", d->output_dir,
+              strerror(errno));
+      goto error;
+    }
+    if (write_index) {
+      // 書き込んだファイルの時刻とキーフレームの位置を追記する
+      char prefix[512];
+      int n = snprintf(prefix, sizeof(prefix), "%s/%s", d->output_dir,
+                       d->device_id);
+      if (n >= sizeof(prefix)) {
+        fprintf(stderr, "error: index path too long\n");
+        goto error;
+      }
+      CHECK_NULL(d->index = segment_index_open(prefix));
+    }
+    if (keeper != NULL) {
+      CHECK_NULL(d->retention = retention_add_channel(keeper, d->output_dir,
+                                                      d->device_id));
+    }
+    if (stream_cache_dir != NULL) {
+      int n = snprintf(d->stream_cache, sizeof(d->stream_cache),
+                       "%s/%s.streams", stream_cache_dir, d->device_id);
+      if (n >= sizeof(d->stream_cache)) {
+        fprintf(stderr, "error: stream cache path too long\n");
+        goto error;
+      }
+    }
+    d->apikey = apikey;
+    d->duration = duration;
+    d->fragment_duration = fragment_duration;
+    d->clip_pre = clip_pre;
+    d->clip_post = clip_post;
+    d->preroll_max = (int64_t)preroll_max;
+    d->limiter = limiter;
+    d->verbosity = verbosity;
+    d->pool = &pool;
+    d->files = &files;
+    d->io = io;
   }
 
-  char auth[256];
-  n = snprintf(auth, sizeof(auth), "Safie-API-Key: %s\r\n", apikey);
-  if (n >= sizeof(auth)) {
-    fprintf(stderr, "error: auth header too long\n");
+  // 上限を超えた古いファイルは, 書き込みと競合しないよう低い優先度で整理する
+  if (keeper != NULL && retention_start(keeper) != 0) {
     goto error;
   }
-  CHECK_AVERROR(av_dict_set(&dict, "headers", auth, 0));
-  // リトライ回数を制限する
-  CHECK_AVERROR(av_dict_set(&dict, "max_reload", "2", 0));
-  CHECK_AVERROR(av_dict_set(&dict, "rw_timeout", "8000000", 0));
 
-  CHECK_AVERROR(avformat_open_input(&ic, url, NULL, &dict));
-  CHECK_AVERROR(avformat_find_stream_info(ic, NULL));
-  int video_stream_index;
-  CHECK_AVERROR(video_stream_index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO,
-                                                         -1, -1, NULL, 0));
+  // 受信したパケットを録画と同時にローカルのクライアントへ中継する
+  if (relay_address != NULL) {
+    CHECK_NULL(relay_server = relay_open(relay_address));
+    for (int i = 0; i < ndevices; i++) {
+      CHECK_NULL(devices[i].relay =
+                     relay_add_channel(relay_server, devices[i].device_id));
+    }
+    if (relay_start(relay_server) != 0) {
+      goto error;
+    }
+  }
 
-  if (verbosity >= 1) {
-    // 入力ストリームの情報表示
-    av_dump_format(ic, 0, url, 0);
+  // 受信したキーフレームを録画と同時に解析する
+  if (analyze_width > 0) {
+    if (analyze_threads == 0) {
+      long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+      analyze_threads = (ncpu > 0) ? (int)ncpu : 1;
+    }
+    CHECK_NULL(tap = frame_tap_open(analyze_width, analyze_height,
+                                    analyze_threads, analyze_frame,
+                                    &verbosity));
+    for (int i = 0; i < ndevices; i++) {
+      CHECK_NULL(devices[i].tap =
+                     frame_tap_add_channel(tap, devices[i].device_id));
+    }
   }
 
   /*
@@ -184,99 +2162,169 @@ int main(int argc, char *argv[]) {
   signal(SIGINT, sighandler);
   signal(SIGTERM, sighandler);
   fprintf(stderr, "press Ctrl+C to stop\n");
-
-  // 最初の1パケットを読む
-  CHECK_AVERROR(av_read_frame(ic, pkt));
-  while (!stopping) {
-    // ファイル出力の最初のパケットのタイミングを計算
-    int64_t pts_offset = pkt->pts;
-    AVRational tb = ic->streams[pkt->stream_index]->time_base;
-    int64_t end_pts = pkt->pts + (int64_t)(duration * tb.den / tb.num);
-
-    /*
-     * ファイル出力の設定
-     */
-    time_t t = time(NULL);
-    struct tm *lt = localtime(&t);
-    char timestr[32];
-    strftime(timestr, sizeof(timestr), "%F %H_%M_%S", lt);
-    char filename[256];
-    n = snprintf(filename, sizeof(filename), "%s/%s.mp4", output_dir, timestr);
-    if (n >= sizeof(filename)) {
-      fprintf(stderr, "error: filename too long\n");
+  if (clip_post > 0.0) {
+    // 切り出しモードでは要求があったときのみ書き込む
+    signal(SIGUSR1, clip_sighandler);
+    if (clip_socket != NULL && (clip_fd = open_clip_socket(clip_socket)) < 0) {
       goto error;
     }
+    fprintf(stderr,
+            "recording %.0f sec before and %.0f sec after each clip request "
+            "(SIGUSR1%s%s%s%s)\n",
+            clip_pre, clip_post, clip_socket ? ", " : "",
+            clip_socket ? clip_socket : "", clip_file ? ", " : "",
+            clip_file ? clip_file : "");
+  }
 
-    fprintf(stderr, "writing file \"%s\"...\n", filename);
-
-    AVFormatContext *oc = NULL;
-    CHECK_AVERROR(avformat_alloc_output_context2(&oc, NULL, NULL, filename));
-
-    for (int i = 0; i < ic->nb_streams; i++) {
-      AVStream *os;
-      CHECK_NULL(os = avformat_new_stream(oc, NULL));
-      CHECK_AVERROR(
-          avcodec_parameters_copy(os->codecpar, ic->streams[i]->codecpar));
-      os->codecpar->codec_tag = 0;
+  // 受信はカメラごとのスレッドで行い, 書き込みは固定数のワーカーで行う
+  // 出力ファイルの準備とトレーラの書き込みは, 同数の別のスレッドで行う
+  if (workers == 0) {
+    workers = (ndevices < 4) ? ndevices : 4;
+  }
+  CHECK_NULL(files.threads = (pthread_t *)calloc(workers, sizeof(pthread_t)));
+  for (; files.nthreads < workers; files.nthreads++) {
+    if (pthread_create(&files.threads[files.nthreads], NULL, file_thread,
+                       &files) != 0) {
+      fprintf(stderr, "error: failed to start file thread\n");
+      goto error;
     }
-
-    if (verbosity >= 1) {
-      // 出力ストリームの情報表示
-      av_dump_format(oc, 0, filename, 1);
+  }
+  CHECK_NULL(pool.ready = (device **)calloc(ndevices, sizeof(device *)));
+  pool.capacity = ndevices;
+  CHECK_NULL(pool.threads = (pthread_t *)calloc(workers, sizeof(pthread_t)));
+  for (; pool.nthreads < workers; pool.nthreads++) {
+    if (pthread_create(&pool.threads[pool.nthreads], NULL, mux_thread,
+                       &pool) != 0) {
+      fprintf(stderr, "error: failed to start writer thread\n");
+      goto error;
     }
-
-    CHECK_AVERROR(avio_open(&oc->pb, filename, AVIO_FLAG_WRITE));
-    CHECK_AVERROR(avformat_write_header(oc, NULL));
-
-    // 最初のパケットを出力
-    pkt->pts -= pts_offset;
-    pkt->dts -= pts_offset;
-    av_packet_rescale_ts(pkt, ic->streams[pkt->stream_index]->time_base,
-                         oc->streams[pkt->stream_index]->time_base);
-    pkt->pos = -1;
-    CHECK_AVERROR(av_interleaved_write_frame(oc, pkt));
-
-    while (!stopping) {
-      // 続くフレームの受信
-      CHECK_AVERROR(av_read_frame(ic, pkt));
-
-      // パケットがキーフレームでありdurationを経過した場合出力ファイルを閉じる
-      if (pkt->stream_index == video_stream_index &&
-          pkt->flags & AV_PKT_FLAG_KEY && end_pts <= pkt->pts) {
-        break;
-      }
-
-      // パケットを出力
-      pkt->pts -= pts_offset;
-      pkt->dts -= pts_offset;
-      av_packet_rescale_ts(pkt, ic->streams[pkt->stream_index]->time_base,
-                           oc->streams[pkt->stream_index]->time_base);
-      pkt->pos = -1;
-      CHECK_AVERROR(av_interleaved_write_frame(oc, pkt));
+  }
+  for (int i = 0; i < ndevices; i++) {
+    device *d = &devices[i];
+    if (pthread_create(&d->thread, &attr, read_thread, d) != 0) {
+      fprintf(stderr, "%s: error: failed to start reader thread\n",
+              d->device_id);
+      goto error;
     }
+    d->reading = 1;
+  }
 
-    // 出力ファイルを閉じる
-    CHECK_AVERROR(av_write_trailer(oc));
-    avio_closep(&oc->pb);
-    avformat_free_context(oc);
-    oc = NULL;
+  // すべてのカメラが終了するまで, 一定間隔で受信量を表示する
+  // 切り出しの要求はシグナルとソケットで待ちを中断し, すぐに処理する
+  double last_report, last_metrics;
+  last_report = last_metrics = monotonic_now();
+  sig_atomic_t clip_signals_seen;
+  clip_signals_seen = clip_signals;
+  while (1) {
+    pthread_mutex_lock(&pool.mutex);
+    int finished = pool.finished;
+    pthread_mutex_unlock(&pool.mutex);
+    if (finished == ndevices) {
+      break;
+    }
+    struct pollfd pfd = {clip_fd, POLLIN, 0};
+    if (poll(&pfd, (clip_fd >= 0) ? 1 : 0, 1000) > 0) {
+      accept_clip_request(clip_fd, devices, ndevices);
+    }
+    if (clip_signals != clip_signals_seen) {
+      clip_signals_seen = clip_signals;
+      char all[] = "";
+      request_clip(devices, ndevices, all);
+    }
+    if (clip_file != NULL) {
+      check_clip_file(clip_file, devices, ndevices);
+    }
+    double now = monotonic_now();
+    if (now - last_report >= REPORT_INTERVAL) {
+      report(devices, ndevices, io, now - last_report);
+      last_report = now;
+    }
+    if (metrics_file != NULL && now - last_metrics >= METRICS_INTERVAL) {
+      // 書き出せなくても録画は続ける
+      write_metrics(metrics_file, devices, ndevices);
+      last_metrics = now;
+    }
   }
 
   /*
    * 後処理
    */
-  av_packet_free(&pkt);
-  avformat_free_context(ic);
-  av_dict_free(&dict);
-  return 0;
+  for (int i = 0; i < ndevices; i++) {
+    pthread_join(devices[i].thread, NULL);
+    devices[i].reading = 0;
+  }
 
 error:
-  if (oc != NULL) {
-    avio_closep(&oc->pb);
-    avformat_free_context(oc);
+  // 受信スレッドを中断させて終了を待つ
+  stopping = 1;
+  for (int i = 0; i < ndevices; i++) {
+    if (devices[i].reading) {
+      pthread_join(devices[i].thread, NULL);
+      failed = 1;
+    }
   }
-  av_packet_free(&pkt);
-  avformat_free_context(ic);
-  av_dict_free(&dict);
-  return 1;
+  relay_close(relay_server);
+  frame_tap_close(tap);
+  if (clip_fd >= 0) {
+    close(clip_fd);
+    unlink(clip_socket);
+  }
+  pthread_mutex_lock(&pool.mutex);
+  pool.stopping = 1;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.mutex);
+  for (int i = 0; i < pool.nthreads; i++) {
+    pthread_join(pool.threads[i], NULL);
+  }
+  // 依頼済みのトレーラの書き込みなどを終えるまで待つ
+  pthread_mutex_lock(&files.mutex);
+  files.stopping = 1;
+  pthread_cond_broadcast(&files.cond);
+  pthread_mutex_unlock(&files.mutex);
+  for (int i = 0; i < files.nthreads; i++) {
+    pthread_join(files.threads[i], NULL);
+  }
+  retention_close(keeper);
+  if (pool.finished != ndevices) {
+    failed = 1;
+  }
+  for (int i = 0; i < ndevices; i++) {
+    device *d = &devices[i];
+    if (d->failed || d->file_failed) {
+      failed++;
+    }
+    if (d->oc != NULL) {
+      close_output(d, d->oc);
+      avformat_free_context(d->oc);
+    }
+    if (d->prepared != NULL) {
+      // 使わなかった次の出力ファイルを削除する
+      close_output(d, d->prepared);
+      avformat_free_context(d->prepared);
+      remove(d->prepared_path);
+    }
+    avformat_close_input(&d->ic);
+    avformat_close_input(&d->handoff);
+    packet_queue_cleanup(&d->queue);
+    preroll_cleanup(&d->recent);
+    segment_index_close(d->index);
+    free(d->keyframes);
+  }
+  // すべての出力ファイルを閉じた後に書き込みスレッドを終了する
+  async_io_close(io);
+  pthread_attr_destroy(&attr);
+  pthread_mutex_destroy(&pool.mutex);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&files.mutex);
+  pthread_cond_destroy(&files.cond);
+  free(pool.threads);
+  free(pool.ready);
+  free(files.threads);
+  if (ndevices > 1 && pool.finished == ndevices) {
+    fprintf(stderr, "%d of %d cameras completed\n", ndevices - failed,
+            ndevices);
+  }
+  free(devices);
+  rate_limit_close(limiter);
+  return (failed == 0) ? 0 : 1;
 }
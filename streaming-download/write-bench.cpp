@@ -0,0 +1,271 @@
+/*
+ * write-bench
+ * 多数のカメラのmp4ファイルへの書き込みを模擬し, FFmpegの既定の出力と
+ * 非同期の書き込み (async-io) の速度と書き込みの停滞を比較する。
+ *
+ * Copyright (c) 2023 Safie Inc.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "async-io.h"
+
+// プログラムの説明文を表示する
+void print_help() {
+  fprintf(stderr,
+          "usage: write-bench [OPTION]... DIR\n"
+          "write FILES mp4-like files in DIR concurrently, interleaving "
+          "packets as\n"
+          "streaming-download does, with the default FFmpeg output and with "
+          "--write-buffer.\n"
+          "\n"
+          "  -n, --files=16          number of files written concurrently\n"
+          "  -s, --size=64M          bytes written to each file (k, M, G)\n"
+          "  -p, --packet=16k        bytes of each packet (k, M)\n"
+          "  -B, --write-buffer=1M   buffer size of the background writer "
+          "(k, M)\n"
+          "  -S, --sync              include fdatasync of the files in the "
+          "elapsed time\n"
+          "  -h, --help              shows this help\n");
+}
+
+// 書き込みの結果
+typedef struct {
+  double elapsed;   // すべてのファイルを閉じるまでの時間 [sec]
+  double write_max; // 1回の書き込みにかかった時間の最大 [sec]
+  double close_max; // 1つのファイルを閉じるのにかかった時間の最大 [sec]
+} bench_result;
+
+/// @brief 単調増加する時刻 [sec] を返します
+double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief サイズを解析します
+/// @param s [IN] サイズ, `k`, `M`, `G` の接尾辞を使える
+/// @param size [OUT] サイズ [byte]
+/// @return 終了コード, `0` のとき正常終了
+int parse_size(const char *s, int64_t *size) {
+  char *end;
+  double v = strtod(s, &end);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    v *= 1024;
+    end++;
+    break;
+  case 'M':
+    v *= 1024 * 1024;
+    end++;
+    break;
+  case 'G':
+    v *= 1024.0 * 1024 * 1024;
+    end++;
+    break;
+  }
+  if (end == s || *end != '\0' || v < 1.0) {
+    return 1;
+  }
+  *size = (int64_t)v;
+  return 0;
+}
+
+/// @brief ファイルを書き込みます
+/// パケットをファイルの順に交互に書き込み, 閉じる前にmp4のトレーラのように
+/// 先頭へシークして書き戻す
+/// @param dir [IN] 出力ディレクトリ
+/// @param io [IN/OUT] 非同期の書き込み, NULLのときFFmpegの既定の出力
+/// @param nfiles [IN] ファイル数
+/// @param size [IN] ファイルごとのバイト数
+/// @param packet [IN] パケットのバイト数
+/// @param sync [IN] `1` のとき閉じた後にfdatasyncする
+/// @param result [OUT] 結果
+/// @return 終了コード, `0` のとき正常終了
+int run(const char *dir, async_io *io, int nfiles, int64_t size, int packet,
+        int sync, bench_result *result) {
+  int ret = 1;
+  char path[1024];
+  unsigned char *data = NULL;
+  AVIOContext **pbs = (AVIOContext **)calloc(nfiles, sizeof(AVIOContext *));
+  if (pbs == NULL || (data = (unsigned char *)malloc(packet)) == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    goto end;
+  }
+  memset(data, 0x5a, packet);
+  memset(result, 0, sizeof(bench_result));
+
+  {
+    double started = monotonic_now();
+    for (int i = 0; i < nfiles; i++) {
+      snprintf(path, sizeof(path), "%s/write-bench-%d.mp4", dir, i);
+      int err = (io != NULL)
+                    ? async_io_open_file(io, path, ASYNC_IO_TRUNCATE, &pbs[i])
+                    : avio_open(&pbs[i], path, AVIO_FLAG_WRITE);
+      if (err < 0) {
+        fprintf(stderr, "error: failed to open %s\n", path);
+        goto end;
+      }
+    }
+    for (int64_t written = 0; written < size; written += packet) {
+      for (int i = 0; i < nfiles; i++) {
+        double since = monotonic_now();
+        avio_write(pbs[i], data, packet);
+        double t = monotonic_now() - since;
+        if (t > result->write_max) {
+          result->write_max = t;
+        }
+      }
+    }
+    for (int i = 0; i < nfiles; i++) {
+      double since = monotonic_now();
+      int64_t end = avio_tell(pbs[i]);
+      avio_seek(pbs[i], 0, SEEK_SET);
+      avio_write(pbs[i], data, 8);
+      avio_seek(pbs[i], end, SEEK_SET);
+      int err = (io != NULL) ? async_io_close_file(&pbs[i])
+                             : avio_closep(&pbs[i]);
+      double t = monotonic_now() - since;
+      if (t > result->close_max) {
+        result->close_max = t;
+      }
+      if (err < 0) {
+        fprintf(stderr, "error: failed to write file %d\n", i);
+        goto end;
+      }
+    }
+    if (sync) {
+      for (int i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/write-bench-%d.mp4", dir, i);
+        int fd = open(path, O_WRONLY);
+        if (fd >= 0) {
+          fdatasync(fd);
+          close(fd);
+        }
+      }
+    }
+    result->elapsed = monotonic_now() - started;
+  }
+  ret = 0;
+
+end:
+  if (pbs != NULL) {
+    for (int i = 0; i < nfiles; i++) {
+      if (pbs[i] != NULL && io != NULL) {
+        async_io_close_file(&pbs[i]);
+      } else if (pbs[i] != NULL) {
+        avio_closep(&pbs[i]);
+      }
+      snprintf(path, sizeof(path), "%s/write-bench-%d.mp4", dir, i);
+      unlink(path);
+    }
+  }
+  free(pbs);
+  free(data);
+  return ret;
+}
+
+/// @brief 結果を表示します
+void print_result(const char *name, const bench_result *r, int nfiles,
+                  int64_t size) {
+  printf("%-16s %8.2f sec %10.1f MiB/s   write max %8.2f ms   close max "
+         "%8.2f ms\n",
+         name, r->elapsed, nfiles * (double)size / 1048576.0 / r->elapsed,
+         r->write_max * 1e3, r->close_max * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+  int64_t nfiles = 16, size = 64 * 1024 * 1024, packet = 16 * 1024;
+  int64_t buffer_size = 1024 * 1024;
+  int sync = 0;
+  bench_result def, async;
+  async_io *io = NULL;
+
+  int opt;
+  static struct option long_options[] = {
+      {"files", required_argument, NULL, 'n'},
+      {"size", required_argument, NULL, 's'},
+      {"packet", required_argument, NULL, 'p'},
+      {"write-buffer", required_argument, NULL, 'B'},
+      {"sync", no_argument, NULL, 'S'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+  while ((opt = getopt_long(argc, argv, "n:s:p:B:Sh", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'n':
+      nfiles = atoi(optarg);
+      if (nfiles < 1) {
+        print_help();
+        exit(2);
+      }
+      break;
+    case 's':
+    case 'p':
+    case 'B':
+      if (parse_size(optarg, (opt == 's')   ? &size
+                             : (opt == 'p') ? &packet
+                                            : &buffer_size) != 0) {
+        print_help();
+        exit(2);
+      }
+      break;
+    case 'S':
+      sync = 1;
+      break;
+    case 'h':
+      print_help();
+      exit(0);
+      break;
+    default:
+      print_help();
+      exit(2);
+      break;
+    }
+  }
+  if (argc - optind != 1 || packet > 64 * 1024 * 1024) {
+    print_help();
+    exit(2);
+  }
+  const char *dir = argv[optind];
+
+  printf("%d files x %.1f MiB, %d byte packets%s\n", (int)nfiles,
+         size / 1048576.0, (int)packet, sync ? ", fdatasync" : "");
+  if (run(dir, NULL, nfiles, size, packet, sync, &def) != 0) {
+    exit(1);
+  }
+  print_result("default", &def, nfiles, size);
+
+  if ((io = async_io_open((size_t)buffer_size)) == NULL) {
+    exit(1);
+  }
+  if (run(dir, io, nfiles, size, packet, sync, &async) != 0) {
+    async_io_close(io);
+    exit(1);
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "async (%s)", async_io_backend(io));
+  print_result(name, &async, nfiles, size);
+  async_io_stats st;
+  async_io_get_stats(io, &st, 0);
+  printf("%-16s %llu writes, latency avg %.2f ms max %.2f ms, queue depth "
+         "max %d, %llu stalls (%.0f ms)\n",
+         "", (unsigned long long)st.writes,
+         (st.writes > 0) ? st.latency_total / st.writes * 1e3 : 0.0,
+         st.latency_max * 1e3, st.depth_max, (unsigned long long)st.stalls,
+         st.stalled * 1e3);
+  async_io_close(io);
+  return 0;
+}